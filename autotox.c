@@ -8,35 +8,58 @@
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
 
 #include <termios.h>
 #include <unistd.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
+#include <fnmatch.h>
 
 #include <tox/tox.h>
 #include "autotox_file_transfers.h"
+#include "autotox_dir.h"
+#include "autotox_index.h"
+#include "autotox_path.h"
+#include "autotox_work.h"
+#include "autotox_trash.h"
+#include "autotox_sum.h"
+#include "autotox_grep.h"
+#include "autotox_preview.h"
+#include "autotox_sysinfo.h"
+#include "autotox_text.h"
+#include "autotox_backup.h"
+#include "autotox_manifest.h"
+#include "autotox_tar.h"
+#include "autotox_archive.h"
+#include "autotox_aio.h"
 
 #define UNUSED_VAR(x) ((void) x)
 
-static const char allcmd[]="ls: view folder's content\nfr: view friend\ncd <folder name>: go to folder\ncd root: go to root\nmyid: show autotox's id\nadd <id>: add friend id\ncmsg <msg>: change added-friend msg\npwd: where you are\ncmd: list all commands\nvmsg: view added-friend msg\nrmvf <friend's num>: remove friend by number\nnext: show next 10-files\nback: back to parent folder\ndelf <file num>: del files\ndown <file num>: download files\nreq: show requests";
+static const char allcmd[]="ls [name|size|time] [asc|desc]: view folder's content\nfr: view friend\ncd <folder name>: go to folder, or into a .tar, .tar.gz, .tgz or .zip to browse it and down its files\ncd root: go to root\nmyid: show autotox's id\nadd <id>: add friend id\ncmsg <msg>: change added-friend msg\npwd: where you are\ncmd: list all commands\nvmsg: view added-friend msg\nrmvf <friend's num>: remove friend by number\nnext: show next 10-files\nback: back to parent folder\ndelf <nums>: del files, e.g. delf 3,5,10-40\ndown <num>: download file num, or folder num as one .tar; down 1-200,205, down *.log or down all: queue those files, sent a few at a time; down: queue status; down stop: drop the queue\nreq: show requests\ncache: show listing cache stats\nfind <pattern>: search names under root (^prefix, glob with * ? [), then next/down/delf\ndu [folder num]: disk usage of this folder or of folder num, biggest first\nsum <num>: BLAKE2b (b2sum) of file num, or a b2sum list of folder num\ngrep <word|\"text\"|/regex/> [folder num]: lines containing it in files below, then next/down/delf\nhead|tail <num> [lines]: first or last lines of file num\nrange <num> <off> <len>: len bytes of file num from off (off<0: from the end)\nhex <num> [off] [len]: hexdump of file num\nsys: uptime, load, memory, disk and addresses\nsearch <words>: files with lines holding all the words, from the content index, then next/down/delf; no words: index size\nbackup [num]: back file num up into the backup folder, stored once per distinct chunk; down on a backup restores it; no num: store size\ntop size|mtime|old [count] [folder num]: biggest, newest or oldest files below this folder or folder num, then next/down/delf\nmanifest [folder num]: gzipped list of everything below this folder or folder num (type, size, mtime, path)\nfollow <file num>: stream file num as it grows, from its last lines; cancel the transfer to stop";
+static const char staleentrymsg[]="not a file, or it changed since ls: run ls again";
+static const char staledirmsg[]="not a folder, or it changed since ls: run ls again";
 static char *add_msg=NULL;
 static const char pathaddolokfile[]="./ol_ok.tox";
 static const char pathaddmsgfile[]="./addmsgdata.tox";
 static const char pathaddbtfile[]="./bt.tox";
 static const char pathlogfile[]="./alog.txt";
+static const char pathtrashdir[]="./trash";  // deleted files wait here for the purge; "" to unlink right away
+static const char pathsumfile[]="./sums.tox";
+static const char pathtextfile[]="./text.tox";  // saved content index for search; "" keeps it in memory only
+static const size_t textindexmem=64*1024*1024;  // memory for the content index, 0 turns search off
+static const uint64_t textindexdisk=256*1024*1024;  // largest content index saved to pathtextfile
+static const bool asyncdiskio=false;  // transfers read ahead and write behind off the main loop, through io_uring or else threads of their own; false: in the tox callbacks, big files mapped
+static const int downinflight=4;  // files a multi-file down keeps going at once per friend, at most MAX_FILES
+static const bool downsmallfirst=true;  // a multi-file down starts with the smallest files
+static const char pathbackupstore[]="./backupstore";  // chunks of the backups in backupdir; keep it on the same disk
+static const bool backupfoldcopies=false;  // backup of a plain file in backupdir unlinks the copy once stored; false keeps it
 static char maindir[]="/var/res";
-static const char lscmd_prefix[]="/ -all | sed -n ";
-//static const char lscmd_suffix[]="p | awk '{$a=\"\";$b=\"\";$c=\"\";$d=\"\";$e=\"\";$f=\"\";$g=\"\"} 1' a=2 b=3 c=4 d=5 e=6 f=7 g=8 | awk '{ sub(/drwxr-xr-x$/, \"dir\", $1) sub(/-rwxr-xr-x$/, \"---\", $1) }1'";
-static const char lscmd_suffix[]="p";
-//static const char lscmd_suffix_wp[]="p | awk '{$a=\"\";$b=\"\";$c=\"\";$d=\"\";$e=\"\";$f=\"\";$g=\"\"} 1' a=2 b=3 c=4 d=5 e=6 f=7 g=8 | awk '{ sub(/drwxr-xr-x$/, \"d\", $1) sub(/-rwxr-xr-x$/, \"f\", $1) }1'";
-static const char lscmd_suffix_wp[]="p";
-static char *curdir;
-static char *relativedir;
-static char *downloaddir;
+static const char backupdir[]="/var/res/backup";
 static size_t maindirlen=0;
-static int maxelecount=0;
-static int curelecount=0;
 
 /*******************************************************************************
  *
@@ -170,6 +193,15 @@ uint32_t TalkingTo = TALK_TYPE_NULL;
  ******************************************************************************/
  
 void writetologfile(char *msg);
+static void freeSession(struct Session *ss);
+int startsendfile(Tox *m, uint32_t friendnum, char *pathtofile);
+int startsendstream(Tox *m, uint32_t friendnum, FILE *file_to_send, uint64_t filesize, const char *name);
+static void downQueueAdd(struct Friend *f, struct DownItem *items, size_t n);
+static void downQueueClear(struct DownQueue *q);
+static const char *startfollow(Tox *m, uint32_t friendnum, const char *path);
+static void stopfollow(Tox *m, struct Friend *f);
+void friend_message_cb(Tox *tox, uint32_t friend_num, TOX_MESSAGE_TYPE type, const uint8_t *message,
+                                   size_t length, void *user_data);
 
 
 /*******************************************************************************
@@ -356,6 +388,8 @@ struct Friend *addfriend(uint32_t friend_num) {
     friends = f;
     f->friend_num = friend_num;
     f->connection = TOX_CONNECTION_NONE;
+    f->session.cwd.fd = f->session.cwd.rootfd = -1;
+    f->session.pending_tail = &f->session.pending;
     tox_friend_get_public_key(tox, friend_num, f->pubkey, NULL);
     return f;
 }
@@ -369,6 +403,7 @@ bool delfriend(uint32_t friend_num) {
         *p = f->next;
         if (f->name) free(f->name);
         if (f->status_message) free(f->status_message);
+        freeSession(&f->session);
         while (f->hist) {
             struct ChatHist *tmp = f->hist;
             f->hist = f->hist->next;
@@ -566,34 +601,41 @@ int arepl_readline(struct AsyncREPL *arepl, char c, char *line, size_t sz){
 
 /*******************************************************************************
  *
- * Get IP Addr
+ * System Info
  *
  ******************************************************************************/
 
-char *getIpAddr() {
-	char cmd[256]="/sbin/ifconfig | grep -E 'netmask 255.255.255.0|scopeid 0x0<global>'";
-	FILE * stream;
-	char buffer[256];
-	size_t n,m=0;
-	char *out=(char*)malloc(2048);
-	
-	stream = popen(cmd, "r");
-	if (stream) {
-		while (!feof(stream)){
-			if (fgets(buffer, 256, stream) != NULL){
-				//PRINT("ExecutionRes:%s %d",buffer,(unsigned)strlen(buffer));
-				n = strlen(buffer);
-				//PRINT("%ldExecutionRes:%s\n",n,buffer);
-				memcpy(out+m,buffer,n);
-				m+=n;
-			}
-		}
-		pclose(stream);
+/* Renders the sampler's cached figures, never touching the system: addresses only, as
+ * the old ifconfig fallback gave, or the full report for sys. Returns the length.
+ */
+static size_t sysInfoText(char *out, size_t outlen, bool full) {
+	const struct SysInfo *si=sysinfo_get();
+	size_t m=0,i;
+	int n;
+
+	out[0]='\0';
+	if(full){
+		char memavail[32],memtotal[32],diskfree[32],disktotal[32];
+		bytes_convert_str(memavail,sizeof(memavail),si->mem_avail);
+		bytes_convert_str(memtotal,sizeof(memtotal),si->mem_total);
+		bytes_convert_str(diskfree,sizeof(diskfree),si->disk_free);
+		bytes_convert_str(disktotal,sizeof(disktotal),si->disk_total);
+		n=snprintf(out,outlen,"up %llud %lluh %llum\nload %.2f %.2f %.2f, %u/%u tasks\nmem %s free of %s\ndisk %s free of %s\n",
+			(unsigned long long)(si->uptime_secs/86400),(unsigned long long)(si->uptime_secs%86400/3600),
+			(unsigned long long)(si->uptime_secs%3600/60),si->load[0],si->load[1],si->load[2],si->running,si->tasks,
+			memavail,memtotal,diskfree,disktotal);
+		m=((size_t)n<outlen)?(size_t)n:outlen-1;
 	}
-
-	out[m]='\0';
-	
-	return out;
+	for(i=0;i<si->naddrs && m<outlen-1;i++){
+		n=snprintf(out+m,outlen-m,"%s %s/%u\n",si->addrs[i].ifname,si->addrs[i].addr,si->addrs[i].prefix);
+		m+=((size_t)n<outlen-m)?(size_t)n:outlen-1-m;
+	}
+	if(si->naddrs==0 && m<outlen-1){
+		n=snprintf(out+m,outlen-m,"no address\n");
+		m+=((size_t)n<outlen-m)?(size_t)n:outlen-1-m;
+	}
+	if(m>0 && out[m-1]=='\n') out[--m]='\0';
+	return m;
 }
 
 
@@ -603,222 +645,486 @@ char *getIpAddr() {
  *
  ******************************************************************************/
 
-char *listDir(int k) {
-	FILE * stream;
-	char buffer[512];
-	size_t j,flag=0,fsize=0,n,m=0;
-	int i=k-3,s1,numsp;
-	char count[64];
-	char *out=(char*)malloc(2048);
-	char lsstr[] = "ls ";
-	char lsmaindir[512];
-	//char lsdirgetsize[512];
-	char k_str[32];
+/* Renders entries first.. of s in order sort. Outside the size view directories get their usage from
+ * the file index appended; live is set then, as such a page goes stale without s changing.
+ */
+static char *renderDirPage(struct DirSnapshot *s, DIR_SORT sort, size_t first, bool *live) {
+	char *out=(char*)malloc(MAX_STR_SIZE+1);
 	char nextstr[]="-- press next to see more --";
-    snprintf(k_str, sizeof(k_str), "%d,%d",k,k+9);
-		
-    size_t lenlsstr=strlen(lsstr);
-    size_t lencurdir=strlen(curdir);
-    size_t lenlscmd_prefix = strlen(lscmd_prefix);
-    size_t lenlscmd_suffix = strlen(lscmd_suffix);
-    size_t k_strlen = strlen(k_str);
-    
-    memcpy(lsmaindir,lsstr,lenlsstr);
-    memcpy(lsmaindir+lenlsstr,curdir,lencurdir);
-    memcpy(lsmaindir+lenlsstr+lencurdir,lscmd_prefix,lenlscmd_prefix);
-    memcpy(lsmaindir+lenlsstr+lencurdir + lenlscmd_prefix,k_str,k_strlen);
-    memcpy(lsmaindir+lenlsstr+lencurdir + lenlscmd_prefix + k_strlen,lscmd_suffix,lenlscmd_suffix);
-    
-    lsmaindir[lenlsstr+lencurdir+lenlscmd_prefix+k_strlen+lenlscmd_suffix]='\0';
-    
-    /*
-    memcpy(lsdirgetsize,"ls -all ",8);
-    memcpy(lsdirgetsize+8,curdir,lencurdir);
-    memcpy(lsdirgetsize+8+lencurdir," | sed -n 2p",12);
-    lsdirgetsize[8+lencurdir+12]='\0';
-    
-     
-    PRINT("%s",lsdirgetsize);
-    
-    stream = popen(lsdirgetsize, "r");
-	if (stream) {
-		while (!feof(stream)){
-			if (fgets(buffer, 512, stream) != NULL){
-					n = strlen(buffer);
-					for(j=0;j<n;j++){
-						if(*(buffer+j)==':') fsize=j;
-					}
-					
-					break;
-			}
+	char col[32];
+	char usage[40];
+	size_t i,last,m=0;
+
+	last=first+DIR_PAGE_SIZE-1;
+	if(last>s->listing.count) last=s->listing.count;
+
+	for(i=first;i<=last && m<MAX_STR_SIZE;i++){
+		const struct DirEntry *e=dir_snapshot_entry(s,sort,i);
+		if(e==NULL) break;
+		col[0]='\0';
+		if(DIR_SORT_KEY(sort)==DIR_SORT_SIZE){
+			bytes_convert_str(col,sizeof(col)-1,e->size);
+			strcat(col," ");
 		}
-	}
-	
-	PRINT("fsize:%d",fsize);
-	*/
-	
-	s1=0;numsp=0;
-	stream = popen(lsmaindir, "r");
-	if (stream) {
-		while (!feof(stream)){
-			if (fgets(buffer, 512, stream) != NULL){
-				n = strlen(buffer);
-				if(flag==0){
-					flag=1;
-					for(j=0;j<n;j++){
-						if((*(buffer+j)==' ')&&(s1==0)) {s1=1;numsp++;}
-						else if((*(buffer+j)!=' ')&&(s1==1)) s1=0;
-						if(numsp==8) {fsize=j;break;}
-					}
-				}
-				snprintf(count, sizeof(count), "%d ",i);
-				i++;
-				memcpy(out+m,count,strlen(count));
-				m+=strlen(count);
-				memset(count,0,32);
-				if(*(buffer)=='d'){
-					memcpy(out+m,"dir ",4);
-					m+=4;
-				}
-				else{
-					memcpy(out+m,"--- ",4);
-					m+=4;
-				}
-				//PRINT("%s",buffer);
-				memcpy(out+m,buffer+fsize+1,n-fsize-1);
-				m+=n-fsize-1;
+		else if(DIR_SORT_KEY(sort)==DIR_SORT_MTIME){
+			struct tm tm;
+			strftime(col,sizeof(col),"%Y-%m-%d %H:%M ",localtime_r(&e->mtime,&tm));
+		}
+		usage[0]='\0';
+		if(e->type==DIR_ENTRY_DIR && DIR_SORT_KEY(sort)!=DIR_SORT_SIZE){
+			char path[4096];
+			uint64_t bytes,files;
+			snprintf(path,sizeof(path),"%s/%s",s->path,e->name);
+			if(file_index_usage(path,&bytes,&files)==0){
+				strcpy(usage," [");
+				bytes_convert_str(usage+2,sizeof(usage)-3,bytes);
+				strcat(usage,"]");
 			}
+			*live=true;
 		}
-		pclose(stream);
+		int n=snprintf(out+m,MAX_STR_SIZE+1-m,"%zu %s %s%s%s%s%s\n",i,(e->type==DIR_ENTRY_DIR)?"dir":"---",col,e->name,usage,
+			e->note?":":"",e->note?e->note:"");
+		if(n<0) break;
+		m+=((size_t)n<MAX_STR_SIZE-m)?(size_t)n:MAX_STR_SIZE-m;
 	}
 
-    if(k+9 <= maxelecount + 3){
+	if(last<s->listing.count && m+strlen(nextstr)<=MAX_STR_SIZE){
 		memcpy(out+m,nextstr,strlen(nextstr));
 		m+=strlen(nextstr);
 	}
-	
+
 	out[m]='\0';
-	
+
 	return out;
 }
 
-int getDirEleSize() {
-	FILE * stream;
-	char buffer[256];
-	size_t n;
+/* Parses the optional `ls` arguments: [name|size|time] [asc|desc].
+ * Size and time default to descending (largest, newest first), name to ascending.
+ */
+static DIR_SORT parseSortArgs(const char *args) {
+	DIR_SORT sort=DIR_SORT_NAME;
+	bool desc=false;
 
-	char lsstr[] = "ls -all ";
-	char wcstr[] = " | wc -l";
-	char lsmaindir[512];
-		
-    size_t lenlsstr=strlen(lsstr);
-    size_t lencurdir=strlen(curdir);
-    size_t lenwcstr = strlen(wcstr);
+	if(strstr(args,"size")!=NULL) {sort=DIR_SORT_SIZE;desc=true;}
+	else if(strstr(args,"time")!=NULL) {sort=DIR_SORT_MTIME;desc=true;}
 
-    
-    memcpy(lsmaindir,lsstr,lenlsstr);
-    memcpy(lsmaindir+lenlsstr,curdir,lencurdir);
-    memcpy(lsmaindir+lenlsstr+lencurdir,wcstr,lenwcstr);
-    
-    lsmaindir[lenlsstr+lencurdir+lenwcstr]='\0';
-    
-	stream = popen(lsmaindir, "r");
-	if (stream) {
-		while (!feof(stream)){
-			if (fgets(buffer, 256, stream) != NULL){
-				n = (int)strtol(buffer,NULL,10);
-			}
+	if(strstr(args,"desc")!=NULL) desc=true;
+	else if(strstr(args,"asc")!=NULL) desc=false;
+
+	return desc?sort+1:sort;
+}
+
+/* Returns the folder the friend is in: its working dir, or a folder inside the archive it browses */
+static const char *curPath(const struct Session *ss) {
+	return (ss->arcpath!=NULL)?ss->arcpath:ss->cwd.path;
+}
+
+/* Makes s the friend's `ls` snapshot, bound to the current dir. Takes over the reference */
+static void setSnapshot(struct Session *ss, struct DirSnapshot *s) {
+	dir_snapshot_release(ss->snap);
+	free(ss->snapdir);
+	ss->snap=s;
+	ss->snapdir=(s!=NULL)?strdup(curPath(ss)):NULL;
+}
+
+/* Lists the folder of the archive the friend browses into a snapshot named by its path inside the archive */
+static struct DirSnapshot *archiveSnapshot(struct Session *ss) {
+	struct DirListing listing={0};
+	char arc[PATH_MAX];
+	const char *dir=ss->arcpath+ss->arclen;
+
+	snprintf(arc,sizeof(arc),"%.*s",(int)ss->arclen,ss->arcpath);
+	if(archive_list(arc,(*dir=='/')?dir+1:dir,&listing)==-1){
+		dir_listing_free(&listing);
+		return NULL;
+	}
+
+	return dir_snapshot_new(ss->arcpath,&listing);
+}
+
+/* Returns the `ls` snapshot of the current dir, taking one if there is none yet or the dir changed since */
+static struct DirSnapshot *curSnapshot(struct Session *ss) {
+	if(ss->snap!=NULL && (ss->snapdir==NULL || strcmp(ss->snapdir,curPath(ss))!=0)) setSnapshot(ss,NULL);
+	if(ss->snap==NULL){
+		struct DirSnapshot *s=(ss->arcpath!=NULL)?archiveSnapshot(ss):dir_snapshot_get(ss->cwd.path);
+		if(s==NULL){
+			PRINT("snapshot [%s] failed: %s",curPath(ss),strerror(errno));
+			return NULL;
 		}
-		pclose(stream);
+		setSnapshot(ss,s);
 	}
+	ss->last_used=time(NULL);
+	return ss->snap;
+}
 
-    
-	return n;
+/* Reads dir into a snapshot of its own where every subdirectory's size is the usage below it,
+ * so the size view ranks folders by what they hold rather than by 4096. Returns NULL on failure.
+ */
+static struct DirSnapshot *usageSnapshot(const char *dir) {
+	struct DirListing listing={0};
+
+	if(dir_enumerate(dir,&listing)==-1){
+		PRINT("usage snapshot [%s] failed: %s",dir,strerror(errno));
+		return NULL;
+	}
+	file_index_fill_usage(dir,&listing);
+
+	return dir_snapshot_new(dir,&listing);
 }
 
-char *getFileWPath(int i, bool quotes) {
-	char cmd[512]="ls -all ";
-	char t[64]="/ | sed -n ";
-	char c[16];
-	FILE * stream;
-	char buffer[512];
-	size_t j,k,count,n,m=0;
-	size_t curdirlen = strlen(curdir);
-	size_t downloaddirlen=strlen(downloaddir);
-	size_t lscmd_suffix_wplen = strlen(lscmd_suffix_wp);
+/* Takes a fresh snapshot of the current dir for ls/next/down/delf. Returns its entry count */
+int snapDir(struct Session *ss) {
+	setSnapshot(ss,NULL);
+
+	if(DIR_SORT_KEY(ss->sort)==DIR_SORT_SIZE && ss->arcpath==NULL) setSnapshot(ss,usageSnapshot(ss->cwd.path));
+
+	struct DirSnapshot *s=curSnapshot(ss);
+	return (s!=NULL)?(int)s->listing.count:0;
+}
+
+/* Drops the `ls` snapshots of friends that stopped paging through them */
+void expireSnapshots(time_t now) {
+	struct Friend *f;
+	for(f=friends;f!=NULL;f=f->next){
+		if(f->session.snap!=NULL && now-f->session.last_used>DIR_SNAPSHOT_TTL) setSnapshot(&f->session,NULL);
+	}
+}
+
+/* Returns f's session, opening its working dir at the root on first use. Returns NULL if that fails */
+static struct Session *getSession(struct Friend *f) {
+	struct Session *ss=&f->session;
+	if(ss->cwd.fd==-1 && workdir_open(&ss->cwd,maindir)==-1){
+		PRINT("session of %u: can not open %s: %s",f->friend_num,maindir,strerror(errno));
+		return NULL;
+	}
+	return ss;
+}
+
+/* Releases what f's session holds: its snapshot, working dir and waiting messages */
+static void freeSession(struct Session *ss) {
+	setSnapshot(ss,NULL);
+	free(ss->arcpath);
+	ss->arcpath=NULL;
+	workdir_close(&ss->cwd);
+	while(ss->pending!=NULL){
+		struct SessionMsg *m=ss->pending;
+		ss->pending=m->next;
+		free(m);
+	}
+	ss->pending_tail=&ss->pending;
+	ss->npending=0;
+}
+
+char *listDir(struct Session *ss, int k) {
+	struct DirSnapshot *s=curSnapshot(ss);
+	size_t first,page;
+	bool aligned;
+
+	if(s==NULL) return strdup("");
+
+	first=(k>3)?(size_t)(k-3):1;
+	page=(first-1)/DIR_PAGE_SIZE;
+	aligned=((first-1)%DIR_PAGE_SIZE==0) && page<s->npages;
+
+	char *cached=aligned?dir_snapshot_get_page(s,ss->sort,page):NULL;
+	if(cached!=NULL) return cached;
+
+	bool live=false;
+	char *out=renderDirPage(s,ss->sort,first,&live);
+	if(aligned && !live) dir_snapshot_set_page(s,ss->sort,page,strdup(out));
+
+	return out;
+}
+
+/* Resolves entry i of the `ls` snapshot to a path, checking it is still the same entry (inode and name).
+ * Returns NULL if the entry is not a dir when dir is set, is one when it is not, or was deleted or replaced since the snapshot.
+ */
+static char *getEntryPath(struct Session *ss, int i, bool quotes, bool dir) {
+	struct DirSnapshot *s;
+	const struct DirEntry *e;
+	char *out=NULL;
 
-	
 	if(i<=0) i=1;
-	snprintf(c, sizeof(c), "%d",i+3);
-	memcpy(cmd+8,curdir,curdirlen);
-	memcpy(cmd+8+curdirlen,t,11);
-	memcpy(cmd+8+curdirlen+11,c,strlen(c));
-	memcpy(cmd+8+curdirlen+11+strlen(c),lscmd_suffix_wp,lscmd_suffix_wplen);
-	cmd[8+curdirlen+11+strlen(c)+lscmd_suffix_wplen]='\0';
-
-	PRINT("%s",cmd);
-	char *out=(char*)malloc(2048);
-	
-	if(quotes==false){
-		//memcpy(out,curdir,curdirlen);
-		//memcpy(out+curdirlen,"/",1);
-		//m=curdirlen+1;
-		memcpy(out,downloaddir,downloaddirlen);
-		memcpy(out+downloaddirlen,"/",1);
-		m=downloaddirlen+1;
-	}
-	else {
-	   //memcpy(out,"/var/res/share/autotox/'",24);
-	   //m=24;
-	   memcpy(out,curdir,curdirlen);
-	   memcpy(out+curdirlen,"/\"",2);
-	   m=curdirlen+2;
-   }
-	
-	
-	stream = popen(cmd, "r");
-	if (stream) {
-		while (!feof(stream)){
-			if (fgets(buffer, 512, stream) != NULL){
-				//PRINT("ExecutionRes:%s %d",buffer,(unsigned)strlen(buffer));
-				if(*(buffer)=='d'){
-					free(out);
-					return NULL;
-				}
-				n = strlen(buffer);
-				count=0;
-				k=0;
-				for(j=0;j<n;j++){
-					if((*(buffer+j)==' ')&&(k==0)) {
-						k=1;
-						count++;
-					}
-					else if((*(buffer+j)!=' ')&&(k==1)) {
-						k=0;
-						if(count==8) {k=j; break;}						
-					}
-				}
-				//PRINT("%ldExecutionRes:%s\n",n,buffer);
-				//memcpy(out+m,buffer+2,n-3);
-				//m+=n-3;
-				memcpy(out+m,buffer+j,n-j-1);
-				m+=n-j-1;
+
+	if((s=curSnapshot(ss))==NULL) return NULL;
+
+	/* archive members have no inode to check, their index is dropped when the archive changes */
+	if(ss->arcpath!=NULL && strcmp(s->path,ss->arcpath)==0) e=dir_snapshot_entry(s,ss->sort,(size_t)i);
+	else e=dir_snapshot_resolve(s,ss->sort,(size_t)i);
+	if(e==NULL){
+		PRINT("getFileWPath %d in [%s]: %s",i,s->path,strerror(errno));
+		return NULL;
+	}
+
+	if((e->type==DIR_ENTRY_DIR)==dir){
+		size_t len=strlen(s->path)+strlen(e->name)+4;
+		out=(char*)malloc(len);
+		if(quotes==false)
+			snprintf(out,len,"%s/%s",s->path,e->name);
+		else
+			snprintf(out,len,"\"%s/%s\"",s->path,e->name);
+	}
+
+	return out;
+}
+
+/* Resolves entry i of the `ls` snapshot to a file path. Returns NULL for directories and stale entries */
+char *getFileWPath(struct Session *ss, int i, bool quotes) {
+	return getEntryPath(ss,i,quotes,false);
+}
+
+/* Resolves entry i of the `ls` snapshot to a dir path. Returns NULL for files and stale entries */
+char *getDirWPath(struct Session *ss, int i) {
+	return getEntryPath(ss,i,false,true);
+}
+
+/*******************************************************************************
+ *
+ * Archives
+ *
+ ******************************************************************************/
+
+/* Moves the friend into, around in or out of an archive along arg, len bytes long: folders below the
+ * working dir down to an archive, then folders inside it; .. at its top leaves it. Runs on a worker,
+ * reading the archive; fsJobDone() moves the working dir to the folder holding the archive.
+ * Returns 0, -1 if a name is not a folder, an archive or a folder of one, or the path leaves the archive and goes on.
+ */
+static int changeArchiveDir(struct Session *ss, const char *arg, size_t len) {
+	char path[PATH_MAX];
+	size_t arclen=(ss->arcpath!=NULL)?ss->arclen:0;
+	size_t cwdlen=strlen(ss->cwd.path);
+	size_t plen=(size_t)snprintf(path,sizeof(path),"%s",curPath(ss));
+	struct stat st;
+	struct DirEntry e;
+
+	while(len>0){
+		size_t n=0;
+		while(n<len && arg[n]!='/') n++;
+		const char *name=arg;
+		size_t nlen=n;
+		arg+=n+(n<len);
+		len-=n+(n<len);
+		if(nlen>=2 && name[0]=='"' && name[nlen-1]=='"'){name++;nlen-=2;}
+
+		if(nlen==0 || (nlen==1 && name[0]=='.')) continue;
+		if(nlen==2 && name[0]=='.' && name[1]=='.'){
+			if(arclen==0) return -1;
+			if(plen==arclen){
+				/* at the top of the archive: back to the folder holding it, and no further */
+				plen=cwdlen;
+				arclen=0;
+				if(len>0) return -1;
 			}
+			else plen=strrchr(path,'/')-path;
+			path[plen]='\0';
+			continue;
+		}
+		if(memchr(name,'\0',nlen)!=NULL || plen+1+nlen>=sizeof(path)) return -1;
+		path[plen]='/';
+		memcpy(path+plen+1,name,nlen);
+		plen+=1+nlen;
+		path[plen]='\0';
+		if(arclen==0){
+			if(lstat(path,&st)==-1 || (!S_ISDIR(st.st_mode) && (!S_ISREG(st.st_mode) || !archive_is_archive(path)))) return -1;
+			if(S_ISREG(st.st_mode)) arclen=plen;
 		}
-		pclose(stream);
 	}
 
-    if(quotes==false){
-		//memcpy(out+m,"\"",1);
-		//m++;
-		out[m]='\0';
+	if(arclen==0 && plen!=cwdlen) return -1;
+	if(arclen>0){
+		char arc[PATH_MAX];
+		snprintf(arc,sizeof(arc),"%.*s",(int)arclen,path);
+		if(archive_stat(arc,(plen>arclen)?path+arclen+1:"",&e)==-1 || e.type!=DIR_ENTRY_DIR){
+			PRINT("cd [%s]: %s",path,strerror(errno));
+			return -1;
+		}
 	}
-	else{
-		out[m]='"';
-		out[m+1]='\0';
+
+	free(ss->arcpath);
+	ss->arcpath=(arclen>0)?strdup(path):NULL;
+	ss->arclen=arclen;
+	return 0;
+}
+
+/*******************************************************************************
+ *
+ * Find Files
+ *
+ ******************************************************************************/
+
+/* Looks pattern up in the file index and makes the matches, relative to maindir, the `ls` snapshot
+ * so next/down/delf work on them. ^prefix matches a name prefix, * ? [ make it a glob, anything
+ * else is a substring. Returns the number of matches, -1 on failure.
+ */
+long findFiles(struct Session *ss, const char *pattern) {
+	struct DirListing listing={0};
+	FILE_INDEX_MATCH match=FILE_INDEX_MATCH_SUBSTRING;
+
+	if(pattern[0]=='^'){
+		match=FILE_INDEX_MATCH_PREFIX;
+		pattern++;
 	}
-	
-	return out;
+	else if(strpbrk(pattern,"*?[")!=NULL) match=FILE_INDEX_MATCH_GLOB;
+
+	long total=file_index_find(pattern,match,&listing);
+	if(total<0){
+		dir_listing_free(&listing);
+		return -1;
+	}
+
+	struct DirSnapshot *s=dir_snapshot_new(maindir,&listing);
+	if(s==NULL) return -1;
+
+	setSnapshot(ss,s);
+	ss->sort=DIR_SORT_NAME;
+
+	return total;
+}
+
+/* Pins the n files below dir that come first by top as the session's snapshot, named from root like find results.
+ * Returns the number of files below dir, -1 on failure.
+ */
+long topFiles(struct Session *ss, const char *dir, FILE_INDEX_TOP top, size_t n) {
+	struct DirListing listing={0};
+
+	long total=file_index_top(dir,top,n,&listing);
+	if(total<0){
+		dir_listing_free(&listing);
+		return -1;
+	}
+
+	struct DirSnapshot *s=dir_snapshot_new(maindir,&listing);
+	if(s==NULL) return -1;
+
+	setSnapshot(ss,s);
+	ss->sort=(top==FILE_INDEX_TOP_SIZE)?DIR_SORT_SIZE_DESC:(top==FILE_INDEX_TOP_NEWEST)?DIR_SORT_MTIME_DESC:DIR_SORT_MTIME;
+
+	return total;
+}
+
+/*******************************************************************************
+ *
+ * Grep Files
+ *
+ ******************************************************************************/
+
+/* Splits the arguments of grep into the pattern, "quoted text", /regex/ or a single word, and what follows it.
+ * Returns false if there is no pattern or a quote is not closed.
+ */
+static bool parseGrepArgs(const char *arg, char *pattern, size_t size, bool *regex, const char **rest) {
+	const char *end;
+	char close=' ';
+
+	while(*arg==' ') arg++;
+	*regex=(*arg=='/');
+	if(*arg=='"' || *arg=='/') close=*arg++;
+
+	end=strchr(arg,close);
+	if(end==NULL){
+		if(close!=' ') return false;
+		end=arg+strlen(arg);
+	}
+	if(end==arg || (size_t)(end-arg)>=size) return false;
+
+	memcpy(pattern,arg,end-arg);
+	pattern[end-arg]='\0';
+	*rest=end+(*end!='\0');
+	return true;
+}
+
+/* Scans the files below dir for lines matching pattern and makes the hits the `ls` snapshot, one entry
+ * per line named after its file, so next pages through them and down/delf act on the file.
+ * Returns 0 with the summary in out, -1 with the reason in out on failure.
+ */
+int grepFiles(struct Session *ss, const char *dir, const char *pattern, bool regex, char *out, size_t outlen) {
+	struct DirListing files={0},hits={0};
+	struct GrepPattern p;
+	struct GrepResult res;
+	struct FileIndexStats st;
+	char scanned[32];
+
+	if(grep_compile(&p,pattern,regex)==-1){
+		grep_free(&p);
+		snprintf(out,outlen,"bad pattern");
+		return -1;
+	}
+
+	long total=file_index_files(dir,GREP_MAX_FILES,&files);
+	int ret=(total>=0)?grep_files(dir,&files,&p,&hits,&res):-1;
+	grep_free(&p);
+	dir_listing_free(&files);
+
+	struct DirSnapshot *s=(ret==0)?dir_snapshot_new(dir,&hits):NULL;
+	if(s==NULL){
+		dir_listing_free(&hits);
+		snprintf(out,outlen,"fail");
+		return -1;
+	}
+
+	setSnapshot(ss,s);
+	ss->sort=DIR_SORT_NAME;
+
+	file_index_get_stats(&st);
+	bytes_convert_str(scanned,sizeof(scanned),res.bytes);
+	snprintf(out,outlen,"%zu hits in %zu files, %zu of %ld files scanned, %s read%s%s%s",res.hits,res.matched,res.files,total,
+		scanned,(res.skipped>0)?", binary or unreadable skipped":"",
+		res.budget_hit?", stopped at the I/O budget":(res.hits>s->listing.count)?", stopped at the first hits":"",
+		(st.pending_dirs>0)?" (index still building)":"");
+	return 0;
+}
+
+/*******************************************************************************
+ *
+ * Search Text
+ *
+ ******************************************************************************/
+
+/* Writes the size of the content index to out */
+static void textIndexReport(char *out, size_t outlen) {
+	struct TextIndexStats st;
+	char mem[32],maxmem[32],disk[32],maxdisk[32],covered[32];
+
+	text_index_get_stats(&st);
+	bytes_convert_str(mem,sizeof(mem),st.bytes);
+	bytes_convert_str(maxmem,sizeof(maxmem),st.max_bytes);
+	bytes_convert_str(disk,sizeof(disk),st.disk_bytes);
+	bytes_convert_str(maxdisk,sizeof(maxdisk),st.max_disk);
+	bytes_convert_str(covered,sizeof(covered),st.text_bytes);
+	snprintf(out,outlen,"text: files:%zu (%s) binary:%zu terms:%zu postings:%llu mem:%s/%s disk:%s/%s dead:%zu passes:%llu last:%.2fs%s%s",
+		st.docs,covered,st.binary_docs,st.terms,(unsigned long long)st.postings,mem,maxmem,disk,maxdisk,st.dead_docs,
+		(unsigned long long)st.passes,st.pass_secs,st.complete?"":" (building)",
+		(st.unindexed>0)?", files left out by the memory budget":"");
+}
+
+/* Looks the words up in the content index and makes the files holding them on one line the `ls` snapshot,
+ * named by their path below root, so next pages through them and down/delf act on them.
+ * Returns 0 with the summary in out, -1 with the reason in out on failure.
+ */
+int searchText(struct Session *ss, const char *query, char *out, size_t outlen) {
+	struct DirListing hits={0};
+	struct TextSearchResult res;
+	struct TextIndexStats st;
+
+	if(text_index_search(query,&hits,&res)==-1){
+		dir_listing_free(&hits);
+		snprintf(out,outlen,(textindexmem>0)?"no word to search for, or fail":"content index is off");
+		return -1;
+	}
+
+	struct DirSnapshot *s=dir_snapshot_new(maindir,&hits);
+	if(s==NULL){
+		dir_listing_free(&hits);
+		snprintf(out,outlen,"fail");
+		return -1;
+	}
+
+	setSnapshot(ss,s);
+	ss->sort=DIR_SORT_NAME;
+
+	text_index_get_stats(&st);
+	snprintf(out,outlen,"%zu lines in %zu files, %llu us%s%s",res.lines,res.files,(unsigned long long)res.usecs,
+		(res.files>s->listing.count)?", showing the first":"",st.complete?"":" (index still building)");
+	return 0;
 }
 
 /*******************************************************************************
@@ -827,351 +1133,931 @@ char *getFileWPath(int i, bool quotes) {
  *
  ******************************************************************************/
 
-void delFile(int i) {
-	char *pathfile=getFileWPath(i,true);
-	
-	char cmd[512]="rm ";
-	int l=strlen(pathfile);
-	memcpy(cmd+3,pathfile,l);
-	cmd[3+l]='\0';
-	PRINT("delfile cmd [%s]",cmd);
-	
-	popen(cmd, "r");
-	
-	free(pathfile);
+/* Parses the `ls` entry numbers of a command like "3,5,10-40" (spaces separate too) into a sorted list
+ * without duplicates, numbers above max dropped. Returns the count and sets *out, -1 if malformed.
+ */
+static int parseSelection(const char *arg, int max, int **out) {
+	char *end;
+	int n=0,i;
+	bool *picked;
+
+	*out=NULL;
+	if(max<1) return 0;
+	if((picked=(bool*)calloc((size_t)max+1,sizeof(bool)))==NULL) return -1;
+
+	for(;;){
+		while(*arg==' ' || *arg==',') arg++;
+		if(*arg=='\0') break;
+
+		long from=strtol(arg,&end,10),to;
+		if(end==arg || from<1) goto bad;
+		to=from;
+		if(*end=='-'){
+			arg=end+1;
+			to=strtol(arg,&end,10);
+			if(end==arg || to<from) goto bad;
+		}
+		if(*end!='\0' && *end!=',' && *end!=' ') goto bad;
+		arg=end;
+
+		/* past the listing: nothing to pick, and never cast to int unbounded */
+		if(from>max) continue;
+		if(to>max) to=max;
+		for(long k=from;k<=to;k++) picked[k]=true;
+	}
+
+	for(i=1;i<=max;i++) if(picked[i]) n++;
+	if(n>0 && (*out=(int*)malloc(n*sizeof(int)))!=NULL){
+		n=0;
+		for(i=1;i<=max;i++) if(picked[i]) (*out)[n++]=i;
+	}
+	else if(n>0) n=-1;
+
+	free(picked);
+	return n;
+bad:
+	free(picked);
+	return -1;
+}
+
+/* Deletes the files numbered sel of the `ls` snapshot, each checked like getFileWPath first.
+ * Nothing in the backup folder is touched. Returns the number deleted, adds the others to stale or kept.
+ */
+int delFiles(struct Session *ss, const int *sel, int n, int *stale, int *kept) {
+	struct DirSnapshot *s=curSnapshot(ss);
+	size_t backuplen=strlen(backupdir);
+	int dirfd,k,done=0;
+
+	if(s==NULL || (dirfd=open(s->path,O_RDONLY|O_DIRECTORY|O_CLOEXEC))==-1){
+		*stale+=n;
+		return 0;
+	}
+
+	for(k=0;k<n;k++){
+		const struct DirEntry *e=dir_snapshot_resolve(s,ss->sort,(size_t)sel[k]);
+		if(e==NULL || e->type==DIR_ENTRY_DIR){
+			(*stale)++;
+			continue;
+		}
+
+		char path[PATH_MAX];
+		snprintf(path,sizeof(path),"%s/%s",s->path,e->name);
+		if(strncmp(path,backupdir,backuplen)==0 && path[backuplen]=='/'){
+			(*kept)++;
+			continue;
+		}
+
+		if(trash_delete(dirfd,e->name)==0){
+			/* the next ls may come before inotify tells the cache */
+			*strrchr(path,'/')='\0';
+			dir_cache_invalidate(path);
+			done++;
+		}
+		else{
+			PRINT("delf [%s]: %s",path,strerror(errno));
+			(*stale)++;
+		}
+	}
+
+	close(dirfd);
+	return done;
 }
 
 /*******************************************************************************
  *
- *  Find Dir
+ * Checksums
  *
  ******************************************************************************/
 
-int removespaces(char *name){
-	char temp[512];
-	size_t len = strlen(name);
-	int i,f=0;
-	for(i=0;i<len;i++){
-		if(*(name+i)==' '){
-			//PRINT("phat hien quote 1");
-			f++;
-		}
-		else break;
-	}
-	memcpy(temp,name+f,len-f);
-	memcpy(name,temp,len-f);
-	*(name+len-f)='\0';
-	return f;
-}
-
-int removequotes(char *name){
-	char temp[512];
-	size_t len = strlen(name);
-	int i,f=0,l=0;
-	for(i=0;i<len;i++){
-		if(*(name+i)=='"'){
-			//PRINT("phat hien quote 1");
-			f++;
-		}
-		else break;
-	}
-	memcpy(temp,name+f,len-f);
-	temp[len-f]='\0';
-	for(i=0;i<len-f;i++){
-		if(*(temp+i)=='"'){
-			//PRINT("phat hien quote 2");
-			l++;
-		}
-	}
-	memcpy(name,temp,strlen(temp)-l);
-	*(name+strlen(temp)-l)='\0';
-	return (f+l);
-}
-
-int findDir(char *dirname, size_t msglen) {
-	char quote[]="\"";
-	char strslash[]="/\"";
-	char strslashwoquote[]="/";
-	char findstr[] = "find ";
-	char args[] = " -maxdepth 1 -type d -name ";
-	char cmd[17408];
-	char buffer[17408];
-	FILE * stream;
-	
-	msglen -= removespaces(dirname);
-	msglen -= removequotes(dirname);
-	//PRINT("name sau khi loai quotes [%s] voi leng=%u",dirname,strlen(dirname));
-	
-	size_t findstrlen=strlen(findstr);
-	size_t curdirlen=strlen(curdir);
-	size_t argslen = strlen(args);
-	size_t dirnamelen = strlen(dirname);
-
-	memcpy(cmd,findstr,findstrlen);
-	memcpy(cmd + findstrlen,curdir,curdirlen);
-	memcpy(cmd + findstrlen + curdirlen,args,argslen);
-	memcpy(cmd + findstrlen + curdirlen + argslen,quote, 1);
-	memcpy(cmd + findstrlen + curdirlen + argslen+1,dirname, dirnamelen);
-	memcpy(cmd + findstrlen + curdirlen + argslen+dirnamelen+1,quote, 1);
-	cmd[findstrlen+curdirlen+argslen+dirnamelen+2] = '\0';
-	
-	//PRINT("cmd=%s",cmd);
-	
-	int n=0;
-	
-	stream = popen(cmd, "r");
-	if (stream) {
-		while (!feof(stream)){
-			if (fgets(buffer, 17408, stream) != NULL){
-				n = strlen(buffer);
-			}
+/* Puts the b2sum line of file name in folder dir into out. Returns 0, -1 with a reason in out on failure */
+int sumFile(const char *dir, const char *name, char *out, size_t outlen) {
+	uint8_t sum[SUM_BYTES];
+	char hex[SUM_HEX_SIZE];
+	int dirfd=open(dir,O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	int ret=(dirfd!=-1)?sum_file(dirfd,name,sum,NULL):-1;
+
+	if(ret==-1){
+		PRINT("sum [%s/%s]: %s",dir,name,strerror(errno));
+		snprintf(out,outlen,"%s",(errno==EAGAIN)?"file changed while reading it, try again":staleentrymsg);
+	}
+	else{
+		const char *base=strrchr(name,'/');
+		sum_to_hex(sum,hex);
+		snprintf(out,outlen,"%s  %s",hex,base?base+1:name);
+	}
+
+	if(dirfd!=-1) close(dirfd);
+	return ret;
+}
+
+/* Writes the b2sum list of every file below path to a temporary file, the summary to out.
+ * Returns the list's path for sending, to be unlinked along with its folder once opened. NULL on failure.
+ */
+char *sumFolder(const char *path, char *out, size_t outlen) {
+	struct SumTreeResult res;
+	char tmpdir[]="/tmp/autotox-sum.XXXXXX";
+	const char *base=(strlen(path)>maindirlen)?strrchr(path,'/')+1:"root";
+	char total[32];
+
+	if(mkdtemp(tmpdir)==NULL){
+		snprintf(out,outlen,"fail");
+		return NULL;
+	}
+
+	size_t len=strlen(tmpdir)+strlen(base)+8;
+	char *list=(char*)malloc(len);
+	snprintf(list,len,"%s/%s.b2sum",tmpdir,base);
+
+	FILE *fp=fopen(list,"w");
+	int ret=(fp!=NULL)?sum_tree(path,fp,&res):-1;
+	if(fp!=NULL && fclose(fp)!=0) ret=-1;
+
+	if(ret==-1){
+		unlink(list);
+		rmdir(tmpdir);
+		free(list);
+		snprintf(out,outlen,"fail");
+		return NULL;
+	}
+
+	bytes_convert_str(total,sizeof(total),res.bytes);
+	snprintf(out,outlen,"%zu files, %s (%zu from cache)%s%s, check a copy with: b2sum -c %s.b2sum",
+		res.files,total,res.cached,(res.failed>0)?", some unreadable or changing, left out":"",
+		res.truncated?", too many files, list cut short":"",base);
+
+	return list;
+}
+
+/*******************************************************************************
+ *
+ * Backup
+ *
+ ******************************************************************************/
+
+/* Writes the size of the backup store to out */
+static void backupReport(char *out, size_t outlen) {
+	struct BackupStats st;
+	char stored[32],backedup[32],written[32],restored[32];
+
+	backup_get_stats(&st);
+	bytes_convert_str(stored,sizeof(stored),st.stored_bytes);
+	bytes_convert_str(backedup,sizeof(backedup),st.backed_up);
+	bytes_convert_str(written,sizeof(written),st.written);
+	bytes_convert_str(restored,sizeof(restored),st.restored);
+	snprintf(out,outlen,"backup: chunks:%zu stored:%s packs:%zu since start: backed up:%s new:%s restored:%s",
+		st.chunks,stored,st.packs,backedup,written,restored);
+}
+
+/* Backs the file at path up into backupdir. A plain file already in backupdir is kept next to its
+ * backup unless backupfoldcopies. Returns 0 with the summary in out, -1 with the reason in out on failure.
+ */
+int backupFile(const char *path, char *out, size_t outlen) {
+	struct BackupResult res;
+	size_t backuplen=strlen(backupdir);
+	bool inbackup=(strncmp(path,backupdir,backuplen)==0 && path[backuplen]=='/');
+	char size[32],added[32];
+
+	if(inbackup && backup_is_manifest(path)){
+		snprintf(out,outlen,"already a backup");
+		return -1;
+	}
+
+	if(backup_file(path,backupdir,&res)==-1){
+		PRINT("backup [%s]: %s",path,strerror(errno));
+		snprintf(out,outlen,"%s",(errno==EAGAIN)?"file changed while reading it, try again":
+			(errno==ENOENT || errno==EINVAL)?staleentrymsg:"backup failed");
+		return -1;
+	}
+
+	dir_cache_invalidate(backupdir);
+	bytes_convert_str(size,sizeof(size),res.bytes);
+	if(res.unchanged){
+		snprintf(out,outlen,"unchanged since %s",res.manifest);
+		return 0;
+	}
+
+	/* its chunks are stored and synced: the copy may go, if that was asked for */
+	bool folded=(inbackup && backupfoldcopies && unlink(path)==0);
+	if(folded){
+		char *parent=strdup(path);
+		if(parent!=NULL){
+			*strrchr(parent,'/')='\0';
+			dir_cache_invalidate(parent);
+			free(parent);
+		}
+	}
+
+	bytes_convert_str(added,sizeof(added),res.new_bytes);
+	snprintf(out,outlen,"backed up as %s: %s in %zu chunks, %s new in %zu%s",res.manifest,size,res.chunks,added,res.new_chunks,
+		folded?", replaces the copy":"");
+	return 0;
+}
+
+/* Rebuilds the file of the backup at path in a folder of its own in the store.
+ * Returns its path for sending, to be unlinked along with its folder once opened. NULL with a reason in out on failure.
+ */
+char *restoreBackup(const char *path, char *out, size_t outlen) {
+	char tmpdir[PATH_MAX],file[PATH_MAX];
+
+	snprintf(tmpdir,sizeof(tmpdir),"%s/restore.XXXXXX",pathbackupstore);
+	if(mkdtemp(tmpdir)==NULL){
+		snprintf(out,outlen,"restore failed");
+		return NULL;
+	}
+
+	if(backup_restore(path,tmpdir,file,sizeof(file))==-1){
+		PRINT("restore [%s]: %s",path,strerror(errno));
+		snprintf(out,outlen,"%s",(errno==EIO)?"restore failed: a chunk is missing or damaged":"restore failed");
+		rmdir(tmpdir);
+		return NULL;
+	}
+
+	return strdup(file);
+}
+
+/*******************************************************************************
+ *
+ * File Command Jobs
+ *
+ ******************************************************************************/
+
+#define FS_JOB_MAX_REPLIES 8
+#define TOP_DEFAULT 50           // files shown by top without a count
+#define SESSION_MAX_PENDING 16
+
+/* A file command on its way through the worker pool. The worker only ever sees ss, a copy of
+ * the friend's session, and collects what to send; fsJobDone() applies both on the tox thread.
+ */
+struct FsJob {
+	struct WorkJob work;
+	uint32_t friend_num;
+	struct Session ss;
+	char *replies[FS_JOB_MAX_REPLIES];
+	int nreplies;
+	char *sendpath;
+	bool sendtemp;        /* sendpath is a temporary file in a folder of its own */
+	FILE *sendstream;     /* sent instead of a file, sendsize bytes under the name sendpath */
+	uint64_t sendsize;
+	bool sendfollow;      /* sendpath is followed as it grows rather than sent */
+	struct DownItem *down;  /* files for the download queue */
+	size_t ndown;
+	size_t length;
+	char msg[];
+};
+
+static void jobReply(struct FsJob *j, const char *text, size_t len) {
+	if(j->nreplies<FS_JOB_MAX_REPLIES) j->replies[j->nreplies++]=strndup(text,len);
+}
+
+/* Replies with text split into as many messages as it takes, at line ends where it can and never inside a UTF-8 character */
+static void jobReplyText(struct FsJob *j, const char *text) {
+	size_t len=strlen(text);
+
+	while(len>MAX_STR_SIZE){
+		size_t n=MAX_STR_SIZE;
+		while(n>0 && text[n]!='\n') n--;
+		if(n==0){
+			n=MAX_STR_SIZE;
+			while(n>1 && ((unsigned char)text[n]&0xC0)==0x80) n--;
+		}
+		jobReply(j,text,n);
+		text+=n+(text[n]=='\n');
+		len=strlen(text);
+	}
+	jobReply(j,text,len);
+}
+
+/* Sends a preview of file i of the `ls` snapshot: head, tail, range or hex, args being what follows the number */
+static void previewFile(struct FsJob *j, struct Session *ss, const char *cmd, const char *arg) {
+	char *end;
+	int i=(int)strtol(arg,&end,10);
+	char *path=(i>0)?getFileWPath(ss,i,false):NULL;
+	uint64_t io=0;
+	char *text=NULL;
+
+	if(path==NULL){
+		const char *msg=(i>0)?staleentrymsg:"which file? e.g. tail 3 50";
+		jobReply(j,msg,strlen(msg));
+		return;
+	}
+
+	int fd=open(path,O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if(fd==-1){
+		PRINT("preview [%s]: %s",path,strerror(errno));
+		free(path);
+		jobReply(j,staleentrymsg,strlen(staleentrymsg));
+		return;
+	}
+
+	long long a=strtoll(end,&end,10);
+	long long b=strtoll(end,&end,10);
+	if(strcmp(cmd,"head")==0 || strcmp(cmd,"tail")==0){
+		unsigned lines=(a>0)?(unsigned)((a<PREVIEW_MAX_LINES)?a:PREVIEW_MAX_LINES):PREVIEW_LINES;
+		text=(cmd[0]=='h')?preview_head(fd,lines,&io):preview_tail(fd,lines,&io);
+	}
+	else if(strcmp(cmd,"range")==0) text=preview_range(fd,a,(b>0)?(size_t)b:0,&io);
+	else text=preview_hex(fd,a,(b>0)?(size_t)b:PREVIEW_HEX_BYTES,&io);
+	close(fd);
+
+	PRINT("%s [%s]: %llu bytes read",cmd,path,(unsigned long long)io);
+	free(path);
+
+	if(text==NULL) jobReply(j,"fail",4);
+	else if(text[0]=='\0') jobReply(j,"(nothing there)",15);
+	else jobReplyText(j,text);
+	free(text);
+}
+
+/* Lists everything below path into a gzip stream for j to send as manifest-<folder>.tsv.gz. Replies with the summary */
+static void manifestFolder(struct FsJob *j, const char *path) {
+	struct ManifestResult res;
+	struct FileIndexStats st;
+	char out[256],files[32],raw[32],size[32];
+	const char *base=(strlen(path)>maindirlen)?strrchr(path,'/')+1:"root";
+
+	FILE *fp=manifest_open(path,&res);
+	if(fp==NULL){
+		PRINT("manifest [%s]: %s",path,strerror(errno));
+		const char *msg=(errno==ENOENT)?"folder not indexed yet, try again":"fail";
+		jobReply(j,msg,strlen(msg));
+		return;
+	}
+
+	size_t len=strlen(base)+sizeof("manifest-.tsv.gz");
+	j->sendpath=(char*)malloc(len);
+	if(j->sendpath==NULL){
+		fclose(fp);
+		jobReply(j,"fail",4);
+		return;
+	}
+	snprintf(j->sendpath,len,"manifest-%s.tsv.gz",base);
+	j->sendstream=fp;
+	j->sendsize=res.size;
+
+	file_index_get_stats(&st);
+	bytes_convert_str(files,sizeof(files),res.file_bytes);
+	bytes_convert_str(raw,sizeof(raw),res.raw_bytes);
+	bytes_convert_str(size,sizeof(size),res.size);
+	snprintf(out,sizeof(out),"%zu entries, %s of files, listing %s gzipped to %s%s%s",res.entries,files,raw,size,
+		((size_t)res.total>res.entries)?", too many entries, list cut short":"",(st.pending_dirs>0)?" (index still building)":"");
+	jobReply(j,out,strlen(out));
+}
+
+/* Walks the folder path into a tar stream for j to send as <folder>.tar. Replies with the summary */
+static void tarFolder(struct FsJob *j, const char *path) {
+	struct TarStreamResult res;
+	char out[256],files[32],size[32],skipped[64]="";
+	const char *base=(strlen(path)>maindirlen)?strrchr(path,'/')+1:"root";
+
+	FILE *fp=tar_stream_open(path,&res);
+	if(fp==NULL){
+		PRINT("tar [%s]: %s",path,strerror(errno));
+		const char *msg=(errno==E2BIG)?"too many entries to tar, down a folder further in":"fail";
+		jobReply(j,msg,strlen(msg));
+		return;
+	}
+
+	size_t len=strlen(base)+sizeof(".tar");
+	j->sendpath=(char*)malloc(len);
+	if(j->sendpath==NULL){
+		fclose(fp);
+		jobReply(j,"fail",4);
+		return;
+	}
+	snprintf(j->sendpath,len,"%s.tar",base);
+	j->sendstream=fp;
+	j->sendsize=res.size;
+
+	bytes_convert_str(files,sizeof(files),res.file_bytes);
+	bytes_convert_str(size,sizeof(size),res.size);
+	if(res.skipped>0) snprintf(skipped,sizeof(skipped),", %zu special or vanished skipped",res.skipped);
+	snprintf(out,sizeof(out),"%s: %zu files (%s), %zu folders, %zu links, %s as one transfer%s",j->sendpath,res.files,files,
+		res.dirs,res.links,size,skipped);
+	jobReply(j,out,strlen(out));
+}
+
+/* Opens member path, a file listed inside the archive the friend browses, for j to send decompressed.
+ * Returns 0, -1 with the reason in out on failure.
+ */
+static int sendArchiveMember(struct FsJob *j, struct Session *ss, const char *path, char *out, size_t outlen) {
+	char arc[PATH_MAX];
+	uint64_t size;
+
+	snprintf(arc,sizeof(arc),"%.*s",(int)ss->arclen,path);
+	FILE *fp=archive_open(arc,path+ss->arclen+1,&size);
+	if(fp==NULL){
+		PRINT("down [%s]: %s",path,strerror(errno));
+		snprintf(out,outlen,"%s",(errno==ENOTSUP)?"compressed in a way that can not be read here, or encrypted":
+			(errno==ENOENT)?staleentrymsg:"can not read it from the archive");
+		return -1;
+	}
+	if(size==0){
+		fclose(fp);
+		snprintf(out,outlen,"empty file");
+		return -1;
+	}
+
+	j->sendpath=strdup(strrchr(path,'/')+1);
+	j->sendstream=fp;
+	j->sendsize=size;
+	return 0;
+}
+
+/* Returns true if arg, what follows down, is more than a single file number: the files go to the download queue */
+static bool downPicksMany(const char *arg) {
+	arg+=strspn(arg," ");
+	arg+=strspn(arg,"0123456789");
+	return arg[strspn(arg," \r\n")]!='\0';
+}
+
+/* Picks the files of the `ls` snapshot sel names for the download queue: all, a glob matched against
+ * the names, or numbers and ranges as delf takes them. Folders and entries gone since ls are skipped.
+ * Returns the number of files, -1 if sel is not understood.
+ */
+static int selectDownFiles(struct FsJob *j, struct Session *ss, const char *sel) {
+	struct DirSnapshot *s=curSnapshot(ss);
+	int max=(s!=NULL)?(int)s->listing.count:0;
+	int *nums=NULL;
+	int n=0,i;
+	bool all=strcmp(sel,"all")==0;
+
+	if(all || strpbrk(sel,"*?[")!=NULL){
+		if(max>0 && (nums=(int*)malloc(max*sizeof(int)))==NULL) return -1;
+		for(i=1;i<=max;i++){
+			const struct DirEntry *e=dir_snapshot_entry(s,ss->sort,(size_t)i);
+			if(e!=NULL && e->type==DIR_ENTRY_FILE && (all || fnmatch(sel,e->name,0)==0)) nums[n++]=i;
+		}
+	}
+	else if((n=parseSelection(sel,max,&nums))<0) return -1;
+
+	if(n>0 && (j->down=(struct DownItem*)calloc(n,sizeof(struct DownItem)))==NULL) n=0;
+	for(i=0;i<n;i++){
+		char *path=getFileWPath(ss,nums[i],false);
+		if(path==NULL) continue;
+		j->down[j->ndown].path=path;
+		j->down[j->ndown++].size=dir_snapshot_entry(s,ss->sort,(size_t)nums[i])->size;
+	}
+	free(nums);
+	if(j->ndown==0){
+		free(j->down);
+		j->down=NULL;
+	}
+	return (int)j->ndown;
+}
+
+/* Runs the file command of j on a worker, against the job's copy of the session */
+static void runFsCommand(struct WorkJob *w) {
+	struct FsJob *j=(struct FsJob*)w;
+	struct Session *ss=&j->ss;
+	const uint8_t *message=(const uint8_t*)j->msg;
+	size_t length=j->length;
+
+	if(strncmp(j->msg,"cd",2)==0){
+		const char *arg=j->msg+2;
+		size_t arglen=length-2;
+		while(arglen>0 && *arg==' '){arg++;arglen--;}
+		while(arglen>0 && (arg[arglen-1]=='\n' || arg[arglen-1]=='\r')) arglen--;
+		const char *msg=(changeArchiveDir(ss,arg,arglen)==0)?"done":"no such folder";
+		jobReply(j,msg,strlen(msg));
+	}
+	else if(strncmp(j->msg,"ls",2)==0){
+		char args[64];
+		snprintf(args,sizeof(args),"%.*s",(int)(length-2),(char*)(message+2));
+		ss->sort=parseSortArgs(args);
+		ss->maxelecount=snapDir(ss);
+		ss->curelecount=4;
+		char *dircon=listDir(ss,ss->curelecount);
+		jobReply(j,dircon,strlen(dircon));
+		free(dircon);
+	}
+	else if(strncmp(j->msg,"du",2)==0){
+		char out[256];
+		char total[32];
+		char *dir;
+		uint64_t bytes,files;
+		struct FileIndexStats st;
+		if(length>3){
+			int i=(int)strtol((char*)(message+3),NULL,10);
+			dir=getDirWPath(ss,i);
+		}
+		else dir=strdup(ss->cwd.path);
+		if(dir==NULL){
+			jobReply(j,staledirmsg,strlen(staledirmsg));
+			return;
+		}
+		file_index_get_stats(&st);
+		struct DirSnapshot *snap=(file_index_usage(dir,&bytes,&files)==0)?usageSnapshot(dir):NULL;
+		if(snap==NULL){
+			jobReply(j,"fail",4);
+			free(dir);
+			return;
+		}
+		setSnapshot(ss,snap);
+		ss->sort=DIR_SORT_SIZE_DESC;
+		bytes_convert_str(total,sizeof(total),bytes);
+		snprintf(out,sizeof(out),"%s in %llu files: root%s%s",total,(unsigned long long)files,dir+maindirlen,
+			(st.pending_dirs>0)?" (index still building)":"");
+		jobReply(j,out,strlen(out));
+		free(dir);
+		ss->maxelecount=(int)snap->listing.count;
+		ss->curelecount=4;
+		if(ss->maxelecount>0){
+			char *dircon=listDir(ss,ss->curelecount);
+			jobReply(j,dircon,strlen(dircon));
+			free(dircon);
+		}
+	}
+	else if(strncmp(j->msg,"next",4)==0){
+		ss->curelecount+=10;
+		if(ss->curelecount <= ss->maxelecount + 3){
+			char *dircon=listDir(ss,ss->curelecount);
+			jobReply(j,dircon,strlen(dircon));
+			free(dircon);
+		}
+	}
+	else if(strncmp(j->msg,"delf",4)==0){
+		char out[160];
+		int *sel;
+		int stale=0,kept=0;
+		int n=parseSelection(j->msg+4,(curSnapshot(ss)!=NULL)?(int)ss->snap->listing.count:0,&sel);
+		if(n<=0){
+			const char *msg=(n<0)?"usage: delf <nums>, e.g. delf 3,5,10-40":"nothing to delete";
+			jobReply(j,msg,strlen(msg));
+			return;
+		}
+		int done=delFiles(ss,sel,n,&stale,&kept);
+		free(sel);
+		int l=snprintf(out,sizeof(out),"deleted %d",done);
+		if(kept>0) l+=snprintf(out+l,sizeof(out)-l,", %d kept in backup folder",kept);
+		if(stale>0) snprintf(out+l,sizeof(out)-l,", %d %s",stale,staleentrymsg);
+		jobReply(j,out,strlen(out));
+	}
+	else if(strncmp(j->msg,"sum",3)==0){
+		char out[512];
+		struct DirSnapshot *s=curSnapshot(ss);
+		const struct DirEntry *e=NULL;
+		int i=(length>4)?(int)strtol(j->msg+4,NULL,10):0;
+		if(s!=NULL && i>0) e=dir_snapshot_resolve(s,ss->sort,(size_t)i);
+		if(e==NULL){
+			const char *msg=(i>0)?staleentrymsg:"usage: sum <num>";
+			jobReply(j,msg,strlen(msg));
+			return;
+		}
+		if(e->type!=DIR_ENTRY_DIR) sumFile(s->path,e->name,out,sizeof(out));
+		else{
+			char path[PATH_MAX];
+			snprintf(path,sizeof(path),"%s/%s",s->path,e->name);
+			j->sendpath=sumFolder(path,out,sizeof(out));
+			j->sendtemp=(j->sendpath!=NULL);
+		}
+		jobReply(j,out,strlen(out));
+	}
+	else if(strncmp(j->msg,"backup",6)==0){
+		char out[512];
+		struct DirSnapshot *s=curSnapshot(ss);
+		const struct DirEntry *e=NULL;
+		int i=(int)strtol(j->msg+6,NULL,10);
+		if(i<=0){
+			backupReport(out,sizeof(out));
+			jobReply(j,out,strlen(out));
+			return;
+		}
+		if(s!=NULL) e=dir_snapshot_resolve(s,ss->sort,(size_t)i);
+		if(e==NULL || e->type==DIR_ENTRY_DIR){
+			jobReply(j,staleentrymsg,strlen(staleentrymsg));
+			return;
+		}
+		char path[PATH_MAX];
+		snprintf(path,sizeof(path),"%s/%s",s->path,e->name);
+		backupFile(path,out,sizeof(out));
+		jobReply(j,out,strlen(out));
+	}
+	else if(strncmp(j->msg,"manifest",8)==0){
+		char *dir;
+		if(length>9) dir=getDirWPath(ss,(int)strtol(j->msg+9,NULL,10));
+		else dir=strdup(ss->cwd.path);
+		if(dir==NULL){
+			jobReply(j,staledirmsg,strlen(staledirmsg));
+			return;
+		}
+		manifestFolder(j,dir);
+		free(dir);
+	}
+	else if(strncmp(j->msg,"grep",4)==0){
+		char pattern[256];
+		char out[256];
+		const char *rest;
+		char *dir;
+		bool regex;
+		if(!parseGrepArgs(j->msg+4,pattern,sizeof(pattern),&regex,&rest)){
+			const char *msg="usage: grep <word|\"text\"|/regex/> [folder num]";
+			jobReply(j,msg,strlen(msg));
+			return;
+		}
+		while(*rest==' ') rest++;
+		if(*rest!='\0') dir=getDirWPath(ss,(int)strtol(rest,NULL,10));
+		else dir=strdup(ss->cwd.path);
+		if(dir==NULL){
+			jobReply(j,staledirmsg,strlen(staledirmsg));
+			return;
+		}
+		int ret=grepFiles(ss,dir,pattern,regex,out,sizeof(out));
+		free(dir);
+		jobReply(j,out,strlen(out));
+		if(ret==-1) return;
+		ss->maxelecount=(int)ss->snap->listing.count;
+		ss->curelecount=4;
+		if(ss->maxelecount>0){
+			char *dircon=listDir(ss,ss->curelecount);
+			jobReply(j,dircon,strlen(dircon));
+			free(dircon);
+		}
+	}
+	else if(strncmp(j->msg,"search",6)==0){
+		char out[512];
+		const char *query=j->msg+6;
+		while(*query==' ') query++;
+		if(*query=='\0'){
+			textIndexReport(out,sizeof(out));
+			jobReply(j,out,strlen(out));
+			return;
+		}
+		int ret=searchText(ss,query,out,sizeof(out));
+		jobReply(j,out,strlen(out));
+		if(ret==-1) return;
+		ss->maxelecount=(int)ss->snap->listing.count;
+		ss->curelecount=4;
+		if(ss->maxelecount>0){
+			char *dircon=listDir(ss,ss->curelecount);
+			jobReply(j,dircon,strlen(dircon));
+			free(dircon);
 		}
-		pclose(stream);
 	}
-	
-	if(n!=0){
-
-		size_t strslashlen=strlen(strslash);
-		size_t quotelen=strlen(quote);
-		size_t relativedirlen=strlen(relativedir);
-		size_t downloaddirlen=strlen(downloaddir);
-		size_t strslashwoquotelen=strlen(strslashwoquote);
-		
-		curdir=(char*)realloc(curdir,curdirlen+strslashlen+quotelen+msglen-3 + 1);
-		memcpy(curdir+curdirlen,strslash,strslashlen);
-		memcpy(curdir+curdirlen + strslashlen,dirname,msglen-3);
-		memcpy(curdir+curdirlen + strslashlen + msglen-3,quote,quotelen);
-		curdir[curdirlen+strslashlen+quotelen+msglen-3]='\0';
-		
-		downloaddir=(char*)realloc(downloaddir,downloaddirlen+strslashwoquotelen+msglen-3 + 1);
-		memcpy(downloaddir+downloaddirlen,strslashwoquote,strslashwoquotelen);
-		memcpy(downloaddir+downloaddirlen + strslashwoquotelen,dirname,msglen-3);
-		downloaddir[downloaddirlen+strslashwoquotelen+msglen-3]='\0';
-		
-		relativedir=(char*)realloc(relativedir,relativedirlen+strslashwoquotelen+msglen-3 + 1);
-		memcpy(relativedir+relativedirlen,strslashwoquote,strslashwoquotelen);
-		memcpy(relativedir+relativedirlen + strslashwoquotelen,dirname,msglen-3);
-		relativedir[relativedirlen+strslashwoquotelen+msglen-3]='\0';
-		
-		PRINT("curdir [%s]",curdir);
-		PRINT("downloaddir [%s]",downloaddir);
-		PRINT("relativedir [%s]",relativedir);
+	else if(strncmp(j->msg,"head",4)==0 || strncmp(j->msg,"tail",4)==0 || strncmp(j->msg,"range",5)==0 || strncmp(j->msg,"hex",3)==0){
+		char cmd[8];
+		size_t n=strcspn(j->msg," ");
+		snprintf(cmd,sizeof(cmd),"%.*s",(int)((n<sizeof(cmd))?n:sizeof(cmd)-1),j->msg);
+		previewFile(j,ss,cmd,j->msg+n);
 	}
-	
-	return n;
-}
-
-
-int findRelativeDir(char *msg,size_t msglen) {
-	int i,j,n=0,m=0,mwoquote=0,ksize=0,k=0,ksizewoquote=0,kwoquote=0,f=0,l=0;
-	char lastdirname[256];
-	char lastdirnamewoquote[256];
-	char fullpath[16384];
-	char fullpathwoquote[16384];
-	char slashstr[] = "/";
-	char quote[] = "\"";
-	
-	char findstr[] = "find ";
-	char args[] = " -maxdepth 1 -type d -name ";
-	char cmd[17408];
-	char buffer[17408];
-	FILE * stream;
-	
-	size_t slashstrlen=strlen(slashstr);
-	size_t quotelen=strlen(quote);
-	
-	memset(lastdirname,0,256);
-	memcpy(fullpath,maindir,maindirlen);
-    m+=maindirlen;
-    memcpy(fullpathwoquote,maindir,maindirlen);
-    mwoquote+=maindirlen;
-
-    int p1=-1,p2=-1;
-    
-	for(i=4;i<msglen;i++){
-		if(msg[i]=='/'){
-				p2=p1;
-				p1=i;
-				if((p1-p2)==1) return 0;
-				if(p2!=-1){
-					size_t lastdirnamelen=strlen(lastdirname);
-					if(lastdirnamelen==0){
-						memcpy(lastdirname+k,quote,quotelen);
-						f=0;l=0;
-						for(j=1;j<=p1-p2-1;j++){
-							if(*(msg+p2+j)=='"') f++;
-							else break;
-						}
-						for(j=p1-p2-1;j>=1;j--){
-							if(*(msg+p2+j)=='"') l++;
-							else break;
-						}
-						//PRINT("1:%ld %ld",f,l);
-						memcpy(lastdirname+k+quotelen,msg+p2+1+f,p1-p2-1-f-l);
-						memcpy(lastdirname+k+quotelen+p1-p2-1-f-l,quote,quotelen);
-						k+=2*quotelen+p1-p2-1-f-l;
-						ksize=2*quotelen+p1-p2-1-f-l;
-						
-						memcpy(lastdirnamewoquote+kwoquote,msg+p2+1+f,p1-p2-1-f-l);
-						kwoquote+=p1-p2-1-f-l;
-						ksizewoquote=p1-p2-1-f-l;
-				    }
-					else{
-						memcpy(fullpath+m,slashstr,slashstrlen);
-						memcpy(fullpath+m+slashstrlen,lastdirname,ksize);
-						m+=slashstrlen+ksize;
-						
-						memcpy(fullpathwoquote+mwoquote,slashstr,slashstrlen);
-						memcpy(fullpathwoquote+mwoquote+slashstrlen,lastdirnamewoquote,ksizewoquote);
-						mwoquote+=slashstrlen+ksizewoquote;
-						
-						memset(lastdirname,0,256);
-						k=0;kwoquote=0;
-						memcpy(lastdirname+k,quote,quotelen);
-						f=0;l=0;
-						for(j=1;j<=p1-p2-1;j++){
-							if(*(msg+p2+j)=='"') f++;
-							else break;
-						}
-						for(j=p1-p2-1;j>=1;j--){
-							if(*(msg+p2+j)=='"') l++;
-							else break;
-						}
-						//PRINT("2:%ld %ld",f,l);
-						memcpy(lastdirname+k+quotelen,msg+p2+1+f,p1-p2-1-f-l);
-						memcpy(lastdirname+k+quotelen+p1-p2-1-f-l,quote,quotelen);
-						k+=2*quotelen+p1-p2-1-f-l;
-						ksize=2*quotelen+p1-p2-1-f-l;
-						
-						memcpy(lastdirnamewoquote+kwoquote,msg+p2+1+f,p1-p2-1-f-l);
-						kwoquote+=p1-p2-1-f-l;
-						ksizewoquote=p1-p2-1-f-l;
-					}
-				}
+	else if(strncmp(j->msg,"top",3)==0){
+		static const char *const keys[]={"size","mtime","old"};
+		static const char *const heads[]={"biggest","newest","oldest"};
+		char out[256];
+		char *end;
+		const char *arg=j->msg+3;
+		struct FileIndexStats st;
+		int k;
+		while(*arg==' ') arg++;
+		size_t klen=strcspn(arg," ");
+		for(k=0;k<3 && (klen!=strlen(keys[k]) || strncmp(arg,keys[k],klen)!=0);k++);
+		if(k==3){
+			const char *msg="usage: top size|mtime|old [count] [folder num]";
+			jobReply(j,msg,strlen(msg));
+			return;
+		}
+		long n=strtol(arg+klen,&end,10);
+		if(end==arg+klen) n=TOP_DEFAULT;
+		long i=strtol(end,NULL,10);
+		char *dir=(i>0)?getDirWPath(ss,(int)i):strdup(ss->cwd.path);
+		if(dir==NULL){
+			jobReply(j,staledirmsg,strlen(staledirmsg));
+			return;
+		}
+		if(n<1) n=1;
+		long total=topFiles(ss,dir,(FILE_INDEX_TOP)k,(size_t)n);
+		if(total<0){
+			jobReply(j,"fail",4);
+			free(dir);
+			return;
+		}
+		file_index_get_stats(&st);
+		snprintf(out,sizeof(out),"%zu %s of %ld files below root%s%s",ss->snap->listing.count,heads[k],total,dir+maindirlen,
+			(st.pending_dirs>0)?" (index still building)":"");
+		free(dir);
+		jobReply(j,out,strlen(out));
+		ss->maxelecount=(int)ss->snap->listing.count;
+		ss->curelecount=4;
+		if(ss->maxelecount>0){
+			char *dircon=listDir(ss,ss->curelecount);
+			jobReply(j,dircon,strlen(dircon));
+			free(dircon);
 		}
 	}
-	
-	f=0;l=0;
-	if(p1==-1) return 0;
-	if(p1<msglen-1){
-		p2=p1;
-		p1=msglen;
-		if(k==0){
-			memcpy(lastdirname+k,quote,quotelen);
-			f=0;l=0;
-			for(j=1;j<=p1-p2-1;j++){
-				if(*(msg+p2+j)=='"') f++;
-				else break;
+	else if(strncmp(j->msg,"find",4)==0){
+		char pattern[256];
+		char head[128];
+		struct FileIndexStats st;
+		if(length<6) return;
+		snprintf(pattern,sizeof(pattern),"%.*s",(int)(length-5),(char*)(message+5));
+		long total=findFiles(ss,pattern);
+		if(total<0){
+			jobReply(j,"fail",4);
+			return;
+		}
+		file_index_get_stats(&st);
+		snprintf(head,sizeof(head),"%ld matches%s%s",total,(total>FILE_INDEX_MAX_RESULTS)?", first ones kept":"",
+			(st.pending_dirs>0)?" (index still building)":"");
+		jobReply(j,head,strlen(head));
+		ss->maxelecount=(int)ss->snap->listing.count;
+		ss->curelecount=4;
+		if(ss->maxelecount>0){
+			char *dircon=listDir(ss,ss->curelecount);
+			jobReply(j,dircon,strlen(dircon));
+			free(dircon);
+		}
+	}
+	else if(strncmp(j->msg,"down",4)==0 && downPicksMany(j->msg+4)){
+		const char *sel=j->msg+4+strspn(j->msg+4," ");
+		struct DirSnapshot *s=curSnapshot(ss);
+		size_t backuplen=strlen(backupdir);
+		const char *msg=NULL;
+		int n;
+		if(ss->arcpath!=NULL) msg="inside an archive, down one member at a time";
+		else if(s!=NULL && strncmp(s->path,backupdir,backuplen)==0 && (s->path[backuplen]=='/' || s->path[backuplen]=='\0'))
+			msg="down one backup at a time to restore it";
+		else if((n=selectDownFiles(j,ss,sel))<0) msg="usage: down <num>, down 1-200,205, down *.log or down all";
+		else if(n==0) msg="no files picked: folders are skipped, run ls again if they changed";
+		if(msg!=NULL) jobReply(j,msg,strlen(msg));
+	}
+	else if(strncmp(j->msg,"down",4)==0){
+		if(strlen(j->msg)<6) return;
+		long num=strtol(j->msg+5,NULL,10);
+		int i=(num<1)?1:(num>INT_MAX)?INT_MAX:(int)num;
+		PRINT("%d", i);
+		char *dircon=getFileWPath(ss,i,false);
+		//writetologfile(dircon);
+		if(dircon!=NULL){
+			PRINT("file need down: [%s]", dircon);
+			size_t backuplen=strlen(backupdir);
+			if(ss->arcpath!=NULL && strncmp(dircon,ss->arcpath,ss->arclen)==0 && dircon[ss->arclen]=='/'){
+				char out[128];
+				if(sendArchiveMember(j,ss,dircon,out,sizeof(out))==-1) jobReply(j,out,strlen(out));
 			}
-			for(j=p1-p2-1;j>=1;j--){
-				if(*(msg+p2+j)=='"') l++;
-				else break;
+			else if(strncmp(dircon,backupdir,backuplen)==0 && dircon[backuplen]=='/' && backup_is_manifest(dircon)){
+				char out[128];
+				j->sendpath=restoreBackup(dircon,out,sizeof(out));
+				j->sendtemp=(j->sendpath!=NULL);
+				if(j->sendpath==NULL) jobReply(j,out,strlen(out));
 			}
-			//PRINT("1:%ld %ld",f,l);
-			memcpy(lastdirname+k+quotelen,msg+p2+1+f,p1-p2-1-f-l);
-			memcpy(lastdirname+k+quotelen+p1-p2-1-f-l,quote,quotelen);
-			k+=2*quotelen+p1-p2-1-f-l;
-			ksize=2*quotelen+p1-p2-1-f-l;
-			
-			memcpy(lastdirnamewoquote+kwoquote,msg+p2+1+f,p1-p2-1-f-l);
-			kwoquote+=p1-p2-1-f-l;
-			ksizewoquote=p1-p2-1-f-l;
+			else j->sendpath=strdup(dircon);
+			free(dircon);
+		}
+		else if(ss->arcpath==NULL && (dircon=getDirWPath(ss,i))!=NULL){
+			PRINT("folder need down: [%s]", dircon);
+			tarFolder(j,dircon);
+			free(dircon);
+		}
+		else
+			jobReply(j,staleentrymsg,strlen(staleentrymsg));
+	}
+	else if(strncmp(j->msg,"follow",6)==0){
+		int i=(int)strtol(j->msg+6,NULL,10);
+		char *path=(i>0)?getFileWPath(ss,i,false):NULL;
+		if(path==NULL){
+			const char *msg=(i>0)?staleentrymsg:"which file? e.g. follow 3";
+			jobReply(j,msg,strlen(msg));
+		}
+		else if(ss->arcpath!=NULL && strncmp(path,ss->arcpath,ss->arclen)==0 && path[ss->arclen]=='/'){
+			const char *msg="files in an archive do not grow: use down";
+			jobReply(j,msg,strlen(msg));
+			free(path);
 		}
 		else{
-			memcpy(fullpath+m,slashstr,slashstrlen);
-			memcpy(fullpath+m+slashstrlen,lastdirname,ksize);
-			m+=slashstrlen+ksize;
-			
-			memcpy(fullpathwoquote+mwoquote,slashstr,slashstrlen);
-			memcpy(fullpathwoquote+mwoquote+slashstrlen,lastdirnamewoquote,ksizewoquote);
-			mwoquote+=slashstrlen+ksizewoquote;
-						
-			memset(lastdirname,0,256);
-			k=0;kwoquote=0;
-			memcpy(lastdirname+k,quote,quotelen);
-			f=0;l=0;
-			for(j=1;j<=p1-p2-1;j++){
-				if(*(msg+p2+j)=='"') f++;
-				else break;
-			}
-			for(j=p1-p2-1;j>=1;j--){
-				if(*(msg+p2+j)=='"') l++;
-				else break;
-			}
-			//PRINT("2:%ld %ld",f,l);
-			memcpy(lastdirname+k+quotelen,msg+p2+1+f,p1-p2-1-f-l);
-			memcpy(lastdirname+k+quotelen+p1-p2-1-f-l,quote,quotelen);
-			k+=2*quotelen+p1-p2-1-f-l;
-			ksize=2*quotelen+p1-p2-1-f-l;
-			
-			memcpy(lastdirnamewoquote+kwoquote,msg+p2+1+f,p1-p2-1-f-l);
-			kwoquote+=p1-p2-1-f-l;
-			ksizewoquote=p1-p2-1-f-l;
+			j->sendpath=path;
+			j->sendfollow=true;
 		}
 	}
-	
-	lastdirname[k]='\0';
-	lastdirnamewoquote[kwoquote]='\0';
-	fullpath[m]='\0';
-	fullpathwoquote[mwoquote]='\0';
-	PRINT("%s",lastdirname);
-	PRINT("%s",fullpath);
-	PRINT("%s",lastdirnamewoquote);
-	PRINT("%s",fullpathwoquote);
-	
-	//create cmd
-	size_t findstrlen=strlen(findstr);
-	size_t fullpathlen=strlen(fullpath);
-	size_t fullpathwoquotelen=strlen(fullpathwoquote);
-	size_t argslen = strlen(args);
-	size_t dirnamelen = strlen(lastdirname);
-	size_t dirnamewoquotelen = strlen(lastdirnamewoquote);
-	
-	memcpy(cmd,findstr,findstrlen);
-	memcpy(cmd + findstrlen,fullpath,fullpathlen);
-	memcpy(cmd + findstrlen + fullpathlen,args,argslen);
-	memcpy(cmd + findstrlen + fullpathlen + argslen,lastdirname, dirnamelen);
-	cmd[findstrlen+fullpathlen+argslen+dirnamelen] = '\0';
-	
-	PRINT("%s",cmd);
-	
-	n=0;
-	
-	stream = popen(cmd, "r");
-	if (stream) {
-		while (!feof(stream)){
-			if (fgets(buffer, 17408, stream) != NULL){
-				n = strlen(buffer);
+}
+
+/* Hands the friend's new browsing state and replies over, then replays the messages that waited */
+static void fsJobDone(struct WorkJob *w) {
+	struct FsJob *j=(struct FsJob*)w;
+	struct Friend *f=getfriend(j->friend_num);
+	int i;
+
+	if(f!=NULL){
+		struct Session *ss=&f->session;
+		dir_snapshot_release(ss->snap);
+		free(ss->snapdir);
+		ss->snap=j->ss.snap;
+		ss->snapdir=j->ss.snapdir;
+		ss->sort=j->ss.sort;
+		ss->maxelecount=j->ss.maxelecount;
+		ss->curelecount=j->ss.curelecount;
+		ss->last_used=j->ss.last_used;
+		free(ss->arcpath);
+		ss->arcpath=j->ss.arcpath;
+		ss->arclen=j->ss.arclen;
+		if(ss->arcpath!=NULL){
+			/* cd may have gone through folders down to the archive: the working dir follows to the one holding it */
+			size_t hlen=ss->arclen;
+			while(hlen>0 && ss->arcpath[hlen-1]!='/') hlen--;
+			hlen--;
+			if((hlen!=strlen(ss->cwd.path) || strncmp(ss->arcpath,ss->cwd.path,hlen)!=0)
+				&& workdir_change(&ss->cwd,ss->arcpath+maindirlen,hlen-maindirlen,true)==-1){
+				free(ss->arcpath);
+				ss->arcpath=NULL;
 			}
 		}
-		pclose(stream);
+		j->ss.snap=NULL;
+		j->ss.snapdir=NULL;
+		j->ss.arcpath=NULL;
+
+		for(i=0;i<j->nreplies;i++){
+			if(j->replies[i]!=NULL) tox_friend_send_message(tox, j->friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)j->replies[i], strlen(j->replies[i]), NULL);
+		}
+		if(j->sendfollow){
+			const char *reply=startfollow(tox,j->friend_num,j->sendpath);
+			tox_friend_send_message(tox, j->friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)reply, strlen(reply), NULL);
+		}
+		else if(j->sendstream!=NULL){
+			startsendstream(tox,j->friend_num,j->sendstream,j->sendsize,j->sendpath);
+			j->sendstream=NULL;
+		}
+		else if(j->sendpath!=NULL) startsendfile(tox,j->friend_num,j->sendpath);
+		if(j->down!=NULL){
+			downQueueAdd(f,j->down,j->ndown);
+			j->down=NULL;
+		}
+		ss->busy=false;
 	}
-	
-    if(n!=0){
-			curdir=(char*)realloc(curdir,fullpathlen+slashstrlen+dirnamelen+1);
-			memcpy(curdir,fullpath,fullpathlen);
-			memcpy(curdir+fullpathlen,slashstr,slashstrlen);
-			memcpy(curdir+fullpathlen+slashstrlen,lastdirname,dirnamelen);
-			curdir[fullpathlen+slashstrlen+dirnamelen]='\0';
-			PRINT("curdir=%s",curdir);
-			
-			downloaddir=(char*)realloc(downloaddir,fullpathwoquotelen + slashstrlen+dirnamewoquotelen + 1);
-			memcpy(downloaddir,fullpathwoquote,fullpathwoquotelen);
-			memcpy(downloaddir+fullpathwoquotelen,slashstr,slashstrlen);
-			memcpy(downloaddir+fullpathwoquotelen+slashstrlen,lastdirnamewoquote,dirnamewoquotelen);
-			downloaddir[fullpathwoquotelen + slashstrlen+ dirnamewoquotelen]='\0';
-			PRINT("downloaddir=%s",downloaddir);
-			
-			relativedir=(char*)realloc(relativedir,4+fullpathwoquotelen - maindirlen + slashstrlen+dirnamewoquotelen + 1);
-			memcpy(relativedir,"root",4);
-			memcpy(relativedir+4,fullpathwoquote+maindirlen,fullpathwoquotelen - maindirlen);
-			memcpy(relativedir+4+fullpathwoquotelen - maindirlen,slashstr,slashstrlen);
-			memcpy(relativedir+4+fullpathwoquotelen - maindirlen+slashstrlen,lastdirnamewoquote,dirnamewoquotelen);
-			relativedir[4+fullpathwoquotelen - maindirlen + slashstrlen+ dirnamewoquotelen]='\0';
-			PRINT("relativedir=%s",relativedir);
+
+	if(j->down!=NULL){
+		size_t k;
+		for(k=0;k<j->ndown;k++) free(j->down[k].path);
+		free(j->down);
 	}
-	
-	return n;
+
+	if(j->sendstream!=NULL) fclose(j->sendstream);
+
+	if(j->sendtemp){
+		/* startsendfile keeps it open */
+		unlink(j->sendpath);
+		*strrchr(j->sendpath,'/')='\0';
+		rmdir(j->sendpath);
+	}
+
+	for(i=0;i<j->nreplies;i++) free(j->replies[i]);
+	free(j->sendpath);
+	freeSession(&j->ss);
+	free(j);
+
+	while(f!=NULL && !f->session.busy && f->session.pending!=NULL){
+		struct SessionMsg *m=f->session.pending;
+		uint32_t friend_num=f->friend_num;
+		f->session.pending=m->next;
+		if(f->session.pending==NULL) f->session.pending_tail=&f->session.pending;
+		f->session.npending--;
+		friend_message_cb(tox,friend_num,TOX_MESSAGE_TYPE_NORMAL,m->data,m->length,NULL);
+		free(m);
+		f=getfriend(friend_num);
+	}
+}
+
+/* Queues the file command message for a worker. The friend's session is busy until it is done */
+static void submitFsJob(struct Friend *f, struct Session *ss, const uint8_t *message, size_t length) {
+	struct FsJob *j=(struct FsJob*)calloc(1,sizeof(struct FsJob)+length+1);
+	if(j==NULL){
+		tox_friend_send_message(tox, f->friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)"fail", 4, NULL);
+		return;
+	}
+
+	j->work.run=runFsCommand;
+	j->work.done=fsJobDone;
+	j->friend_num=f->friend_num;
+	j->ss=*ss;
+	j->ss.cwd.fd=j->ss.cwd.rootfd=-1;
+	j->ss.cwd.path=strdup(ss->cwd.path);
+	j->ss.arcpath=(ss->arcpath!=NULL)?strdup(ss->arcpath):NULL;
+	j->ss.snap=dir_snapshot_ref(ss->snap);
+	j->ss.snapdir=(ss->snapdir!=NULL)?strdup(ss->snapdir):NULL;
+	j->ss.pending=NULL;
+	j->ss.pending_tail=&j->ss.pending;
+	j->ss.npending=0;
+	j->length=length;
+	memcpy(j->msg,message,length);
+
+	ss->busy=true;
+	work_submit(&j->work);
+}
+
+/* Keeps a message of a busy friend for when its running command is done.
+ * Returns false if too many are waiting already.
+ */
+static bool deferMessage(struct Session *ss, const uint8_t *message, size_t length) {
+	if(ss->npending>=SESSION_MAX_PENDING) return false;
+
+	struct SessionMsg *m=(struct SessionMsg*)malloc(sizeof(struct SessionMsg)+length);
+	if(m==NULL) return false;
+
+	m->next=NULL;
+	m->length=length;
+	memcpy(m->data,message,length);
+	*ss->pending_tail=m;
+	ss->pending_tail=&m->next;
+	ss->npending++;
+
+	return true;
 }
 
 /*******************************************************************************
@@ -1180,7 +2066,6 @@ int findRelativeDir(char *msg,size_t msglen) {
  *
  ******************************************************************************/
  
-void startsendfile(Tox *m, uint32_t friendnum, char *pathtofile);//need for friend_message_cb
 char *auto_contacts() ;
 void setnew_add_msg(char *m);
 int auto_del(char *args, uint32_t friend_num);
@@ -1195,6 +2080,17 @@ void friend_message_cb(Tox *tox, uint32_t friend_num, TOX_MESSAGE_TYPE type, con
 			return;
 		}
 
+		struct Session *ss=getSession(f);
+		if(ss==NULL){
+			tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)"fail", 4, NULL);
+			return;
+		}
+		if(ss->busy){
+			if(!deferMessage(ss,message,length))
+				tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)"busy, try again", 15, NULL);
+			return;
+		}
+
 		char s[3];
 		memcpy(s, (char*)message,2);
 		s[2]='\0';
@@ -1205,45 +2101,42 @@ void friend_message_cb(Tox *tox, uint32_t friend_num, TOX_MESSAGE_TYPE type, con
 			free(s);
 		}
 		else if(strcmp(s,"ls")==0){
-			int n=getDirEleSize();
-			maxelecount=n-3;
-			curelecount=4;
-			char *dircon=listDir(curelecount);
-			tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)dircon, strlen(dircon), NULL);
-			free(dircon);
+			submitFsJob(f,ss,message,length);
+		}
+		else if(strcmp(s,"du")==0){
+			submitFsJob(f,ss,message,length);
 		}
 		else if(strcmp(s,"cd")==0){
-			char ss[8];
-			memcpy(ss, (char*)message,7);
-			ss[7]='\0';
-			
-			if(strcmp(ss,"cd root")==0){
-				//PRINT("vaoday");
-				size_t msglen=strlen((char*)message);
-				if(msglen == 7) {
-					curdir[maindirlen]='\0';
-					relativedir[4]='\0';
-					downloaddir[maindirlen]='\0';
-					tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)"done", 4, NULL);
-					return;
-				}
-				int out1=findRelativeDir((char*)message,msglen);
-				if(out1!=0){
-					tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)"done", 4, NULL);
-				}
+			//cd <folder>[/<folder>...], cd root[/<folder>...], .. allowed, never above root
+			const char *arg=(const char*)message+2;
+			size_t arglen=length-2;
+			bool fromroot=false;
+			while(arglen>0 && *arg==' '){arg++;arglen--;}
+			while(arglen>0 && (arg[arglen-1]=='\n' || arg[arglen-1]=='\r')) arglen--;
+			if(arglen==0 || (arglen>=4 && memcmp(arg,"root",4)==0 && (arglen==4 || arg[4]=='/'))){
+				fromroot=true;
+				if(arglen>=4){arg+=4;arglen-=4;}
+			}
+			if(fromroot && ss->arcpath!=NULL){
+				free(ss->arcpath);
+				ss->arcpath=NULL;
+			}
+			if(ss->arcpath!=NULL){
+				/* inside an archive: its index is read on a worker */
+				submitFsJob(f,ss,message,length);
+			}
+			else if(workdir_change(&ss->cwd,arg,arglen,fromroot)==0){
+				PRINT("cwd [%s]",ss->cwd.path);
+				tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)"done", 4, NULL);
+			}
+			else if(!fromroot && errno==ENOTDIR){
+				/* a file on the way, maybe an archive to browse */
+				submitFsJob(f,ss,message,length);
 			}
 			else{
-					char dirname2[512];
-					size_t msglen=strlen((char*)message);
-					if(msglen < 4) return;
-					memcpy(dirname2, (char*)(message+3), msglen-3);
-					dirname2[msglen-3]='\0';
-					
-					int out2=findDir(dirname2,msglen);
-					if(out2!=0){
-						tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)"done", 4, NULL);
-					}
-				}
+				PRINT("cd [%.*s] failed: %s",(int)arglen,arg,strerror(errno));
+				tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)"no such folder", 14, NULL);
+			}
 		}else{
 			char s2[4];
 			memcpy(s2, (char*)message,3);
@@ -1270,7 +2163,17 @@ void friend_message_cb(Tox *tox, uint32_t friend_num, TOX_MESSAGE_TYPE type, con
                     tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)"add fail", 8, NULL);
 			}
 			else if(strcmp(s2,"pwd")==0){
-				tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)relativedir, strlen(relativedir), NULL);
+				char out[4096];
+				snprintf(out,sizeof(out),"root%s%s",workdir_relative(&ss->cwd),(ss->arcpath!=NULL)?ss->arcpath+strlen(ss->cwd.path):"");
+				tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)out, strlen(out), NULL);
+			}
+			else if(strcmp(s2,"sum")==0 || strcmp(s2,"hex")==0 || strcmp(s2,"top")==0){
+				submitFsJob(f,ss,message,length);
+			}
+			else if(strcmp(s2,"sys")==0){
+				char out[MAX_STR_SIZE];
+				size_t n=sysInfoText(out,sizeof(out),true);
+				tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)out, n, NULL);
 			}
 			else if(strcmp(s2,"cmd")==0){
 				tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)allcmd, strlen(allcmd), NULL);
@@ -1315,69 +2218,118 @@ void friend_message_cb(Tox *tox, uint32_t friend_num, TOX_MESSAGE_TYPE type, con
 					else tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)"fail", 4, NULL);
 				}
 				else if(strcmp(s3,"next")==0){
-					curelecount+=10;
-					if(curelecount <= maxelecount + 3){
-						char *dircon=listDir(curelecount);
-						tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)dircon, strlen(dircon), NULL);
-						free(dircon);
-					}
+					submitFsJob(f,ss,message,length);
+				}
+				else if(strncmp((char*)message,"backup",6)==0){
+					submitFsJob(f,ss,message,length);
 				}
 				else if(strcmp(s3,"back")==0){
-					if(strcmp(curdir,maindir)==0)
-						tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)"in root", 7, NULL);
-					else{
-						size_t t=getPosOfLastDir(curdir);
-						curdir[t]='\0';
-						//PRINT("curdir=%s",curdir);
-						t=getPosOfLastDir(relativedir);
-						relativedir[t]='\0';
-						t=getPosOfLastDir(downloaddir);
-						downloaddir[t]='\0';
-						//PRINT("relativedir=%s",relativedir);
+					if(ss->arcpath!=NULL){
+						/* the folder above is in the index already, or is the one holding the archive */
+						if(strlen(ss->arcpath)>ss->arclen) *strrchr(ss->arcpath,'/')='\0';
+						else{
+							free(ss->arcpath);
+							ss->arcpath=NULL;
+						}
 						tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)"done", 4, NULL);
 					}
+					else if(workdir_relative(&ss->cwd)[0]=='\0')
+						tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)"in root", 7, NULL);
+					else if(workdir_change(&ss->cwd,"..",2,false)==0)
+						tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)"done", 4, NULL);
+					else
+						tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)"fail", 4, NULL);
 				}
 				else if(strcmp(s3,"delf")==0){
-					char c[2];
-					memcpy(c, (char*)(message+5),1);
-					c[1]='\0';
-					//PRINT("c=%s", c);
-					int i = (int)strtol(c, NULL, 10);
-					//PRINT("i=%d", i);
-					if(i==0) i=1;
-					char backupfolderpath[]="/var/res/backup";
-					char cmppath[64];
-					memcpy(cmppath,downloaddir,strlen(backupfolderpath));
-					cmppath[strlen(backupfolderpath)]='\0';
-					if(strcmp(cmppath,backupfolderpath)==0){
-						PRINT("ko the del file o backup");
-						tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)"can not delete file in backup folder", 36, NULL);
-						return;
-					}
-					delFile(i);
-					tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)"done", 4, NULL);
+					submitFsJob(f,ss,message,length);
+				}
+				else if(strcmp(s3,"find")==0){
+					submitFsJob(f,ss,message,length);
+				}
+				else if(strcmp(s3,"mani")==0){
+					submitFsJob(f,ss,message,length);
+				}
+				else if(strcmp(s3,"grep")==0 || strcmp(s3,"sear")==0 || strcmp(s3,"head")==0 || strcmp(s3,"tail")==0 || strcmp(s3,"rang")==0){
+					submitFsJob(f,ss,message,length);
 				}
 				else if(strcmp(s3,"down")==0){
-					char c[16];
-					size_t msglen=strlen((char*)message);
-					if(msglen<6) return;
-					
-					memcpy(c, (char*)(message+5),msglen-5);
-					c[msglen-5]='\0';
-					int i = (int)strtol(c, NULL, 10);
-					if(i==0) i=1;
-					PRINT("%d", i);
-					char *dircon=getFileWPath(i,false);
-					//writetologfile(dircon);
-					if(dircon!=NULL){
-						PRINT("file need down: [%s]", dircon);
-						startsendfile(tox,friend_num,dircon);
-						free(dircon);
+					const char *arg=(const char*)message+4;
+					size_t arglen=length-4;
+					while(arglen>0 && (*arg==' ')){arg++;arglen--;}
+					while(arglen>0 && (arg[arglen-1]=='\n' || arg[arglen-1]=='\r' || arg[arglen-1]==' ')) arglen--;
+					if(arglen==0 || (arglen==4 && strncmp(arg,"stop",4)==0)){
+						struct DownQueue *q=&f->downq;
+						char out[128];
+						if(q->next>=q->count) snprintf(out,sizeof(out),"down queue is empty");
+						else if(arglen==0) snprintf(out,sizeof(out),"down queue: %zu waiting, %zu started, %zu failed",q->count-q->next,q->started,q->failed);
+						else snprintf(out,sizeof(out),"dropped %zu queued files",q->count-q->next);
+						if(arglen>0) downQueueClear(q);
+						tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)out, strlen(out), NULL);
 					}
+					else submitFsJob(f,ss,message,length);
+				}
+				else if(strcmp(s3,"foll")==0){
+					submitFsJob(f,ss,message,length);
+				}
+				else if(strncmp((char*)message,"cache",5)==0){
+					struct DirCacheStats st;
+					char out[256];
+					dir_cache_get_stats(&st);
+					snprintf(out,sizeof(out),"dirs:%zu mem:%zu/%zu hits:%llu misses:%llu invalidations:%llu evictions:%llu snapshots:%zu (%zu bytes)",
+						st.entries,st.bytes,st.max_bytes,(unsigned long long)st.hits,(unsigned long long)st.misses,
+						(unsigned long long)st.invalidations,(unsigned long long)st.evictions,st.snapshots,st.snapshot_bytes);
+					tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)out, strlen(out), NULL);
+					struct FileIndexStats ist;
+					file_index_get_stats(&ist);
+					char total[32];
+					bytes_convert_str(total,sizeof(total),ist.total_bytes);
+					snprintf(out,sizeof(out),"index: files:%zu dirs:%zu mem:%zu pending:%zu unwatched:%zu events:%llu rebuilds:%llu crawl:%.2fs usage:%s",
+						ist.files,ist.dirs,ist.bytes,ist.pending_dirs,ist.unwatched_dirs,(unsigned long long)ist.events,
+						(unsigned long long)ist.rebuilds,ist.crawl_secs,total);
+					tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)out, strlen(out), NULL);
+					struct WorkStats wst;
+					work_get_stats(&wst);
+					snprintf(out,sizeof(out),"work: threads:%zu queued:%zu running:%zu done:%llu lag max:%lluus avg:%lluus",
+						wst.threads,wst.queued,wst.running,(unsigned long long)wst.completed,
+						(unsigned long long)wst.lag_max_us,(unsigned long long)wst.lag_avg_us);
+					tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)out, strlen(out), NULL);
+					struct SumStats sst;
+					sum_get_stats(&sst);
+					char hashed[32];
+					bytes_convert_str(hashed,sizeof(hashed),sst.hashed_bytes);
+					snprintf(out,sizeof(out),"sums: kept:%llu hits:%llu misses:%llu hashed:%s",
+						(unsigned long long)sst.entries,(unsigned long long)sst.hits,(unsigned long long)sst.misses,hashed);
+					tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)out, strlen(out), NULL);
+					struct TrashStats tst;
+					trash_get_stats(&tst);
+					snprintf(out,sizeof(out),"trash: moved:%llu unlinked:%llu purged:%llu",
+						(unsigned long long)tst.moved,(unsigned long long)tst.unlinked,(unsigned long long)tst.purged);
+					tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)out, strlen(out), NULL);
+					char textout[512];
+					textIndexReport(textout,sizeof(textout));
+					tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)textout, strlen(textout), NULL);
+					backupReport(textout,sizeof(textout));
+					tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)textout, strlen(textout), NULL);
+					struct ArchiveStats ast;
+					archive_get_stats(&ast);
+					snprintf(out,sizeof(out),"archives: cached:%zu members:%zu mem:%zu hits:%llu misses:%llu opened:%llu",
+						ast.indexes,ast.members,ast.bytes,(unsigned long long)ast.hits,(unsigned long long)ast.misses,(unsigned long long)ast.opened);
+					tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)out, strlen(out), NULL);
+					static const char *const engines[]={"off","io_uring","threads"};
+					struct AioStats aiost;
+					char rd[32],wr[32];
+					aio_get_stats(&aiost);
+					bytes_convert_str(rd,sizeof(rd),aiost.bytes_read);
+					bytes_convert_str(wr,sizeof(wr),aiost.bytes_written);
+					snprintf(out,sizeof(out),"disk io: engine:%s inflight:%zu reads:%llu (%s) writes:%llu (%s) refused:%llu",
+						engines[aiost.engine],aiost.inflight,(unsigned long long)aiost.reads,rd,(unsigned long long)aiost.writes,wr,
+						(unsigned long long)aiost.refused);
+					tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)out, strlen(out), NULL);
 				} else{
-					char *ipaddr=getIpAddr();
-					tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)ipaddr, strlen(ipaddr), NULL);
-					free(ipaddr);
+					//unknown: the cached addresses, no shell
+					char out[MAX_STR_SIZE];
+					size_t n=sysInfoText(out,sizeof(out),false);
+					tox_friend_send_message(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)out, n, NULL);
 				}
 			}
 		}
@@ -1414,6 +2366,11 @@ void friend_connection_status_cb(Tox *tox, uint32_t friend_num, TOX_CONNECTION c
     struct Friend *f = getfriend(friend_num);
     if (f) {
         f->connection = connection_status;
+        if (connection_status == TOX_CONNECTION_NONE) {
+            setSnapshot(&f->session, NULL);
+            stopfollow(tox, f);
+            downQueueClear(&f->downq);
+        }
         
        char buffer[256];
        snprintf(buffer, sizeof(buffer), "%s",connection_enum2text(connection_status));
@@ -2063,7 +3020,195 @@ void command_help(int narg, char **args){
                           void *userdata){
 		  onFileControl(m, friendnumber, filenumber, control);
 }
- 
+
+/*******************************************************************************
+ *
+ * Follow
+ *
+ ******************************************************************************/
+
+#define FOLLOW_BACKLOG (16*1024)   // bytes before the end a follow starts from, like tail -f
+#define FOLLOW_MAX_CHUNK 4096      // tox asks for MAX_FILE_DATA_SIZE (1371) bytes at a time
+
+static int followfd=-1;            // inotify fd of the followed files, open while one is followed
+static bool followretry=false;     // a chunk was refused because the send queue was full
+
+/* Calls fn on every file followed, stops early if it returns false */
+static void eachFollow(bool (*fn)(struct FileTransfer *ft, void *arg), void *arg) {
+	struct Friend *f;
+	int i;
+	for(f=friends;f!=NULL;f=f->next){
+		for(i=0;i<MAX_FILES;i++){
+			struct FileTransfer *ft=&f->file_sender[i];
+			if(ft->state!=FILE_TRANSFER_INACTIVE && ft->follow && !fn(ft,arg)) return;
+		}
+	}
+}
+
+/* Sends the chunks tox asked for that the file now holds in full; bytes already sent are never read again */
+static void followPush(Tox *m, struct FileTransfer *ft) {
+	uint8_t buf[FOLLOW_MAX_CHUNK];
+	char msg[MAX_STR_SIZE];
+	struct stat st;
+
+	if(ft->state!=FILE_TRANSFER_STARTED || ft->position>=ft->follow_requested) return;
+	if(fstat(fileno(ft->file),&st)==-1) return;
+
+	uint64_t off=ft->follow_base+ft->position;
+	if((uint64_t)st.st_size<off){
+		/* truncated under us, e.g. rotated by copytruncate: a short chunk ends the stream */
+		tox_file_send_chunk(m, ft->friendnumber, ft->filenumber, ft->position, buf, 0, NULL);
+		return;
+	}
+
+	while(ft->position<ft->follow_requested && (uint64_t)st.st_size-off>=ft->follow_chunk){
+		ssize_t n=pread(fileno(ft->file),buf,ft->follow_chunk,(off_t)off);
+		if(n!=(ssize_t)ft->follow_chunk){
+			snprintf(msg, sizeof(msg), "File transfer for '%s' failed: Read fail.", ft->file_name);
+			close_file_transfer(m, ft, TOX_FILE_CONTROL_CANCEL, msg);
+			return;
+		}
+
+		Tox_Err_File_Send_Chunk err;
+		tox_file_send_chunk(m, ft->friendnumber, ft->filenumber, ft->position, buf, (size_t)n, &err);
+		if(err!=TOX_ERR_FILE_SEND_CHUNK_OK){
+			if(err==TOX_ERR_FILE_SEND_CHUNK_SENDQ) followretry=true;
+			else fprintf(stderr, "tox_file_send_chunk failed while following (error %d)\n", err);
+			return;
+		}
+
+		ft->position+=n;
+		ft->bps+=n;
+		off+=n;
+	}
+}
+
+/* A chunk request of a followed file: held until the file has grown enough to answer it */
+static void followChunkRequest(Tox *m, struct FileTransfer *ft, uint64_t position, size_t length) {
+	char msg[MAX_STR_SIZE];
+
+	if(length>FOLLOW_MAX_CHUNK || (ft->follow_chunk!=0 && length!=ft->follow_chunk)){
+		snprintf(msg, sizeof(msg), "File transfer for '%s' failed: Bad chunk length.", ft->file_name);
+		close_file_transfer(m, ft, TOX_FILE_CONTROL_CANCEL, msg);
+		return;
+	}
+
+	ft->follow_chunk=length;
+	ft->follow_requested=position+length;
+	followPush(m,ft);
+}
+
+static bool followPushOne(struct FileTransfer *ft, void *arg) {
+	followPush((Tox*)arg,ft);
+	return true;
+}
+
+static bool followUsesWatch(struct FileTransfer *ft, void *arg) {
+	int *wd=arg;
+	if(*wd!=-1 && ft->follow_wd!=*wd) return true;
+	*wd=-2;
+	return false;
+}
+
+/* Offers the file at path as a stream of unknown size, starting at most FOLLOW_BACKLOG bytes before its end.
+   Returns the reply for the friend. */
+static const char *startfollow(Tox *m, uint32_t friendnum, const char *path) {
+	struct Friend *f=getfriend(friendnum);
+	char file_name[TOX_MAX_FILENAME_LENGTH];
+	struct stat st;
+
+	FILE *file=fopen(path,"r");
+	if(file==NULL || fstat(fileno(file),&st)==-1 || !S_ISREG(st.st_mode)){
+		if(file!=NULL) fclose(file);
+		return staleentrymsg;
+	}
+
+	if(followfd==-1) followfd=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	int wd=(followfd==-1)?-1:inotify_add_watch(followfd,path,IN_MODIFY|IN_CLOSE_WRITE);
+	if(wd==-1){
+		PRINT("follow [%s]: %s",path,strerror(errno));
+		fclose(file);
+		return "follow failed: cannot watch the file";
+	}
+
+	/* start on a line boundary within the backlog */
+	uint64_t base=0;
+	if(st.st_size>FOLLOW_BACKLOG){
+		char back[FOLLOW_BACKLOG];
+		base=(uint64_t)st.st_size-FOLLOW_BACKLOG;
+		ssize_t n=pread(fileno(file),back,sizeof(back),(off_t)base);
+		char *nl=(n>0)?memchr(back,'\n',(size_t)n):NULL;
+		if(nl!=NULL) base+=nl-back+1;
+	}
+
+	get_file_name(file_name, sizeof(file_name), path);
+	size_t namelen=strlen(file_name);
+
+	Tox_Err_File_Send err;
+	uint32_t filenum=tox_file_send(m, friendnum, TOX_FILE_KIND_DATA, UINT64_MAX, NULL, (uint8_t*)file_name, namelen, &err);
+	struct FileTransfer *ft=(err==TOX_ERR_FILE_SEND_OK)?new_file_transfer(f,friendnum,filenum,FILE_TRANSFER_SEND,TOX_FILE_KIND_DATA):NULL;
+	if(ft==NULL){
+		if(err==TOX_ERR_FILE_SEND_OK) tox_file_control(m, friendnum, filenum, TOX_FILE_CONTROL_CANCEL, NULL);
+		fclose(file);
+		return (err==TOX_ERR_FILE_SEND_TOO_MANY || err==TOX_ERR_FILE_SEND_OK)?"follow failed: too many transfers":"follow failed";
+	}
+
+	memcpy(ft->file_name, file_name, namelen + 1);
+	ft->file=file;
+	ft->file_size=UINT64_MAX;
+	ft->follow=true;
+	ft->follow_wd=wd;
+	ft->follow_base=base;
+	tox_file_get_file_id(m, friendnum, filenum, ft->file_id, NULL);
+
+	return "following, cancel the transfer to stop";
+}
+
+/* Closes the friend's followed files, it went offline */
+static void stopfollow(Tox *m, struct Friend *f) {
+	int i;
+	for(i=0;i<MAX_FILES;i++){
+		struct FileTransfer *ft=&f->file_sender[i];
+		if(ft->state!=FILE_TRANSFER_INACTIVE && ft->follow) close_file_transfer(m, ft, -1, NULL);
+	}
+}
+
+/* Pushes what was appended to the followed files; drops the watches no follow uses anymore */
+static void followPoll(Tox *m) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool woken=followretry;
+	ssize_t n;
+
+	if(followfd==-1) return;
+
+	while((n=read(followfd,buf,sizeof(buf)))>0){
+		char *ptr=buf;
+		woken=true;
+		while(ptr<buf+n){
+			const struct inotify_event *ev=(const struct inotify_event*)ptr;
+			int wd=ev->wd;
+			ptr+=sizeof(struct inotify_event)+ev->len;
+			/* several follows of one file share its watch, it goes with the last of them */
+			if(!(ev->mask & IN_IGNORED)){
+				eachFollow(followUsesWatch,&wd);
+				if(wd!=-2) inotify_rm_watch(followfd,ev->wd);
+			}
+		}
+	}
+
+	if(woken){
+		followretry=false;
+		eachFollow(followPushOne,m);
+	}
+
+	int any=-1;
+	eachFollow(followUsesWatch,&any);
+	if(any!=-2){
+		close(followfd);
+		followfd=-1;
+	}
+}
+
 /*******************************************************************************
  *
  * SendFile
@@ -2071,34 +3216,49 @@ void command_help(int narg, char **args){
  ******************************************************************************/
  
 
-void startsendfile(Tox *m, uint32_t friendnum, char *pathtofile) //tuong dong cmd_sendfile o toxic
+/* Returns 0 if the transfer was offered, -1 if not */
+int startsendfile(Tox *m, uint32_t friendnum, char *pathtofile) //tuong dong cmd_sendfile o toxic
 {
-    const char *errmsg = NULL;
-    struct Friend *f = getfriend(friendnum); 
-
     char path[MAX_STR_SIZE];
     snprintf(path, sizeof(path), "%s", pathtofile);
     int path_len = strlen(path);
 
     if (path_len >= MAX_STR_SIZE) {
-        return;
+        return -1;
     }
 
     FILE *file_to_send = fopen(path, "r");
 
     if (file_to_send == NULL) {
-        return;
+        return -1;
     }
 
     off_t filesize = file_size(path);
    
     if (filesize == 0) {
         fclose(file_to_send);
-        return;
+        return -1;
     }
 
     char file_name[TOX_MAX_FILENAME_LENGTH];
-    size_t namelen = get_file_name(file_name, sizeof(file_name), path);
+    get_file_name(file_name, sizeof(file_name), path);
+
+    return startsendstream(m, friendnum, file_to_send, (uint64_t) filesize, file_name);
+}
+
+/* Offers filesize bytes read from file_to_send under file_name; file_to_send is closed when the transfer ends or fails.
+   Returns 0 if the transfer was offered, -1 if not */
+int startsendstream(Tox *m, uint32_t friendnum, FILE *file_to_send, uint64_t filesize, const char *name)
+{
+    const char *errmsg = NULL;
+    struct Friend *f = getfriend(friendnum); 
+
+    char file_name[TOX_MAX_FILENAME_LENGTH];
+    size_t namelen = snprintf(file_name, sizeof(file_name), "%s", name);
+
+    if (namelen >= sizeof(file_name)) {
+        namelen = sizeof(file_name) - 1;
+    }
 
     Tox_Err_File_Send err;
     //PRINT(" %d %lu %s %ld ", friendnum,filesize,file_name,namelen);
@@ -2123,7 +3283,7 @@ void startsendfile(Tox *m, uint32_t friendnum, char *pathtofile) //tuong dong cm
 
     //PRINT("Sending file [%d]: '%s' ", filenum, file_name);
     
-    return;
+    return 0;
 
 on_send_error:
 
@@ -2149,8 +3309,10 @@ on_send_error:
             break;
     }
 
+    PRINT("%s", errmsg);
     tox_file_control(m, friendnum, filenum, TOX_FILE_CONTROL_CANCEL, NULL);
     fclose(file_to_send);
+    return -1;
 }
 
 static void onFileChunkRequest(Tox *m, uint32_t friendnum, uint32_t filenumber, uint64_t position, size_t length)
@@ -2181,44 +3343,45 @@ static void onFileChunkRequest(Tox *m, uint32_t friendnum, uint32_t filenumber,
         return;
     }
 
-    if (ft->position != position) {
-        if (fseek(ft->file, position, SEEK_SET) == -1) {
-            snprintf(msg, sizeof(msg), "File transfer for '%s' failed: Seek fail.", ft->file_name);
+    if (ft->follow) {
+        followChunkRequest(m, ft, position, length);
+        return;
+    }
+
+    int queued = file_transfer_io_send(m, ft, position, length);
+
+    if (queued != 0) {
+        if (queued == -1) {
+            snprintf(msg, sizeof(msg), "File transfer for '%s' failed: Read fail.", ft->file_name);
             close_file_transfer(m, ft, TOX_FILE_CONTROL_CANCEL, msg);
-            return;
         }
 
-        ft->position = position;
+        return;
     }
 
-    uint8_t *send_data = malloc(length);
+    const uint8_t *send_data = file_transfer_read(ft, position, length);
 
     if (send_data == NULL) {
-        snprintf(msg, sizeof(msg), "File transfer for '%s' failed: Out of memory.", ft->file_name);
+        snprintf(msg, sizeof(msg), "File transfer for '%s' failed: Read fail.", ft->file_name);
         close_file_transfer(m, ft, TOX_FILE_CONTROL_CANCEL, msg);
         return;
     }
 
-    size_t send_length = fread(send_data, 1, length, ft->file);
+    Tox_Err_File_Send_Chunk err;
+    tox_file_send_chunk(m, ft->friendnumber, ft->filenumber, position, send_data, length, &err);
 
-    if (send_length != length) {
-        snprintf(msg, sizeof(msg), "File transfer for '%s' failed: Read fail.", ft->file_name);
+    if (!file_transfer_read_ok(ft)) {
+        snprintf(msg, sizeof(msg), "File transfer for '%s' failed: File shrank.", ft->file_name);
         close_file_transfer(m, ft, TOX_FILE_CONTROL_CANCEL, msg);
-        free(send_data);
         return;
     }
 
-    Tox_Err_File_Send_Chunk err;
-    tox_file_send_chunk(m, ft->friendnumber, ft->filenumber, position, send_data, send_length, &err);
-
-    free(send_data);
-
     if (err != TOX_ERR_FILE_SEND_CHUNK_OK) {
         fprintf(stderr, "tox_file_send_chunk failed in chat callback (error %d)\n", err);
     }
 
-    ft->position += send_length;
-    ft->bps += send_length;
+    ft->position = position + length;
+    ft->bps += length;
 }
 
 void on_file_chunk_request_cb(Tox *m, uint32_t friendnumber, uint32_t filenumber, uint64_t position,
@@ -2231,6 +3394,92 @@ void on_file_chunk_request_cb(Tox *m, uint32_t friendnumber, uint32_t filenumber
     onFileChunkRequest(m, friendnumber, filenumber, position, length);
 }
 
+/*******************************************************************************
+ *
+ * Download Queue
+ *
+ ******************************************************************************/
+
+static int cmpDownSize(const void *a, const void *b) {
+	uint64_t x=((const struct DownItem*)a)->size, y=((const struct DownItem*)b)->size;
+	return (x>y)-(x<y);
+}
+
+static void downQueueClear(struct DownQueue *q) {
+	size_t i;
+	for(i=q->next;i<q->count;i++) free(q->items[i].path);
+	free(q->items);
+	*q=(struct DownQueue){0};
+}
+
+/* Starts queued files while fewer than downinflight transfers go out to f */
+static void downQueuePump(struct Friend *f) {
+	struct DownQueue *q=&f->downq;
+	int active=0,i;
+	int limit=(downinflight<MAX_FILES)?downinflight:MAX_FILES;
+
+	for(i=0;i<MAX_FILES;i++) if(f->file_sender[i].state!=FILE_TRANSFER_INACTIVE) active++;
+
+	while(q->next<q->count && active<limit){
+		struct DownItem *it=&q->items[q->next++];
+		if(startsendfile(tox,f->friend_num,it->path)==0){
+			q->started++;
+			active++;
+		}
+		else q->failed++;
+		free(it->path);
+	}
+
+	if(q->count>0 && q->next==q->count){
+		char out[128];
+		snprintf(out,sizeof(out),"down queue: all %zu files started, %zu failed",q->started+q->failed,q->failed);
+		tox_friend_send_message(tox, f->friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)out, strlen(out), NULL);
+		downQueueClear(q);
+	}
+}
+
+/* Appends the n files of items to f's queue, which takes them over, and starts what fits */
+static void downQueueAdd(struct Friend *f, struct DownItem *items, size_t n) {
+	struct DownQueue *q=&f->downq;
+	char out[160],total[32];
+	uint64_t bytes=0;
+	size_t i;
+
+	if(downsmallfirst) qsort(items,n,sizeof(struct DownItem),cmpDownSize);
+	for(i=0;i<n;i++) bytes+=items[i].size;
+
+	/* the started ones are gone, the waiting ones move to the front */
+	struct DownItem *all=(struct DownItem*)malloc((q->count-q->next+n)*sizeof(struct DownItem));
+	if(all==NULL){
+		for(i=0;i<n;i++) free(items[i].path);
+		free(items);
+		tox_friend_send_message(tox, f->friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)"fail", 4, NULL);
+		return;
+	}
+	if(q->count>q->next) memcpy(all,q->items+q->next,(q->count-q->next)*sizeof(struct DownItem));
+	memcpy(all+q->count-q->next,items,n*sizeof(struct DownItem));
+	free(q->items);
+	free(items);
+	q->items=all;
+	q->count=q->count-q->next+n;
+	q->next=0;
+
+	bytes_convert_str(total,sizeof(total),bytes);
+	snprintf(out,sizeof(out),"queued %zu files (%s), %zu waiting, %d at a time%s; down stop drops the rest",
+		n,total,q->count,downinflight,downsmallfirst?", smallest first":"");
+	tox_friend_send_message(tox, f->friend_num, TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)out, strlen(out), NULL);
+
+	downQueuePump(f);
+}
+
+/* Starts the next queued files of every friend whose transfers freed up */
+static void downQueuePoll(void) {
+	struct Friend *f;
+	for(f=friends;f!=NULL;f=f->next){
+		if(f->downq.next<f->downq.count) downQueuePump(f);
+	}
+}
+
 /*******************************************************************************
  *
  * SaveFile
@@ -2336,7 +3585,8 @@ void onFileRecv(Tox *m, uint32_t friendnum, uint32_t filenumber, uint64_t file_s
 	char rootpath[]="/var/res";
 	char backupfolderpath[]="/var/res/backup";
 	char cmppath[64];
-	memcpy(cmppath,downloaddir,strlen(backupfolderpath));
+	const char *updir=(f->session.cwd.path!=NULL)?f->session.cwd.path:maindir;
+	memcpy(cmppath,updir,strlen(backupfolderpath));
 	cmppath[strlen(backupfolderpath)]='\0';
 	PRINT("[%s][%s]",cmppath,backupfolderpath);
 	
@@ -2350,7 +3600,7 @@ void onFileRecv(Tox *m, uint32_t friendnum, uint32_t filenumber, uint64_t file_s
 		return;
 	}
 		
-    snprintf(file_path, file_path_buf_size, "%s/%s",downloaddir, filename);
+    snprintf(file_path, file_path_buf_size, "%s/%s",updir, filename);
    
 
     if (path_len >= file_path_buf_size || path_len >= sizeof(ft->file_path) || name_length >= sizeof(ft->file_name)) {
@@ -2417,7 +3667,9 @@ static void onFileRecvChunk(Tox *m, uint32_t friendnum, uint32_t filenumber, uin
         return;
     }
 
-    if (fwrite(data, length, 1, ft->file) != 1) {
+    int queued = file_transfer_io_recv(m, ft, position, (const uint8_t *) data, length);
+
+    if (queued == -1 || (queued == 0 && fwrite(data, length, 1, ft->file) != 1)) {
         snprintf(msg, sizeof(msg), "File transfer for '%s' failed: Write fail.", ft->file_name);
         //writetologfile("FileRecvChunk Write failed");
         close_file_transfer( m, ft, TOX_FILE_CONTROL_CANCEL, msg);
@@ -2701,17 +3953,46 @@ int main(int argc, char **argv) {
 		memset(buffer,0,1024);
     }
 
-    //set up curdir
     maindirlen=strlen(maindir);
-    curdir=(char*)malloc(maindirlen+1);
-    memcpy(curdir,maindir,maindirlen);
-    curdir[maindirlen]='\0';
-    downloaddir=(char*)malloc(maindirlen+1);
-    memcpy(downloaddir,maindir,maindirlen);
-    downloaddir[maindirlen]='\0';
-    relativedir=(char*)malloc(5);
-    memcpy(relativedir,"root",4);
-    relativedir[4]='\0';
+
+    if(dir_cache_init(DIR_CACHE_MAX_BYTES)==-1){
+		writetologfile("! inotify unavailable, listing cache falls back to mtime checks");
+	}
+
+    long ncpu=sysconf(_SC_NPROCESSORS_ONLN);
+    if(file_index_start(maindir,(ncpu>0)?(int)ncpu:1)==-1){
+		writetologfile("! file index unavailable, find will return nothing");
+	}
+
+    if(textindexmem>0 && text_index_start(maindir,pathtextfile,textindexmem,textindexdisk)==-1){
+		writetologfile("! content index unavailable, search will find nothing");
+	}
+
+    if(work_start((ncpu>0)?(int)ncpu:1)==-1){
+		writetologfile("! no worker threads, file commands run on the main loop");
+	}
+
+    if(asyncdiskio){
+		AIO_ENGINE engine=aio_start(true);
+		if(engine==AIO_ENGINE_THREADS) writetologfile("! no io_uring, transfers read ahead and write behind on threads of their own");
+		else if(engine==AIO_ENGINE_NONE) writetologfile("! no disk io engine, transfers do their io in the tox callbacks");
+	}
+
+    if(pathtrashdir[0]!='\0' && trash_init(pathtrashdir)==-1){
+		writetologfile("! trash unavailable, delf unlinks right away");
+	}
+
+    if(sum_init(pathsumfile)==-1){
+		writetologfile("! sum store unavailable, sums are not kept across restarts");
+	}
+
+    if(backup_init(pathbackupstore)==-1){
+		writetologfile("! backup store unavailable, backup will fail");
+	}
+
+    if(sysinfo_init(maindir)==-1){
+		writetologfile("! no netlink, addresses for sys are resampled on a timer");
+	}
     
     INFO("* Waiting to be online ...");
 
@@ -2725,15 +4006,38 @@ int main(int argc, char **argv) {
         } */
         
         
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        dir_cache_poll();
+        file_index_poll();
+        expireSnapshots(time(NULL));
+        trash_poll(time(NULL));
+        sysinfo_poll(time(NULL));
+        text_index_poll(time(NULL));
+        work_poll();
+        aio_poll();
+        file_transfer_io_poll();
+        followPoll(tox);
+        downQueuePoll();
         tox_iterate(tox, NULL);
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        work_record_lag((uint64_t)(t1.tv_sec-t0.tv_sec)*1000000+(t1.tv_nsec-t0.tv_nsec)/1000);
+
         uint32_t v = tox_iteration_interval(tox);
         msecs += v;
         msecs_check_live += v;
-        
-        struct timespec pause;
-        pause.tv_sec = 0;
-        pause.tv_nsec = v * 1000 * 1000;
-        nanosleep(&pause, NULL);
+
+        /* sleeps until the next tox iteration is due, a file command or disk I/O finished, an address
+           changed or a followed file grew; poll() skips the fds that are -1 */
+        struct pollfd pfd[4] = {
+            { .fd = work_fd(), .events = POLLIN },
+            { .fd = sysinfo_fd(), .events = POLLIN },
+            { .fd = followfd, .events = POLLIN },
+            { .fd = aio_fd(), .events = POLLIN },
+        };
+        poll(pfd, 4, v);
     }
 
     return 0;
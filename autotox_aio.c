@@ -0,0 +1,549 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef __NR_io_uring_setup
+#define AIO_HAVE_URING 1
+#endif
+#endif
+#endif
+
+#include "autotox_aio.h"
+
+static struct {
+    AIO_ENGINE engine;
+    size_t   inflight;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t refused;
+} aio = {
+    .engine = AIO_ENGINE_NONE,
+};
+
+static void count_done(const struct AioReq *req)
+{
+    --aio.inflight;
+
+    if (req->res > 0) {
+        if (req->write) {
+            ++aio.writes;
+            aio.bytes_written += req->res;
+        } else {
+            ++aio.reads;
+            aio.bytes_read += req->res;
+        }
+    }
+}
+
+/*******************************************************************************
+ *
+ * Threads
+ *
+ ******************************************************************************/
+
+/* Threads of the engine's own, not the shared workers: a grep or an index pass queued there
+ * must not hold transfers up, and they keep the main loop's priority instead of a lower one.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  work;
+    struct AioReq  *queue_head;    /* submitted, under lock */
+    struct AioReq  *queue_tail;
+    size_t   threads;
+
+    /* finished, pushed without a lock and taken all at once by aio_poll(), as in autotox_work */
+    _Atomic(struct AioReq *) done;
+    int      eventfd;
+} lane = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .eventfd = -1,
+};
+
+/* Does what is left of req from req->res on, blocking: all of it on the engine's threads,
+ * the rest of a short io_uring transfer that could not be queued again.
+ */
+static void run_rest(struct AioReq *req)
+{
+    size_t done = (req->res > 0) ? (size_t) req->res : 0;
+
+    while (done < req->len) {
+        ssize_t n = req->write ? pwrite(req->fd, req->buf + done, req->len - done, (off_t) (req->off + done))
+                    : pread(req->fd, req->buf + done, req->len - done, (off_t) (req->off + done));
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n == -1) {
+            req->res = -errno;
+            return;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        done += n;
+    }
+
+    req->res = done;
+}
+
+static void lane_push_done(struct AioReq *req)
+{
+    struct AioReq *head = atomic_load_explicit(&lane.done, memory_order_relaxed);
+
+    do {
+        req->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&lane.done, &head, req, memory_order_release,
+             memory_order_relaxed));
+
+    uint64_t one = 1;
+
+    /* only fails when the counter is saturated, and then the reader is due anyway */
+    if (write(lane.eventfd, &one, sizeof(one)) == -1) {
+        return;
+    }
+}
+
+static void *lane_thread(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&lane.lock);
+
+    for (;;) {
+        while (lane.queue_head == NULL) {
+            pthread_cond_wait(&lane.work, &lane.lock);
+        }
+
+        struct AioReq *req = lane.queue_head;
+        lane.queue_head = req->next;
+
+        if (lane.queue_head == NULL) {
+            lane.queue_tail = NULL;
+        }
+
+        pthread_mutex_unlock(&lane.lock);
+
+        run_rest(req);
+        lane_push_done(req);
+
+        pthread_mutex_lock(&lane.lock);
+    }
+
+    return NULL;
+}
+
+/* Returns false if no thread could be started. */
+static bool lane_start(void)
+{
+    if (lane.threads > 0) {
+        return true;
+    }
+
+    lane.eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (lane.eventfd == -1) {
+        return false;
+    }
+
+    for (int i = 0; i < AIO_THREADS; ++i) {
+        pthread_t t;
+
+        if (pthread_create(&t, NULL, lane_thread, NULL) == 0) {
+            pthread_detach(t);
+            ++lane.threads;
+        }
+    }
+
+    return lane.threads > 0;
+}
+
+static void lane_submit(struct AioReq *req)
+{
+    req->next = NULL;
+
+    pthread_mutex_lock(&lane.lock);
+
+    if (lane.queue_tail) {
+        lane.queue_tail->next = req;
+    } else {
+        lane.queue_head = req;
+    }
+
+    lane.queue_tail = req;
+    pthread_cond_signal(&lane.work);
+    pthread_mutex_unlock(&lane.lock);
+}
+
+static void lane_poll(void)
+{
+    uint64_t count;
+
+    if (read(lane.eventfd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        return;
+    }
+
+    struct AioReq *list = atomic_exchange_explicit(&lane.done, NULL, memory_order_acquire);
+    struct AioReq *fifo = NULL;
+
+    /* the stack holds them newest first */
+    while (list) {
+        struct AioReq *next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
+    }
+
+    while (fifo) {
+        struct AioReq *next = fifo->next;
+        count_done(fifo);
+        fifo->done(fifo);
+        fifo = next;
+    }
+}
+
+/*******************************************************************************
+ *
+ * io_uring
+ *
+ ******************************************************************************/
+
+#ifdef AIO_HAVE_URING
+
+/* The rings, used through the raw system calls: no liburing needed. */
+static struct {
+    int      fd;
+    int      eventfd;
+    unsigned entries;
+    void    *sq_ring;
+    size_t   sq_ring_size;
+    void    *cq_ring;
+    size_t   cq_ring_size;
+    struct io_uring_sqe *sqes;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+} ring = {
+    .fd = -1,
+    .eventfd = -1,
+};
+
+static void uring_close(void)
+{
+    if (ring.sqes != NULL) {
+        munmap(ring.sqes, ring.entries * sizeof(struct io_uring_sqe));
+    }
+
+    if (ring.cq_ring != NULL && ring.cq_ring != ring.sq_ring) {
+        munmap(ring.cq_ring, ring.cq_ring_size);
+    }
+
+    if (ring.sq_ring != NULL) {
+        munmap(ring.sq_ring, ring.sq_ring_size);
+    }
+
+    if (ring.eventfd != -1) {
+        close(ring.eventfd);
+    }
+
+    if (ring.fd != -1) {
+        close(ring.fd);
+    }
+
+    ring = (typeof(ring)) {
+        .fd = -1,
+        .eventfd = -1,
+    };
+}
+
+/* Returns false if the kernel has no io_uring, or it is not allowed here. */
+static bool uring_open(void)
+{
+    struct io_uring_params p = {0};
+
+    ring.fd = syscall(__NR_io_uring_setup, AIO_QUEUE_DEPTH, &p);
+
+    if (ring.fd == -1) {
+        return false;
+    }
+
+    ring.entries = p.sq_entries;
+    ring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_ring_size > ring.sq_ring_size) {
+            ring.sq_ring_size = ring.cq_ring_size;
+        }
+
+        ring.cq_ring_size = ring.sq_ring_size;
+    }
+
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                        IORING_OFF_SQ_RING);
+
+    if (ring.sq_ring == MAP_FAILED) {
+        ring.sq_ring = NULL;
+        uring_close();
+        return false;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ring = ring.sq_ring;
+    } else {
+        ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                            IORING_OFF_CQ_RING);
+
+        if (ring.cq_ring == MAP_FAILED) {
+            ring.cq_ring = NULL;
+            uring_close();
+            return false;
+        }
+    }
+
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+
+    if (ring.sqes == MAP_FAILED) {
+        ring.sqes = NULL;
+        uring_close();
+        return false;
+    }
+
+    uint8_t *sq = ring.sq_ring;
+    uint8_t *cq = ring.cq_ring;
+
+    ring.sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *) (sq + p.sq_off.array);
+    ring.cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    /* completions wake the main loop's poll() through an eventfd */
+    ring.eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (ring.eventfd == -1
+            || syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_EVENTFD, &ring.eventfd, 1) == -1) {
+        uring_close();
+        return false;
+    }
+
+    return true;
+}
+
+/* Queues what is left of req: readv and writev, which every io_uring kernel has. */
+static bool uring_queue(struct AioReq *req)
+{
+    unsigned tail = *ring.sq_tail;
+
+    if (tail - atomic_load_explicit((_Atomic unsigned *) ring.sq_head, memory_order_acquire) >= ring.entries) {
+        return false;
+    }
+
+    unsigned idx = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    size_t done = (req->res > 0) ? (size_t) req->res : 0;
+
+    req->iov.iov_base = req->buf + done;
+    req->iov.iov_len = req->len - done;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = req->fd;
+    sqe->off = req->off + done;
+    sqe->addr = (uintptr_t) &req->iov;
+    sqe->len = 1;
+    sqe->user_data = (uintptr_t) req;
+
+    ring.sq_array[idx] = idx;
+    atomic_store_explicit((_Atomic unsigned *) ring.sq_tail, tail + 1, memory_order_release);
+
+    bool waited = false;
+
+    while (syscall(__NR_io_uring_enter, ring.fd, 1, 0, 0, NULL, 0) == -1) {
+        if (errno == EINTR) {
+            continue;
+        }
+
+        /* out of kernel resources until requests in flight complete: sleep until one does, once,
+         * rather than spin. Their completions stay queued for uring_poll(). */
+        if ((errno == EAGAIN || errno == EBUSY) && !waited && aio.inflight > 0
+                && syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) != -1) {
+            waited = true;
+            continue;
+        }
+
+        /* take the entry back, nobody consumed it */
+        atomic_store_explicit((_Atomic unsigned *) ring.sq_tail, tail, memory_order_release);
+        return false;
+    }
+
+    return true;
+}
+
+static void uring_poll(void)
+{
+    uint64_t count;
+
+    if (read(ring.eventfd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        return;
+    }
+
+    unsigned head = *ring.cq_head;
+
+    while (head != atomic_load_explicit((_Atomic unsigned *) ring.cq_tail, memory_order_acquire)) {
+        const struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        struct AioReq *req = (struct AioReq *) (uintptr_t) cqe->user_data;
+        int res = cqe->res;
+
+        atomic_store_explicit((_Atomic unsigned *) ring.cq_head, ++head, memory_order_release);
+
+        if (res > 0) {
+            req->res = ((req->res > 0) ? req->res : 0) + res;
+
+            /* a short transfer that did not hit the end of the file: queue the rest. It is not
+             * in the kernel's hands meanwhile, so uring_queue() must not wait for it. */
+            if ((size_t) req->res < req->len) {
+                --aio.inflight;
+                bool again = uring_queue(req);
+                ++aio.inflight;
+
+                if (again) {
+                    continue;
+                }
+
+                /* the ring is full: a partial result would read as the end of the file or a failed write */
+                run_rest(req);
+            }
+        } else if (res < 0) {
+            req->res = res;
+        }
+
+        count_done(req);
+        req->done(req);
+    }
+}
+
+#endif /* AIO_HAVE_URING */
+
+/*******************************************************************************
+ *
+ * Engine
+ *
+ ******************************************************************************/
+
+AIO_ENGINE aio_start(bool use_uring)
+{
+#ifdef AIO_HAVE_URING
+
+    if (use_uring && uring_open()) {
+        aio.engine = AIO_ENGINE_URING;
+        return aio.engine;
+    }
+
+#endif
+    (void) use_uring;
+    aio.engine = lane_start() ? AIO_ENGINE_THREADS : AIO_ENGINE_NONE;
+
+    return aio.engine;
+}
+
+AIO_ENGINE aio_engine(void)
+{
+    return aio.engine;
+}
+
+bool aio_submit(struct AioReq *req)
+{
+    if (aio.engine == AIO_ENGINE_NONE || aio.inflight >= AIO_QUEUE_DEPTH) {
+        ++aio.refused;
+        return false;
+    }
+
+    req->res = 0;
+
+#ifdef AIO_HAVE_URING
+
+    if (aio.engine == AIO_ENGINE_URING) {
+        if (!uring_queue(req)) {
+            ++aio.refused;
+            return false;
+        }
+
+        ++aio.inflight;
+        return true;
+    }
+
+#endif
+
+    ++aio.inflight;
+    lane_submit(req);
+
+    return true;
+}
+
+int aio_fd(void)
+{
+#ifdef AIO_HAVE_URING
+
+    if (aio.engine == AIO_ENGINE_URING) {
+        return ring.eventfd;
+    }
+
+#endif
+    return lane.eventfd;
+}
+
+void aio_poll(void)
+{
+#ifdef AIO_HAVE_URING
+
+    if (aio.engine == AIO_ENGINE_URING) {
+        uring_poll();
+        return;
+    }
+
+#endif
+
+    if (aio.engine == AIO_ENGINE_THREADS) {
+        lane_poll();
+    }
+}
+
+void aio_get_stats(struct AioStats *stats)
+{
+    *stats = (struct AioStats) {
+        .engine = aio.engine,
+        .inflight = aio.inflight,
+        .reads = aio.reads,
+        .writes = aio.writes,
+        .bytes_read = aio.bytes_read,
+        .bytes_written = aio.bytes_written,
+        .refused = aio.refused,
+    };
+}
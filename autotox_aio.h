@@ -0,0 +1,71 @@
+#ifndef AUTOTOX_AIO_H
+#define AUTOTOX_AIO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define AIO_QUEUE_DEPTH 64      /* requests in flight at once, io_uring or not */
+#define AIO_THREADS     2       /* threads of the engine's own when io_uring is unavailable */
+
+typedef enum AIO_ENGINE {
+    AIO_ENGINE_NONE,            /* not started: callers do their I/O themselves */
+    AIO_ENGINE_URING,
+    AIO_ENGINE_THREADS,         /* io_uring unavailable: AIO_THREADS threads of its own */
+} AIO_ENGINE;
+
+/* A read or write of len bytes at off. Embed it as the first member of the request's own
+ * struct: done() is called on the thread calling aio_poll(), once all of it is done, the
+ * file ended or it failed.
+ */
+struct AioReq {
+    struct AioReq *next;        /* the thread engine's queue */
+    void (*done)(struct AioReq *req);
+    int      fd;
+    bool     write;
+    uint8_t *buf;
+    size_t   len;
+    uint64_t off;
+    ssize_t  res;               /* bytes done, less than len only at the end of the file; -errno on failure */
+    struct iovec iov;           /* io_uring: the part still to do */
+};
+
+struct AioStats {
+    AIO_ENGINE engine;
+    size_t   inflight;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t refused;           /* requests turned away with the queue full */
+};
+
+/* Starts the engine: io_uring if the kernel has it and use_uring, else threads of its own,
+ * kept apart from the autotox_work pool so other jobs never queue ahead of transfers.
+ *
+ * Returns the engine in use, AIO_ENGINE_NONE if not even a thread could be started.
+ */
+AIO_ENGINE aio_start(bool use_uring);
+
+AIO_ENGINE aio_engine(void);
+
+/* Queues req. Never blocks on the I/O itself.
+ *
+ * Returns true on success.
+ * Returns false if AIO_QUEUE_DEPTH requests are in flight or no engine runs: do it yourself.
+ */
+bool aio_submit(struct AioReq *req);
+
+/* Returns an fd that turns readable when completions wait for aio_poll(),
+ * to sleep on instead of a fixed pause. Returns -1 if no engine runs.
+ */
+int aio_fd(void);
+
+/* Calls done() of every request completed since the last call. */
+void aio_poll(void);
+
+void aio_get_stats(struct AioStats *stats);
+
+#endif /* AUTOTOX_AIO_H */
@@ -0,0 +1,1264 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/stat.h>
+
+#include "autotox_archive.h"
+
+#define TAR_BLOCK        512
+#define TAR_MAX_LONGNAME (64 * 1024)    /* bigger pax records or GNU long names are skipped */
+#define ZIP_EOCD_SCAN    (65535 + 22)   /* largest comment plus the record itself */
+#define ZIP_STORED       0
+#define ZIP_DEFLATED     8
+#define METHOD_TAR       0xFFFE         /* data lies in the (decompressed) tar stream */
+#define METHOD_NONE      0xFFFF         /* listed but can not be read */
+
+typedef enum ARCHIVE_KIND {
+    ARCHIVE_TAR,          /* plain or gzipped, zlib reads both */
+    ARCHIVE_ZIP,
+} ARCHIVE_KIND;
+
+struct ArchiveMember {
+    size_t   name;        /* offset in the index's names, no leading or trailing '/' */
+    uint32_t seq;         /* 0 for an implied folder, else the position in the archive + 1 */
+    uint16_t method;
+    uint8_t  type;
+    uint32_t crc;
+    uint64_t size;
+    uint64_t csize;
+    uint64_t off;         /* tar: data offset in the stream, zip: local header offset */
+    time_t   mtime;
+};
+
+/* The members of one archive sorted by name, as it was when read. */
+struct ArchiveIndex {
+    struct ArchiveIndex *next;
+    char    *path;
+    dev_t    dev;
+    ino_t    ino;
+    off_t    size;
+    struct timespec mtime;
+    ARCHIVE_KIND kind;
+
+    struct ArchiveMember *members;
+    size_t   count;
+    size_t   cap;
+    char    *names;
+    size_t   names_len;
+    size_t   names_cap;
+    int      refs;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct ArchiveIndex *head;    /* most recently used first */
+    size_t   count;
+    size_t   bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t opened;
+} cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static bool has_suffix(const char *name, const char *suffix)
+{
+    size_t len = strlen(name), slen = strlen(suffix);
+
+    return len > slen && strcasecmp(name + len - slen, suffix) == 0;
+}
+
+bool archive_is_archive(const char *name)
+{
+    return has_suffix(name, ".tar") || has_suffix(name, ".tar.gz") || has_suffix(name, ".tgz")
+           || has_suffix(name, ".zip");
+}
+
+/*******************************************************************************
+ *
+ * Member index
+ *
+ ******************************************************************************/
+
+static size_t index_bytes(const struct ArchiveIndex *ai)
+{
+    return sizeof(*ai) + ai->cap * sizeof(struct ArchiveMember) + ai->names_cap;
+}
+
+static void index_free(struct ArchiveIndex *ai)
+{
+    if (ai) {
+        free(ai->path);
+        free(ai->members);
+        free(ai->names);
+        free(ai);
+    }
+}
+
+static const char *member_name(const struct ArchiveIndex *ai, const struct ArchiveMember *m)
+{
+    return ai->names + m->name;
+}
+
+/* Appends a member named name, len bytes long, cleaned of "./" and slashes at either end.
+ * Names with an empty, "." or ".." component in the middle are dropped: they would not
+ * map onto a folder path. Returns NULL if out of memory or the index is full (errno set).
+ */
+static struct ArchiveMember *index_push(struct ArchiveIndex *ai, const char *name, size_t len, bool *dropped)
+{
+    *dropped = false;
+
+    while (len >= 2 && name[0] == '.' && name[1] == '/') {
+        name += 2;
+        len -= 2;
+    }
+
+    while (len > 0 && name[0] == '/') {
+        ++name;
+        --len;
+    }
+
+    while (len > 0 && name[len - 1] == '/') {
+        --len;
+    }
+
+    for (size_t i = 0, start = 0; i <= len; ++i) {
+        if (i < len && name[i] != '/') {
+            continue;
+        }
+
+        size_t clen = i - start;
+
+        if (clen == 0 || (clen == 1 && name[start] == '.') || (clen == 2 && name[start] == '.' && name[start + 1] == '.')
+                || memchr(name + start, '\0', clen) != NULL) {
+            *dropped = true;
+            return NULL;
+        }
+
+        start = i + 1;
+    }
+
+    if (ai->count >= ARCHIVE_MAX_MEMBERS) {
+        errno = EFBIG;
+        return NULL;
+    }
+
+    if (ai->count == ai->cap) {
+        size_t cap = ai->cap ? ai->cap * 2 : 256;
+        struct ArchiveMember *members = realloc(ai->members, cap * sizeof(struct ArchiveMember));
+
+        if (members == NULL) {
+            return NULL;
+        }
+
+        ai->members = members;
+        ai->cap = cap;
+    }
+
+    if (ai->names_len + len + 1 > ai->names_cap) {
+        size_t cap = ai->names_cap ? ai->names_cap * 2 : 4096;
+
+        while (cap < ai->names_len + len + 1) {
+            cap *= 2;
+        }
+
+        char *names = realloc(ai->names, cap);
+
+        if (names == NULL) {
+            return NULL;
+        }
+
+        ai->names = names;
+        ai->names_cap = cap;
+    }
+
+    struct ArchiveMember *m = &ai->members[ai->count];
+
+    *m = (struct ArchiveMember) {
+        .name = ai->names_len,
+        .seq = ai->count + 1,
+        .method = METHOD_NONE,
+        .type = DIR_ENTRY_OTHER,
+    };
+
+    memcpy(ai->names + ai->names_len, name, len);
+    ai->names[ai->names_len + len] = '\0';
+    ai->names_len += len + 1;
+    ++ai->count;
+
+    return m;
+}
+
+static int member_cmp(const void *a, const void *b, void *arg)
+{
+    const struct ArchiveMember *ma = a, *mb = b;
+    int c = strcmp((const char *) arg + ma->name, (const char *) arg + mb->name);
+
+    if (c == 0) {
+        c = (ma->seq > mb->seq) - (ma->seq < mb->seq);
+    }
+
+    return c;
+}
+
+/* Adds the folders only implied by deeper names, sorts the members by name and keeps one
+ * member per name: the last one in the archive, which is what tar extracts.
+ */
+static int index_seal(struct ArchiveIndex *ai)
+{
+    qsort_r(ai->members, ai->count, sizeof(struct ArchiveMember), member_cmp, ai->names);
+
+    size_t real = ai->count;
+    size_t prev = SIZE_MAX;
+
+    for (size_t i = 0; i < real; ++i) {
+        /* sorted names share their folders with the name before, only new ones are added */
+        size_t name = ai->members[i].name;
+
+        for (size_t p = 0; ai->names[name + p] != '\0'; ++p) {
+            if (ai->names[name + p] != '/') {
+                continue;
+            }
+
+            if (prev != SIZE_MAX && strncmp(ai->names + prev, ai->names + name, p + 1) == 0) {
+                continue;
+            }
+
+            /* a copy, index_push may move the names */
+            char *folder = strndup(ai->names + name, p);
+            bool dropped;
+            struct ArchiveMember *m = folder ? index_push(ai, folder, p, &dropped) : NULL;
+
+            free(folder);
+
+            if (m == NULL) {
+                return -1;
+            }
+
+            m->seq = 0;
+            m->type = DIR_ENTRY_DIR;
+        }
+
+        prev = name;
+    }
+
+    qsort_r(ai->members, ai->count, sizeof(struct ArchiveMember), member_cmp, ai->names);
+
+    size_t kept = 0;
+
+    for (size_t i = 0; i < ai->count; ++i) {
+        if (kept > 0 && strcmp(member_name(ai, &ai->members[kept - 1]), member_name(ai, &ai->members[i])) == 0) {
+            ai->members[kept - 1] = ai->members[i];
+        } else {
+            ai->members[kept++] = ai->members[i];
+        }
+    }
+
+    ai->count = kept;
+
+    return 0;
+}
+
+/* Returns the first member whose name is not below name in sort order. */
+static size_t index_lower_bound(const struct ArchiveIndex *ai, const char *name)
+{
+    size_t lo = 0, hi = ai->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (strcmp(member_name(ai, &ai->members[mid]), name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static const struct ArchiveMember *index_find(const struct ArchiveIndex *ai, const char *name)
+{
+    size_t i = index_lower_bound(ai, name);
+
+    return (i < ai->count && strcmp(member_name(ai, &ai->members[i]), name) == 0) ? &ai->members[i] : NULL;
+}
+
+/*******************************************************************************
+ *
+ * Tar
+ *
+ ******************************************************************************/
+
+/* Parses a tar number field: octal, or base-256 if its top bit is set. */
+static uint64_t tar_number(const unsigned char *field, size_t len)
+{
+    uint64_t v = 0;
+
+    if (field[0] & 0x80) {
+        v = field[0] & 0x3F;
+
+        for (size_t i = 1; i < len; ++i) {
+            v = (v << 8) | field[i];
+        }
+
+        return v;
+    }
+
+    size_t i = 0;
+
+    while (i < len && (field[i] == ' ' || field[i] == '\0')) {
+        ++i;
+    }
+
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i) {
+        v = (v << 3) | (field[i] - '0');
+    }
+
+    return v;
+}
+
+static bool tar_checksum_ok(const unsigned char *h)
+{
+    unsigned sum = 0;
+
+    for (size_t i = 0; i < TAR_BLOCK; ++i) {
+        sum += (i >= 148 && i < 156) ? ' ' : h[i];
+    }
+
+    return sum == tar_number(h + 148, 8);
+}
+
+static bool gz_read_full(gzFile gz, void *buf, size_t len)
+{
+    return gzread(gz, buf, len) == (int) len;
+}
+
+/* Reads the data of a pax header or GNU long name entry, size bytes padded to a block. */
+static char *tar_read_extra(gzFile gz, uint64_t size)
+{
+    uint64_t padded = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+
+    if (size > TAR_MAX_LONGNAME) {
+        gzseek(gz, padded, SEEK_CUR);
+        return NULL;
+    }
+
+    char *data = malloc(padded + 1);
+
+    if (data == NULL || !gz_read_full(gz, data, padded)) {
+        free(data);
+        return NULL;
+    }
+
+    data[size] = '\0';
+
+    return data;
+}
+
+/* Picks path, size and mtime out of pax records "<len> <key>=<value>\n". */
+static void pax_parse(const char *data, size_t len, char **path, uint64_t *size, time_t *mtime, bool *has_size)
+{
+    const char *p = data, *end = data + len;
+
+    while (p < end) {
+        char *rest;
+        unsigned long rlen = strtoul(p, &rest, 10);
+
+        if (rlen == 0 || rlen > (size_t)(end - p) || *rest != ' ') {
+            break;
+        }
+
+        const char *key = rest + 1, *rend = p + rlen - 1;   /* rend is the '\n' */
+        const char *eq = memchr(key, '=', rend - key);
+
+        if (eq != NULL) {
+            size_t klen = eq - key;
+
+            if (klen == 4 && memcmp(key, "path", 4) == 0) {
+                free(*path);
+                *path = strndup(eq + 1, rend - eq - 1);
+            } else if (klen == 4 && memcmp(key, "size", 4) == 0) {
+                *size = strtoull(eq + 1, NULL, 10);
+                *has_size = true;
+            } else if (klen == 5 && memcmp(key, "mtime", 5) == 0) {
+                *mtime = strtoll(eq + 1, NULL, 10);
+            }
+        }
+
+        p += rlen;
+    }
+}
+
+static int tar_read_index(int fd, struct ArchiveIndex *ai)
+{
+    int dupfd = dup(fd);
+    gzFile gz = (dupfd != -1) ? gzdopen(dupfd, "rb") : NULL;
+    unsigned char h[TAR_BLOCK];
+    uint64_t off = 0;
+    char *longname = NULL, *paxpath = NULL;
+    uint64_t paxsize = 0;
+    time_t paxmtime = 0;
+    bool has_paxsize = false;
+    int ret = 0;
+
+    if (gz == NULL) {
+        if (dupfd != -1) {
+            close(dupfd);
+        }
+
+        return -1;
+    }
+
+    gzbuffer(gz, ARCHIVE_INPUT_BLOCK);
+
+    while (gz_read_full(gz, h, TAR_BLOCK)) {
+        off += TAR_BLOCK;
+
+        if (h[0] == '\0') {
+            break;                  /* end of archive */
+        }
+
+        if (!tar_checksum_ok(h)) {
+            if (off == TAR_BLOCK) {
+                errno = EINVAL;
+                ret = -1;
+            }
+
+            break;
+        }
+
+        uint64_t size = tar_number(h + 124, 12);
+        uint64_t padded = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        char flag = h[156];
+
+        if (flag == 'L' || flag == 'x') {
+            char *data = tar_read_extra(gz, size);
+
+            if (flag == 'L') {
+                free(longname);
+                longname = data;
+            } else if (data != NULL) {
+                pax_parse(data, size, &paxpath, &paxsize, &paxmtime, &has_paxsize);
+                free(data);
+            }
+
+            off += padded;
+            continue;
+        }
+
+        if (flag == 'g' || flag == 'K') {
+            gzseek(gz, padded, SEEK_CUR);
+            off += padded;
+            continue;
+        }
+
+        char name[TAR_BLOCK];
+        const char *mname = paxpath ? paxpath : longname;
+
+        if (mname == NULL) {
+            size_t nlen = strnlen((const char *) h, 100);
+
+            /* ustar keeps the leading folders of a long name in prefix */
+            if (memcmp(h + 257, "ustar", 5) == 0 && h[345] != '\0') {
+                size_t plen = strnlen((const char *) h + 345, 155);
+                memcpy(name, h + 345, plen);
+                name[plen] = '/';
+                memcpy(name + plen + 1, h, nlen);
+                name[plen + 1 + nlen] = '\0';
+            } else {
+                memcpy(name, h, nlen);
+                name[nlen] = '\0';
+            }
+
+            mname = name;
+        }
+
+        if (has_paxsize) {
+            size = paxsize;
+            padded = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        }
+
+        bool dropped;
+        struct ArchiveMember *m = index_push(ai, mname, strlen(mname), &dropped);
+
+        if (m == NULL && !dropped) {
+            ret = -1;
+            break;
+        }
+
+        if (m != NULL) {
+            m->type = (flag == '0' || flag == '\0' || flag == '7') ? DIR_ENTRY_FILE : (flag == '5') ? DIR_ENTRY_DIR :
+                      (flag == '2') ? DIR_ENTRY_LINK : DIR_ENTRY_OTHER;
+            m->size = (m->type == DIR_ENTRY_FILE) ? size : 0;
+            m->mtime = paxmtime ? paxmtime : (time_t) tar_number(h + 136, 12);
+            m->off = off;
+            m->method = (m->type == DIR_ENTRY_FILE) ? METHOD_TAR : METHOD_NONE;
+        }
+
+        free(longname);
+        free(paxpath);
+        longname = paxpath = NULL;
+        paxmtime = 0;
+        has_paxsize = false;
+
+        if (padded > 0 && gzseek(gz, padded, SEEK_CUR) == -1) {
+            break;
+        }
+
+        off += padded;
+    }
+
+    if (ai->count == 0 && ret == 0 && off < TAR_BLOCK) {
+        errno = EINVAL;
+        ret = -1;
+    }
+
+    free(longname);
+    free(paxpath);
+    gzclose(gz);
+
+    return ret;
+}
+
+/*******************************************************************************
+ *
+ * Zip
+ *
+ ******************************************************************************/
+
+static uint16_t le16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+    return (uint32_t) le16(p) | (uint32_t) le16(p + 2) << 16;
+}
+
+static uint64_t le64(const unsigned char *p)
+{
+    return (uint64_t) le32(p) | (uint64_t) le32(p + 4) << 32;
+}
+
+static bool pread_full(int fd, void *buf, size_t len, uint64_t off)
+{
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t n = pread(fd, (char *) buf + got, len - got, off + got);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return false;
+        }
+
+        got += n;
+    }
+
+    return true;
+}
+
+static time_t dos_time(uint16_t time, uint16_t date)
+{
+    struct tm tm = {
+        .tm_sec = (time & 0x1F) * 2,
+        .tm_min = (time >> 5) & 0x3F,
+        .tm_hour = time >> 11,
+        .tm_mday = date & 0x1F,
+        .tm_mon = ((date >> 5) & 0x0F) - 1,
+        .tm_year = (date >> 9) + 80,
+        .tm_isdst = -1,
+    };
+
+    return mktime(&tm);
+}
+
+/* Finds the central directory through the end record, or its zip64 version. */
+static int zip_find_central(int fd, off_t fsize, uint64_t *cd_off, uint64_t *cd_size, uint64_t *entries)
+{
+    size_t scan = (fsize < ZIP_EOCD_SCAN) ? (size_t) fsize : ZIP_EOCD_SCAN;
+    unsigned char *tail = malloc(scan);
+    int ret = -1;
+
+    if (tail == NULL || scan < 22 || !pread_full(fd, tail, scan, fsize - scan)) {
+        free(tail);
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (size_t i = scan - 22 + 1; i-- > 0;) {
+        if (memcmp(tail + i, "PK\5\6", 4) != 0) {
+            continue;
+        }
+
+        const unsigned char *e = tail + i;
+        uint64_t eocd = fsize - scan + i;
+        unsigned char loc[20], rec[56];
+
+        *entries = le16(e + 10);
+        *cd_size = le32(e + 12);
+        *cd_off = le32(e + 16);
+
+        if (eocd >= 20 && pread_full(fd, loc, 20, eocd - 20) && memcmp(loc, "PK\6\7", 4) == 0
+                && pread_full(fd, rec, 56, le64(loc + 8)) && memcmp(rec, "PK\6\6", 4) == 0) {
+            *entries = le64(rec + 32);
+            *cd_size = le64(rec + 40);
+            *cd_off = le64(rec + 48);
+        }
+
+        ret = 0;
+        break;
+    }
+
+    free(tail);
+
+    if (ret == -1) {
+        errno = EINVAL;
+    }
+
+    return ret;
+}
+
+static int zip_read_index(int fd, off_t fsize, struct ArchiveIndex *ai)
+{
+    uint64_t cd_off, cd_size, entries;
+
+    if (zip_find_central(fd, fsize, &cd_off, &cd_size, &entries) == -1) {
+        return -1;
+    }
+
+    if (cd_size > ARCHIVE_MAX_CENTRAL_DIR || entries > ARCHIVE_MAX_MEMBERS) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    if (cd_off + cd_size > (uint64_t) fsize) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    unsigned char *cd = malloc(cd_size ? cd_size : 1);
+
+    if (cd == NULL || !pread_full(fd, cd, cd_size, cd_off)) {
+        free(cd);
+        errno = cd ? EINVAL : ENOMEM;
+        return -1;
+    }
+
+    size_t pos = 0;
+    int ret = 0;
+
+    for (uint64_t k = 0; k < entries; ++k) {
+        if (pos + 46 > cd_size || memcmp(cd + pos, "PK\1\2", 4) != 0) {
+            errno = EINVAL;
+            ret = -1;
+            break;
+        }
+
+        const unsigned char *c = cd + pos;
+        size_t nlen = le16(c + 28), xlen = le16(c + 30), clen = le16(c + 32);
+
+        if (pos + 46 + nlen + xlen + clen > cd_size) {
+            errno = EINVAL;
+            ret = -1;
+            break;
+        }
+
+        uint64_t usize = le32(c + 24), csize = le32(c + 20), off = le32(c + 42);
+        time_t mtime = dos_time(le16(c + 12), le16(c + 14));
+        const unsigned char *x = c + 46 + nlen, *xend = x + xlen;
+
+        /* zip64 sizes and offset, then the unix mtime of the extended timestamp */
+        while (x + 4 <= xend) {
+            uint16_t id = le16(x), len = le16(x + 2);
+            const unsigned char *v = x + 4, *vend = v + len;
+
+            if (vend > xend) {
+                break;
+            }
+
+            if (id == 0x0001) {
+                if (usize == 0xFFFFFFFF && v + 8 <= vend) {
+                    usize = le64(v);
+                    v += 8;
+                }
+
+                if (csize == 0xFFFFFFFF && v + 8 <= vend) {
+                    csize = le64(v);
+                    v += 8;
+                }
+
+                if (off == 0xFFFFFFFF && v + 8 <= vend) {
+                    off = le64(v);
+                }
+            } else if (id == 0x5455 && len >= 5 && (v[0] & 1)) {
+                mtime = (time_t)(int32_t) le32(v + 1);
+            }
+
+            x = vend;
+        }
+
+        bool isdir = nlen > 0 && c[46 + nlen - 1] == '/';
+        uint32_t mode = le32(c + 38) >> 16;
+        bool dropped;
+        struct ArchiveMember *m = index_push(ai, (const char *) c + 46, nlen, &dropped);
+
+        pos += 46 + nlen + xlen + clen;
+
+        if (m == NULL && !dropped) {
+            ret = -1;
+            break;
+        }
+
+        if (m == NULL) {
+            continue;
+        }
+
+        uint16_t method = le16(c + 10);
+
+        m->type = isdir ? DIR_ENTRY_DIR : (c[5] == 3 && S_ISLNK(mode)) ? DIR_ENTRY_LINK : DIR_ENTRY_FILE;
+        m->size = isdir ? 0 : usize;
+        m->csize = csize;
+        m->off = off;
+        m->mtime = mtime;
+        m->crc = le32(c + 16);
+        m->method = (m->type != DIR_ENTRY_FILE || (le16(c + 8) & 1)) ? METHOD_NONE : method;
+    }
+
+    free(cd);
+
+    return ret;
+}
+
+/*******************************************************************************
+ *
+ * Cache
+ *
+ ******************************************************************************/
+
+static void index_release(struct ArchiveIndex *ai)
+{
+    pthread_mutex_lock(&cache.lock);
+    bool last = (--ai->refs == 0);
+    pthread_mutex_unlock(&cache.lock);
+
+    if (last) {
+        index_free(ai);
+    }
+}
+
+/* Drops the least recently used indexes beyond the cache limits. Called with the lock held;
+ * an index still in use is freed by its last index_release().
+ */
+static void cache_trim(void)
+{
+    while (cache.head && (cache.count > ARCHIVE_CACHE_ENTRIES || cache.bytes > ARCHIVE_CACHE_MAX_BYTES)) {
+        struct ArchiveIndex **p = &cache.head;
+
+        while ((*p)->next) {
+            p = &(*p)->next;
+        }
+
+        struct ArchiveIndex *ai = *p;
+        *p = NULL;
+        --cache.count;
+        cache.bytes -= index_bytes(ai);
+
+        if (--ai->refs == 0) {
+            index_free(ai);
+        }
+    }
+}
+
+/* Returns a reference to the member index of the archive open as fd at path, from the cache
+ * while the archive keeps its inode, size and mtime. Returns NULL on failure (errno set).
+ */
+static struct ArchiveIndex *index_get(const char *path, int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == -1) {
+        return NULL;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+
+    for (struct ArchiveIndex **p = &cache.head; *p; p = &(*p)->next) {
+        struct ArchiveIndex *ai = *p;
+
+        if (strcmp(ai->path, path) != 0) {
+            continue;
+        }
+
+        if (ai->dev == st.st_dev && ai->ino == st.st_ino && ai->size == st.st_size
+                && ai->mtime.tv_sec == st.st_mtim.tv_sec && ai->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            *p = ai->next;
+            ai->next = cache.head;
+            cache.head = ai;
+            ++ai->refs;
+            ++cache.hits;
+            pthread_mutex_unlock(&cache.lock);
+            return ai;
+        }
+
+        /* the archive changed, its index goes */
+        *p = ai->next;
+        --cache.count;
+        cache.bytes -= index_bytes(ai);
+
+        if (--ai->refs == 0) {
+            index_free(ai);
+        }
+
+        break;
+    }
+
+    ++cache.misses;
+    pthread_mutex_unlock(&cache.lock);
+
+    /* read without the lock, other archives stay browsable meanwhile */
+    struct ArchiveIndex *ai = calloc(1, sizeof(struct ArchiveIndex));
+
+    if (ai == NULL || (ai->path = strdup(path)) == NULL) {
+        index_free(ai);
+        return NULL;
+    }
+
+    ai->dev = st.st_dev;
+    ai->ino = st.st_ino;
+    ai->size = st.st_size;
+    ai->mtime = st.st_mtim;
+    ai->kind = has_suffix(path, ".zip") ? ARCHIVE_ZIP : ARCHIVE_TAR;
+
+    int ret = (ai->kind == ARCHIVE_ZIP) ? zip_read_index(fd, st.st_size, ai) : tar_read_index(fd, ai);
+
+    if (ret == -1 || index_seal(ai) == -1) {
+        index_free(ai);
+        return NULL;
+    }
+
+    ai->refs = 2;    /* the cache's and the caller's */
+
+    pthread_mutex_lock(&cache.lock);
+    ai->next = cache.head;
+    cache.head = ai;
+    ++cache.count;
+    cache.bytes += index_bytes(ai);
+    cache_trim();
+    pthread_mutex_unlock(&cache.lock);
+
+    return ai;
+}
+
+/* Opens path and returns its index, with the fd in *fdp if fdp is set. Returns NULL on failure. */
+static struct ArchiveIndex *index_open(const char *path, int *fdp)
+{
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct ArchiveIndex *ai = index_get(path, fd);
+
+    if (ai == NULL || fdp == NULL) {
+        int err = errno;
+        close(fd);
+        errno = err;
+    } else {
+        *fdp = fd;
+    }
+
+    return ai;
+}
+
+int archive_list(const char *path, const char *dir, struct DirListing *out)
+{
+    struct ArchiveIndex *ai = index_open(path, NULL);
+
+    if (ai == NULL) {
+        return -1;
+    }
+
+    const struct ArchiveMember *d = (*dir != '\0') ? index_find(ai, dir) : NULL;
+
+    if (*dir != '\0' && (d == NULL || d->type != DIR_ENTRY_DIR)) {
+        index_release(ai);
+        errno = ENOENT;
+        return -1;
+    }
+
+    /* every name below dir starts with "dir/" and sorts in one run */
+    size_t plen = strlen(dir) + (*dir != '\0');
+    char *prefix = malloc(plen + 1);
+    int ret = 0;
+
+    if (prefix == NULL) {
+        index_release(ai);
+        return -1;
+    }
+
+    snprintf(prefix, plen + 1, "%s%s", dir, (*dir != '\0') ? "/" : "");
+
+    for (size_t i = index_lower_bound(ai, prefix); i < ai->count; ++i) {
+        const struct ArchiveMember *m = &ai->members[i];
+        const char *name = member_name(ai, m);
+
+        if (strncmp(name, prefix, plen) != 0) {
+            break;
+        }
+
+        if (strchr(name + plen, '/') != NULL) {
+            continue;
+        }
+
+        struct DirEntry *e = dir_listing_push(out, name + plen, strlen(name + plen));
+
+        if (e == NULL) {
+            ret = -1;
+            break;
+        }
+
+        e->type = m->type;
+        e->size = m->size;
+        e->mtime = m->mtime;
+        e->nlink = 1;
+    }
+
+    free(prefix);
+    index_release(ai);
+    dir_listing_seal(out);
+
+    return ret;
+}
+
+int archive_stat(const char *path, const char *member, struct DirEntry *e)
+{
+    struct ArchiveIndex *ai = index_open(path, NULL);
+
+    if (ai == NULL) {
+        return -1;
+    }
+
+    const struct ArchiveMember *m = (*member != '\0') ? index_find(ai, member) : NULL;
+
+    if (*member == '\0') {
+        e->type = DIR_ENTRY_DIR;
+        e->size = 0;
+        e->mtime = ai->mtime.tv_sec;
+    } else if (m != NULL) {
+        e->type = m->type;
+        e->size = m->size;
+        e->mtime = m->mtime;
+    }
+
+    index_release(ai);
+
+    if (*member != '\0' && m == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Member streams
+ *
+ ******************************************************************************/
+
+struct MemberStream {
+    int      fd;
+    gzFile   gz;          /* tar members */
+    uint16_t method;
+    uint64_t data;        /* offset of the member's data */
+    uint64_t csize;
+    uint64_t size;
+    uint64_t pos;         /* of the next read */
+    uint64_t upos;        /* where the decompressor is */
+    z_stream z;
+    bool     zinit;
+    uint64_t cin;         /* compressed bytes fed to z */
+    uint8_t *in;
+    uint32_t crc;         /* of the first crc_pos bytes */
+    uint64_t crc_pos;
+    uint32_t crc_want;
+};
+
+/* Adds n bytes at at to the running CRC while the member is read through in order.
+ * Returns false once the whole member was seen and it does not match.
+ */
+static bool stream_crc(struct MemberStream *ms, const uint8_t *buf, size_t n, uint64_t at)
+{
+    if (at != ms->crc_pos) {
+        return true;
+    }
+
+    ms->crc = crc32(ms->crc, buf, n);
+    ms->crc_pos += n;
+
+    return ms->crc_pos < ms->size || ms->crc == ms->crc_want;
+}
+
+/* Inflates up to len bytes of the member at upos into buf. Returns the count, -1 on error. */
+static ssize_t stream_inflate(struct MemberStream *ms, uint8_t *buf, size_t len)
+{
+    ms->z.next_out = buf;
+    ms->z.avail_out = len;
+
+    while (ms->z.avail_out > 0) {
+        if (ms->z.avail_in == 0) {
+            uint64_t left = ms->csize - ms->cin;
+            size_t n = (left < ARCHIVE_INPUT_BLOCK) ? (size_t) left : ARCHIVE_INPUT_BLOCK;
+
+            if (n == 0 || !pread_full(ms->fd, ms->in, n, ms->data + ms->cin)) {
+                break;
+            }
+
+            ms->cin += n;
+            ms->z.next_in = ms->in;
+            ms->z.avail_in = n;
+        }
+
+        int ret = inflate(&ms->z, Z_NO_FLUSH);
+
+        if (ret == Z_STREAM_END) {
+            break;
+        }
+
+        if (ret != Z_OK) {
+            return -1;
+        }
+    }
+
+    size_t got = len - ms->z.avail_out;
+
+    if (!stream_crc(ms, buf, got, ms->upos)) {
+        return -1;
+    }
+
+    ms->upos += got;
+
+    return got;
+}
+
+static ssize_t stream_read(void *cookie, char *buf, size_t size)
+{
+    struct MemberStream *ms = cookie;
+    ssize_t n;
+
+    if (ms->pos >= ms->size) {
+        return 0;
+    }
+
+    if (size > ms->size - ms->pos) {
+        size = ms->size - ms->pos;
+    }
+
+    /* going back in compressed data means inflating again from the start, on the reader's
+     * thread, which for a transfer is the tox loop: refuse it, the chunks only go forward */
+    if (ms->pos < ms->upos && (ms->method == ZIP_DEFLATED || (ms->method == METHOD_TAR && !gzdirect(ms->gz)))) {
+        errno = ESPIPE;
+        return -1;
+    }
+
+    if (ms->method == METHOD_TAR) {
+        if (ms->upos != ms->pos && gzseek(ms->gz, ms->data + ms->pos, SEEK_SET) == -1) {
+            errno = EIO;
+            return -1;
+        }
+
+        n = gzread(ms->gz, buf, size);
+        ms->upos = ms->pos + ((n > 0) ? n : 0);
+    } else if (ms->method == ZIP_STORED) {
+        n = pread(ms->fd, buf, size, ms->data + ms->pos);
+
+        if (n > 0 && !stream_crc(ms, (uint8_t *) buf, n, ms->pos)) {
+            n = -1;
+        }
+    } else {
+        /* skipping forward is inflated into buf and dropped */
+        n = 0;
+
+        while (ms->upos < ms->pos && n >= 0) {
+            uint64_t skip = ms->pos - ms->upos;
+            n = stream_inflate(ms, (uint8_t *) buf, (skip < size) ? (size_t) skip : size);
+            n = (n == 0) ? -1 : n;
+        }
+
+        if (n >= 0) {
+            n = stream_inflate(ms, (uint8_t *) buf, size);
+        }
+    }
+
+    if (n <= 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    ms->pos += n;
+
+    return n;
+}
+
+static int stream_seek(void *cookie, off64_t *offset, int whence)
+{
+    struct MemberStream *ms = cookie;
+    off64_t base = (whence == SEEK_SET) ? 0 : (whence == SEEK_CUR) ? (off64_t) ms->pos : (off64_t) ms->size;
+
+    if (base + *offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ms->pos = base + *offset;
+    *offset = ms->pos;
+
+    return 0;
+}
+
+static int stream_close(void *cookie)
+{
+    struct MemberStream *ms = cookie;
+
+    if (ms->zinit) {
+        inflateEnd(&ms->z);
+    }
+
+    if (ms->gz != NULL) {
+        gzclose(ms->gz);        /* closes fd */
+    } else {
+        close(ms->fd);
+    }
+
+    free(ms->in);
+    free(ms);
+
+    return 0;
+}
+
+FILE *archive_open(const char *path, const char *member, uint64_t *size)
+{
+    int fd = -1;
+    struct ArchiveIndex *ai = index_open(path, &fd);
+
+    if (ai == NULL) {
+        return NULL;
+    }
+
+    const struct ArchiveMember *m = index_find(ai, member);
+    struct MemberStream *ms = (m != NULL && m->type == DIR_ENTRY_FILE) ? calloc(1, sizeof(struct MemberStream)) : NULL;
+
+    if (ms == NULL) {
+        if (m == NULL || m->type != DIR_ENTRY_FILE) {
+            errno = ENOENT;
+        }
+
+        index_release(ai);
+        close(fd);
+        return NULL;
+    }
+
+    *ms = (struct MemberStream) {
+        .fd = fd,
+        .method = m->method,
+        .data = m->off,
+        .csize = m->csize,
+        .size = m->size,
+        .crc_want = m->crc,
+    };
+    index_release(ai);
+
+    int err = 0;
+
+    if (ms->method == METHOD_TAR) {
+        ms->gz = gzdopen(fd, "rb");
+        err = (ms->gz == NULL) ? ENOMEM : 0;
+
+        if (ms->gz != NULL) {
+            gzbuffer(ms->gz, ARCHIVE_INPUT_BLOCK);
+
+            /* inflate up to the member here, on the worker: reads then only go forward a block at a time */
+            if (gzseek(ms->gz, ms->data, SEEK_SET) == -1) {
+                err = EIO;
+            }
+        }
+    } else if (ms->method == ZIP_STORED || ms->method == ZIP_DEFLATED) {
+        unsigned char lh[30];
+
+        /* the data starts after the local header, whose extra field may differ from the central one */
+        if (!pread_full(fd, lh, sizeof(lh), ms->data) || memcmp(lh, "PK\3\4", 4) != 0) {
+            err = EIO;
+        } else {
+            ms->data += 30 + le16(lh + 26) + le16(lh + 28);
+        }
+
+        if (err == 0 && ms->method == ZIP_DEFLATED) {
+            ms->in = malloc(ARCHIVE_INPUT_BLOCK);
+            ms->zinit = (ms->in != NULL && inflateInit2(&ms->z, -MAX_WBITS) == Z_OK);
+            err = ms->zinit ? 0 : ENOMEM;
+        }
+    } else {
+        err = ENOTSUP;
+    }
+
+    cookie_io_functions_t io = {
+        .read = stream_read,
+        .seek = stream_seek,
+        .close = stream_close,
+    };
+    FILE *fp = (err == 0) ? fopencookie(ms, "r", io) : NULL;
+
+    if (fp == NULL) {
+        err = err ? err : errno;
+        stream_close(ms);
+        errno = err;
+        return NULL;
+    }
+
+    *size = ms->size;
+
+    pthread_mutex_lock(&cache.lock);
+    ++cache.opened;
+    pthread_mutex_unlock(&cache.lock);
+
+    return fp;
+}
+
+void archive_get_stats(struct ArchiveStats *stats)
+{
+    pthread_mutex_lock(&cache.lock);
+
+    *stats = (struct ArchiveStats) {
+        .indexes = cache.count,
+        .bytes = cache.bytes,
+        .hits = cache.hits,
+        .misses = cache.misses,
+        .opened = cache.opened,
+    };
+
+    for (const struct ArchiveIndex *ai = cache.head; ai; ai = ai->next) {
+        stats->members += ai->count;
+    }
+
+    pthread_mutex_unlock(&cache.lock);
+}
@@ -0,0 +1,64 @@
+#ifndef AUTOTOX_ARCHIVE_H
+#define AUTOTOX_ARCHIVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "autotox_dir.h"
+
+#define ARCHIVE_CACHE_ENTRIES   16
+#define ARCHIVE_CACHE_MAX_BYTES (32 * 1024 * 1024)  /* member indexes kept for repeat browsing */
+#define ARCHIVE_MAX_MEMBERS     (1 << 20)
+#define ARCHIVE_MAX_CENTRAL_DIR (256 * 1024 * 1024)  /* zip central directories read whole */
+#define ARCHIVE_INPUT_BLOCK     (64 * 1024)
+
+struct ArchiveStats {
+    size_t   indexes;          /* archives whose member index is cached */
+    size_t   members;
+    size_t   bytes;            /* memory used by the cached indexes */
+    uint64_t hits;
+    uint64_t misses;           /* archives read to build their index */
+    uint64_t opened;           /* members opened for reading */
+};
+
+/* Returns true if name has the suffix of an archive that can be browsed:
+ * .tar, .tar.gz, .tgz or .zip.
+ */
+bool archive_is_archive(const char *name);
+
+/* Appends the members in folder dir of the archive at path ("" for its top) to out, named
+ * relative to dir. Folders only implied by the members below them are listed too. The
+ * member index is read once and cached until the archive changes.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure and leaves errno set: ENOENT if dir is not a folder of the archive,
+ * EINVAL if path is not an archive that can be read, EFBIG if it has too many members.
+ */
+int archive_list(const char *path, const char *dir, struct DirListing *out);
+
+/* Looks member up in the archive at path, "" being its top folder, and fills in the type,
+ * size and mtime of e. e->name is left alone.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure and leaves errno set: ENOENT if there is no such member.
+ */
+int archive_stat(const char *path, const char *member, struct DirEntry *e);
+
+/* Opens the regular file member of the archive at path for reading. Its data is
+ * decompressed as it is read, nothing is extracted to disk; zip members are checked
+ * against their CRC-32 when read through. A gzipped tar has no random access, so a
+ * member is reached by inflating the archive from its start, here rather than on the
+ * first read. Reading compressed data only goes forward: seeking back in a gzipped tar
+ * or a deflated member makes the next read fail with ESPIPE.
+ *
+ * Returns a stream reading the member, *size bytes long.
+ * Returns NULL on failure and leaves errno set: ENOENT if there is no such file member,
+ * ENOTSUP for a compression method other than store and deflate or an encrypted member.
+ */
+FILE *archive_open(const char *path, const char *member, uint64_t *size);
+
+void archive_get_stats(struct ArchiveStats *stats);
+
+#endif /* AUTOTOX_ARCHIVE_H */
@@ -0,0 +1,882 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <sodium.h>
+
+#include "autotox_backup.h"
+
+#define BACKUP_INDEX_MAGIC    "ATXIDX1\n"
+#define BACKUP_MANIFEST_MAGIC "ATXBAK1\n"
+#define BACKUP_MAGIC_LEN      8
+
+/* Normalized chunking: before the average size a cut needs more zero bits than after it,
+ * which gathers the chunk sizes around the average. fp is shifted left once a byte, so
+ * its top bits depend on the last 64 bytes.
+ */
+#define BACKUP_MASK_S (~0ULL << (64 - 18))
+#define BACKUP_MASK_L (~0ULL << (64 - 14))
+
+/* Where a chunk is, in memory and, field for field, in the index file */
+struct ChunkRef {
+    uint8_t  hash[BACKUP_HASH_BYTES];
+    uint32_t pack;
+    uint32_t len;               /* 0 marks a free slot in memory */
+    uint64_t off;
+};
+
+struct ManifestHead {
+    uint64_t size;
+    int64_t  mtime_sec;
+    int64_t  mtime_nsec;
+    uint32_t mode;
+    uint32_t nchunks;
+    uint16_t namelen;
+    uint16_t srclen;
+    uint32_t reserved;
+};
+
+struct ManifestChunk {
+    uint8_t  hash[BACKUP_HASH_BYTES];
+    uint32_t len;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct ChunkRef *slots;     /* open addressing on the first bytes of the hash */
+    size_t   mask;
+    size_t   count;
+    int      dirfd;
+    int      indexfd;
+    int     *packs;             /* every pack stays open for restores */
+    size_t   npacks;
+    size_t   cappacks;
+    uint64_t packsize;          /* of the last pack, which chunks are appended to */
+
+    uint64_t stored;
+    uint64_t backed_up;
+    uint64_t written;
+    uint64_t restored;
+} store = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .dirfd = -1,
+    .indexfd = -1,
+};
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/*******************************************************************************
+ *
+ * Chunking
+ *
+ ******************************************************************************/
+
+/* The table must never change: chunks cut with another one would not match the stored ones */
+static void gear_init(void)
+{
+    uint64_t x = 0x6175746f746f7821ULL;
+
+    for (int i = 0; i < 256; ++i) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* Returns the length of the chunk starting at data, of which n bytes are there: all that
+ * is left of the file when n is below BACKUP_MAX_CHUNK.
+ */
+static size_t cdc_cut(const uint8_t *data, size_t n)
+{
+    size_t end = (n < BACKUP_MAX_CHUNK) ? n : BACKUP_MAX_CHUNK;
+    size_t normal = (end < BACKUP_AVG_CHUNK) ? end : BACKUP_AVG_CHUNK;
+    uint64_t fp = 0;
+    size_t i = BACKUP_MIN_CHUNK;
+
+    if (n <= BACKUP_MIN_CHUNK) {
+        return n;
+    }
+
+    for (; i < normal; ++i) {
+        fp = (fp << 1) + gear[data[i]];
+
+        if (!(fp & BACKUP_MASK_S)) {
+            return i + 1;
+        }
+    }
+
+    for (; i < end; ++i) {
+        fp = (fp << 1) + gear[data[i]];
+
+        if (!(fp & BACKUP_MASK_L)) {
+            return i + 1;
+        }
+    }
+
+    return end;
+}
+
+/*******************************************************************************
+ *
+ * Store
+ *
+ ******************************************************************************/
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return false;
+        }
+
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static bool pwrite_all(int fd, const void *buf, size_t len, uint64_t off)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, off);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return false;
+        }
+
+        p += n;
+        len -= n;
+        off += n;
+    }
+
+    return true;
+}
+
+static bool pread_all(int fd, void *buf, size_t len, uint64_t off)
+{
+    char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, off);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return false;
+        }
+
+        p += n;
+        len -= n;
+        off += n;
+    }
+
+    return true;
+}
+
+static size_t ref_slot(const uint8_t *hash, size_t mask)
+{
+    uint64_t h;
+
+    memcpy(&h, hash, sizeof(h));
+
+    return h & mask;
+}
+
+/* Called with store.lock held. Returns the chunk named hash, NULL if it is not stored. */
+static const struct ChunkRef *ref_find(const uint8_t *hash)
+{
+    for (size_t i = store.slots ? ref_slot(hash, store.mask) : 0; store.slots; i = (i + 1) & store.mask) {
+        const struct ChunkRef *r = &store.slots[i];
+
+        if (r->len == 0) {
+            return NULL;
+        }
+
+        if (memcmp(r->hash, hash, BACKUP_HASH_BYTES) == 0) {
+            return r;
+        }
+    }
+
+    return NULL;
+}
+
+/* Called with store.lock held. Returns false if out of memory. */
+static bool ref_put(const struct ChunkRef *ref)
+{
+    if ((store.count + 1) * 2 > (store.slots ? store.mask + 1 : 0)) {
+        size_t n = store.slots ? (store.mask + 1) * 2 : 4096;
+        struct ChunkRef *slots = calloc(n, sizeof(*slots));
+
+        if (slots == NULL) {
+            return false;
+        }
+
+        for (size_t i = 0; store.slots && i <= store.mask; ++i) {
+            if (store.slots[i].len != 0) {
+                size_t k = ref_slot(store.slots[i].hash, n - 1);
+
+                while (slots[k].len != 0) {
+                    k = (k + 1) & (n - 1);
+                }
+
+                slots[k] = store.slots[i];
+            }
+        }
+
+        free(store.slots);
+        store.slots = slots;
+        store.mask = n - 1;
+    }
+
+    size_t k = ref_slot(ref->hash, store.mask);
+
+    while (store.slots[k].len != 0) {
+        k = (k + 1) & store.mask;
+    }
+
+    store.slots[k] = *ref;
+    ++store.count;
+    store.stored += ref->len;
+
+    return true;
+}
+
+/* Called with store.lock held. Opens pack number n, created if missing. */
+static bool pack_open(size_t n, bool create)
+{
+    char name[32];
+
+    if (n == store.cappacks) {
+        size_t cap = store.cappacks ? store.cappacks * 2 : 16;
+        int *packs = realloc(store.packs, cap * sizeof(*packs));
+
+        if (packs == NULL) {
+            return false;
+        }
+
+        store.packs = packs;
+        store.cappacks = cap;
+    }
+
+    snprintf(name, sizeof(name), "pack-%06zu", n);
+
+    int fd = openat(store.dirfd, name, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0600);
+    struct stat st;
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+
+        return false;
+    }
+
+    store.packs[n] = fd;
+    store.npacks = n + 1;
+    store.packsize = st.st_size;
+
+    return true;
+}
+
+/* Keeps the chunk unless it is stored already. Returns 1 if it was added, 0 if it was there, -1 on error. */
+static int store_chunk(const uint8_t *hash, const uint8_t *data, uint32_t len)
+{
+    pthread_mutex_lock(&store.lock);
+
+    if (ref_find(hash) != NULL) {
+        pthread_mutex_unlock(&store.lock);
+        return 0;
+    }
+
+    /* the pack left behind is synced now, the last one by backup_file() */
+    if (store.npacks == 0 || store.packsize + len > BACKUP_PACK_MAX) {
+        if (store.npacks > 0) {
+            fdatasync(store.packs[store.npacks - 1]);
+        }
+
+        if (!pack_open(store.npacks, true)) {
+            pthread_mutex_unlock(&store.lock);
+            return -1;
+        }
+    }
+
+    struct ChunkRef ref = {
+        .pack = store.npacks - 1,
+        .len = len,
+        .off = store.packsize,
+    };
+
+    memcpy(ref.hash, hash, BACKUP_HASH_BYTES);
+
+    /* the data first: an index record never points at bytes that were not written */
+    bool ok = pwrite_all(store.packs[ref.pack], data, len, ref.off) && write_all(store.indexfd, &ref, sizeof(ref));
+
+    if (ok) {
+        store.packsize += len;
+        ok = ref_put(&ref);
+    }
+
+    pthread_mutex_unlock(&store.lock);
+
+    return ok ? 1 : -1;
+}
+
+/* Loads the index, dropping records that point past the end of their pack, which a crash
+ * between writing a chunk and its record can leave; the index is rewritten without them.
+ */
+static bool index_load(void)
+{
+    struct ChunkRef ref;
+    char magic[BACKUP_MAGIC_LEN];
+    size_t records = 0;
+    bool clean = false;
+    int fd = openat(store.dirfd, "index", O_RDONLY | O_CLOEXEC);
+
+    if (fd != -1) {
+        if (read(fd, magic, sizeof(magic)) == sizeof(magic) && memcmp(magic, BACKUP_INDEX_MAGIC, sizeof(magic)) == 0) {
+            clean = true;
+
+            while (read(fd, &ref, sizeof(ref)) == sizeof(ref)) {
+                ++records;
+
+                if (ref.len == 0 || ref.pack >= store.npacks) {
+                    clean = false;
+                    continue;
+                }
+
+                struct stat st;
+
+                if (fstat(store.packs[ref.pack], &st) == -1 || ref.off + ref.len > (uint64_t) st.st_size) {
+                    clean = false;
+                    continue;
+                }
+
+                if (ref_find(ref.hash) == NULL && !ref_put(&ref)) {
+                    close(fd);
+                    return false;
+                }
+            }
+
+            clean = clean && lseek(fd, 0, SEEK_END) == (off_t)(sizeof(magic) + records * sizeof(ref));
+        }
+
+        close(fd);
+    }
+
+    if (clean) {
+        store.indexfd = openat(store.dirfd, "index", O_WRONLY | O_APPEND | O_CLOEXEC);
+        return store.indexfd != -1;
+    }
+
+    fd = openat(store.dirfd, "index.tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool ok = (fd != -1) && write_all(fd, BACKUP_INDEX_MAGIC, BACKUP_MAGIC_LEN);
+
+    for (size_t i = 0; ok && store.slots && i <= store.mask; ++i) {
+        if (store.slots[i].len != 0) {
+            ok = write_all(fd, &store.slots[i], sizeof(store.slots[i]));
+        }
+    }
+
+    ok = ok && fsync(fd) == 0;
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    if (!ok || renameat(store.dirfd, "index.tmp", store.dirfd, "index") == -1) {
+        unlinkat(store.dirfd, "index.tmp", 0);
+        return false;
+    }
+
+    store.indexfd = openat(store.dirfd, "index", O_WRONLY | O_APPEND | O_CLOEXEC);
+
+    return store.indexfd != -1;
+}
+
+int backup_init(const char *path)
+{
+    pthread_once(&gear_once, gear_init);
+
+    if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&store.lock);
+
+    store.dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    bool ok = (store.dirfd != -1);
+
+    /* packs are numbered from 0 without gaps */
+    while (ok && pack_open(store.npacks, false)) {
+    }
+
+    ok = ok && index_load();
+    pthread_mutex_unlock(&store.lock);
+
+    return ok ? 0 : -1;
+}
+
+/*******************************************************************************
+ *
+ * Manifests
+ *
+ ******************************************************************************/
+
+static bool read_head(int fd, struct ManifestHead *head, char *name, char *src, size_t srcsize)
+{
+    char magic[BACKUP_MAGIC_LEN];
+
+    if (read(fd, magic, sizeof(magic)) != sizeof(magic) || memcmp(magic, BACKUP_MANIFEST_MAGIC, sizeof(magic)) != 0
+            || read(fd, head, sizeof(*head)) != sizeof(*head)
+            || head->namelen == 0 || head->namelen > NAME_MAX || head->srclen >= srcsize
+            || read(fd, name, head->namelen) != head->namelen || read(fd, src, head->srclen) != head->srclen) {
+        return false;
+    }
+
+    name[head->namelen] = '\0';
+    src[head->srclen] = '\0';
+
+    /* the name becomes a path component on restore */
+    return strchr(name, '/') == NULL && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+bool backup_is_manifest(const char *path)
+{
+    char magic[BACKUP_MAGIC_LEN];
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    bool ret = (fd != -1 && read(fd, magic, sizeof(magic)) == sizeof(magic)
+                && memcmp(magic, BACKUP_MANIFEST_MAGIC, sizeof(magic)) == 0);
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    return ret;
+}
+
+/* Looks in dest for the newest manifest of path. Returns true, with its name in out, if it
+ * was taken from the file as it is now.
+ */
+static bool find_unchanged(int destfd, const char *path, const char *base, const struct stat *st, char *out)
+{
+    size_t baselen = strlen(base);
+    DIR *d = fdopendir(dup(destfd));
+    struct dirent *de;
+    char newest[NAME_MAX + 1] = "";
+
+    if (d == NULL) {
+        return false;
+    }
+
+    /* <name>.<time>.atxb: the times sort as text */
+    while ((de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name);
+
+        if (len > baselen + strlen(BACKUP_SUFFIX) && strncmp(de->d_name, base, baselen) == 0 && de->d_name[baselen] == '.'
+                && strcmp(de->d_name + len - strlen(BACKUP_SUFFIX), BACKUP_SUFFIX) == 0 && strcmp(de->d_name, newest) > 0) {
+            snprintf(newest, sizeof(newest), "%s", de->d_name);
+        }
+    }
+
+    closedir(d);
+
+    int fd = newest[0] ? openat(destfd, newest, O_RDONLY | O_NOFOLLOW | O_CLOEXEC) : -1;
+    struct ManifestHead head;
+    char name[NAME_MAX + 1], src[PATH_MAX];
+    bool same = (fd != -1 && read_head(fd, &head, name, src, sizeof(src)) && strcmp(src, path) == 0
+                 && head.size == (uint64_t) st->st_size && head.mtime_sec == st->st_mtim.tv_sec
+                 && head.mtime_nsec == st->st_mtim.tv_nsec);
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    if (same) {
+        snprintf(out, NAME_MAX + 1, "%s", newest);
+    }
+
+    return same;
+}
+
+/* Writes the manifest through a temporary file, under a name no other manifest has */
+static int write_manifest(int destfd, const char *base, const char *path, const struct stat *st,
+                          const struct ManifestChunk *chunks, uint32_t nchunks, char *out)
+{
+    struct ManifestHead head = {
+        .size = st->st_size,
+        .mtime_sec = st->st_mtim.tv_sec,
+        .mtime_nsec = st->st_mtim.tv_nsec,
+        .mode = st->st_mode & 07777,
+        .nchunks = nchunks,
+        .namelen = strlen(base),
+        .srclen = strlen(path),
+    };
+    char tmp[NAME_MAX + 1], stamp[32];
+    struct tm tm;
+    time_t now = time(NULL);
+
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+
+    for (int n = 1;; ++n) {
+        int len = (n == 1) ? snprintf(out, NAME_MAX + 1, "%.*s.%s%s", NAME_MAX - 30, base, stamp, BACKUP_SUFFIX)
+                  : snprintf(out, NAME_MAX + 1, "%.*s.%s-%d%s", NAME_MAX - 30, base, stamp, n, BACKUP_SUFFIX);
+
+        if (len > NAME_MAX || faccessat(destfd, out, F_OK, AT_SYMLINK_NOFOLLOW) == -1) {
+            break;
+        }
+    }
+
+    snprintf(tmp, sizeof(tmp), ".%.*s.tmp", NAME_MAX - 8, out);
+
+    int fd = openat(destfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = (fd != -1) && write_all(fd, BACKUP_MANIFEST_MAGIC, BACKUP_MAGIC_LEN) && write_all(fd, &head, sizeof(head))
+              && write_all(fd, base, head.namelen) && write_all(fd, path, head.srclen)
+              && write_all(fd, chunks, nchunks * sizeof(*chunks)) && fsync(fd) == 0;
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    if (!ok || renameat(destfd, tmp, destfd, out) == -1) {
+        int err = errno;
+        unlinkat(destfd, tmp, 0);
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Backup and Restore
+ *
+ ******************************************************************************/
+
+/* Reads until buf holds len bytes or the file ends. Returns the count, -1 on error. */
+static ssize_t read_full(int fd, uint8_t *buf, size_t len)
+{
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t n = read(fd, buf + got, len - got);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n == -1) {
+            return -1;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        got += n;
+    }
+
+    return got;
+}
+
+int backup_file(const char *path, const char *dest, struct BackupResult *res)
+{
+    const char *base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    struct stat st, after;
+    struct ManifestChunk *chunks = NULL;
+    size_t nchunks = 0, capchunks = 0;
+    uint8_t *buf = NULL;
+    int fd = -1, destfd = -1, ret = -1, err = EIO;
+
+    memset(res, 0, sizeof(*res));
+
+    if (store.indexfd == -1) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) == -1 || fstat(fd, &st) == -1
+            || (destfd = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        err = errno;
+        goto out;
+    }
+
+    if (!S_ISREG(st.st_mode) || st.st_size / BACKUP_MIN_CHUNK >= UINT32_MAX) {
+        err = EINVAL;
+        goto out;
+    }
+
+    res->bytes = st.st_size;
+
+    /* what makes backing up a big file that barely changes quick: an unchanged one is not even read */
+    if (find_unchanged(destfd, path, base, &st, res->manifest)) {
+        res->unchanged = true;
+        ret = 0;
+        goto out;
+    }
+
+    if ((buf = malloc(BACKUP_READ_BLOCK + BACKUP_MAX_CHUNK)) == NULL) {
+        err = ENOMEM;
+        goto out;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    size_t have = 0;
+    uint64_t total = 0;
+    bool eof = false;
+
+    for (;;) {
+        if (!eof && have < BACKUP_MAX_CHUNK) {
+            ssize_t n = read_full(fd, buf + have, BACKUP_READ_BLOCK + BACKUP_MAX_CHUNK - have);
+
+            if (n == -1) {
+                err = errno;
+                goto out;
+            }
+
+            have += n;
+            total += n;
+            eof = (have < BACKUP_READ_BLOCK + BACKUP_MAX_CHUNK);
+        }
+
+        if (have == 0) {
+            break;
+        }
+
+        /* cut while a whole chunk is in the buffer, or what is left of the file */
+        size_t pos = 0;
+
+        while (have - pos >= BACKUP_MAX_CHUNK || (eof && pos < have)) {
+            size_t len = cdc_cut(buf + pos, have - pos);
+
+            if (nchunks == capchunks) {
+                size_t cap = capchunks ? capchunks * 2 : 64;
+                struct ManifestChunk *c = realloc(chunks, cap * sizeof(*c));
+
+                if (c == NULL) {
+                    err = ENOMEM;
+                    goto out;
+                }
+
+                chunks = c;
+                capchunks = cap;
+            }
+
+            struct ManifestChunk *c = &chunks[nchunks++];
+            c->len = len;
+            crypto_generichash(c->hash, BACKUP_HASH_BYTES, buf + pos, len, NULL, 0);
+
+            int added = store_chunk(c->hash, buf + pos, len);
+
+            if (added == -1) {
+                err = (errno == 0) ? EIO : errno;
+                goto out;
+            }
+
+            res->new_chunks += added;
+            res->new_bytes += added ? len : 0;
+            pos += len;
+        }
+
+        memmove(buf, buf + pos, have - pos);
+        have -= pos;
+
+        if (eof && have == 0) {
+            break;
+        }
+    }
+
+    if (fstat(fd, &after) == -1 || after.st_size != st.st_size || total != (uint64_t) st.st_size
+            || after.st_mtim.tv_sec != st.st_mtim.tv_sec || after.st_mtim.tv_nsec != st.st_mtim.tv_nsec) {
+        err = EAGAIN;
+        goto out;
+    }
+
+    /* the chunks and their records reach the disk before a manifest names them */
+    pthread_mutex_lock(&store.lock);
+    int packfd = (store.npacks > 0) ? store.packs[store.npacks - 1] : -1;
+    pthread_mutex_unlock(&store.lock);
+
+    if ((packfd != -1 && fdatasync(packfd) == -1) || fdatasync(store.indexfd) == -1
+            || write_manifest(destfd, base, path, &st, chunks, nchunks, res->manifest) == -1) {
+        err = errno;
+        goto out;
+    }
+
+    res->chunks = nchunks;
+    ret = 0;
+
+    pthread_mutex_lock(&store.lock);
+    store.backed_up += res->bytes;
+    store.written += res->new_bytes;
+    pthread_mutex_unlock(&store.lock);
+
+out:
+    if (fd != -1) {
+        close(fd);
+    }
+
+    if (destfd != -1) {
+        close(destfd);
+    }
+
+    free(buf);
+    free(chunks);
+
+    if (ret == -1) {
+        errno = err;
+    }
+
+    return ret;
+}
+
+int backup_restore(const char *manifest, const char *dir, char *out, size_t outlen)
+{
+    struct ManifestHead head;
+    struct ManifestChunk c;
+    char name[NAME_MAX + 1], src[PATH_MAX];
+    uint8_t hash[BACKUP_HASH_BYTES];
+    uint8_t *buf = malloc(BACKUP_MAX_CHUNK);
+    uint64_t total = 0;
+    int in = open(manifest, O_RDONLY | O_NOFOLLOW | O_CLOEXEC), fd = -1, err = EIO;
+    bool created = false;
+
+    if (in == -1 || buf == NULL) {
+        err = (in == -1) ? errno : ENOMEM;
+        goto fail;
+    }
+
+    if (!read_head(in, &head, name, src, sizeof(src))) {
+        err = EINVAL;
+        goto fail;
+    }
+
+    if (snprintf(out, outlen, "%s/%s", dir, name) >= (int) outlen) {
+        err = ENAMETOOLONG;
+        goto fail;
+    }
+
+    if ((fd = open(out, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, head.mode & 0777)) == -1) {
+        err = errno;
+        goto fail;
+    }
+
+    created = true;
+
+    for (uint32_t i = 0; i < head.nchunks; ++i) {
+        if (read(in, &c, sizeof(c)) != sizeof(c) || c.len == 0 || c.len > BACKUP_MAX_CHUNK) {
+            goto fail;
+        }
+
+        pthread_mutex_lock(&store.lock);
+        const struct ChunkRef *r = ref_find(c.hash);
+        struct ChunkRef ref = r ? *r : (struct ChunkRef) {0};
+        int packfd = r ? store.packs[ref.pack] : -1;
+        pthread_mutex_unlock(&store.lock);
+
+        if (packfd == -1 || ref.len != c.len || !pread_all(packfd, buf, c.len, ref.off)) {
+            goto fail;
+        }
+
+        crypto_generichash(hash, sizeof(hash), buf, c.len, NULL, 0);
+
+        if (memcmp(hash, c.hash, sizeof(hash)) != 0) {
+            goto fail;
+        }
+
+        if (!write_all(fd, buf, c.len)) {
+            err = errno;
+            goto fail;
+        }
+
+        total += c.len;
+    }
+
+    if (total != head.size) {
+        goto fail;
+    }
+
+    struct timespec times[2] = {
+        { .tv_nsec = UTIME_OMIT },
+        { .tv_sec = head.mtime_sec, .tv_nsec = head.mtime_nsec },
+    };
+
+    futimens(fd, times);
+
+    if (close(fd) == -1) {
+        fd = -1;
+        err = errno;
+        goto fail;
+    }
+
+    close(in);
+    free(buf);
+
+    pthread_mutex_lock(&store.lock);
+    store.restored += total;
+    pthread_mutex_unlock(&store.lock);
+
+    return 0;
+
+fail:
+    if (fd != -1) {
+        close(fd);
+    }
+
+    if (created) {
+        unlink(out);
+    }
+
+    if (in != -1) {
+        close(in);
+    }
+
+    free(buf);
+    errno = err;
+
+    return -1;
+}
+
+void backup_get_stats(struct BackupStats *stats)
+{
+    pthread_mutex_lock(&store.lock);
+    stats->chunks = store.count;
+    stats->stored_bytes = store.stored;
+    stats->packs = store.npacks;
+    stats->backed_up = store.backed_up;
+    stats->written = store.written;
+    stats->restored = store.restored;
+    pthread_mutex_unlock(&store.lock);
+}
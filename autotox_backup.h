@@ -0,0 +1,66 @@
+#ifndef AUTOTOX_BACKUP_H
+#define AUTOTOX_BACKUP_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BACKUP_MIN_CHUNK  (16 * 1024)
+#define BACKUP_AVG_CHUNK  (64 * 1024)
+#define BACKUP_MAX_CHUNK  (256 * 1024)
+#define BACKUP_PACK_MAX   (256 * 1024 * 1024)   /* a pack is closed once it reaches this size */
+#define BACKUP_READ_BLOCK (4 * 1024 * 1024)
+#define BACKUP_HASH_BYTES 32                    /* BLAKE2b-256 names a chunk */
+#define BACKUP_SUFFIX     ".atxb"
+
+struct BackupResult {
+    uint64_t bytes;           /* size of the file */
+    uint64_t new_bytes;       /* written to the store, the rest was there already */
+    size_t   chunks;
+    size_t   new_chunks;
+    bool     unchanged;       /* same file, size and mtime as its last backup: nothing was read */
+    char     manifest[NAME_MAX + 1];
+};
+
+struct BackupStats {
+    size_t   chunks;
+    uint64_t stored_bytes;
+    size_t   packs;
+    uint64_t backed_up;       /* size of the files backed up since start */
+    uint64_t written;         /* of those, bytes new to the store */
+    uint64_t restored;
+};
+
+/* Opens the chunk store in the directory path, created if missing. Files are cut into
+ * chunks where their content says so (FastCDC), so an insert or a change early in a
+ * file moves the boundaries of the chunks around it only. Each chunk is kept once,
+ * appended to a pack file and found again by its hash through the index file.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the store can not be opened.
+ */
+int backup_init(const char *path);
+
+/* Backs up the regular file path: the chunks new to the store are written to it, then a
+ * manifest listing them is written to the directory dest as <name>.<time>.atxb.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure and leaves errno set: EAGAIN if the file changed while it was read.
+ */
+int backup_file(const char *path, const char *dest, struct BackupResult *res);
+
+/* Returns true if path is a manifest written by backup_file(). */
+bool backup_is_manifest(const char *path);
+
+/* Rebuilds the file of manifest, checking every chunk against its hash, in the directory
+ * dir under its original name and mtime. The path of the new file is written to out.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure and leaves errno set: EIO if a chunk is missing or damaged.
+ */
+int backup_restore(const char *manifest, const char *dir, char *out, size_t outlen);
+
+void backup_get_stats(struct BackupStats *stats);
+
+#endif /* AUTOTOX_BACKUP_H */
@@ -0,0 +1,837 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+
+#include "autotox_dir.h"
+
+/* getdents64 read buffer. Large enough that a 10k entry directory takes a handful of syscalls */
+#define DENTS_BUF_SIZE (64 * 1024)
+
+struct linux_dirent64 {
+    ino64_t        d_ino;
+    off64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+static DIR_ENTRY_TYPE mode_to_type(mode_t mode)
+{
+    if (S_ISREG(mode)) {
+        return DIR_ENTRY_FILE;
+    }
+
+    if (S_ISDIR(mode)) {
+        return DIR_ENTRY_DIR;
+    }
+
+    if (S_ISLNK(mode)) {
+        return DIR_ENTRY_LINK;
+    }
+
+    return DIR_ENTRY_OTHER;
+}
+
+static int compare_entry_name(const void *a, const void *b)
+{
+    const struct DirEntry *ea = a, *eb = b;
+    int c = strcmp(ea->name, eb->name);
+
+    /* names sit in the arena in push order, which keeps equal ones in that order */
+    return c ? c : (ea->name > eb->name) - (ea->name < eb->name);
+}
+
+struct DirEntry *dir_listing_push(struct DirListing *l, const char *name, size_t namelen)
+{
+    return dir_listing_push_note(l, name, namelen, NULL, 0);
+}
+
+struct DirEntry *dir_listing_push_note(struct DirListing *l, const char *name, size_t namelen,
+                                       const char *note, size_t notelen)
+{
+    size_t need = namelen + 1 + (note ? notelen + 1 : 0);
+
+    if (l->count == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 64;
+        struct DirEntry *e = realloc(l->entries, cap * sizeof(struct DirEntry));
+
+        if (e == NULL) {
+            return NULL;
+        }
+
+        l->entries = e;
+        l->cap = cap;
+    }
+
+    if (l->names_len + need > l->names_cap) {
+        size_t cap = l->names_cap ? l->names_cap * 2 : 4096;
+
+        while (cap < l->names_len + need) {
+            cap *= 2;
+        }
+
+        char *n = realloc(l->names, cap);
+
+        if (n == NULL) {
+            return NULL;
+        }
+
+        l->names = n;
+        l->names_cap = cap;
+    }
+
+    memcpy(l->names + l->names_len, name, namelen);
+    l->names[l->names_len + namelen] = '\0';
+
+    /* the arena may still move, keep the offset until dir_listing_seal() */
+    struct DirEntry *e = &l->entries[l->count++];
+    *e = (struct DirEntry) {
+        0
+    };
+    e->name = (const char *)(uintptr_t) l->names_len;
+
+    if (note) {
+        memcpy(l->names + l->names_len + namelen + 1, note, notelen);
+        l->names[l->names_len + namelen + 1 + notelen] = '\0';
+        e->note = (const char *)(uintptr_t)(l->names_len + namelen + 1);
+    }
+
+    l->names_len += need;
+
+    return e;
+}
+
+void dir_listing_seal(struct DirListing *l)
+{
+    for (size_t i = 0; i < l->count; ++i) {
+        l->entries[i].name = l->names + (uintptr_t) l->entries[i].name;
+
+        if (l->entries[i].note) {
+            l->entries[i].note = l->names + (uintptr_t) l->entries[i].note;
+        }
+    }
+
+    if (l->count > 1) {
+        qsort(l->entries, l->count, sizeof(struct DirEntry), compare_entry_name);
+    }
+}
+
+void dir_listing_free(struct DirListing *listing)
+{
+    free(listing->entries);
+    free(listing->names);
+
+    *listing = (struct DirListing) {
+        0
+    };
+}
+
+int dir_enumerate_fd(int dirfd, struct DirListing *listing)
+{
+    *listing = (struct DirListing) {
+        0
+    };
+
+    char *buf = malloc(DENTS_BUF_SIZE);
+
+    if (buf == NULL) {
+        return -1;
+    }
+
+    if (lseek(dirfd, 0, SEEK_SET) == -1) {
+        free(buf);
+        return -1;
+    }
+
+    for (;;) {
+        long n = syscall(SYS_getdents64, dirfd, buf, DENTS_BUF_SIZE);
+
+        if (n == -1) {
+            goto on_error;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        for (long pos = 0; pos < n;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + pos);
+            pos += d->d_reclen;
+
+            const char *name = d->d_name;
+
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+
+            struct DirEntry *e = dir_listing_push(listing, name, strlen(name));
+
+            if (e == NULL) {
+                goto on_error;
+            }
+
+            e->ino = d->d_ino;
+        }
+    }
+
+    free(buf);
+
+    for (size_t i = 0; i < listing->count; ++i) {
+        struct DirEntry *e = &listing->entries[i];
+        const char *name = listing->names + (uintptr_t) e->name;
+
+        struct stat st;
+
+        if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            /* raced with an unlink, keep the name so numbering stays put */
+            e->type = DIR_ENTRY_OTHER;
+            continue;
+        }
+
+        e->type = mode_to_type(st.st_mode);
+        e->nlink = st.st_nlink;
+        e->size = st.st_size;
+        e->mtime = st.st_mtime;
+        e->ino = st.st_ino;
+    }
+
+    dir_listing_seal(listing);
+
+    return 0;
+
+on_error: {
+        int saved = errno;
+        free(buf);
+        dir_listing_free(listing);
+        errno = saved;
+        return -1;
+    }
+}
+
+int dir_enumerate(const char *path, struct DirListing *listing)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd == -1) {
+        *listing = (struct DirListing) {
+            0
+        };
+        return -1;
+    }
+
+    int ret = dir_enumerate_fd(fd, listing);
+    int saved = errno;
+    close(fd);
+    errno = saved;
+
+    return ret;
+}
+
+const struct DirEntry *dir_listing_get(const struct DirListing *listing, size_t num)
+{
+    if (num == 0 || num > listing->count) {
+        return NULL;
+    }
+
+    return &listing->entries[num - 1];
+}
+
+/*******************************************************************************
+ *
+ * Snapshots
+ *
+ ******************************************************************************/
+
+/* Snapshots are shared between the cache, friends' sessions and the worker threads
+ * rendering them. dir_lock covers reference counts, the lazily built orders and pages,
+ * and the whole listing cache. Disk reads and sorting happen outside of it.
+ */
+static pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t snapshot_live_bytes = 0;
+static size_t snapshot_live_count = 0;
+
+static void snapshot_account(struct DirSnapshot *s)
+{
+    size_t bytes = sizeof(struct DirSnapshot) + s->listing.cap * sizeof(struct DirEntry) + s->listing.names_cap;
+
+    for (int sort = 0; sort < DIR_SORT_COUNT; ++sort) {
+        if (s->order[sort]) {
+            bytes += s->listing.count * sizeof(uint32_t);
+        }
+
+        if (s->pages[sort] == NULL) {
+            continue;
+        }
+
+        bytes += s->npages * sizeof(char *);
+
+        for (size_t i = 0; i < s->npages; ++i) {
+            if (s->pages[sort][i]) {
+                bytes += strlen(s->pages[sort][i]) + 1;
+            }
+        }
+    }
+
+    snapshot_live_bytes -= s->bytes;
+    s->bytes = bytes;
+    snapshot_live_bytes += s->bytes;
+}
+
+struct DirSnapshot *dir_snapshot_new(const char *base, struct DirListing *listing)
+{
+    struct DirSnapshot *s = calloc(1, sizeof(struct DirSnapshot));
+
+    if (s == NULL || (s->path = strdup(base)) == NULL) {
+        free(s);
+        dir_listing_free(listing);
+        return NULL;
+    }
+
+    s->listing = *listing;
+    *listing = (struct DirListing) {
+        0
+    };
+    s->npages = (s->listing.count + DIR_PAGE_SIZE - 1) / DIR_PAGE_SIZE;
+    s->refs = 1;
+
+    pthread_mutex_lock(&dir_lock);
+    ++snapshot_live_count;
+    snapshot_account(s);
+    pthread_mutex_unlock(&dir_lock);
+
+    return s;
+}
+
+static struct DirSnapshot *snapshot_load(const char *path)
+{
+    struct DirListing listing;
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd == -1 || fstat(fd, &st) == -1 || dir_enumerate_fd(fd, &listing) == -1) {
+        int saved = errno;
+
+        if (fd != -1) {
+            close(fd);
+        }
+
+        errno = saved;
+        return NULL;
+    }
+
+    close(fd);
+
+    struct DirSnapshot *s = dir_snapshot_new(path, &listing);
+
+    if (s) {
+        s->mtime = st.st_mtim;
+    }
+
+    return s;
+}
+
+struct DirSnapshot *dir_snapshot_ref(struct DirSnapshot *s)
+{
+    if (s) {
+        pthread_mutex_lock(&dir_lock);
+        ++s->refs;
+        pthread_mutex_unlock(&dir_lock);
+    }
+
+    return s;
+}
+
+/* Drops a reference with dir_lock held. */
+static void snapshot_unref(struct DirSnapshot *s)
+{
+    if (s == NULL || --s->refs > 0) {
+        return;
+    }
+
+    for (int sort = 0; sort < DIR_SORT_COUNT; ++sort) {
+        if (s->pages[sort]) {
+            for (size_t i = 0; i < s->npages; ++i) {
+                free(s->pages[sort][i]);
+            }
+        }
+
+        free(s->pages[sort]);
+        free(s->order[sort]);
+    }
+
+    snapshot_live_bytes -= s->bytes;
+    --snapshot_live_count;
+
+    dir_listing_free(&s->listing);
+    free(s->path);
+    free(s);
+}
+
+void dir_snapshot_release(struct DirSnapshot *s)
+{
+    if (s) {
+        pthread_mutex_lock(&dir_lock);
+        snapshot_unref(s);
+        pthread_mutex_unlock(&dir_lock);
+    }
+}
+
+/* Entries are stored name sorted, so equal keys fall back to the index, which is the name order. */
+static int compare_order(const void *a, const void *b, void *arg)
+{
+    const struct DirSnapshot *s = ((void **) arg)[0];
+    DIR_SORT sort = *(const DIR_SORT *)((void **) arg)[1];
+    uint32_t ia = *(const uint32_t *) a;
+    uint32_t ib = *(const uint32_t *) b;
+    const struct DirEntry *ea = &s->listing.entries[ia];
+    const struct DirEntry *eb = &s->listing.entries[ib];
+    int r = 0;
+
+    switch (DIR_SORT_KEY(sort)) {
+        case DIR_SORT_SIZE:
+            r = (ea->size > eb->size) - (ea->size < eb->size);
+            break;
+
+        case DIR_SORT_MTIME:
+            r = (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+            break;
+
+        default:
+            break;
+    }
+
+    if (DIR_SORT_IS_DESC(sort)) {
+        r = -r;
+    }
+
+    if (r == 0) {
+        r = (ia > ib) - (ia < ib);
+
+        if (DIR_SORT_IS_DESC(sort) && DIR_SORT_KEY(sort) == DIR_SORT_NAME) {
+            r = -r;
+        }
+    }
+
+    return r;
+}
+
+/* Builds the permutation for sort once per snapshot. Name ascending is the storage order and needs none. */
+static const uint32_t *snapshot_order(struct DirSnapshot *s, DIR_SORT sort)
+{
+    if (sort == DIR_SORT_NAME || s->listing.count == 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&dir_lock);
+    const uint32_t *built = s->order[sort];
+    pthread_mutex_unlock(&dir_lock);
+
+    if (built) {
+        return built;
+    }
+
+    /* entries never change, so sorting needs no lock; two threads racing here both sort and one result is kept */
+    uint32_t *order = malloc(s->listing.count * sizeof(uint32_t));
+
+    if (order == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < s->listing.count; ++i) {
+        order[i] = i;
+    }
+
+    void *arg[2] = {s, &sort};
+    qsort_r(order, s->listing.count, sizeof(uint32_t), compare_order, arg);
+
+    pthread_mutex_lock(&dir_lock);
+
+    if (s->order[sort]) {
+        free(order);
+    } else {
+        s->order[sort] = order;
+        snapshot_account(s);
+    }
+
+    built = s->order[sort];
+    pthread_mutex_unlock(&dir_lock);
+
+    return built;
+}
+
+const struct DirEntry *dir_snapshot_entry(struct DirSnapshot *s, DIR_SORT sort, size_t num)
+{
+    if (num == 0 || num > s->listing.count || sort >= DIR_SORT_COUNT) {
+        return NULL;
+    }
+
+    const uint32_t *order = snapshot_order(s, sort);
+
+    if (order == NULL && sort != DIR_SORT_NAME) {
+        /* out of memory sorting, numbering has to match what was shown: refuse */
+        return NULL;
+    }
+
+    return &s->listing.entries[order ? order[num - 1] : num - 1];
+}
+
+char *dir_snapshot_get_page(const struct DirSnapshot *s, DIR_SORT sort, size_t page)
+{
+    char *text = NULL;
+
+    if (sort >= DIR_SORT_COUNT || page >= s->npages) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&dir_lock);
+
+    if (s->pages[sort] && s->pages[sort][page]) {
+        text = strdup(s->pages[sort][page]);
+    }
+
+    pthread_mutex_unlock(&dir_lock);
+
+    return text;
+}
+
+void dir_snapshot_set_page(struct DirSnapshot *s, DIR_SORT sort, size_t page, char *text)
+{
+    if (sort >= DIR_SORT_COUNT || page >= s->npages) {
+        free(text);
+        return;
+    }
+
+    pthread_mutex_lock(&dir_lock);
+
+    if (s->pages[sort] == NULL && (s->pages[sort] = calloc(s->npages, sizeof(char *))) == NULL) {
+        pthread_mutex_unlock(&dir_lock);
+        free(text);
+        return;
+    }
+
+    free(s->pages[sort][page]);
+    s->pages[sort][page] = text;
+    snapshot_account(s);
+    pthread_mutex_unlock(&dir_lock);
+}
+
+const struct DirEntry *dir_snapshot_resolve(struct DirSnapshot *s, DIR_SORT sort, size_t num)
+{
+    const struct DirEntry *e = dir_snapshot_entry(s, sort, num);
+
+    if (e == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    size_t len = strlen(s->path) + strlen(e->name) + 2;
+    char path[len];
+    snprintf(path, len, "%s/%s", s->path, e->name);
+
+    struct stat st;
+
+    if (lstat(path, &st) == -1) {
+        return NULL;
+    }
+
+    if (st.st_ino != e->ino || (mode_to_type(st.st_mode) == DIR_ENTRY_DIR) != (e->type == DIR_ENTRY_DIR)) {
+        errno = ESTALE;
+        return NULL;
+    }
+
+    return e;
+}
+
+/*******************************************************************************
+ *
+ * Listing cache
+ *
+ ******************************************************************************/
+
+#define DIR_CACHE_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_MODIFY \
+                              | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct DirCacheEntry {
+    char *path;
+    int   wd;                    /* inotify watch descriptor, -1 if the watch could not be added */
+    uint32_t gen;                /* bumped by every invalidation, a load that saw it change is not cached */
+    struct DirSnapshot *snap;    /* NULL while stale */
+    struct DirCacheEntry *next;
+};
+
+static struct DirCacheEntry *dir_cache = NULL;   /* most recently used first */
+static struct DirCacheStats dir_cache_stats = {
+    .max_bytes = DIR_CACHE_MAX_BYTES
+};
+static int dir_cache_inotify_fd = -1;
+
+static size_t cache_bytes(void)
+{
+    size_t bytes = 0;
+
+    for (struct DirCacheEntry *e = dir_cache; e != NULL; e = e->next) {
+        if (e->snap) {
+            bytes += e->snap->bytes;
+        }
+    }
+
+    return bytes;
+}
+
+/* Drops the cache's reference to the listing of e but keeps its inotify watch.
+ * Friends still holding the snapshot keep seeing it unchanged.
+ */
+static void cache_entry_clear(struct DirCacheEntry *e)
+{
+    ++e->gen;
+
+    if (e->snap) {
+        snapshot_unref(e->snap);
+        e->snap = NULL;
+        ++dir_cache_stats.invalidations;
+    }
+}
+
+static void cache_entry_free(struct DirCacheEntry *e)
+{
+    snapshot_unref(e->snap);
+
+    if (e->wd != -1 && dir_cache_inotify_fd != -1) {
+        inotify_rm_watch(dir_cache_inotify_fd, e->wd);
+    }
+
+    free(e->path);
+    free(e);
+    --dir_cache_stats.entries;
+}
+
+/* Evicts least recently used entries, never keep, until the budget is met. */
+static void cache_shrink(const struct DirCacheEntry *keep)
+{
+    while (cache_bytes() > dir_cache_stats.max_bytes || dir_cache_stats.entries > DIR_CACHE_MAX_ENTRIES) {
+        struct DirCacheEntry **p = &dir_cache;
+        struct DirCacheEntry **victim = NULL;
+
+        for (; *p != NULL; p = &(*p)->next) {
+            if (*p != keep) {
+                victim = p;
+            }
+        }
+
+        if (victim == NULL) {
+            return;
+        }
+
+        struct DirCacheEntry *e = *victim;
+        *victim = e->next;
+        cache_entry_free(e);
+        ++dir_cache_stats.evictions;
+    }
+}
+
+/* Without a watch the directory mtime is the only change signal we have. */
+static bool cache_entry_changed(const struct DirCacheEntry *e)
+{
+    if (e->wd != -1) {
+        return false;
+    }
+
+    struct stat st;
+
+    if (stat(e->path, &st) == -1) {
+        return true;
+    }
+
+    return st.st_mtim.tv_sec != e->snap->mtime.tv_sec || st.st_mtim.tv_nsec != e->snap->mtime.tv_nsec;
+}
+
+int dir_cache_init(size_t max_bytes)
+{
+    pthread_mutex_lock(&dir_lock);
+
+    if (max_bytes) {
+        dir_cache_stats.max_bytes = max_bytes;
+    }
+
+    if (dir_cache_inotify_fd == -1) {
+        dir_cache_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+
+    int ret = dir_cache_inotify_fd == -1 ? -1 : 0;
+    pthread_mutex_unlock(&dir_lock);
+
+    return ret;
+}
+
+void dir_cache_poll(void)
+{
+    /* a worker holding the lock means a busy moment; the events keep until the next poll */
+    if (dir_cache_inotify_fd == -1 || pthread_mutex_trylock(&dir_lock) != 0) {
+        return;
+    }
+
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t len = read(dir_cache_inotify_fd, buf, sizeof(buf));
+
+        if (len <= 0) {
+            break;
+        }
+
+        for (char *ptr = buf; ptr < buf + len;) {
+            const struct inotify_event *ev = (const struct inotify_event *) ptr;
+            ptr += sizeof(struct inotify_event) + ev->len;
+
+            for (struct DirCacheEntry *e = dir_cache; e != NULL; e = e->next) {
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    cache_entry_clear(e);
+                    continue;
+                }
+
+                if (e->wd != ev->wd) {
+                    continue;
+                }
+
+                if (ev->mask & IN_IGNORED) {
+                    /* watch is gone (dir removed or unmounted), fall back to mtime checks */
+                    e->wd = -1;
+                }
+
+                cache_entry_clear(e);
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&dir_lock);
+}
+
+/* Returns the entry of path, NULL if there is none. If p is given it is set to the link pointing at it. */
+static struct DirCacheEntry *cache_find(const char *path, struct DirCacheEntry ***p)
+{
+    struct DirCacheEntry **link = &dir_cache;
+
+    for (; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->path, path) == 0) {
+            break;
+        }
+    }
+
+    if (p) {
+        *p = link;
+    }
+
+    return *link;
+}
+
+struct DirSnapshot *dir_snapshot_get(const char *path)
+{
+    struct DirCacheEntry **p;
+
+    pthread_mutex_lock(&dir_lock);
+
+    struct DirCacheEntry *e = cache_find(path, &p);
+
+    if (e) {
+        /* move to front */
+        *p = e->next;
+        e->next = dir_cache;
+        dir_cache = e;
+
+        if (e->snap && !cache_entry_changed(e)) {
+            struct DirSnapshot *s = e->snap;
+            ++dir_cache_stats.hits;
+            ++s->refs;
+            pthread_mutex_unlock(&dir_lock);
+            return s;
+        }
+
+        cache_entry_clear(e);
+    } else {
+        e = calloc(1, sizeof(struct DirCacheEntry));
+
+        if (e == NULL || (e->path = strdup(path)) == NULL) {
+            free(e);
+            pthread_mutex_unlock(&dir_lock);
+            return NULL;
+        }
+
+        e->wd = -1;
+
+        /* watch before reading so a change during enumeration is not lost */
+        if (dir_cache_inotify_fd != -1) {
+            e->wd = inotify_add_watch(dir_cache_inotify_fd, path, DIR_CACHE_WATCH_MASK);
+        }
+
+        e->next = dir_cache;
+        dir_cache = e;
+        ++dir_cache_stats.entries;
+    }
+
+    ++dir_cache_stats.misses;
+    uint32_t gen = e->gen;
+    pthread_mutex_unlock(&dir_lock);
+
+    /* the directory is read unlocked: other lookups and dir_cache_poll() go on meanwhile */
+    struct DirSnapshot *s = snapshot_load(path);
+    int saved = errno;
+
+    pthread_mutex_lock(&dir_lock);
+    e = cache_find(path, &p);
+
+    if (s == NULL) {
+        if (e && e->snap == NULL) {
+            *p = e->next;
+            cache_entry_free(e);
+        }
+    } else if (e && e->snap == NULL && e->gen == gen) {
+        e->snap = s;
+        ++s->refs;
+        cache_shrink(e);
+    }
+
+    /* otherwise it changed while being read or another thread got there first:
+     * ours is still a consistent listing, it is just not cached
+     */
+    pthread_mutex_unlock(&dir_lock);
+    errno = saved;
+
+    return s;
+}
+
+void dir_cache_invalidate(const char *path)
+{
+    pthread_mutex_lock(&dir_lock);
+
+    struct DirCacheEntry *e = cache_find(path, NULL);
+
+    if (e) {
+        cache_entry_clear(e);
+    }
+
+    pthread_mutex_unlock(&dir_lock);
+}
+
+void dir_cache_get_stats(struct DirCacheStats *stats)
+{
+    pthread_mutex_lock(&dir_lock);
+    *stats = dir_cache_stats;
+    stats->bytes = cache_bytes();
+    stats->snapshots = snapshot_live_count;
+    stats->snapshot_bytes = snapshot_live_bytes;
+    pthread_mutex_unlock(&dir_lock);
+}
@@ -0,0 +1,189 @@
+#ifndef AUTOTOX_DIR_H
+#define AUTOTOX_DIR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+typedef enum DIR_ENTRY_TYPE {
+    DIR_ENTRY_FILE,
+    DIR_ENTRY_DIR,
+    DIR_ENTRY_LINK,
+    DIR_ENTRY_OTHER,
+} DIR_ENTRY_TYPE;
+
+struct DirEntry {
+    const char *name;    /* points into the owning listing's name arena */
+    const char *note;    /* shown after the name, e.g. the line of a grep hit; NULL if none */
+    uint8_t  type;
+    uint32_t nlink;
+    uint64_t size;
+    time_t   mtime;
+    ino_t    ino;
+};
+
+/* All entries of one directory, "." and ".." excluded, sorted by name; entries with the same
+ * name (hits of a search in one file) stay in the order they were pushed.
+ */
+struct DirListing {
+    struct DirEntry *entries;
+    size_t count;
+    size_t cap;
+    char  *names;        /* every name back to back, '\0' terminated */
+    size_t names_len;
+    size_t names_cap;
+};
+
+/*******************************************************************************
+ *
+ * Enumeration
+ *
+ ******************************************************************************/
+
+/* Reads directory path with getdents64 and fills every entry's type, size and mtime
+ * with fstatat relative to the directory fd.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure and leaves errno set; listing is left empty.
+ */
+int dir_enumerate(const char *path, struct DirListing *listing);
+
+/* Same as dir_enumerate() but reads an already opened directory fd. The fd is not closed. */
+int dir_enumerate_fd(int dirfd, struct DirListing *listing);
+
+/* Frees everything owned by listing and leaves it empty. */
+void dir_listing_free(struct DirListing *listing);
+
+/* Appends an entry named name to listing and returns it for the caller to fill in.
+ * Its name pointer is only valid after dir_listing_seal().
+ * Returns NULL if out of memory.
+ */
+struct DirEntry *dir_listing_push(struct DirListing *listing, const char *name, size_t namelen);
+
+/* Same as dir_listing_push() with note, notelen bytes long, kept in the arena too. */
+struct DirEntry *dir_listing_push_note(struct DirListing *listing, const char *name, size_t namelen,
+                                       const char *note, size_t notelen);
+
+/* Fixes up the name pointers of pushed entries and sorts them by name. */
+void dir_listing_seal(struct DirListing *listing);
+
+/* Returns the 1-based entry num of listing (the numbering shown by `ls`).
+ * Returns NULL if num is out of range.
+ */
+const struct DirEntry *dir_listing_get(const struct DirListing *listing, size_t num);
+
+/*******************************************************************************
+ *
+ * Snapshots
+ *
+ ******************************************************************************/
+
+#define DIR_PAGE_SIZE 10                      /* entries per `ls`/`next` message */
+#define DIR_SNAPSHOT_TTL 600                  /* seconds an unused `ls` snapshot is kept for a friend */
+
+/* Orders `ls` can serve a snapshot in. Ascending and descending alternate so
+ * DIR_SORT_KEY() and DIR_SORT_IS_DESC() can take a value apart.
+ */
+typedef enum DIR_SORT {
+    DIR_SORT_NAME,
+    DIR_SORT_NAME_DESC,
+    DIR_SORT_SIZE,
+    DIR_SORT_SIZE_DESC,
+    DIR_SORT_MTIME,
+    DIR_SORT_MTIME_DESC,
+    DIR_SORT_COUNT,
+} DIR_SORT;
+
+#define DIR_SORT_KEY(sort)     ((sort) & ~1)
+#define DIR_SORT_IS_DESC(sort) ((sort) & 1)
+
+/* A reference counted listing of one directory as it was when it was read.
+ * `ls` pins one so that next/down/delf keep the numbering it showed, whatever
+ * happens to the directory afterwards. Entries never change once loaded; sort
+ * orders and rendered pages are filled in lazily, once per snapshot. Every
+ * function here may be called from any thread.
+ */
+struct DirSnapshot {
+    char  *path;
+    struct timespec mtime;
+    struct DirListing listing;          /* name ascending */
+    uint32_t *order[DIR_SORT_COUNT];    /* entry indexes in each other order, NULL until used */
+    char **pages[DIR_SORT_COUNT];       /* rendered `ls` pages per order, NULL until first requested */
+    size_t npages;
+    size_t bytes;
+    int    refs;
+};
+
+/* Returns a new reference to the current snapshot of path, served from the listing cache.
+ * Returns NULL if the directory can not be read.
+ */
+struct DirSnapshot *dir_snapshot_get(const char *path);
+
+/* Wraps a sealed listing whose names are relative to base into a snapshot that is not
+ * part of the cache, e.g. a set of search results. Takes ownership of listing's memory.
+ * Returns NULL if out of memory.
+ */
+struct DirSnapshot *dir_snapshot_new(const char *base, struct DirListing *listing);
+
+struct DirSnapshot *dir_snapshot_ref(struct DirSnapshot *s);
+
+/* Drops a reference, freeing the snapshot with the last one. NULL is ignored. */
+void dir_snapshot_release(struct DirSnapshot *s);
+
+/* Returns the 1-based entry num of s in order sort, sorting the snapshot on first use.
+ * Returns NULL if num is out of range.
+ */
+const struct DirEntry *dir_snapshot_entry(struct DirSnapshot *s, DIR_SORT sort, size_t num);
+
+/* Returns a copy of the rendered text of page in order sort, NULL if it was not rendered yet. */
+char *dir_snapshot_get_page(const struct DirSnapshot *s, DIR_SORT sort, size_t page);
+
+/* Stores the rendered text of page in order sort. The snapshot takes ownership of text. */
+void dir_snapshot_set_page(struct DirSnapshot *s, DIR_SORT sort, size_t page, char *text);
+
+/* Returns entry num of s in order sort if its name still refers to the same inode on disk.
+ * Returns NULL with errno ENOENT if it is gone, ESTALE if it was replaced.
+ */
+const struct DirEntry *dir_snapshot_resolve(struct DirSnapshot *s, DIR_SORT sort, size_t num);
+
+/*******************************************************************************
+ *
+ * Listing cache
+ *
+ ******************************************************************************/
+
+#define DIR_CACHE_MAX_BYTES (32 * 1024 * 1024)
+#define DIR_CACHE_MAX_ENTRIES 64
+
+struct DirCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+    uint64_t evictions;
+    size_t   entries;
+    size_t   bytes;
+    size_t   max_bytes;
+    size_t   snapshots;       /* every live snapshot, cached or pinned by a friend */
+    size_t   snapshot_bytes;
+};
+
+/* Sets up the inotify instance used for invalidation and the memory budget of the cache.
+ * The cache still works without inotify, falling back to a directory mtime check per lookup.
+ *
+ * Returns 0 on success, -1 if inotify is unavailable.
+ */
+int dir_cache_init(size_t max_bytes);
+
+/* Drains pending inotify events and marks the affected directories stale. Never blocks:
+ * if another thread is using the cache the events are left for the next call.
+ */
+void dir_cache_poll(void);
+
+/* Drops path from the cache so the next lookup rereads it. */
+void dir_cache_invalidate(const char *path);
+
+void dir_cache_get_stats(struct DirCacheStats *stats);
+
+#endif /* AUTOTOX_DIR_H */
@@ -1,10 +1,16 @@
 
 
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "autotox_aio.h"
 #include "autotox_file_transfers.h"
 
 
@@ -128,6 +134,690 @@ struct FileTransfer *new_file_transfer(struct Friend *f, uint32_t friendnumber,
     return NULL;
 }
 
+/* Fills ft's block with the file's bytes from position on.
+ * Returns false on failure.
+ */
+static bool fill_block(struct FileTransfer *ft, uint64_t position)
+{
+    int fd = fileno(ft->file);
+    uint64_t end = (ft->block != NULL) ? ft->block_pos + ft->block_len : 0;   /* where a stream was left */
+    ssize_t n = 0;
+
+    if (ft->block == NULL) {
+        /* page aligned, so the kernel copies whole pages into it */
+        if (posix_memalign((void **) &ft->block, 4096, FILE_TRANSFER_BLOCK) != 0) {
+            ft->block = NULL;
+            return false;
+        }
+
+        if (fd != -1) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+    }
+
+    if (fd == -1) {
+        /* a stream of our own, e.g. an archive member or a manifest: no fd to pread from. Keep
+         * what the block holds from position on, so the stream is only read forward: going
+         * back in a compressed one would mean inflating it again from the start */
+        size_t keep = (ft->block != NULL && position >= ft->block_pos && position < end) ? end - position : 0;
+
+        if (keep > 0) {
+            memmove(ft->block, ft->block + (position - ft->block_pos), keep);
+        } else if (position != end && fseeko(ft->file, (off_t) position, SEEK_SET) == -1) {
+            ft->block_len = 0;
+            return false;
+        }
+
+        ft->block_pos = position;
+        ft->block_len = keep + fread(ft->block + keep, 1, FILE_TRANSFER_BLOCK - keep, ft->file);
+        return !ferror(ft->file);
+    }
+
+    ft->block_pos = position;
+    ft->block_len = 0;
+
+    while (ft->block_len < FILE_TRANSFER_BLOCK) {
+        n = pread(fd, ft->block + ft->block_len, FILE_TRANSFER_BLOCK - ft->block_len, (off_t) (position + ft->block_len));
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            break;
+        }
+
+        ft->block_len += n;
+    }
+
+    if (ft->block_len == FILE_TRANSFER_BLOCK) {
+        /* start reading the next block while this one is sent */
+        posix_fadvise(fd, (off_t) (position + FILE_TRANSFER_BLOCK), FILE_TRANSFER_BLOCK, POSIX_FADV_WILLNEED);
+    }
+
+    return n != -1 || ft->block_len > 0;
+}
+
+/* A file shrinking under its mapping turns reads past its new end into SIGBUS, maybe inside
+ * tox_file_send_chunk where nothing can be unwound. A fault in the chunk last handed out maps
+ * zeros over its page so the read completes, and the sender learns the chunk was lost;
+ * any other fault goes to the handler that was there before.
+ */
+static const uint8_t *volatile bus_lo;
+static const uint8_t *volatile bus_hi;
+static volatile sig_atomic_t bus_faulted;
+static struct sigaction bus_prev;
+static size_t page_size;
+
+static void on_sigbus(int sig, siginfo_t *si, void *ctx)
+{
+    const uint8_t *addr = si->si_addr;
+
+    if (addr >= bus_lo && addr < bus_hi) {
+        void *page = (void *) ((uintptr_t) addr & ~(uintptr_t) (page_size - 1));
+
+        if (mmap(page, page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+            bus_faulted = 1;
+            return;
+        }
+    }
+
+    if (bus_prev.sa_flags & SA_SIGINFO) {
+        bus_prev.sa_sigaction(sig, si, ctx);
+    } else if (bus_prev.sa_handler != SIG_DFL && bus_prev.sa_handler != SIG_IGN) {
+        bus_prev.sa_handler(sig);
+    } else {
+        signal(sig, SIG_DFL);   /* the fault recurs on return, now fatal */
+    }
+}
+
+/* Installs on_sigbus once. A handler installed later, e.g. grep's, must pass on the faults
+ * it does not handle: putting this one back over it would make each chain to the other.
+ */
+static void install_sigbus(void)
+{
+    static bool installed;
+
+    if (installed) {
+        return;
+    }
+
+    installed = true;
+
+    struct sigaction sa = {
+        .sa_sigaction = on_sigbus,
+        .sa_flags = SA_SIGINFO,
+    };
+
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, &bus_prev);
+}
+
+static void drop_map(struct FileTransfer *ft)
+{
+    if (ft->map != NULL) {
+        munmap(ft->map, ft->map_len);
+        ft->map = NULL;
+    }
+}
+
+/* Returns true if the file of ft is big enough and regular, so worth mapping. */
+static bool mappable(struct FileTransfer *ft)
+{
+    int fd = fileno(ft->file);
+    struct stat st;
+
+    return fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= FILE_TRANSFER_MAP_MIN;
+}
+
+/* Maps the window of ft's file holding the length bytes at position.
+ * Returns false if the file no longer holds them or mmap fails.
+ */
+static bool map_window(struct FileTransfer *ft, uint64_t position, size_t length)
+{
+    int fd = fileno(ft->file);
+    struct stat st;
+
+    drop_map(ft);
+
+    if (fstat(fd, &st) == -1 || (uint64_t) st.st_size < position + length) {
+        return false;
+    }
+
+    if (page_size == 0) {
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+
+    ft->map_pos = position & ~(uint64_t) (page_size - 1);
+    ft->map_len = ((uint64_t) st.st_size - ft->map_pos < FILE_TRANSFER_MAP_WINDOW) ? st.st_size - ft->map_pos : FILE_TRANSFER_MAP_WINDOW;
+
+    void *map = mmap(NULL, ft->map_len, PROT_READ, MAP_PRIVATE, fd, (off_t) ft->map_pos);
+
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    madvise(map, ft->map_len, MADV_SEQUENTIAL);
+    ft->map = map;
+    install_sigbus();
+
+    return true;
+}
+
+/* Returns the length bytes at position straight from the mapping, NULL if they are gone. */
+static const uint8_t *read_mapped(struct FileTransfer *ft, uint64_t position, size_t length)
+{
+    if ((ft->map == NULL || position < ft->map_pos || position + length > ft->map_pos + ft->map_len)
+            && !map_window(ft, position, length)) {
+        return NULL;
+    }
+
+    const uint8_t *p = ft->map + (position - ft->map_pos);
+
+    bus_faulted = 0;
+    bus_lo = p;
+    bus_hi = p + length;
+
+    /* touch both ends now: a chunk spans two pages at most, and if the file shrank they are gone */
+    (void) *(volatile const uint8_t *) p;
+    (void) *(volatile const uint8_t *) (p + length - 1);
+
+    if (bus_faulted) {
+        bus_lo = bus_hi = NULL;
+        bus_faulted = 0;
+        return NULL;
+    }
+
+    return p;
+}
+
+const uint8_t *file_transfer_read(struct FileTransfer *ft, uint64_t position, size_t length)
+{
+    if (ft->file == NULL || length == 0 || length > FILE_TRANSFER_BLOCK) {
+        return NULL;
+    }
+
+    /* the first chunk decides: big regular files are mapped, the rest read into the block */
+    if (ft->map == NULL && ft->block == NULL && !ft->map_off) {
+        ft->map_off = !mappable(ft);
+    }
+
+    if (!ft->map_off) {
+        const uint8_t *p = read_mapped(ft, position, length);
+
+        if (p != NULL) {
+            return p;
+        }
+
+        drop_map(ft);
+        ft->map_off = true;
+    }
+
+    if (ft->block == NULL || position < ft->block_pos || position + length > ft->block_pos + ft->block_len) {
+        if (!fill_block(ft, position) || length > ft->block_len) {
+            return NULL;
+        }
+    }
+
+    return ft->block + (position - ft->block_pos);
+}
+
+bool file_transfer_read_ok(struct FileTransfer *ft)
+{
+    bool ok = !bus_faulted;
+
+    bus_lo = bus_hi = NULL;
+
+    if (!ok) {
+        bus_faulted = 0;
+        drop_map(ft);
+        ft->map_off = true;
+    }
+
+    return ok;
+}
+
+enum {
+    IO_FREE,
+    IO_FILLING,                    /* receivers: taking chunks */
+    IO_BUSY,                       /* queued to the engine */
+    IO_READY,                      /* senders: read, chunks are sent from it */
+};
+
+struct IoBlock {
+    struct AioReq req;             /* first: the engine hands it back */
+    struct FileTransferIO *io;
+    int      state;
+    unsigned gen;                  /* io->gen when queued: a read from before a seek is dropped */
+    uint64_t pos;                  /* position in the transfer of buf[0] */
+    size_t   len;
+    uint8_t *buf;
+};
+
+/* The engine's side of a transfer. It outlives the transfer while blocks are queued: the
+ * buffers and the fd stay valid until their I/O completes.
+ */
+struct FileTransferIO {
+    struct FileTransfer *ft;       /* NULL once the transfer closed */
+    struct FileTransferIO *next;
+    Tox     *m;
+    int      fd;                   /* a dup of the transfer's, without O_APPEND */
+    bool     send;
+    bool     stalled;              /* held chunks wait for room in tox's send queue or the engine's */
+    unsigned gen;
+    uint64_t base;                 /* offset in the file of position 0 */
+    uint64_t size;                 /* senders: of the file */
+    size_t   chunk;                /* senders: length tox asks for */
+    uint64_t requested;            /* senders: end of the chunks asked for, held from ft->position on */
+    uint64_t readpos;              /* senders: where the next block read starts */
+    int      busy;                 /* blocks queued */
+    size_t   nblocks;
+    struct IoBlock blocks[];
+};
+
+static struct FileTransferIO *ios;
+
+static void io_free(struct FileTransferIO *io)
+{
+    struct FileTransferIO **p = &ios;
+
+    LIST_FIND(p, *p == io);
+
+    if (*p != NULL) {
+        *p = io->next;
+    }
+
+    for (size_t i = 0; i < io->nblocks; ++i) {
+        free(io->blocks[i].buf);
+    }
+
+    close(io->fd);
+    free(io);
+}
+
+/* Fails the transfer of io with reason, or reports it if the transfer is gone already. */
+static void io_fail(struct FileTransferIO *io, const char *reason)
+{
+    char msg[MAX_STR_SIZE];
+
+    if (io->ft == NULL) {
+        PRINT("File transfer failed after closing: %s.", reason);
+        return;
+    }
+
+    snprintf(msg, sizeof(msg), "File transfer for '%s' failed: %s.", io->ft->file_name, reason);
+    close_file_transfer(io->m, io->ft, TOX_FILE_CONTROL_CANCEL, msg);
+}
+
+/* Returns the engine's side of ft, set up on first use; NULL if the engine does not take ft. */
+static struct FileTransferIO *io_get(Tox *m, struct FileTransfer *ft, bool send)
+{
+    struct stat st;
+
+    if (ft->io != NULL || ft->io_off) {
+        return ft->io;
+    }
+
+    ft->io_off = true;
+
+    if (aio_engine() == AIO_ENGINE_NONE || ft->file == NULL || fileno(ft->file) == -1
+            || fstat(fileno(ft->file), &st) == -1 || !S_ISREG(st.st_mode)) {
+        return NULL;
+    }
+
+    size_t nblocks = send ? FILE_TRANSFER_IO_READS : FILE_TRANSFER_IO_WRITES;
+    struct FileTransferIO *io = calloc(1, sizeof(struct FileTransferIO) + nblocks * sizeof(struct IoBlock));
+
+    if (io == NULL) {
+        return NULL;
+    }
+
+    /* pwrite on an O_APPEND fd ignores its offset, receivers write blocks in any order */
+    io->fd = fcntl(fileno(ft->file), F_DUPFD_CLOEXEC, 0);
+
+    if (io->fd == -1 || (!send && fcntl(io->fd, F_SETFL, fcntl(io->fd, F_GETFL) & ~O_APPEND) == -1)) {
+        if (io->fd != -1) {
+            close(io->fd);
+        }
+
+        free(io);
+        return NULL;
+    }
+
+    io->ft = ft;
+    io->m = m;
+    io->send = send;
+    io->size = ft->file_size;
+    io->base = send ? 0 : (uint64_t) st.st_size;   /* a receiver appends to what the file held */
+    io->nblocks = nblocks;
+
+    for (size_t i = 0; i < nblocks; ++i) {
+        io->blocks[i].io = io;
+    }
+
+    io->next = ios;
+    ios = io;
+    ft->io = io;
+    ft->io_off = false;
+
+    return io;
+}
+
+static void read_done(struct AioReq *req);
+
+/* Queues reads into the free blocks, of what follows the blocks read or being read. A block
+ * holds whole chunks, so a chunk never straddles two.
+ */
+static void read_ahead(struct FileTransferIO *io)
+{
+    size_t span = (FILE_TRANSFER_BLOCK / io->chunk) * io->chunk;
+
+    for (size_t i = 0; i < io->nblocks && io->readpos < io->size; ++i) {
+        struct IoBlock *b = &io->blocks[i];
+
+        if (b->state == IO_READY && b->pos + b->len <= io->ft->position) {
+            b->state = IO_FREE;   /* all sent */
+        }
+
+        if (b->state != IO_FREE) {
+            continue;
+        }
+
+        if (b->buf == NULL && posix_memalign((void **) &b->buf, 4096, FILE_TRANSFER_BLOCK) != 0) {
+            b->buf = NULL;
+            io->stalled = true;
+            return;
+        }
+
+        b->pos = io->readpos;
+        b->len = (io->size - b->pos < span) ? io->size - b->pos : span;
+        b->gen = io->gen;
+        b->req = (struct AioReq) {
+            .done = read_done,
+            .fd = io->fd,
+            .buf = b->buf,
+            .len = b->len,
+            .off = io->base + b->pos,
+        };
+
+        if (!aio_submit(&b->req)) {
+            io->stalled = true;
+            return;
+        }
+
+        b->state = IO_BUSY;
+        ++io->busy;
+        io->readpos += b->len;
+    }
+}
+
+/* Sends the held chunks whose block is in, then reads ahead into the blocks they freed. */
+static void io_push(struct FileTransferIO *io)
+{
+    struct FileTransfer *ft = io->ft;
+
+    io->stalled = false;
+
+    while (ft->position < io->requested) {
+        size_t len = (io->size - ft->position < io->chunk) ? io->size - ft->position : io->chunk;
+        struct IoBlock *b = NULL;
+
+        for (size_t i = 0; i < io->nblocks && b == NULL; ++i) {
+            struct IoBlock *c = &io->blocks[i];
+
+            if (c->state == IO_READY && c->pos <= ft->position && ft->position + len <= c->pos + c->len) {
+                b = c;
+            }
+        }
+
+        if (b == NULL) {
+            break;
+        }
+
+        if (ft->state != FILE_TRANSFER_STARTED) {
+            io->stalled = true;   /* paused: resumed ones are not asked again */
+            break;
+        }
+
+        Tox_Err_File_Send_Chunk err;
+        tox_file_send_chunk(io->m, ft->friendnumber, ft->filenumber, ft->position, b->buf + (ft->position - b->pos), len,
+                            &err);
+
+        if (err == TOX_ERR_FILE_SEND_CHUNK_SENDQ) {
+            io->stalled = true;
+            break;
+        }
+
+        if (err != TOX_ERR_FILE_SEND_CHUNK_OK) {
+            fprintf(stderr, "tox_file_send_chunk failed for a held chunk (error %d)\n", err);
+        }
+
+        ft->position += len;
+        ft->bps += len;
+    }
+
+    read_ahead(io);
+}
+
+static void read_done(struct AioReq *req)
+{
+    struct IoBlock *b = (struct IoBlock *) req;
+    struct FileTransferIO *io = b->io;
+
+    --io->busy;
+    b->state = IO_FREE;
+
+    if (io->ft == NULL) {
+        if (io->busy == 0) {
+            io_free(io);
+        }
+
+        return;
+    }
+
+    if (b->gen != io->gen) {
+        io_push(io);   /* read for before a seek */
+        return;
+    }
+
+    if (req->res < 0 || (size_t) req->res < b->len) {
+        io_fail(io, (req->res < 0) ? "Read fail" : "File shrank");
+        return;
+    }
+
+    b->state = IO_READY;
+    io_push(io);
+}
+
+int file_transfer_io_send(Tox *m, struct FileTransfer *ft, uint64_t position, size_t length)
+{
+    struct FileTransferIO *io = io_get(m, ft, true);
+
+    if (io == NULL) {
+        return 0;
+    }
+
+    if (length == 0 || length > FILE_TRANSFER_BLOCK || position + length > io->size) {
+        return -1;
+    }
+
+    if (io->chunk == 0 || position != io->requested) {
+        /* the first request, or tox went back: reading starts over from position */
+        ++io->gen;
+
+        for (size_t i = 0; i < io->nblocks; ++i) {
+            if (io->blocks[i].state == IO_READY) {
+                io->blocks[i].state = IO_FREE;
+            }
+        }
+
+        io->chunk = length;
+        io->readpos = position;
+        ft->position = position;
+    }
+
+    io->requested = position + length;
+    io_push(io);
+
+    return 1;
+}
+
+static void write_done(struct AioReq *req)
+{
+    struct IoBlock *b = (struct IoBlock *) req;
+    struct FileTransferIO *io = b->io;
+
+    --io->busy;
+    b->state = IO_FREE;
+
+    if (req->res != (ssize_t) b->len && io->ft != NULL) {
+        io_fail(io, "Write fail");
+        return;   /* closing the transfer detached io, and freed it if this was its last block */
+    }
+
+    if (req->res != (ssize_t) b->len) {
+        io_fail(io, "Write fail");
+    }
+
+    if (io->ft == NULL && io->busy == 0) {
+        io_free(io);
+    }
+}
+
+static bool write_full(int fd, const uint8_t *data, size_t len, uint64_t off)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, (off_t) off);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return false;
+        }
+
+        data += n;
+        len -= n;
+        off += n;
+    }
+
+    return true;
+}
+
+/* Queues the write of b, or writes it here if the engine is full.
+ * Returns false on failure.
+ */
+static bool io_flush(struct FileTransferIO *io, struct IoBlock *b)
+{
+    b->req = (struct AioReq) {
+        .done = write_done,
+        .fd = io->fd,
+        .write = true,
+        .buf = b->buf,
+        .len = b->len,
+        .off = io->base + b->pos,
+    };
+
+    if (aio_submit(&b->req)) {
+        b->state = IO_BUSY;
+        ++io->busy;
+        return true;
+    }
+
+    b->state = IO_FREE;
+
+    return write_full(io->fd, b->buf, b->len, io->base + b->pos);
+}
+
+int file_transfer_io_recv(Tox *m, struct FileTransfer *ft, uint64_t position, const uint8_t *data, size_t length)
+{
+    struct FileTransferIO *io = io_get(m, ft, false);
+
+    if (io == NULL) {
+        return 0;
+    }
+
+    while (length > 0) {
+        struct IoBlock *b = NULL;
+        struct IoBlock *free_b = NULL;
+
+        for (size_t i = 0; i < io->nblocks; ++i) {
+            struct IoBlock *c = &io->blocks[i];
+
+            if (c->state == IO_FILLING) {
+                b = c;
+            } else if (c->state == IO_FREE && free_b == NULL) {
+                free_b = c;
+            }
+        }
+
+        if (b != NULL && b->pos + b->len != position) {
+            if (!io_flush(io, b)) {
+                return -1;
+            }
+
+            b = NULL;
+        }
+
+        if (b == NULL) {
+            if (free_b == NULL || (free_b->buf == NULL
+                                   && posix_memalign((void **) &free_b->buf, 4096, FILE_TRANSFER_BLOCK) != 0)) {
+                /* the disk is behind by all the blocks: this one is written in the callback */
+                if (free_b != NULL) {
+                    free_b->buf = NULL;
+                }
+
+                return write_full(io->fd, data, length, io->base + position) ? 1 : -1;
+            }
+
+            b = free_b;
+            b->state = IO_FILLING;
+            b->pos = position;
+            b->len = 0;
+        }
+
+        size_t n = (length < FILE_TRANSFER_BLOCK - b->len) ? length : FILE_TRANSFER_BLOCK - b->len;
+
+        memcpy(b->buf + b->len, data, n);
+        b->len += n;
+        data += n;
+        position += n;
+        length -= n;
+
+        if (b->len == FILE_TRANSFER_BLOCK && !io_flush(io, b)) {
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+void file_transfer_io_poll(void)
+{
+    for (struct FileTransferIO *io = ios; io != NULL; io = io->next) {
+        if (io->stalled && io->ft != NULL && io->send) {
+            io_push(io);
+        }
+    }
+}
+
+/* Leaves io to finish what is queued once its transfer closes; a receiver's last block is queued too. */
+static void io_detach(struct FileTransferIO *io)
+{
+    io->ft = NULL;
+
+    for (size_t i = 0; i < io->nblocks; ++i) {
+        if (io->blocks[i].state == IO_FILLING && !io_flush(io, &io->blocks[i])) {
+            io_fail(io, "Write fail");
+        }
+    }
+
+    if (io->busy == 0) {
+        io_free(io);
+    }
+}
+
 /* Closes file transfer ft.
  *
  * Set CTRL to -1 if we don't want to send a control signal.
@@ -147,6 +837,13 @@ void close_file_transfer(Tox *m, struct FileTransfer *ft, int CTRL, const char *
         fclose(ft->file);
     }
 
+    free(ft->block);
+    drop_map(ft);
+
+    if (ft->io) {
+        io_detach(ft->io);
+    }
+
     if (CTRL >= 0) {
         tox_file_control(m, ft->friendnumber, ft->filenumber, (Tox_File_Control) CTRL, NULL);
     }
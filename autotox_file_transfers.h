@@ -7,12 +7,21 @@
 #include <stdint.h>
 #include <tox/tox.h>
 
+#include "autotox_dir.h"
+#include "autotox_path.h"
+
 #define KiB 1024
 #define MiB 1048576       /* 1024^2 */
 #define GiB 1073741824    /* 1024^3 */
 
 #define MAX_FILES 32
 
+#define FILE_TRANSFER_BLOCK (256 * KiB)   /* a sender reads this much at once, then serves chunks from it */
+#define FILE_TRANSFER_MAP_MIN (4 * MiB)   /* bigger files are sent straight from a mapping instead */
+#define FILE_TRANSFER_MAP_WINDOW ((sizeof(void *) > 4) ? 64 * MiB : 8 * MiB)  /* of the file mapped at once */
+#define FILE_TRANSFER_IO_READS  2       /* blocks a sender reads ahead through the aio engine */
+#define FILE_TRANSFER_IO_WRITES 8       /* blocks a receiver writes behind, more are written in the callback */
+
 #define MAX_STR_SIZE TOX_MAX_MESSAGE_LENGTH    /* must be >= TOX_MAX_MESSAGE_LENGTH */
 
 /*******************************************************************************
@@ -55,6 +64,8 @@ typedef enum FILE_TRANSFER_DIRECTION {
     FILE_TRANSFER_RECV
 } FILE_TRANSFER_DIRECTION;
 
+struct FileTransferIO;
+
 struct FileTransfer {
     FILE *file;
     FILE_TRANSFER_STATE state;
@@ -70,6 +81,71 @@ struct FileTransfer {
     time_t   last_line_progress;   /* The last time we updated the progress bar */
     uint32_t line_id;
     uint8_t  file_id[TOX_FILE_ID_LENGTH];
+
+    uint8_t *block;                /* senders: the file's bytes from block_pos on, allocated with the first chunk */
+    uint64_t block_pos;
+    size_t   block_len;
+    uint8_t *map;                  /* senders of big files: the window of the file mapped at map_pos */
+    uint64_t map_pos;
+    size_t   map_len;
+    bool     map_off;              /* not mapped, or it shrank under the mapping: read into block */
+    struct FileTransferIO *io;     /* blocks read ahead or written behind by the aio engine */
+    bool     io_off;               /* the engine does not take this transfer */
+
+    /* A followed file is sent as a stream of unknown size: chunks are held back until
+     * the file has grown by a whole one, the receiver ends the transfer. */
+    bool     follow;
+    int      follow_wd;            /* inotify watch of the file */
+    uint64_t follow_base;          /* offset in the file of position 0 */
+    uint64_t follow_requested;     /* end of the chunks tox asked for, they start at position */
+    size_t   follow_chunk;         /* length of each chunk, a shorter one would end the stream */
+};
+
+/* A message that arrived while its friend's previous command was still running. */
+struct SessionMsg {
+    struct SessionMsg *next;
+    size_t  length;
+    uint8_t data[];
+};
+
+/* What one friend is browsing: its own working dir, `ls` snapshot and page cursor,
+ * so friends using the file commands at the same time never see each other's state.
+ * The working dir is opened on first use, cwd.fd is -1 until then. An archive in it
+ * can be browsed like a folder; cwd stays on the folder holding the archive meanwhile.
+ *
+ * File commands run on worker threads against a copy of the session. While one is
+ * busy, later messages of the same friend wait in pending so replies keep their order.
+ */
+struct Session {
+    struct WorkDir cwd;
+    char    *arcpath;            /* inside an archive: cwd.path/<archive>[/<folder in it>], else NULL */
+    size_t   arclen;             /* length of the archive's own path in arcpath */
+    struct DirSnapshot *snap;    /* pinned by ls/find/du for next/down/delf */
+    char    *snapdir;            /* cwd.path snap was taken in */
+    DIR_SORT sort;
+    int      maxelecount;
+    int      curelecount;
+    time_t   last_used;          /* of snap, for DIR_SNAPSHOT_TTL */
+
+    bool     busy;
+    struct SessionMsg *pending;
+    struct SessionMsg **pending_tail;
+    int      npending;
+};
+
+/* A file waiting in a friend's download queue. */
+struct DownItem {
+    char    *path;
+    uint64_t size;
+};
+
+/* Files a multi-file `down` picked, started a few at a time as the friend's transfers free up. */
+struct DownQueue {
+    struct DownItem *items;
+    size_t   count;
+    size_t   next;               /* first one not started yet */
+    size_t   started;
+    size_t   failed;
 };
 
 struct Friend {
@@ -82,6 +158,8 @@ struct Friend {
     struct ChatHist *hist;
     struct FileTransfer file_receiver[MAX_FILES];
     struct FileTransfer file_sender[MAX_FILES];
+    struct Session session;
+    struct DownQueue downq;
     struct Friend *next;
 };
 
@@ -102,6 +180,43 @@ struct FileTransfer *get_file_transfer_struct_index(struct Friend *f, uint32_t i
 struct FileTransfer *new_file_transfer(struct Friend *f, uint32_t friendnumber, uint32_t filenumber,
                                        FILE_TRANSFER_DIRECTION direction, uint8_t type);
 
+/* Returns a pointer to the length bytes of the file of sender ft at position, valid until the next call.
+ * Files of FILE_TRANSFER_MAP_MIN bytes or more are mapped a window at a time and the pointer
+ * points into the mapping. Others are served from a block read ahead, refilled with one
+ * FILE_TRANSFER_BLOCK read when a chunk falls outside it. Either way consecutive chunks cost
+ * neither a syscall nor an allocation each. A file that shrank under its mapping is read
+ * into the block from then on.
+ * Returns NULL on failure or if the file ends before position + length.
+ */
+const uint8_t *file_transfer_read(struct FileTransfer *ft, uint64_t position, size_t length);
+
+/* Call once the bytes file_transfer_read returned are used.
+ * Returns false if they were lost meanwhile, the file having shrunk under its mapping: they read as zeros.
+ */
+bool file_transfer_read_ok(struct FileTransfer *ft);
+
+/* With the aio engine started, answers the chunk request of sender ft from blocks read ahead
+ * of the requests: a chunk whose block is still being read is held, and sent by aio_poll()
+ * or file_transfer_io_poll() once it is in.
+ *
+ * Returns 1 if the engine took the request.
+ * Returns 0 if it does not take this transfer, e.g. a stream with no fd: use file_transfer_read.
+ * Returns -1 on failure.
+ */
+int file_transfer_io_send(Tox *m, struct FileTransfer *ft, uint64_t position, size_t length);
+
+/* With the aio engine started, copies the chunk receiver ft got into a block, written once
+ * full while the next ones arrive. The file's own FILE is left alone.
+ *
+ * Returns 1 if the engine took the chunk.
+ * Returns 0 if it does not take this transfer: write it yourself.
+ * Returns -1 on failure.
+ */
+int file_transfer_io_recv(Tox *m, struct FileTransfer *ft, uint64_t position, const uint8_t *data, size_t length);
+
+/* Sends the held chunks tox had no room for before. */
+void file_transfer_io_poll(void);
+
 /* Closes file transfer ft.
  *
  * Set CTRL to -1 if we don't want to send a control signal.
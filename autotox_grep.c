@@ -0,0 +1,424 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "autotox_grep.h"
+
+struct GrepHit {
+    uint32_t line;
+    char     text[GREP_LINE_MAX + 1];
+};
+
+struct GrepFile {
+    struct GrepHit *hits;
+    size_t   nhits;
+    size_t   cap;
+    size_t   found;           /* hits, including those past GREP_MAX_HITS */
+    int8_t   status;          /* 0 not scanned, 1 scanned, -1 skipped */
+};
+
+struct GrepJob {
+    int      dirfd;
+    const struct DirListing *files;
+    const struct GrepPattern *p;
+    struct GrepFile *out;
+    atomic_size_t next;
+    atomic_uint_fast64_t bytes;     /* budget taken so far */
+    atomic_size_t kept;
+    atomic_bool budget_hit;
+};
+
+/*******************************************************************************
+ *
+ * Matching
+ *
+ ******************************************************************************/
+
+/* Returns the first occurrence of needle, k > 1 bytes, in s. Compares the first and last
+ * byte of needle against 16 positions at a time and only checks the rest where both
+ * agree, which skips text far faster than a byte loop.
+ */
+static const char *find_substr(const char *s, size_t n, const char *needle, size_t k)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[k - 1]);
+
+    for (; i + k - 1 + 16 <= n; i += 16) {
+        __m128i bf = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i bl = _mm_loadu_si128((const __m128i *)(s + i + k - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(last, bl)));
+
+        while (mask) {
+            unsigned bit = __builtin_ctz(mask);
+
+            if (memcmp(s + i + bit + 1, needle + 1, k - 2) == 0) {
+                return s + i + bit;
+            }
+
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    return (i < n) ? memmem(s + i, n - i, needle, k) : NULL;
+}
+
+/* Returns the number of '\n' in the n bytes at s, 16 at a time: a hit deep into a log
+ * needs the newlines before it counted, and one memchr() per line costs more than the search.
+ */
+static size_t count_lines(const char *s, size_t n)
+{
+    size_t count = 0, i = 0;
+
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(b, nl)));
+    }
+#endif
+
+    for (; i < n; ++i) {
+        count += (s[i] == '\n');
+    }
+
+    return count;
+}
+
+/* Returns the offset of the next match at or after pos, -1 if there is none */
+static ssize_t next_match(const struct GrepPattern *p, const char *base, size_t pos, size_t len)
+{
+    if (p->regex) {
+        regmatch_t m = { .rm_so = pos, .rm_eo = len };
+
+        /* REG_STARTEND: the mapping is not '\0' terminated */
+        if (regexec(&p->re, base, 1, &m, REG_STARTEND) != 0) {
+            return -1;
+        }
+
+        return m.rm_so;
+    }
+
+    const char *hit = (p->len == 1) ? memchr(base + pos, p->needle[0], len - pos)
+                      : find_substr(base + pos, len - pos, p->needle, p->len);
+
+    return hit ? hit - base : -1;
+}
+
+int grep_compile(struct GrepPattern *p, const char *pattern, bool regex)
+{
+    memset(p, 0, sizeof(*p));
+    p->regex = regex;
+
+    if (regex) {
+        return (regcomp(&p->re, pattern, REG_EXTENDED | REG_NEWLINE) == 0) ? 0 : -1;
+    }
+
+    p->len = strlen(pattern);
+    p->needle = strdup(pattern);
+
+    return (p->needle && p->len > 0) ? 0 : -1;
+}
+
+void grep_free(struct GrepPattern *p)
+{
+    if (p->regex) {
+        regfree(&p->re);
+    }
+
+    free(p->needle);
+    p->needle = NULL;
+}
+
+/*******************************************************************************
+ *
+ * Scanning
+ *
+ ******************************************************************************/
+
+/* A file shrinking under a mapping turns reads past its new end into SIGBUS.
+ * The scanning thread arms bus_jump so the fault only costs that one file. Faults on
+ * other threads, e.g. in a transfer's mapping, go to the handler that was there before.
+ */
+static __thread sigjmp_buf *bus_jump;
+static pthread_once_t bus_once = PTHREAD_ONCE_INIT;
+static struct sigaction bus_prev;
+
+static void on_sigbus(int sig, siginfo_t *si, void *ctx)
+{
+    if (bus_jump) {
+        siglongjmp(*bus_jump, 1);
+    }
+
+    if (bus_prev.sa_flags & SA_SIGINFO) {
+        bus_prev.sa_sigaction(sig, si, ctx);
+    } else if (bus_prev.sa_handler != SIG_DFL && bus_prev.sa_handler != SIG_IGN) {
+        bus_prev.sa_handler(sig);
+    } else {
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+}
+
+static void install_sigbus(void)
+{
+    struct sigaction sa = {
+        .sa_sigaction = on_sigbus,
+        .sa_flags = SA_SIGINFO,
+    };
+
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, &bus_prev);
+}
+
+static bool add_hit(struct GrepJob *g, struct GrepFile *f, uint32_t line, const char *text, size_t len)
+{
+    ++f->found;
+
+    if (f->nhits >= GREP_MAX_HITS) {
+        return true;
+    }
+
+    if (f->nhits == f->cap) {
+        size_t cap = f->cap ? f->cap * 2 : 8;
+        struct GrepHit *h = realloc(f->hits, cap * sizeof(*h));
+
+        if (h == NULL) {
+            return false;
+        }
+
+        f->hits = h;
+        f->cap = cap;
+    }
+
+    struct GrepHit *h = &f->hits[f->nhits++];
+    h->line = line;
+
+    if (len > 0 && text[len - 1] == '\r') {
+        --len;
+    }
+
+    if (len > GREP_LINE_MAX) {
+        len = GREP_LINE_MAX;
+    }
+
+    /* terminated first: a fault while copying from the mapping leaves it cut short, not open */
+    h->text[len] = '\0';
+
+    /* the text goes out in a chat message */
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = text[i];
+        h->text[i] = (c == '\t') ? ' ' : (c < 0x20 || c == 0x7f) ? '?' : c;
+    }
+
+    atomic_fetch_add(&g->kept, 1);
+
+    return true;
+}
+
+/* Scans the mapped bytes for matching lines, one hit per line */
+static void scan_map(struct GrepJob *g, struct GrepFile *f, const char *map, size_t len)
+{
+    size_t pos = 0;
+    size_t counted = 0;       /* newlines are counted up to here */
+    uint32_t line = 1;
+    ssize_t m;
+
+    while (pos < len && (m = next_match(g->p, map, pos, len)) != -1) {
+        const char *nl = memrchr(map + counted, '\n', m - counted);
+
+        if (nl) {
+            line += count_lines(map + counted, nl - map - counted + 1);
+            counted = nl - map + 1;
+        }
+
+        const char *end = memchr(map + m, '\n', len - m);
+        size_t eol = end ? (size_t)(end - map) : len;
+
+        if (!add_hit(g, f, line, map + counted, eol - counted)) {
+            break;
+        }
+
+        pos = counted = eol + 1;
+        ++line;
+    }
+}
+
+static void scan_file(struct GrepJob *g, size_t i)
+{
+    const struct DirEntry *e = &g->files->entries[i];
+    struct GrepFile *f = &g->out[i];
+    struct stat st;
+
+    f->status = -1;
+
+    int fd = openat(g->dirfd, e->name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+    if (fd == -1) {
+        return;
+    }
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return;
+    }
+
+    uint64_t size = st.st_size;
+    uint64_t used = atomic_fetch_add(&g->bytes, size);
+
+    if (used >= GREP_IO_BUDGET) {
+        atomic_store(&g->budget_hit, true);
+        close(fd);
+        f->status = 0;
+        return;
+    }
+
+    /* the last file within budget is scanned only as far as the budget goes */
+    if (used + size > GREP_IO_BUDGET) {
+        size = GREP_IO_BUDGET - used;
+        atomic_store(&g->budget_hit, true);
+    }
+
+    if (size == 0) {
+        close(fd);
+        f->status = 1;
+        return;
+    }
+
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    sigjmp_buf jump;
+
+    if (sigsetjmp(jump, 1) == 0) {
+        bus_jump = &jump;
+
+        if (memchr(map, '\0', size < GREP_BINARY_PEEK ? size : GREP_BINARY_PEEK) == NULL) {
+            scan_map(g, f, map, size);
+            f->status = 1;
+        }
+    }
+
+    bus_jump = NULL;
+    munmap(map, size);
+}
+
+static void *grep_thread(void *arg)
+{
+    struct GrepJob *g = arg;
+    size_t i;
+
+    while ((i = atomic_fetch_add(&g->next, 1)) < g->files->count) {
+        /* files are handed out in order, so once enough hits are kept the rest would be dropped anyway */
+        if (atomic_load(&g->kept) >= GREP_MAX_HITS || atomic_load(&g->budget_hit)) {
+            continue;
+        }
+
+        scan_file(g, i);
+    }
+
+    return NULL;
+}
+
+int grep_files(const char *dir, const struct DirListing *files, const struct GrepPattern *p,
+               struct DirListing *hits, struct GrepResult *res)
+{
+    struct GrepJob g = {
+        .files = files,
+        .p = p,
+    };
+    pthread_t threads[GREP_MAX_THREADS - 1];
+    size_t nthreads = 0;
+    int ret = 0;
+
+    memset(res, 0, sizeof(*res));
+    pthread_once(&bus_once, install_sigbus);
+
+    if ((g.dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        return -1;
+    }
+
+    if ((g.out = calloc(files->count + 1, sizeof(*g.out))) == NULL) {
+        close(g.dirfd);
+        return -1;
+    }
+
+    /* the calling thread scans too */
+    while (nthreads + 1 < GREP_MAX_THREADS && nthreads + 1 < files->count
+            && pthread_create(&threads[nthreads], NULL, grep_thread, &g) == 0) {
+        ++nthreads;
+    }
+
+    grep_thread(&g);
+
+    for (size_t i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    size_t kept = 0;
+
+    for (size_t i = 0; i < files->count; ++i) {
+        const struct DirEntry *e = &files->entries[i];
+        struct GrepFile *f = &g.out[i];
+
+        res->files += (f->status != 0);
+        res->skipped += (f->status < 0);
+        res->matched += (f->found > 0);
+        res->hits += f->found;
+
+        for (size_t k = 0; k < f->nhits && kept < GREP_MAX_HITS && ret == 0; ++k, ++kept) {
+            char note[GREP_LINE_MAX + 16];
+            int len = snprintf(note, sizeof(note), "%u: %s", f->hits[k].line, f->hits[k].text);
+            struct DirEntry *h = dir_listing_push_note(hits, e->name, strlen(e->name), note, len);
+
+            if (h == NULL) {
+                ret = -1;
+                break;
+            }
+
+            h->type = e->type;
+            h->size = e->size;
+            h->mtime = e->mtime;
+            h->ino = e->ino;
+        }
+
+        free(f->hits);
+    }
+
+    uint64_t bytes = atomic_load(&g.bytes);
+    res->bytes = bytes < GREP_IO_BUDGET ? bytes : GREP_IO_BUDGET;
+    res->budget_hit = atomic_load(&g.budget_hit);
+
+    free(g.out);
+    close(g.dirfd);
+    dir_listing_seal(hits);
+
+    return ret;
+}
@@ -0,0 +1,55 @@
+#ifndef AUTOTOX_GREP_H
+#define AUTOTOX_GREP_H
+
+#include <regex.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "autotox_dir.h"
+
+#define GREP_MAX_THREADS 4
+#define GREP_MAX_HITS    1000                      /* hits kept for paging */
+#define GREP_MAX_FILES   100000
+#define GREP_IO_BUDGET   (512ULL * 1024 * 1024)    /* bytes scanned by one grep */
+#define GREP_LINE_MAX    96                        /* chars of a matching line shown */
+#define GREP_BINARY_PEEK 8192                      /* a NUL in there makes a file binary */
+
+struct GrepPattern {
+    bool    regex;
+    regex_t re;
+    char   *needle;
+    size_t  len;
+};
+
+struct GrepResult {
+    size_t   files;          /* scanned */
+    size_t   matched;        /* files with hits */
+    size_t   skipped;        /* binary, unreadable or shrunk under us */
+    size_t   hits;           /* found, may exceed the GREP_MAX_HITS kept */
+    uint64_t bytes;          /* scanned */
+    bool     budget_hit;     /* stopped at GREP_IO_BUDGET */
+};
+
+/* Prepares pattern: a POSIX extended regex if regex is set, a plain substring otherwise.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the regex does not compile or out of memory.
+ */
+int grep_compile(struct GrepPattern *p, const char *pattern, bool regex);
+
+void grep_free(struct GrepPattern *p);
+
+/* Scans files, a listing of paths relative to dir, for lines matching p on up to
+ * GREP_MAX_THREADS threads, each file mapped rather than read. Binary files are skipped.
+ * Every hit is appended to hits as an entry named after its file, with its line number
+ * and text as note, files in listing order and lines in file order. Stops once
+ * GREP_IO_BUDGET bytes were scanned.
+ *
+ * Returns 0 on success.
+ * Returns -1 if dir can not be opened or out of memory.
+ */
+int grep_files(const char *dir, const struct DirListing *files, const struct GrepPattern *p,
+               struct DirListing *hits, struct GrepResult *res);
+
+#endif /* AUTOTOX_GREP_H */
@@ -0,0 +1,1343 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "autotox_index.h"
+
+#define NODE_NONE UINT32_MAX
+
+#define INDEX_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB \
+                          | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+/* Renames are reported as a MOVED_FROM/MOVED_TO pair sharing a cookie. Sources are
+ * held this many at a time until their destination shows up in the same read.
+ */
+#define MAX_PENDING_MOVES 64
+
+/* Disk usage is kept per directory as the sum over everything below it and updated
+ * along the parent chain on every change. An inode reachable through several names
+ * (hard links, or a directory bind mounted inside the tree) is counted at one of them
+ * only, found through a (dev, ino) table. Files with a single link go in the table
+ * too: linking them later only reports the new name, not a change to the old one.
+ */
+struct IndexNode {
+    char    *name;        /* NULL for a free slot */
+    uint32_t parent;
+    uint32_t hnext;       /* next node in the same hash bucket, or next free slot */
+    uint32_t inext;       /* next node in the same inode bucket */
+    uint32_t nchildren;
+    int32_t  wd;          /* directories only, -1 if not watched */
+    uint8_t  type;
+    bool     queued;      /* directory was handed to the crawler */
+    bool     unwatched;   /* directory was crawled but inotify refused a watch */
+    bool     linked;      /* in the inode table: every file, and directories once crawled */
+    bool     counted;     /* adds to the usage of its ancestors (directories: was crawled) */
+    uint64_t size;
+    time_t   mtime;
+    ino_t    ino;
+    dev_t    dev;
+    uint64_t total;       /* directories only: bytes of the counted entries below */
+    uint32_t nfiles;      /* directories only: counted non directory entries below */
+};
+
+struct CrawlItem {
+    uint32_t node;
+    uint32_t epoch;
+    char    *path;
+    struct CrawlItem *next;
+};
+
+struct PendingMove {
+    uint32_t cookie;
+    uint32_t node;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  work;
+    bool     started;
+    char    *root;
+    int      ifd;
+    uint32_t epoch;       /* bumped by every rebuild, crawl results of older epochs are dropped */
+
+    struct IndexNode *nodes;
+    uint32_t nslots;
+    uint32_t cap;
+    uint32_t free_head;
+
+    uint32_t *buckets;
+    uint32_t *ibuckets;   /* (dev, ino) table, same size */
+    uint32_t nbuckets;    /* power of 2 */
+    uint32_t root_node;
+
+    uint32_t *wd_node;
+    size_t    wd_cap;
+
+    struct CrawlItem *queue_head;
+    struct CrawlItem *queue_tail;
+    size_t   pending;     /* queued plus being crawled */
+
+    size_t   files;
+    size_t   dirs;
+    size_t   unwatched;
+    size_t   name_bytes;
+    uint64_t events;
+    uint64_t rebuilds;
+    struct timespec crawl_start;
+    double   crawl_secs;
+} idx = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .ifd = -1,
+    .free_head = NODE_NONE,
+    .root_node = NODE_NONE,
+};
+
+/*******************************************************************************
+ *
+ * Nodes
+ *
+ ******************************************************************************/
+
+static uint32_t hash_key(uint32_t parent, const char *name)
+{
+    uint32_t h = 2166136261u ^ (parent * 0x9E3779B1u);
+
+    for (; *name; ++name) {
+        h ^= (uint8_t) * name;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static void hash_insert(uint32_t id)
+{
+    uint32_t b = hash_key(idx.nodes[id].parent, idx.nodes[id].name) & (idx.nbuckets - 1);
+    idx.nodes[id].hnext = idx.buckets[b];
+    idx.buckets[b] = id;
+}
+
+static void hash_remove(uint32_t id)
+{
+    uint32_t *p = &idx.buckets[hash_key(idx.nodes[id].parent, idx.nodes[id].name) & (idx.nbuckets - 1)];
+
+    for (; *p != NODE_NONE; p = &idx.nodes[*p].hnext) {
+        if (*p == id) {
+            *p = idx.nodes[id].hnext;
+            return;
+        }
+    }
+}
+
+static uint32_t hash_find(uint32_t parent, const char *name)
+{
+    uint32_t id = idx.buckets[hash_key(parent, name) & (idx.nbuckets - 1)];
+
+    for (; id != NODE_NONE; id = idx.nodes[id].hnext) {
+        if (idx.nodes[id].parent == parent && strcmp(idx.nodes[id].name, name) == 0) {
+            return id;
+        }
+    }
+
+    return NODE_NONE;
+}
+
+static uint32_t inode_hash(dev_t dev, ino_t ino)
+{
+    uint64_t h = ((uint64_t) ino ^ ((uint64_t) dev << 32)) * 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(h >> 32);
+}
+
+static void inode_insert(uint32_t id)
+{
+    uint32_t b = inode_hash(idx.nodes[id].dev, idx.nodes[id].ino) & (idx.nbuckets - 1);
+    idx.nodes[id].inext = idx.ibuckets[b];
+    idx.ibuckets[b] = id;
+}
+
+static void inode_remove(uint32_t id)
+{
+    uint32_t *p = &idx.ibuckets[inode_hash(idx.nodes[id].dev, idx.nodes[id].ino) & (idx.nbuckets - 1)];
+
+    for (; *p != NODE_NONE; p = &idx.nodes[*p].inext) {
+        if (*p == id) {
+            *p = idx.nodes[id].inext;
+            return;
+        }
+    }
+}
+
+/* Returns a node in the inode table other than id for (dev, ino), the counted one if
+ * counted is set, NODE_NONE if there is none.
+ */
+static uint32_t inode_find(dev_t dev, ino_t ino, uint32_t id, bool counted)
+{
+    uint32_t i = idx.ibuckets[inode_hash(dev, ino) & (idx.nbuckets - 1)];
+
+    for (; i != NODE_NONE; i = idx.nodes[i].inext) {
+        if (i != id && idx.nodes[i].ino == ino && idx.nodes[i].dev == dev && (!counted || idx.nodes[i].counted)) {
+            return i;
+        }
+    }
+
+    return NODE_NONE;
+}
+
+static int hash_grow(void)
+{
+    uint32_t n = idx.nbuckets ? idx.nbuckets * 2 : 1024;
+    uint32_t *b = malloc(n * sizeof(uint32_t));
+    uint32_t *ib = malloc(n * sizeof(uint32_t));
+
+    if (b == NULL || ib == NULL) {
+        free(b);
+        free(ib);
+        return -1;
+    }
+
+    free(idx.buckets);
+    free(idx.ibuckets);
+    idx.buckets = b;
+    idx.ibuckets = ib;
+    idx.nbuckets = n;
+
+    for (uint32_t i = 0; i < n; ++i) {
+        idx.buckets[i] = NODE_NONE;
+        idx.ibuckets[i] = NODE_NONE;
+    }
+
+    for (uint32_t id = 0; id < idx.nslots; ++id) {
+        if (idx.nodes[id].name) {
+            hash_insert(id);
+
+            if (idx.nodes[id].linked) {
+                inode_insert(id);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static uint32_t node_alloc(void)
+{
+    if (idx.files + idx.dirs + 1 > idx.nbuckets && hash_grow() == -1) {
+        return NODE_NONE;
+    }
+
+    if (idx.free_head != NODE_NONE) {
+        uint32_t id = idx.free_head;
+        idx.free_head = idx.nodes[id].hnext;
+        return id;
+    }
+
+    if (idx.nslots == idx.cap) {
+        uint32_t cap = idx.cap ? idx.cap * 2 : 4096;
+        struct IndexNode *n = realloc(idx.nodes, cap * sizeof(struct IndexNode));
+
+        if (n == NULL) {
+            return NODE_NONE;
+        }
+
+        idx.nodes = n;
+        idx.cap = cap;
+    }
+
+    return idx.nslots++;
+}
+
+static void wd_set(int wd, uint32_t id)
+{
+    if (wd < 0) {
+        return;
+    }
+
+    if ((size_t) wd >= idx.wd_cap) {
+        size_t cap = idx.wd_cap ? idx.wd_cap : 1024;
+
+        while (cap <= (size_t) wd) {
+            cap *= 2;
+        }
+
+        uint32_t *w = realloc(idx.wd_node, cap * sizeof(uint32_t));
+
+        if (w == NULL) {
+            return;
+        }
+
+        for (size_t i = idx.wd_cap; i < cap; ++i) {
+            w[i] = NODE_NONE;
+        }
+
+        idx.wd_node = w;
+        idx.wd_cap = cap;
+    }
+
+    idx.wd_node[wd] = id;
+}
+
+static uint32_t wd_get(int wd)
+{
+    return (wd >= 0 && (size_t) wd < idx.wd_cap) ? idx.wd_node[wd] : NODE_NONE;
+}
+
+/* Adds a change of the entries below directory id to it and all its ancestors. */
+static void usage_add(uint32_t id, int64_t bytes, int32_t files)
+{
+    for (; id != NODE_NONE; id = idx.nodes[id].parent) {
+        idx.nodes[id].total += bytes;
+        idx.nodes[id].nfiles += files;
+    }
+}
+
+/* Returns what id adds to the usage of its parent. */
+static void node_usage(uint32_t id, int64_t *bytes, int32_t *files)
+{
+    const struct IndexNode *n = &idx.nodes[id];
+
+    if (n->type == DIR_ENTRY_DIR) {
+        *bytes = n->total;
+        *files = n->nfiles;
+    } else {
+        *bytes = n->counted ? n->size : 0;
+        *files = n->counted ? 1 : 0;
+    }
+}
+
+static void crawl_enqueue(uint32_t id, const char *path);
+static int node_full_path(uint32_t id, const char *name, char *buf, size_t size);
+
+/* Starts counting file id, unless it is a hard link to an inode counted elsewhere. */
+static void node_attach(uint32_t id, uint32_t nlink)
+{
+    struct IndexNode *n = &idx.nodes[id];
+
+    n->counted = nlink <= 1 || inode_find(n->dev, n->ino, id, true) == NODE_NONE;
+    n->linked = true;
+    inode_insert(id);
+
+    if (n->counted && n->type != DIR_ENTRY_DIR) {
+        usage_add(n->parent, n->size, 1);
+    }
+}
+
+/* Stops counting id. If it was the counted name of a shared inode, another name takes over:
+ * a file adds its size there, a directory alias gets crawled in its place.
+ */
+static void node_detach(uint32_t id)
+{
+    struct IndexNode *n = &idx.nodes[id];
+
+    if (n->counted && n->type != DIR_ENTRY_DIR) {
+        usage_add(n->parent, -(int64_t) n->size, -1);
+    }
+
+    if (n->linked) {
+        inode_remove(id);
+        n->linked = false;
+
+        uint32_t heir = n->counted ? inode_find(n->dev, n->ino, id, false) : NODE_NONE;
+
+        if (heir != NODE_NONE) {
+            struct IndexNode *h = &idx.nodes[heir];
+            char path[PATH_MAX];
+
+            h->counted = true;
+
+            if (h->type != DIR_ENTRY_DIR) {
+                usage_add(h->parent, h->size, 1);
+            } else if (node_full_path(heir, NULL, path, sizeof(path)) != -1) {
+                crawl_enqueue(heir, path);
+            }
+        }
+    }
+
+    n->counted = false;
+}
+
+/* Registers crawled directory id under its (dev, ino).
+ * Returns false if the same directory is already indexed under another name,
+ * i.e. a bind mount that would otherwise be counted twice or loop forever.
+ */
+static bool node_claim_dir(uint32_t id)
+{
+    struct IndexNode *n = &idx.nodes[id];
+
+    if (!n->linked) {
+        n->counted = inode_find(n->dev, n->ino, id, true) == NODE_NONE;
+        n->linked = true;
+        inode_insert(id);
+    }
+
+    return n->counted;
+}
+
+static void node_free(uint32_t id)
+{
+    struct IndexNode *n = &idx.nodes[id];
+
+    node_detach(id);
+
+    if (n->type == DIR_ENTRY_DIR) {
+        if (n->wd >= 0) {
+            inotify_rm_watch(idx.ifd, n->wd);
+            wd_set(n->wd, NODE_NONE);
+        }
+
+        if (n->unwatched) {
+            --idx.unwatched;
+        }
+
+        --idx.dirs;
+    } else {
+        --idx.files;
+    }
+
+    if (n->parent != NODE_NONE) {
+        --idx.nodes[n->parent].nchildren;
+    }
+
+    hash_remove(id);
+    idx.name_bytes -= strlen(n->name) + 1;
+    free(n->name);
+    n->name = NULL;
+    n->hnext = idx.free_head;
+    idx.free_head = id;
+}
+
+static bool node_is_below(uint32_t id, uint32_t ancestor)
+{
+    for (id = idx.nodes[id].parent; id != NODE_NONE; id = idx.nodes[id].parent) {
+        if (id == ancestor) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Removes id and, for a directory that still has entries, everything below it. */
+static void node_remove(uint32_t id)
+{
+    if (idx.nodes[id].nchildren > 0) {
+        /* a whole tree moved away or vanished behind our back, rare enough for a scan */
+        uint32_t *victims = malloc(idx.nslots * sizeof(uint32_t));
+        uint32_t nvictims = 0;
+
+        if (victims) {
+            for (uint32_t i = 0; i < idx.nslots; ++i) {
+                if (idx.nodes[i].name && node_is_below(i, id)) {
+                    victims[nvictims++] = i;
+                }
+            }
+
+            /* parents stay intact while freeing: the hash key needs them */
+            for (uint32_t i = 0; i < nvictims; ++i) {
+                node_free(victims[i]);
+            }
+
+            free(victims);
+        }
+
+        idx.nodes[id].nchildren = 0;
+    }
+
+    node_free(id);
+}
+
+/* Inserts or refreshes the entry name of directory parent.
+ * Returns the node id, NODE_NONE if out of memory.
+ */
+static uint32_t node_upsert(uint32_t parent, const char *name, const struct DirEntry *meta)
+{
+    uint32_t id = hash_find(parent, name);
+
+    if (id != NODE_NONE && idx.nodes[id].type != meta->type) {
+        node_remove(id);
+        id = NODE_NONE;
+    }
+
+    if (id == NODE_NONE) {
+        if ((id = node_alloc()) == NODE_NONE) {
+            return NODE_NONE;
+        }
+
+        struct IndexNode *n = &idx.nodes[id];
+        *n = (struct IndexNode) {
+            0
+        };
+
+        if ((n->name = strdup(name)) == NULL) {
+            n->hnext = idx.free_head;
+            idx.free_head = id;
+            return NODE_NONE;
+        }
+
+        n->parent = parent;
+        n->wd = -1;
+        n->type = meta->type;
+        n->dev = (parent != NODE_NONE) ? idx.nodes[parent].dev : 0;
+        idx.name_bytes += strlen(name) + 1;
+        hash_insert(id);
+
+        if (parent != NODE_NONE) {
+            ++idx.nodes[parent].nchildren;
+        }
+
+        if (n->type == DIR_ENTRY_DIR) {
+            ++idx.dirs;
+        } else {
+            ++idx.files;
+        }
+    }
+
+    struct IndexNode *n = &idx.nodes[id];
+
+    if (n->type == DIR_ENTRY_DIR) {
+        n->size = meta->size;
+        n->mtime = meta->mtime;
+        n->ino = meta->ino;
+        return id;
+    }
+
+    node_detach(id);
+    n->size = meta->size;
+    n->mtime = meta->mtime;
+    n->ino = meta->ino;
+    node_attach(id, meta->nlink);
+
+    return id;
+}
+
+/* Writes the path of id relative to the root into buf.
+ * Returns its length, or -1 if it does not fit.
+ */
+static int node_path(uint32_t id, char *buf, size_t size)
+{
+    size_t pos = size - 1;
+    buf[pos] = '\0';
+
+    for (; id != NODE_NONE && idx.nodes[id].parent != NODE_NONE; id = idx.nodes[id].parent) {
+        if (idx.nodes[id].name == NULL) {
+            return -1;
+        }
+
+        size_t len = strlen(idx.nodes[id].name);
+
+        if (len + 1 > pos) {
+            return -1;
+        }
+
+        pos -= len;
+        memcpy(buf + pos, idx.nodes[id].name, len);
+
+        if (idx.nodes[idx.nodes[id].parent].parent != NODE_NONE) {
+            buf[--pos] = '/';
+        }
+    }
+
+    memmove(buf, buf + pos, size - pos);
+
+    return size - 1 - pos;
+}
+
+/* Writes the absolute path of entry name in directory id into buf. */
+static int node_full_path(uint32_t id, const char *name, char *buf, size_t size)
+{
+    char rel[PATH_MAX];
+
+    if (node_path(id, rel, sizeof(rel)) == -1) {
+        return -1;
+    }
+
+    int n = snprintf(buf, size, "%s%s%s%s%s", idx.root, rel[0] ? "/" : "", rel, name ? "/" : "", name ? name : "");
+
+    return (n < 0 || (size_t) n >= size) ? -1 : n;
+}
+
+/*******************************************************************************
+ *
+ * Crawler
+ *
+ ******************************************************************************/
+
+static void crawl_enqueue(uint32_t id, const char *path)
+{
+    struct CrawlItem *item = malloc(sizeof(struct CrawlItem));
+
+    if (item == NULL || (item->path = strdup(path)) == NULL) {
+        free(item);
+        return;
+    }
+
+    item->node = id;
+    item->epoch = idx.epoch;
+    item->next = NULL;
+
+    if (idx.queue_tail) {
+        idx.queue_tail->next = item;
+    } else {
+        idx.queue_head = item;
+    }
+
+    idx.queue_tail = item;
+    idx.nodes[id].queued = true;
+
+    if (idx.pending++ == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &idx.crawl_start);
+    }
+
+    pthread_cond_signal(&idx.work);
+}
+
+static void crawl_done(void)
+{
+    if (--idx.pending == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        idx.crawl_secs = (now.tv_sec - idx.crawl_start.tv_sec) + (now.tv_nsec - idx.crawl_start.tv_nsec) / 1e9;
+    }
+}
+
+/* Adds the entries of one directory, queueing its subdirectories. Called with the lock held. */
+static void crawl_merge(uint32_t id, int wd, const char *path, const struct DirListing *listing)
+{
+    idx.nodes[id].wd = wd;
+
+    if (wd >= 0) {
+        wd_set(wd, id);
+    } else if (!idx.nodes[id].unwatched) {
+        idx.nodes[id].unwatched = true;
+        ++idx.unwatched;
+    }
+
+    size_t pathlen = strlen(path);
+
+    for (size_t i = 0; i < listing->count; ++i) {
+        const struct DirEntry *e = &listing->entries[i];
+
+        if (e->type == DIR_ENTRY_OTHER && e->ino == 0) {
+            continue;
+        }
+
+        uint32_t child = node_upsert(id, e->name, e);
+
+        if (child == NODE_NONE || e->type != DIR_ENTRY_DIR || idx.nodes[child].queued) {
+            continue;
+        }
+
+        size_t len = pathlen + strlen(e->name) + 2;
+        char childpath[len];
+        snprintf(childpath, len, "%s/%s", path, e->name);
+        crawl_enqueue(child, childpath);
+    }
+}
+
+static void *crawler_thread(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&idx.lock);
+
+    for (;;) {
+        while (idx.queue_head == NULL) {
+            pthread_cond_wait(&idx.work, &idx.lock);
+        }
+
+        struct CrawlItem *item = idx.queue_head;
+        idx.queue_head = item->next;
+
+        if (idx.queue_head == NULL) {
+            idx.queue_tail = NULL;
+        }
+
+        int ifd = idx.ifd;
+        uint32_t epoch = idx.epoch;
+        pthread_mutex_unlock(&idx.lock);
+
+        /* the disk work happens unlocked; the directory is watched before it is read
+         * so nothing created meanwhile can be missed
+         */
+        struct DirListing listing = {
+            0
+        };
+        struct stat st;
+        int wd = -1;
+        int fd = open(item->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        bool ok = false;
+
+        if (fd != -1) {
+            wd = inotify_add_watch(ifd, item->path, INDEX_WATCH_MASK);
+            ok = fstat(fd, &st) == 0 && dir_enumerate_fd(fd, &listing) == 0;
+            close(fd);
+        }
+
+        pthread_mutex_lock(&idx.lock);
+
+        /* a rebuild closed ifd meanwhile, and its number likely went to the new instance: drop
+         * the watch added there, unless the new crawl owns that wd already */
+        if (epoch != idx.epoch && wd >= 0 && ifd == idx.ifd && wd_get(wd) == NODE_NONE) {
+            inotify_rm_watch(idx.ifd, wd);
+        }
+
+        struct IndexNode *n = &idx.nodes[item->node];
+
+        if (ok && item->epoch == idx.epoch && item->node < idx.nslots && n->name && n->ino == st.st_ino) {
+            n->dev = st.st_dev;
+
+            /* an alias shares the watch descriptor of the directory it aliases, leave it alone */
+            if (node_claim_dir(item->node)) {
+                crawl_merge(item->node, wd, item->path, &listing);
+            }
+        }
+
+        crawl_done();
+        dir_listing_free(&listing);
+        free(item->path);
+        free(item);
+    }
+
+    return NULL;
+}
+
+/* Throws the index away and crawls the whole tree again. Called with the lock held. */
+static void index_rebuild(void)
+{
+    for (uint32_t id = 0; id < idx.nslots; ++id) {
+        free(idx.nodes[id].name);
+    }
+
+    /* closing the instance drops every watch at once */
+    if (idx.ifd != -1) {
+        close(idx.ifd);
+    }
+
+    idx.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    ++idx.epoch;
+    idx.nslots = 0;
+    idx.free_head = NODE_NONE;
+    idx.files = idx.dirs = idx.unwatched = idx.name_bytes = 0;
+
+    for (uint32_t i = 0; i < idx.nbuckets; ++i) {
+        idx.buckets[i] = NODE_NONE;
+        idx.ibuckets[i] = NODE_NONE;
+    }
+
+    for (size_t i = 0; i < idx.wd_cap; ++i) {
+        idx.wd_node[i] = NODE_NONE;
+    }
+
+    struct stat st;
+    struct DirEntry meta = {
+        .type = DIR_ENTRY_DIR
+    };
+
+    if (stat(idx.root, &st) == 0) {
+        meta.mtime = st.st_mtime;
+        meta.ino = st.st_ino;
+    }
+
+    idx.root_node = node_upsert(NODE_NONE, "", &meta);
+
+    if (idx.root_node != NODE_NONE) {
+        crawl_enqueue(idx.root_node, idx.root);
+    }
+}
+
+int file_index_start(const char *root, int nthreads)
+{
+    pthread_mutex_lock(&idx.lock);
+
+    if (idx.started) {
+        pthread_mutex_unlock(&idx.lock);
+        return 0;
+    }
+
+    idx.root = strdup(root);
+
+    if (idx.root == NULL || hash_grow() == -1) {
+        pthread_mutex_unlock(&idx.lock);
+        return -1;
+    }
+
+    index_rebuild();
+
+    if (idx.ifd == -1) {
+        pthread_mutex_unlock(&idx.lock);
+        return -1;
+    }
+
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+
+    if (nthreads > FILE_INDEX_MAX_THREADS) {
+        nthreads = FILE_INDEX_MAX_THREADS;
+    }
+
+    int started = 0;
+
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_t t;
+
+        if (pthread_create(&t, NULL, crawler_thread, NULL) == 0) {
+            pthread_detach(t);
+            ++started;
+        }
+    }
+
+    idx.started = started > 0;
+    pthread_mutex_unlock(&idx.lock);
+
+    return idx.started ? 0 : -1;
+}
+
+/*******************************************************************************
+ *
+ * Incremental maintenance
+ *
+ ******************************************************************************/
+
+/* Looks name up on disk and brings its node in directory dir up to date. Called with the lock held. */
+static void index_refresh(uint32_t dir, const char *name)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (node_full_path(dir, name, path, sizeof(path)) == -1) {
+        return;
+    }
+
+    if (lstat(path, &st) == -1) {
+        uint32_t id = hash_find(dir, name);
+
+        if (id != NODE_NONE) {
+            node_remove(id);
+        }
+
+        return;
+    }
+
+    struct DirEntry meta = {
+        .type = S_ISDIR(st.st_mode) ? DIR_ENTRY_DIR : S_ISREG(st.st_mode) ? DIR_ENTRY_FILE
+        : S_ISLNK(st.st_mode) ? DIR_ENTRY_LINK : DIR_ENTRY_OTHER,
+        .nlink = st.st_nlink,
+        .size = st.st_size,
+        .mtime = st.st_mtime,
+        .ino = st.st_ino,
+    };
+
+    uint32_t id = node_upsert(dir, name, &meta);
+
+    if (id != NODE_NONE && meta.type == DIR_ENTRY_DIR && !idx.nodes[id].queued) {
+        crawl_enqueue(id, path);
+    }
+}
+
+static void index_move(uint32_t id, uint32_t dir, const char *name)
+{
+    uint32_t old = hash_find(dir, name);
+
+    if (old != NODE_NONE && old != id) {
+        node_remove(old);
+    }
+
+    char *newname = strdup(name);
+
+    if (newname == NULL) {
+        node_remove(id);
+        return;
+    }
+
+    int64_t bytes;
+    int32_t files;
+    node_usage(id, &bytes, &files);
+    usage_add(idx.nodes[id].parent, -bytes, -files);
+    usage_add(dir, bytes, files);
+
+    struct IndexNode *n = &idx.nodes[id];
+    hash_remove(id);
+    --idx.nodes[n->parent].nchildren;
+    idx.name_bytes += strlen(newname) - strlen(n->name);
+    free(n->name);
+    n->name = newname;
+    n->parent = dir;
+    ++idx.nodes[dir].nchildren;
+    hash_insert(id);
+}
+
+void file_index_poll(void)
+{
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    /* a lookup running on a worker holds the lock, the events keep until next time */
+    if (pthread_mutex_trylock(&idx.lock) != 0) {
+        return;
+    }
+
+    if (!idx.started) {
+        pthread_mutex_unlock(&idx.lock);
+        return;
+    }
+
+    for (;;) {
+        ssize_t len = read(idx.ifd, buf, sizeof(buf));
+
+        if (len <= 0) {
+            break;
+        }
+
+        struct PendingMove moves[MAX_PENDING_MOVES];
+        size_t nmoves = 0;
+        bool overflow = false;
+
+        for (char *ptr = buf; ptr < buf + len && !overflow;) {
+            const struct inotify_event *ev = (const struct inotify_event *) ptr;
+            ptr += sizeof(struct inotify_event) + ev->len;
+            ++idx.events;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                overflow = true;
+                break;
+            }
+
+            uint32_t dir = wd_get(ev->wd);
+
+            if (dir == NODE_NONE || idx.nodes[dir].name == NULL) {
+                continue;
+            }
+
+            if (ev->mask & IN_IGNORED) {
+                wd_set(ev->wd, NODE_NONE);
+
+                if (idx.nodes[dir].wd == ev->wd) {
+                    idx.nodes[dir].wd = -1;
+                }
+
+                continue;
+            }
+
+            if (ev->len == 0) {
+                continue;
+            }
+
+            if (ev->mask & IN_DELETE) {
+                uint32_t id = hash_find(dir, ev->name);
+
+                if (id != NODE_NONE) {
+                    node_remove(id);
+                }
+            } else if (ev->mask & IN_MOVED_FROM) {
+                uint32_t id = hash_find(dir, ev->name);
+
+                if (id == NODE_NONE) {
+                    continue;
+                }
+
+                if (nmoves < MAX_PENDING_MOVES) {
+                    moves[nmoves++] = (struct PendingMove) {
+                        ev->cookie, id
+                    };
+                } else {
+                    node_remove(id);
+                }
+            } else {
+                if (ev->mask & IN_MOVED_TO) {
+                    for (size_t i = 0; i < nmoves; ++i) {
+                        if (moves[i].cookie == ev->cookie) {
+                            index_move(moves[i].node, dir, ev->name);
+                            moves[i] = moves[--nmoves];
+                            break;
+                        }
+                    }
+                }
+
+                index_refresh(dir, ev->name);
+            }
+        }
+
+        /* sources without a destination left the indexed tree */
+        for (size_t i = 0; i < nmoves && !overflow; ++i) {
+            if (idx.nodes[moves[i].node].name) {
+                node_remove(moves[i].node);
+            }
+        }
+
+        if (overflow) {
+            ++idx.rebuilds;
+            index_rebuild();
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&idx.lock);
+}
+
+/*******************************************************************************
+ *
+ * Queries
+ *
+ ******************************************************************************/
+
+static bool name_matches(const char *name, const char *pattern, size_t patlen, FILE_INDEX_MATCH match)
+{
+    switch (match) {
+        case FILE_INDEX_MATCH_PREFIX:
+            return strncasecmp(name, pattern, patlen) == 0;
+
+        case FILE_INDEX_MATCH_GLOB:
+            return fnmatch(pattern, name, FNM_CASEFOLD) == 0;
+
+        default:
+            return strcasestr(name, pattern) != NULL;
+    }
+}
+
+/* Returns the node of path, an absolute path below the root, NODE_NONE if it is not indexed. */
+static uint32_t node_lookup(const char *path)
+{
+    size_t rootlen = strlen(idx.root);
+
+    if (strncmp(path, idx.root, rootlen) != 0 || (path[rootlen] != '\0' && path[rootlen] != '/')) {
+        return NODE_NONE;
+    }
+
+    uint32_t id = idx.root_node;
+    char name[NAME_MAX + 1];
+
+    for (path += rootlen; *path && id != NODE_NONE;) {
+        size_t len = strcspn(++path, "/");
+
+        if (len > NAME_MAX) {
+            return NODE_NONE;
+        }
+
+        if (len > 0) {
+            memcpy(name, path, len);
+            name[len] = '\0';
+            id = hash_find(id, name);
+        }
+
+        path += len;
+    }
+
+    return id;
+}
+
+int file_index_usage(const char *path, uint64_t *bytes, uint64_t *files)
+{
+    pthread_mutex_lock(&idx.lock);
+
+    uint32_t id = idx.started ? node_lookup(path) : NODE_NONE;
+
+    if (id != NODE_NONE && idx.nodes[id].type == DIR_ENTRY_DIR) {
+        *bytes = idx.nodes[id].total;
+        *files = idx.nodes[id].nfiles;
+    } else if (id != NODE_NONE) {
+        *bytes = idx.nodes[id].size;
+        *files = 1;
+    }
+
+    pthread_mutex_unlock(&idx.lock);
+
+    return id != NODE_NONE ? 0 : -1;
+}
+
+void file_index_fill_usage(const char *path, struct DirListing *listing)
+{
+    pthread_mutex_lock(&idx.lock);
+
+    uint32_t dir = idx.started ? node_lookup(path) : NODE_NONE;
+
+    for (size_t i = 0; i < listing->count && dir != NODE_NONE; ++i) {
+        struct DirEntry *e = &listing->entries[i];
+        uint32_t id;
+
+        if (e->type == DIR_ENTRY_DIR && (id = hash_find(dir, e->name)) != NODE_NONE) {
+            e->size = idx.nodes[id].total;
+        }
+    }
+
+    pthread_mutex_unlock(&idx.lock);
+}
+
+long file_index_find(const char *pattern, FILE_INDEX_MATCH match, struct DirListing *out)
+{
+    size_t patlen = strlen(pattern);
+    long total = 0;
+    char path[PATH_MAX];
+
+    pthread_mutex_lock(&idx.lock);
+
+    for (uint32_t id = 0; id < idx.nslots; ++id) {
+        const struct IndexNode *n = &idx.nodes[id];
+
+        if (n->name == NULL || n->parent == NODE_NONE || !name_matches(n->name, pattern, patlen, match)) {
+            continue;
+        }
+
+        if (++total > FILE_INDEX_MAX_RESULTS) {
+            continue;
+        }
+
+        int len = node_path(id, path, sizeof(path));
+
+        if (len == -1) {
+            continue;
+        }
+
+        struct DirEntry *e = dir_listing_push(out, path, len);
+
+        if (e == NULL) {
+            total = -1;
+            break;
+        }
+
+        e->type = n->type;
+        e->size = n->size;
+        e->mtime = n->mtime;
+        e->ino = n->ino;
+    }
+
+    pthread_mutex_unlock(&idx.lock);
+
+    dir_listing_seal(out);
+
+    return total;
+}
+
+/* Appends the entries below path to out, regular files only if files_only. */
+static long collect_below(const char *path, size_t max, bool files_only, struct DirListing *out)
+{
+    char buf[PATH_MAX];
+    long total = 0;
+
+    pthread_mutex_lock(&idx.lock);
+
+    uint32_t dir = idx.started ? node_lookup(path) : NODE_NONE;
+    int skip = (dir != NODE_NONE) ? node_path(dir, buf, sizeof(buf)) : -1;
+
+    if (skip == -1 || idx.nodes[dir].type != DIR_ENTRY_DIR) {
+        pthread_mutex_unlock(&idx.lock);
+        return -1;
+    }
+
+    /* node_path() leaves no leading '/', the names below dir start after its own and a '/' */
+    skip += (skip > 0);
+
+    for (uint32_t id = 0; id < idx.nslots; ++id) {
+        const struct IndexNode *n = &idx.nodes[id];
+        uint32_t up = n->parent;
+
+        if (n->name == NULL || id == dir || (files_only && n->type != DIR_ENTRY_FILE)) {
+            continue;
+        }
+
+        while (up != NODE_NONE && up != dir) {
+            up = idx.nodes[up].parent;
+        }
+
+        if (up != dir || (size_t) ++total > max) {
+            continue;
+        }
+
+        int len = node_path(id, buf, sizeof(buf));
+
+        if (len == -1) {
+            continue;
+        }
+
+        struct DirEntry *e = dir_listing_push(out, buf + skip, len - skip);
+
+        if (e == NULL) {
+            total = -1;
+            break;
+        }
+
+        e->type = n->type;
+        e->size = n->size;
+        e->mtime = n->mtime;
+        e->ino = n->ino;
+    }
+
+    pthread_mutex_unlock(&idx.lock);
+
+    dir_listing_seal(out);
+
+    return total;
+}
+
+long file_index_files(const char *path, size_t max, struct DirListing *out)
+{
+    return collect_below(path, max, true, out);
+}
+
+long file_index_entries(const char *path, size_t max, struct DirListing *out)
+{
+    return collect_below(path, max, false, out);
+}
+
+struct TopItem {
+    int64_t  key;
+    uint32_t id;
+};
+
+static int64_t top_key(const struct IndexNode *n, FILE_INDEX_TOP top)
+{
+    switch (top) {
+        case FILE_INDEX_TOP_SIZE:
+            return (int64_t) n->size;
+
+        case FILE_INDEX_TOP_NEWEST:
+            return n->mtime;
+
+        default:
+            return -(int64_t) n->mtime;
+    }
+}
+
+/* Moves heap[i] down to its place in the min-heap of len items. */
+static void top_sift_down(struct TopItem *heap, size_t len, size_t i)
+{
+    struct TopItem item = heap[i];
+
+    for (size_t c; (c = 2 * i + 1) < len; i = c) {
+        if (c + 1 < len && heap[c + 1].key < heap[c].key) {
+            ++c;
+        }
+
+        if (item.key <= heap[c].key) {
+            break;
+        }
+
+        heap[i] = heap[c];
+    }
+
+    heap[i] = item;
+}
+
+long file_index_top(const char *path, FILE_INDEX_TOP top, size_t n, struct DirListing *out)
+{
+    char buf[PATH_MAX];
+    long total = 0;
+    size_t len = 0;
+
+    if (n > FILE_INDEX_MAX_TOP) {
+        n = FILE_INDEX_MAX_TOP;
+    }
+
+    struct TopItem *heap = malloc((n ? n : 1) * sizeof(struct TopItem));
+
+    if (heap == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&idx.lock);
+
+    uint32_t dir = idx.started ? node_lookup(path) : NODE_NONE;
+
+    if (dir == NODE_NONE || idx.nodes[dir].type != DIR_ENTRY_DIR) {
+        pthread_mutex_unlock(&idx.lock);
+        free(heap);
+        return -1;
+    }
+
+    /* the heap keeps the n best seen so far with the worst of them on top, a file that does
+     * not beat it costs one comparison */
+    for (uint32_t id = 0; id < idx.nslots; ++id) {
+        const struct IndexNode *node = &idx.nodes[id];
+        uint32_t up = node->parent;
+
+        if (node->name == NULL || node->type != DIR_ENTRY_FILE) {
+            continue;
+        }
+
+        while (dir != idx.root_node && up != NODE_NONE && up != dir) {
+            up = idx.nodes[up].parent;
+        }
+
+        if (up == NODE_NONE) {
+            continue;
+        }
+
+        ++total;
+        int64_t key = top_key(node, top);
+
+        if (len < n) {
+            size_t i = len++;
+
+            /* sift up */
+            for (; i > 0 && heap[(i - 1) / 2].key > key; i = (i - 1) / 2) {
+                heap[i] = heap[(i - 1) / 2];
+            }
+
+            heap[i] = (struct TopItem) {key, id};
+        } else if (n > 0 && key > heap[0].key) {
+            heap[0] = (struct TopItem) {key, id};
+            top_sift_down(heap, len, 0);
+        }
+    }
+
+    for (size_t i = 0; i < len; ++i) {
+        const struct IndexNode *node = &idx.nodes[heap[i].id];
+        int plen = node_path(heap[i].id, buf, sizeof(buf));
+
+        if (plen == -1) {
+            continue;
+        }
+
+        struct DirEntry *e = dir_listing_push(out, buf, plen);
+
+        if (e == NULL) {
+            total = -1;
+            break;
+        }
+
+        e->type = node->type;
+        e->size = node->size;
+        e->mtime = node->mtime;
+        e->ino = node->ino;
+    }
+
+    pthread_mutex_unlock(&idx.lock);
+
+    free(heap);
+    dir_listing_seal(out);
+
+    return total;
+}
+
+void file_index_get_stats(struct FileIndexStats *stats)
+{
+    pthread_mutex_lock(&idx.lock);
+
+    *stats = (struct FileIndexStats) {
+        .files = idx.files,
+        .dirs = idx.dirs,
+        .bytes = idx.cap * sizeof(struct IndexNode) + 2 * idx.nbuckets * sizeof(uint32_t)
+        + idx.wd_cap * sizeof(uint32_t) + idx.name_bytes,
+        .pending_dirs = idx.pending,
+        .unwatched_dirs = idx.unwatched,
+        .events = idx.events,
+        .rebuilds = idx.rebuilds,
+        .crawl_secs = idx.crawl_secs,
+        .total_bytes = (idx.root_node != NODE_NONE) ? idx.nodes[idx.root_node].total : 0,
+        .total_files = (idx.root_node != NODE_NONE) ? idx.nodes[idx.root_node].nfiles : 0,
+    };
+
+    pthread_mutex_unlock(&idx.lock);
+}
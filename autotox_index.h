@@ -0,0 +1,97 @@
+#ifndef AUTOTOX_INDEX_H
+#define AUTOTOX_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "autotox_dir.h"
+
+#define FILE_INDEX_MAX_THREADS 8
+#define FILE_INDEX_MAX_RESULTS 10000   /* per query, to bound the result snapshot */
+#define FILE_INDEX_MAX_TOP     1000
+
+typedef enum FILE_INDEX_MATCH {
+    FILE_INDEX_MATCH_SUBSTRING,
+    FILE_INDEX_MATCH_PREFIX,
+    FILE_INDEX_MATCH_GLOB,
+} FILE_INDEX_MATCH;
+
+typedef enum FILE_INDEX_TOP {
+    FILE_INDEX_TOP_SIZE,       /* biggest first */
+    FILE_INDEX_TOP_NEWEST,
+    FILE_INDEX_TOP_OLDEST,
+} FILE_INDEX_TOP;
+
+struct FileIndexStats {
+    size_t   files;
+    size_t   dirs;
+    size_t   bytes;            /* memory used by the index */
+    size_t   pending_dirs;     /* directories queued for crawling, 0 once the index is complete */
+    size_t   unwatched_dirs;   /* directories inotify could not watch (watch limit), not kept current */
+    uint64_t events;
+    uint64_t rebuilds;
+    double   crawl_secs;       /* duration of the last full crawl */
+    uint64_t total_bytes;      /* usage of the whole tree */
+    uint64_t total_files;
+};
+
+/* Starts indexing every name under root: nthreads crawler threads walk the tree
+ * in the background and inotify keeps the index current afterwards.
+ *
+ * Returns 0 on success.
+ * Returns -1 if inotify or the crawler threads could not be set up.
+ */
+int file_index_start(const char *root, int nthreads);
+
+/* Applies pending inotify events to the index. Never blocks on disk or on a lookup
+ * in progress; directories created or moved in are handed to the crawler threads.
+ */
+void file_index_poll(void);
+
+/* Finds every entry whose name matches pattern, case insensitively.
+ * Matching entries are appended to out with their path relative to root as name,
+ * sorted by path, at most FILE_INDEX_MAX_RESULTS of them.
+ *
+ * Returns the total number of matches, which may exceed the entries appended.
+ * Returns -1 if out of memory.
+ */
+long file_index_find(const char *pattern, FILE_INDEX_MATCH match, struct DirListing *out);
+
+/* Appends every regular file below path, an absolute path below root, to out with its
+ * path relative to path as name, sorted by path, at most max of them.
+ *
+ * Returns the total number of files, which may exceed the entries appended.
+ * Returns -1 if path is not indexed (yet) or out of memory.
+ */
+long file_index_files(const char *path, size_t max, struct DirListing *out);
+
+/* Same as file_index_files() for every entry below path, directories included. */
+long file_index_entries(const char *path, size_t max, struct DirListing *out);
+
+/* Appends the n regular files below path, an absolute path below root, that come first by
+ * top to out, with their path relative to root as name, at most FILE_INDEX_MAX_TOP of them.
+ * One pass over the index with a heap of n entries, the rest of the files are never copied.
+ *
+ * Returns the number of files below path.
+ * Returns -1 if path is not indexed (yet) or out of memory.
+ */
+long file_index_top(const char *path, FILE_INDEX_TOP top, size_t n, struct DirListing *out);
+
+/* Looks up the disk usage of path, an absolute path below root: for a directory the
+ * apparent size and number of the files below it, hard links and bind mounts counted
+ * once, for anything else its own size. Kept current without rewalking the tree.
+ *
+ * Returns 0 on success.
+ * Returns -1 if path is not indexed (yet).
+ */
+int file_index_usage(const char *path, uint64_t *bytes, uint64_t *files);
+
+/* Replaces the size of every directory in listing, the contents of directory path,
+ * with its usage as reported by file_index_usage(). Directories not indexed yet keep theirs.
+ */
+void file_index_fill_usage(const char *path, struct DirListing *listing);
+
+void file_index_get_stats(struct FileIndexStats *stats);
+
+#endif /* AUTOTOX_INDEX_H */
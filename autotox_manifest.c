@@ -0,0 +1,221 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "autotox_dir.h"
+#include "autotox_index.h"
+#include "autotox_manifest.h"
+
+/* The compressed listing, grown as deflate fills it, then read back through a FILE. */
+struct GzBuffer {
+    uint8_t *data;
+    size_t   len;
+    size_t   cap;
+    size_t   pos;              /* read offset once the listing is complete */
+};
+
+/*******************************************************************************
+ *
+ * Compression
+ *
+ ******************************************************************************/
+
+/* Deflates len bytes of in into gz, finishing the stream if finish.
+ * Returns false if out of memory or zlib fails.
+ */
+static bool gz_write(z_stream *z, struct GzBuffer *gz, const char *in, size_t len, bool finish)
+{
+    int flush = finish ? Z_FINISH : Z_NO_FLUSH;
+    int ret;
+
+    z->next_in = (Bytef *) in;
+    z->avail_in = len;
+
+    do {
+        if (gz->cap - gz->len < 4096) {
+            size_t cap = gz->cap ? gz->cap * 2 : 65536;
+            uint8_t *data = realloc(gz->data, cap);
+
+            if (data == NULL) {
+                return false;
+            }
+
+            gz->data = data;
+            gz->cap = cap;
+        }
+
+        z->next_out = gz->data + gz->len;
+        z->avail_out = gz->cap - gz->len;
+        ret = deflate(z, flush);
+        gz->len = gz->cap - z->avail_out;
+
+        if (ret == Z_STREAM_ERROR) {
+            return false;
+        }
+    } while (z->avail_in > 0 || (finish && ret != Z_STREAM_END));
+
+    return true;
+}
+
+/* Appends the manifest line of e to buf, which has room for the longest one.
+ * Returns the length of the line.
+ */
+static size_t format_line(char *buf, const struct DirEntry *e)
+{
+    static const char types[] = "fdlo";
+    size_t len = sprintf(buf, "%c\t%" PRIu64 "\t%lld\t", types[e->type & 3], e->size, (long long) e->mtime);
+
+    for (const char *p = e->name; *p; ++p) {
+        if (*p == '\\' || *p == '\t' || *p == '\n') {
+            buf[len++] = '\\';
+            buf[len++] = (*p == '\t') ? 't' : (*p == '\n') ? 'n' : '\\';
+        } else {
+            buf[len++] = *p;
+        }
+    }
+
+    buf[len++] = '\n';
+
+    return len;
+}
+
+/*******************************************************************************
+ *
+ * Stream
+ *
+ ******************************************************************************/
+
+static ssize_t gz_read(void *cookie, char *buf, size_t size)
+{
+    struct GzBuffer *gz = cookie;
+    size_t n = (gz->pos < gz->len) ? gz->len - gz->pos : 0;
+
+    if (n > size) {
+        n = size;
+    }
+
+    memcpy(buf, gz->data + gz->pos, n);
+    gz->pos += n;
+
+    return n;
+}
+
+static int gz_seek(void *cookie, off64_t *offset, int whence)
+{
+    struct GzBuffer *gz = cookie;
+    off64_t base = (whence == SEEK_SET) ? 0 : (whence == SEEK_CUR) ? (off64_t) gz->pos : (off64_t) gz->len;
+
+    if (base + *offset < 0 || base + *offset > (off64_t) gz->len) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    gz->pos = base + *offset;
+    *offset = gz->pos;
+
+    return 0;
+}
+
+static int gz_close(void *cookie)
+{
+    struct GzBuffer *gz = cookie;
+
+    free(gz->data);
+    free(gz);
+
+    return 0;
+}
+
+FILE *manifest_open(const char *path, struct ManifestResult *res)
+{
+    struct DirListing listing = {0};
+    z_stream z = {0};
+    struct GzBuffer *gz = calloc(1, sizeof(struct GzBuffer));
+    char *block = malloc(MANIFEST_LINE_BLOCK + 2 * PATH_MAX + 64);
+    FILE *fp = NULL;
+
+    *res = (struct ManifestResult) {0};
+
+    if (gz == NULL || block == NULL) {
+        goto fail;
+    }
+
+    res->total = file_index_entries(path, MANIFEST_MAX_ENTRIES, &listing);
+
+    if (res->total == -1) {
+        errno = ENOENT;
+        goto fail;
+    }
+
+    /* 15 + 16: a gzip header and trailer around the deflate stream, for gunzip and zcat */
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    size_t fill = 0;
+    bool ok = true;
+
+    for (size_t i = 0; i < listing.count && ok; ++i) {
+        const struct DirEntry *e = &listing.entries[i];
+        size_t len = format_line(block + fill, e);
+
+        fill += len;
+        res->raw_bytes += len;
+
+        if (e->type == DIR_ENTRY_FILE) {
+            res->file_bytes += e->size;
+        }
+
+        if (fill >= MANIFEST_LINE_BLOCK) {
+            ok = gz_write(&z, gz, block, fill, false);
+            fill = 0;
+        }
+    }
+
+    ok = ok && gz_write(&z, gz, block, fill, true);
+    deflateEnd(&z);
+
+    if (!ok) {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    cookie_io_functions_t io = {
+        .read = gz_read,
+        .seek = gz_seek,
+        .close = gz_close,
+    };
+
+    fp = fopencookie(gz, "r", io);
+
+    if (fp == NULL) {
+        goto fail;
+    }
+
+    res->entries = listing.count;
+    res->size = gz->len;
+
+    dir_listing_free(&listing);
+    free(block);
+
+    return fp;
+
+fail:
+    dir_listing_free(&listing);
+    free(block);
+
+    if (gz != NULL) {
+        free(gz->data);
+        free(gz);
+    }
+
+    return NULL;
+}
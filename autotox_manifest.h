@@ -0,0 +1,31 @@
+#ifndef AUTOTOX_MANIFEST_H
+#define AUTOTOX_MANIFEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define MANIFEST_MAX_ENTRIES 1000000
+#define MANIFEST_LINE_BLOCK  (64 * 1024)   /* lines are deflated in blocks of this size */
+
+struct ManifestResult {
+    size_t   entries;          /* lines written */
+    long     total;            /* entries below the folder, may exceed the lines written */
+    uint64_t file_bytes;       /* size of the regular files listed */
+    uint64_t raw_bytes;        /* size of the listing before compression */
+    uint64_t size;             /* size of the compressed listing, what the stream reads */
+};
+
+/* Lists every entry below path, an absolute path below root, as the file index knows it:
+ * one line "type\tsize\tmtime\tpath" per entry, sorted by path, with type one of f d l o,
+ * mtime in seconds since the epoch and path relative to path, its backslashes, tabs and
+ * newlines escaped as \\, \t and \n. The lines are gzip compressed as they are written, in memory:
+ * nothing is staged on disk and the exact size is known before the first byte is sent.
+ *
+ * Returns a stream reading the compressed listing, which frees it once closed.
+ * Returns NULL on failure and leaves errno set: ENOENT if path is not indexed (yet).
+ */
+FILE *manifest_open(const char *path, struct ManifestResult *res);
+
+#endif /* AUTOTOX_MANIFEST_H */
@@ -0,0 +1,249 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+
+#include "autotox_path.h"
+
+#define DIR_OPEN_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+
+/* Opens directory rel, a normalized path without "..", below dirfd. Symlinks are refused
+ * anywhere along the way. openat2() does it in one call; kernels without it (before 5.6)
+ * or sandboxes that filter it get the same walk one component at a time.
+ */
+static int open_beneath(int dirfd, const char *rel)
+{
+    if (rel[0] == '\0') {
+        rel = ".";
+    }
+
+#ifdef SYS_openat2
+    static bool no_openat2;
+
+    if (!no_openat2) {
+        struct open_how how = {
+            .flags = DIR_OPEN_FLAGS,
+            .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS,
+        };
+        int fd = syscall(SYS_openat2, dirfd, rel, &how, sizeof(how));
+
+        if (fd != -1 || (errno != ENOSYS && errno != EPERM)) {
+            return fd;
+        }
+
+        no_openat2 = true;
+    }
+#endif
+
+    int fd = dirfd;
+
+    while (*rel) {
+        size_t len = strcspn(rel, "/");
+        char name[NAME_MAX + 1];
+
+        if (len > NAME_MAX) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        memcpy(name, rel, len);
+        name[len] = '\0';
+        rel += len + (rel[len] == '/');
+
+        int next = openat(fd, name, DIR_OPEN_FLAGS | O_NOFOLLOW);
+        int saved = errno;
+
+        if (fd != dirfd) {
+            close(fd);
+        }
+
+        if (next == -1) {
+            errno = saved;
+            return -1;
+        }
+
+        fd = next;
+    }
+
+    return (fd == dirfd) ? openat(dirfd, ".", DIR_OPEN_FLAGS) : fd;
+}
+
+/* Appends the components of path to out, which holds len bytes of a normalized path
+ * relative to the root. Sets climbed if a ".." had to go above what out held on entry.
+ * Returns the new length, or -1 with errno set.
+ */
+static int normalize(char *out, size_t len, size_t size, const char *path, size_t pathlen, bool *climbed)
+{
+    size_t base = len;
+    const char *end = path + pathlen;
+
+    while (path < end) {
+        const char *sep = memchr(path, '/', end - path);
+        const char *next = sep ? sep + 1 : end;
+        const char *last = sep ? sep : end;
+
+        while (path < last && *path == '"') {
+            ++path;
+        }
+
+        while (last > path && last[-1] == '"') {
+            --last;
+        }
+
+        size_t n = last - path;
+
+        if (n == 0 || (n == 1 && path[0] == '.')) {
+            /* empty or "." */
+        } else if (n == 2 && path[0] == '.' && path[1] == '.') {
+            if (len == 0) {
+                errno = EXDEV;
+                return -1;
+            }
+
+            while (len > 0 && out[len - 1] != '/') {
+                --len;
+            }
+
+            if (len > 0) {
+                --len;
+            }
+
+            if (len < base) {
+                *climbed = true;
+            }
+        } else {
+            if (n > NAME_MAX) {
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+
+            if (len + 1 + n >= size) {
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+
+            if (len > 0) {
+                out[len++] = '/';
+            }
+
+            memcpy(out + len, path, n);
+            len += n;
+        }
+
+        path = next;
+    }
+
+    out[len] = '\0';
+
+    return len;
+}
+
+int workdir_open(struct WorkDir *wd, const char *root)
+{
+    wd->rootfd = open(root, DIR_OPEN_FLAGS);
+
+    if (wd->rootfd == -1) {
+        return -1;
+    }
+
+    wd->fd = dup(wd->rootfd);
+    wd->path = strdup(root);
+    wd->rootlen = strlen(root);
+
+    if (wd->fd == -1 || wd->path == NULL) {
+        workdir_close(wd);
+        return -1;
+    }
+
+    return 0;
+}
+
+void workdir_close(struct WorkDir *wd)
+{
+    if (wd->fd != -1) {
+        close(wd->fd);
+    }
+
+    if (wd->rootfd != -1) {
+        close(wd->rootfd);
+    }
+
+    free(wd->path);
+    wd->fd = wd->rootfd = -1;
+    wd->path = NULL;
+}
+
+int workdir_change(struct WorkDir *wd, const char *path, size_t len, bool from_root)
+{
+    char rel[PATH_MAX];
+    size_t base = 0;
+    bool climbed = false;
+
+    if (len > 0 && path[0] == '/') {
+        from_root = true;
+    }
+
+    if (!from_root) {
+        const char *cur = workdir_relative(wd);
+        base = strlen(cur);
+
+        if (base > 0) {
+            /* drop the leading '/' */
+            memcpy(rel, cur + 1, base);
+            --base;
+        }
+    }
+
+    int n = normalize(rel, base, sizeof(rel), path, len, &climbed);
+
+    if (n == -1) {
+        return -1;
+    }
+
+    /* going down from here needs only the new components, anything else starts over at the root */
+    int fd = (from_root || climbed) ? open_beneath(wd->rootfd, rel)
+             : open_beneath(wd->fd, rel + base + (base > 0 && (size_t) n > base));
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    char *newpath = malloc(wd->rootlen + 1 + n + 1);
+
+    if (newpath == NULL) {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memcpy(newpath, wd->path, wd->rootlen);
+    newpath[wd->rootlen] = '\0';
+
+    if (n > 0) {
+        newpath[wd->rootlen] = '/';
+        memcpy(newpath + wd->rootlen + 1, rel, n + 1);
+    }
+
+    close(wd->fd);
+    free(wd->path);
+    wd->fd = fd;
+    wd->path = newpath;
+
+    return 0;
+}
+
+const char *workdir_relative(const struct WorkDir *wd)
+{
+    return wd->path + wd->rootlen;
+}
@@ -0,0 +1,41 @@
+#ifndef AUTOTOX_PATH_H
+#define AUTOTOX_PATH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A current directory confined to a root, kept open. Paths handed to it are folded
+ * lexically first ("." and ".." resolved against the current path), then opened
+ * beneath the root without following symlinks, so no name can lead outside of it.
+ */
+struct WorkDir {
+    int    rootfd;
+    int    fd;
+    char  *path;      /* absolute, no trailing slash */
+    size_t rootlen;
+};
+
+/* Opens root as both the root and the current directory of wd.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure and leaves errno set.
+ */
+int workdir_open(struct WorkDir *wd, const char *root);
+
+void workdir_close(struct WorkDir *wd);
+
+/* Changes the current directory of wd to path, len bytes long. path is taken relative
+ * to the root if from_root is set or it starts with '/', to the current directory
+ * otherwise. Double quotes around a component are dropped.
+ *
+ * Returns 0 on success.
+ * Returns -1 and leaves wd unchanged on failure, errno set to ENOENT or ENOTDIR for a
+ * missing folder, ELOOP (ENOTDIR without openat2) for a symlink, EXDEV if path climbs
+ * above the root.
+ */
+int workdir_change(struct WorkDir *wd, const char *path, size_t len, bool from_root);
+
+/* Returns the current directory relative to the root: "" at the root, "/a/b" below it. */
+const char *workdir_relative(const struct WorkDir *wd);
+
+#endif /* AUTOTOX_PATH_H */
@@ -0,0 +1,292 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "autotox_preview.h"
+
+/* Reads len bytes at off. Returns the count, short only at the end of the file, -1 on error. */
+static ssize_t read_at(int fd, char *buf, size_t len, uint64_t off, uint64_t *io)
+{
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t n = pread(fd, buf + got, len - got, off + got);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n == -1) {
+            return -1;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        got += n;
+    }
+
+    *io += got;
+
+    return got;
+}
+
+static void sanitize(char *text, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = text[i];
+
+        if ((c < 0x20 && c != '\n' && c != '\t') || c == 0x7f) {
+            text[i] = '?';
+        }
+    }
+}
+
+/* Returns a sanitized, '\0' terminated copy of len bytes at text. */
+static char *finish(const char *text, size_t len)
+{
+    char *out = malloc(len + 1);
+
+    if (out) {
+        memcpy(out, text, len);
+        out[len] = '\0';
+        sanitize(out, len);
+    }
+
+    return out;
+}
+
+/* Resolves a negative off against the size of fd. Returns -1 on error. */
+static int64_t resolve_off(int fd, int64_t off)
+{
+    struct stat st;
+
+    if (off >= 0) {
+        return off;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+
+    return (st.st_size + off > 0) ? st.st_size + off : 0;
+}
+
+char *preview_head(int fd, unsigned lines, uint64_t *io)
+{
+    char *buf = malloc(PREVIEW_MAX_BYTES);
+    size_t have = 0;
+    unsigned found = 0;
+
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    while (have < PREVIEW_MAX_BYTES) {
+        size_t want = PREVIEW_MAX_BYTES - have < PREVIEW_BLOCK ? PREVIEW_MAX_BYTES - have : PREVIEW_BLOCK;
+        ssize_t n = read_at(fd, buf + have, want, have, io);
+
+        if (n == -1) {
+            free(buf);
+            return NULL;
+        }
+
+        const char *nl, *p = buf + have, *end = buf + have + n;
+
+        while ((nl = memchr(p, '\n', end - p)) != NULL) {
+            if (++found == lines) {
+                char *out = finish(buf, nl - buf);
+                free(buf);
+                return out;
+            }
+
+            p = nl + 1;
+        }
+
+        have += n;
+
+        if ((size_t) n < want) {
+            break;
+        }
+    }
+
+    /* fewer lines than asked, or they fill PREVIEW_MAX_BYTES */
+    if (have > 0 && buf[have - 1] == '\n') {
+        --have;
+    }
+
+    char *out = finish(buf, have);
+    free(buf);
+
+    return out;
+}
+
+char *preview_tail(int fd, unsigned lines, uint64_t *io)
+{
+    struct stat st;
+    const size_t cap = PREVIEW_MAX_BYTES + PREVIEW_BLOCK;
+
+    if (fstat(fd, &st) == -1) {
+        return NULL;
+    }
+
+    char *buf = malloc(cap);
+
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    /* the blocks are read from the end of the file towards its start and stored the same
+     * way, from the end of buf, so buf + cap - have always holds the last have bytes
+     */
+    uint64_t pos = st.st_size;
+    size_t have = 0;
+    size_t start = cap;
+    unsigned found = 0;
+    bool done = false;
+
+    while (pos > 0 && !done && have < PREVIEW_MAX_BYTES) {
+        /* the first read takes the partial block at the end, the rest stay block aligned */
+        size_t n = (pos % PREVIEW_BLOCK) ? pos % PREVIEW_BLOCK : PREVIEW_BLOCK;
+
+        if (n > cap - have) {
+            n = cap - have;
+        }
+
+        pos -= n;
+
+        char *chunk = buf + cap - have - n;
+
+        if (read_at(fd, chunk, n, pos, io) != (ssize_t) n) {
+            free(buf);
+            return NULL;
+        }
+
+        have += n;
+
+        for (size_t i = n; i-- > 0;) {
+            /* the newline ending the last line does not start another */
+            if (chunk[i] == '\n' && chunk + i != buf + cap - 1 && ++found == lines) {
+                start = chunk + i + 1 - buf;
+                done = true;
+                break;
+            }
+        }
+    }
+
+    if (!done) {
+        start = cap - have;
+    }
+
+    if (cap - start > PREVIEW_MAX_BYTES) {
+        start = cap - PREVIEW_MAX_BYTES;
+        done = false;
+    }
+
+    /* cut short by PREVIEW_MAX_BYTES: start at a whole line if there is one */
+    if (!done && (pos > 0 || start > cap - have)) {
+        char *nl = memchr(buf + start, '\n', cap - 1 - start);
+
+        if (nl) {
+            start = nl + 1 - buf;
+        }
+    }
+
+    size_t len = cap - start;
+
+    if (len > 0 && buf[cap - 1] == '\n') {
+        --len;
+    }
+
+    char *out = finish(buf + start, len);
+    free(buf);
+
+    return out;
+}
+
+char *preview_range(int fd, int64_t off, size_t len, uint64_t *io)
+{
+    if ((off = resolve_off(fd, off)) == -1) {
+        return NULL;
+    }
+
+    if (len > PREVIEW_MAX_BYTES) {
+        len = PREVIEW_MAX_BYTES;
+    }
+
+    char *buf = malloc(len + 1);
+    ssize_t n = buf ? read_at(fd, buf, len, off, io) : -1;
+
+    if (n == -1) {
+        free(buf);
+        return NULL;
+    }
+
+    buf[n] = '\0';
+    sanitize(buf, n);
+
+    return buf;
+}
+
+char *preview_hex(int fd, int64_t off, size_t len, uint64_t *io)
+{
+    unsigned char data[PREVIEW_HEX_MAX];
+
+    if ((off = resolve_off(fd, off)) == -1) {
+        return NULL;
+    }
+
+    if (len > PREVIEW_HEX_MAX) {
+        len = PREVIEW_HEX_MAX;
+    }
+
+    ssize_t n = read_at(fd, (char *) data, len, off, io);
+
+    if (n == -1) {
+        return NULL;
+    }
+
+    /* "00000000  00 01 02 03 04 05 06 07  08 09 0a 0b 0c 0d 0e 0f  |................|\n",
+     * with room for an offset of up to 16 digits */
+    size_t size = ((size_t) n / 16 + 1) * (16 + 72) + 1;
+    char *out = malloc(size);
+    size_t m = 0;
+
+    if (out == NULL) {
+        return NULL;
+    }
+
+    out[0] = '\0';
+
+    for (ssize_t row = 0; row < n && m < size; row += 16) {
+        m += snprintf(out + m, size - m, "%08llx ", (unsigned long long)(off + row));
+
+        for (int i = 0; i < 16; ++i) {
+            if (row + i < n) {
+                m += snprintf(out + m, size - m, "%s%02x", (i == 8) ? "  " : " ", data[row + i]);
+            } else {
+                m += snprintf(out + m, size - m, "%s  ", (i == 8) ? "   " : " ");
+            }
+        }
+
+        m += snprintf(out + m, size - m, "  |");
+
+        for (int i = 0; i < 16 && row + i < n && m + 1 < size; ++i) {
+            unsigned char c = data[row + i];
+            out[m++] = (c >= 0x20 && c < 0x7f) ? c : '.';
+        }
+
+        m += snprintf(out + m, size - m, "|%s", (row + 16 < n) ? "\n" : "");
+    }
+
+    return out;
+}
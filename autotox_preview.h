@@ -0,0 +1,32 @@
+#ifndef AUTOTOX_PREVIEW_H
+#define AUTOTOX_PREVIEW_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PREVIEW_LINES     20                /* head/tail without a count */
+#define PREVIEW_MAX_LINES 500
+#define PREVIEW_MAX_BYTES (6 * 1024)        /* text one preview sends at most */
+#define PREVIEW_BLOCK     4096
+#define PREVIEW_HEX_BYTES 256               /* hex without a length */
+#define PREVIEW_HEX_MAX   1024
+
+/* Previews of a file opened as fd that read only the bytes they show. Control characters
+ * other than newline and tab come back as '?', so the text can go out as chat messages.
+ * Each returns the text, to be freed, and adds the bytes it read to *io.
+ * Returns NULL if the file can not be read or out of memory.
+ */
+
+/* The first lines of fd, at most PREVIEW_MAX_BYTES of them. */
+char *preview_head(int fd, unsigned lines, uint64_t *io);
+
+/* The last lines of fd, found by reading blocks backwards from its end. */
+char *preview_tail(int fd, unsigned lines, uint64_t *io);
+
+/* len bytes of fd from off; a negative off counts from the end. */
+char *preview_range(int fd, int64_t off, size_t len, uint64_t *io);
+
+/* len bytes of fd from off as `hexdump -C` lines, PREVIEW_HEX_MAX at most. */
+char *preview_hex(int fd, int64_t off, size_t len, uint64_t *io);
+
+#endif /* AUTOTOX_PREVIEW_H */
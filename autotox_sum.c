@@ -0,0 +1,724 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <sodium.h>
+
+#include "autotox_sum.h"
+
+#define SUM_RING 4                  /* blocks read ahead of the hasher */
+#define SUM_STORE_MAGIC "ATXSUM1\n"
+#define SUM_MAX_DEPTH 64
+
+/* One sum as kept in memory and, field for field, in the store file */
+struct SumRecord {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t  mtime_sec;
+    int64_t  mtime_nsec;
+    uint8_t  sum[SUM_BYTES];
+};
+
+struct SumNode {
+    struct SumNode *next;
+    struct SumRecord rec;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct SumNode **buckets;
+    size_t   nbuckets;
+    size_t   entries;
+    int      fd;                    /* store, appended to; -1 keeps sums in memory only */
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t hashed_bytes;
+} store = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .fd = -1,
+};
+
+/*******************************************************************************
+ *
+ * Store
+ *
+ ******************************************************************************/
+
+static size_t record_hash(uint64_t dev, uint64_t ino)
+{
+    uint64_t h = (ino ^ (dev << 32 | dev >> 32)) * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(h >> 17);
+}
+
+static void record_key(struct SumRecord *rec, const struct stat *st)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->dev = st->st_dev;
+    rec->ino = st->st_ino;
+    rec->size = st->st_size;
+    rec->mtime_sec = st->st_mtim.tv_sec;
+    rec->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+/* Called with store.lock held. Returns false if out of memory. */
+static bool store_grow(void)
+{
+    size_t n = store.nbuckets ? store.nbuckets * 2 : 1024;
+    struct SumNode **b = calloc(n, sizeof(*b));
+
+    if (b == NULL) {
+        return false;
+    }
+
+    for (size_t i = 0; i < store.nbuckets; ++i) {
+        struct SumNode *node = store.buckets[i];
+
+        while (node) {
+            struct SumNode *next = node->next;
+            size_t h = record_hash(node->rec.dev, node->rec.ino) & (n - 1);
+            node->next = b[h];
+            b[h] = node;
+            node = next;
+        }
+    }
+
+    free(store.buckets);
+    store.buckets = b;
+    store.nbuckets = n;
+
+    return true;
+}
+
+/* Called with store.lock held. One sum per inode: a newer one replaces what it had. */
+static bool store_put(const struct SumRecord *rec)
+{
+    /* a failed grow only makes the chains longer */
+    if (store.entries >= store.nbuckets && !store_grow() && store.nbuckets == 0) {
+        return false;
+    }
+
+    size_t h = record_hash(rec->dev, rec->ino) & (store.nbuckets - 1);
+
+    for (struct SumNode *node = store.buckets[h]; node; node = node->next) {
+        if (node->rec.dev == rec->dev && node->rec.ino == rec->ino) {
+            node->rec = *rec;
+            return true;
+        }
+    }
+
+    struct SumNode *node = malloc(sizeof(*node));
+
+    if (node == NULL) {
+        return false;
+    }
+
+    node->rec = *rec;
+    node->next = store.buckets[h];
+    store.buckets[h] = node;
+    ++store.entries;
+
+    return true;
+}
+
+/* Called with store.lock held. Fills the sum of key in if the store has it for the same size and mtime. */
+static bool store_get(struct SumRecord *key)
+{
+    if (store.nbuckets == 0) {
+        return false;
+    }
+
+    size_t h = record_hash(key->dev, key->ino) & (store.nbuckets - 1);
+
+    for (struct SumNode *node = store.buckets[h]; node; node = node->next) {
+        if (node->rec.dev == key->dev && node->rec.ino == key->ino) {
+            if (node->rec.size != key->size || node->rec.mtime_sec != key->mtime_sec
+                    || node->rec.mtime_nsec != key->mtime_nsec) {
+                return false;
+            }
+
+            memcpy(key->sum, node->rec.sum, SUM_BYTES);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return false;
+        }
+
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+/* Rewrites the store with only the live sums, once superseded ones make up most of it */
+static void store_compact(const char *path)
+{
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    if (fd == -1) {
+        return;
+    }
+
+    bool ok = write_all(fd, SUM_STORE_MAGIC, 8);
+
+    for (size_t i = 0; ok && i < store.nbuckets; ++i) {
+        for (struct SumNode *node = store.buckets[i]; ok && node; node = node->next) {
+            ok = write_all(fd, &node->rec, sizeof(node->rec));
+        }
+    }
+
+    if (close(fd) == -1 || !ok || rename(tmp, path) == -1) {
+        unlink(tmp);
+    }
+}
+
+int sum_init(const char *path)
+{
+    struct SumRecord rec;
+    char magic[8];
+    size_t records = 0;
+    bool clean = false;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    pthread_mutex_lock(&store.lock);
+
+    if (fd != -1) {
+        if (read(fd, magic, sizeof(magic)) == sizeof(magic) && memcmp(magic, SUM_STORE_MAGIC, 8) == 0) {
+            while (read(fd, &rec, sizeof(rec)) == sizeof(rec)) {
+                store_put(&rec);
+                ++records;
+            }
+
+            /* a record cut short by a crash would misalign every append after it */
+            clean = lseek(fd, 0, SEEK_END) == (off_t)(8 + records * sizeof(rec));
+        }
+
+        close(fd);
+    }
+
+    if (!clean || records > store.entries * 2 + 1024) {
+        store_compact(path);
+    }
+
+    store.fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+
+    int ret = (store.fd != -1) ? 0 : -1;
+    pthread_mutex_unlock(&store.lock);
+
+    return ret;
+}
+
+/*******************************************************************************
+ *
+ * Hashing
+ *
+ ******************************************************************************/
+
+/* Reads up to len bytes, fewer only at the end of the file. Returns the count, -1 on error. */
+static ssize_t read_block(int fd, uint8_t *buf, size_t len)
+{
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t n = read(fd, buf + got, len - got);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n == -1) {
+            return -1;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        got += n;
+    }
+
+    return got;
+}
+
+/* Blocks handed from the reader thread to the hasher. A block of length 0 marks the end,
+ * -1 a read error.
+ */
+struct SumPipe {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    uint8_t *buf[SUM_RING];
+    ssize_t  len[SUM_RING];
+    unsigned head;                  /* blocks read */
+    unsigned tail;                  /* blocks hashed */
+    int      fd;
+};
+
+static void *pipe_reader(void *arg)
+{
+    struct SumPipe *p = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+
+        while (p->head - p->tail == SUM_RING) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+
+        unsigned slot = p->head % SUM_RING;
+        pthread_mutex_unlock(&p->lock);
+
+        ssize_t n = read_block(p->fd, p->buf[slot], SUM_BLOCK_SIZE);
+
+        pthread_mutex_lock(&p->lock);
+        p->len[slot] = n;
+        ++p->head;
+        pthread_cond_signal(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+
+        if (n <= 0) {
+            return NULL;
+        }
+    }
+}
+
+/* Hashes fd while a second thread reads the next blocks, so the disk and the CPU are
+ * busy at the same time. BLAKE2b itself is sequential: splitting one file across
+ * hashers would give a digest that b2sum does not produce.
+ */
+static int hash_pipelined(int fd, crypto_generichash_state *state)
+{
+    struct SumPipe p = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .fd = fd,
+    };
+    pthread_t reader;
+    int ret = -1;
+
+    uint8_t *mem = malloc((size_t) SUM_RING * SUM_BLOCK_SIZE);
+
+    if (mem == NULL) {
+        return -1;
+    }
+
+    for (int i = 0; i < SUM_RING; ++i) {
+        p.buf[i] = mem + (size_t) i * SUM_BLOCK_SIZE;
+    }
+
+    if (pthread_create(&reader, NULL, pipe_reader, &p) != 0) {
+        free(mem);
+        return -1;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&p.lock);
+
+        while (p.tail == p.head) {
+            pthread_cond_wait(&p.cond, &p.lock);
+        }
+
+        unsigned slot = p.tail % SUM_RING;
+        ssize_t n = p.len[slot];
+        pthread_mutex_unlock(&p.lock);
+
+        if (n <= 0) {
+            ret = (n == 0) ? 0 : -1;
+            break;
+        }
+
+        crypto_generichash_update(state, p.buf[slot], n);
+
+        pthread_mutex_lock(&p.lock);
+        ++p.tail;
+        pthread_cond_signal(&p.cond);
+        pthread_mutex_unlock(&p.lock);
+    }
+
+    pthread_join(reader, NULL);
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.cond);
+    free(mem);
+
+    return ret;
+}
+
+static int hash_plain(int fd, crypto_generichash_state *state)
+{
+    uint8_t *buf = malloc(SUM_BLOCK_SIZE);
+    ssize_t n;
+
+    if (buf == NULL) {
+        return -1;
+    }
+
+    while ((n = read_block(fd, buf, SUM_BLOCK_SIZE)) > 0) {
+        crypto_generichash_update(state, buf, n);
+    }
+
+    free(buf);
+
+    return (n == 0) ? 0 : -1;
+}
+
+int sum_file(int dirfd, const char *name, uint8_t sum[SUM_BYTES], bool *cached)
+{
+    struct SumRecord rec;
+    struct stat st, after;
+
+    if (cached) {
+        *cached = false;
+    }
+
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        close(fd);
+        errno = EISDIR;
+        return -1;
+    }
+
+    record_key(&rec, &st);
+
+    pthread_mutex_lock(&store.lock);
+    bool hit = store_get(&rec);
+    ++*(hit ? &store.hits : &store.misses);
+    pthread_mutex_unlock(&store.lock);
+
+    if (hit) {
+        close(fd);
+        memcpy(sum, rec.sum, SUM_BYTES);
+
+        if (cached) {
+            *cached = true;
+        }
+
+        return 0;
+    }
+
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, NULL, 0, SUM_BYTES);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    int ret = (st.st_size >= SUM_PIPELINE_MIN) ? hash_pipelined(fd, &state) : hash_plain(fd, &state);
+    int saved = errno;
+
+    if (ret == 0 && fstat(fd, &after) == 0 && (after.st_size != st.st_size
+            || after.st_mtim.tv_sec != st.st_mtim.tv_sec || after.st_mtim.tv_nsec != st.st_mtim.tv_nsec)) {
+        ret = -1;
+        saved = EAGAIN;
+    }
+
+    close(fd);
+
+    if (ret == -1) {
+        errno = saved;
+        return -1;
+    }
+
+    crypto_generichash_final(&state, rec.sum, SUM_BYTES);
+    memcpy(sum, rec.sum, SUM_BYTES);
+
+    pthread_mutex_lock(&store.lock);
+    store.hashed_bytes += st.st_size;
+
+    if (store_put(&rec) && store.fd != -1) {
+        /* one write of a whole record, O_APPEND keeps it in one piece */
+        write_all(store.fd, &rec, sizeof(rec));
+    }
+
+    pthread_mutex_unlock(&store.lock);
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Trees
+ *
+ ******************************************************************************/
+
+struct SumTree {
+    int      dirfd;
+    char   **paths;
+    size_t   npaths;
+    size_t   cap;
+    uint8_t (*sums)[SUM_BYTES];
+    int8_t  *status;                /* 1 hashed, 2 cached, -1 failed */
+    uint64_t *sizes;
+    atomic_size_t next;
+    bool     truncated;
+};
+
+static bool tree_add(struct SumTree *t, const char *path)
+{
+    if (t->npaths == SUM_MAX_FILES) {
+        t->truncated = true;
+        return false;
+    }
+
+    if (t->npaths == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 256;
+        char **p = realloc(t->paths, cap * sizeof(*p));
+
+        if (p == NULL) {
+            return false;
+        }
+
+        t->paths = p;
+        t->cap = cap;
+    }
+
+    if ((t->paths[t->npaths] = strdup(path)) == NULL) {
+        return false;
+    }
+
+    ++t->npaths;
+
+    return true;
+}
+
+/* Collects the regular files below fd, rel being its path relative to the tree root. Closes fd. */
+static void tree_walk(struct SumTree *t, int fd, char *rel, size_t rellen, int depth)
+{
+    DIR *d = fdopendir(fd);
+    struct dirent *de;
+
+    if (d == NULL) {
+        close(fd);
+        return;
+    }
+
+    while ((de = readdir(d)) != NULL && !t->truncated) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+
+        size_t namelen = strlen(de->d_name);
+
+        if (rellen + namelen + 2 > PATH_MAX) {
+            continue;
+        }
+
+        unsigned char type = de->d_type;
+
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+
+            if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                continue;
+            }
+
+            type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+        }
+
+        size_t len = rellen;
+
+        if (len > 0) {
+            rel[len++] = '/';
+        }
+
+        memcpy(rel + len, de->d_name, namelen + 1);
+
+        if (type == DT_REG) {
+            tree_add(t, rel);
+        } else if (type == DT_DIR && depth < SUM_MAX_DEPTH) {
+            int sub = openat(dirfd(d), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+            if (sub != -1) {
+                tree_walk(t, sub, rel, len + namelen, depth + 1);
+            }
+        }
+
+        rel[rellen] = '\0';
+    }
+
+    closedir(d);
+}
+
+static void *tree_hasher(void *arg)
+{
+    struct SumTree *t = arg;
+    size_t i;
+
+    while ((i = atomic_fetch_add(&t->next, 1)) < t->npaths) {
+        bool cached;
+        struct stat st;
+
+        if (sum_file(t->dirfd, t->paths[i], t->sums[i], &cached) == 0) {
+            t->status[i] = cached ? 2 : 1;
+            t->sizes[i] = (fstatat(t->dirfd, t->paths[i], &st, AT_SYMLINK_NOFOLLOW) == 0) ? (uint64_t) st.st_size : 0;
+        } else {
+            t->status[i] = -1;
+        }
+    }
+
+    return NULL;
+}
+
+static int path_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* Writes one b2sum line. Names holding a backslash or a newline get them escaped and
+ * the line a leading backslash, as coreutils does.
+ */
+static void write_line(FILE *out, const char *hex, const char *path)
+{
+    if (strpbrk(path, "\\\n") == NULL) {
+        fprintf(out, "%s  %s\n", hex, path);
+        return;
+    }
+
+    fprintf(out, "\\%s  ", hex);
+
+    for (const char *c = path; *c; ++c) {
+        if (*c == '\\') {
+            fputs("\\\\", out);
+        } else if (*c == '\n') {
+            fputs("\\n", out);
+        } else {
+            fputc(*c, out);
+        }
+    }
+
+    fputc('\n', out);
+}
+
+int sum_tree(const char *dir, FILE *out, struct SumTreeResult *res)
+{
+    struct SumTree t = {0};
+    char rel[PATH_MAX] = "";
+    pthread_t threads[SUM_MAX_THREADS - 1];
+    size_t nthreads = 0;
+
+    memset(res, 0, sizeof(*res));
+
+    t.dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (t.dirfd == -1) {
+        return -1;
+    }
+
+    int walkfd = dup(t.dirfd);
+
+    if (walkfd != -1) {
+        tree_walk(&t, walkfd, rel, 0, 0);
+    }
+
+    qsort(t.paths, t.npaths, sizeof(*t.paths), path_cmp);
+
+    t.sums = malloc(t.npaths * sizeof(*t.sums) + 1);
+    t.status = calloc(t.npaths + 1, sizeof(*t.status));
+    t.sizes = calloc(t.npaths + 1, sizeof(*t.sizes));
+
+    int ret = -1;
+
+    if (t.sums && t.status && t.sizes) {
+        /* the calling thread hashes too */
+        while (nthreads + 1 < SUM_MAX_THREADS && nthreads + 1 < t.npaths
+                && pthread_create(&threads[nthreads], NULL, tree_hasher, &t) == 0) {
+            ++nthreads;
+        }
+
+        tree_hasher(&t);
+
+        for (size_t i = 0; i < nthreads; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+
+        for (size_t i = 0; i < t.npaths; ++i) {
+            char hex[SUM_HEX_SIZE];
+
+            if (t.status[i] < 0) {
+                ++res->failed;
+                continue;
+            }
+
+            sum_to_hex(t.sums[i], hex);
+            write_line(out, hex, t.paths[i]);
+            ++res->files;
+            res->cached += (t.status[i] == 2);
+            res->bytes += t.sizes[i];
+        }
+
+        res->truncated = t.truncated;
+        ret = ferror(out) ? -1 : 0;
+    }
+
+    for (size_t i = 0; i < t.npaths; ++i) {
+        free(t.paths[i]);
+    }
+
+    free(t.paths);
+    free(t.sums);
+    free(t.status);
+    free(t.sizes);
+    close(t.dirfd);
+
+    return ret;
+}
+
+void sum_to_hex(const uint8_t sum[SUM_BYTES], char hex[SUM_HEX_SIZE])
+{
+    static const char digits[] = "0123456789abcdef";
+
+    for (int i = 0; i < SUM_BYTES; ++i) {
+        hex[i * 2] = digits[sum[i] >> 4];
+        hex[i * 2 + 1] = digits[sum[i] & 0xf];
+    }
+
+    hex[SUM_BYTES * 2] = '\0';
+}
+
+void sum_get_stats(struct SumStats *stats)
+{
+    pthread_mutex_lock(&store.lock);
+    stats->hits = store.hits;
+    stats->misses = store.misses;
+    stats->entries = store.entries;
+    stats->hashed_bytes = store.hashed_bytes;
+    pthread_mutex_unlock(&store.lock);
+}
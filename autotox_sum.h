@@ -0,0 +1,61 @@
+#ifndef AUTOTOX_SUM_H
+#define AUTOTOX_SUM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define SUM_BYTES 64                        /* BLAKE2b-512, what b2sum prints by default */
+#define SUM_HEX_SIZE (SUM_BYTES * 2 + 1)
+
+#define SUM_BLOCK_SIZE   (1024 * 1024)
+#define SUM_PIPELINE_MIN (8 * 1024 * 1024)  /* files from this size read ahead on a second thread */
+#define SUM_MAX_THREADS  4                  /* files hashed at once by sum_tree() */
+#define SUM_MAX_FILES    100000
+
+struct SumStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t entries;         /* sums kept in the store */
+    uint64_t hashed_bytes;
+};
+
+struct SumTreeResult {
+    size_t   files;
+    size_t   cached;
+    size_t   failed;          /* vanished, unreadable or changed while hashing */
+    uint64_t bytes;
+    bool     truncated;       /* more than SUM_MAX_FILES files */
+};
+
+/* Loads the sum store kept at path, created on first write. Sums are keyed by device,
+ * inode, size and mtime, so a file changed in any way is hashed again.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the store can not be opened; sums are then only cached in memory.
+ */
+int sum_init(const char *path);
+
+/* Hashes the regular file name below dirfd, or takes the sum from the store.
+ * Symlinks are not followed. Sets cached, if not NULL, when no hashing was needed.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure and leaves errno set; EAGAIN if the file changed while being hashed.
+ */
+int sum_file(int dirfd, const char *name, uint8_t sum[SUM_BYTES], bool *cached);
+
+/* Hashes every regular file below dir on up to SUM_MAX_THREADS threads and writes the
+ * sums to out in b2sum format ("<hex>  <path>"), paths relative to dir and sorted, so
+ * `b2sum -c` checks a copy of the folder against it.
+ *
+ * Returns 0 on success.
+ * Returns -1 if dir can not be read or out can not be written.
+ */
+int sum_tree(const char *dir, FILE *out, struct SumTreeResult *res);
+
+void sum_to_hex(const uint8_t sum[SUM_BYTES], char hex[SUM_HEX_SIZE]);
+
+void sum_get_stats(struct SumStats *stats);
+
+#endif /* AUTOTOX_SUM_H */
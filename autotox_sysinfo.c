@@ -0,0 +1,226 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+#include <sys/statvfs.h>
+
+#include "autotox_sysinfo.h"
+
+static struct {
+    struct SysInfo info;
+    char  *root;
+    int    nlfd;
+    bool   addrs_stale;
+} sampler = {
+    .nlfd = -1,
+    .addrs_stale = true,
+};
+
+/* Reads a small /proc file whole into buf. Returns false if it can not be read. */
+static bool read_proc(const char *path, char *buf, size_t size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return false;
+    }
+
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+
+    if (n <= 0) {
+        return false;
+    }
+
+    buf[n] = '\0';
+
+    return true;
+}
+
+/* Returns the value of field, in kB, from /proc/meminfo text, 0 if it is missing. */
+static uint64_t meminfo_field(const char *text, const char *field)
+{
+    const char *p = strstr(text, field);
+
+    return p ? strtoull(p + strlen(field), NULL, 10) * 1024 : 0;
+}
+
+static unsigned prefix_len(const struct sockaddr *mask)
+{
+    const unsigned char *b;
+    size_t len;
+    unsigned bits = 0;
+
+    if (mask == NULL) {
+        return 0;
+    }
+
+    if (mask->sa_family == AF_INET) {
+        b = (const unsigned char *) &((const struct sockaddr_in *) mask)->sin_addr;
+        len = 4;
+    } else {
+        b = (const unsigned char *) &((const struct sockaddr_in6 *) mask)->sin6_addr;
+        len = 16;
+    }
+
+    for (size_t i = 0; i < len; ++i) {
+        bits += __builtin_popcount(b[i]);
+    }
+
+    return bits;
+}
+
+static void sample_addrs(void)
+{
+    struct ifaddrs *ifs;
+    struct SysInfo *info = &sampler.info;
+
+    if (getifaddrs(&ifs) == -1) {
+        return;
+    }
+
+    info->naddrs = 0;
+
+    for (struct ifaddrs *i = ifs; i && info->naddrs < SYSINFO_MAX_ADDRS; i = i->ifa_next) {
+        if (i->ifa_addr == NULL || !(i->ifa_flags & IFF_UP) || (i->ifa_flags & IFF_LOOPBACK)) {
+            continue;
+        }
+
+        int family = i->ifa_addr->sa_family;
+        const void *addr;
+
+        if (family == AF_INET) {
+            addr = &((const struct sockaddr_in *) i->ifa_addr)->sin_addr;
+        } else if (family == AF_INET6) {
+            const struct in6_addr *a6 = &((const struct sockaddr_in6 *) i->ifa_addr)->sin6_addr;
+
+            /* fe80::/10 is of no use from outside the link */
+            if (IN6_IS_ADDR_LINKLOCAL(a6)) {
+                continue;
+            }
+
+            addr = a6;
+        } else {
+            continue;
+        }
+
+        struct SysAddr *a = &info->addrs[info->naddrs];
+
+        if (inet_ntop(family, addr, a->addr, sizeof(a->addr)) == NULL) {
+            continue;
+        }
+
+        snprintf(a->ifname, sizeof(a->ifname), "%s", i->ifa_name);
+        a->prefix = prefix_len(i->ifa_netmask);
+        ++info->naddrs;
+    }
+
+    freeifaddrs(ifs);
+    ++info->addr_samples;
+    sampler.addrs_stale = false;
+}
+
+static void sample_system(time_t now)
+{
+    struct SysInfo *info = &sampler.info;
+    char buf[4096];
+    struct statvfs vfs;
+    struct timespec boot;
+
+    if (read_proc("/proc/loadavg", buf, sizeof(buf))) {
+        sscanf(buf, "%lf %lf %lf %u/%u", &info->load[0], &info->load[1], &info->load[2], &info->running, &info->tasks);
+    }
+
+    if (read_proc("/proc/meminfo", buf, sizeof(buf))) {
+        info->mem_total = meminfo_field(buf, "MemTotal:");
+        info->mem_avail = meminfo_field(buf, "MemAvailable:");
+    }
+
+    if (sampler.root && statvfs(sampler.root, &vfs) == 0) {
+        info->disk_total = (uint64_t) vfs.f_blocks * vfs.f_frsize;
+        info->disk_free = (uint64_t) vfs.f_bavail * vfs.f_frsize;
+    }
+
+    if (clock_gettime(CLOCK_BOOTTIME, &boot) == 0) {
+        info->uptime_secs = boot.tv_sec;
+    }
+
+    info->sampled = now;
+    ++info->samples;
+}
+
+int sysinfo_init(const char *root)
+{
+    struct sockaddr_nl sa = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR,
+    };
+
+    free(sampler.root);
+    sampler.root = strdup(root);
+
+    sampler.nlfd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+
+    if (sampler.nlfd != -1 && bind(sampler.nlfd, (struct sockaddr *) &sa, sizeof(sa)) == -1) {
+        close(sampler.nlfd);
+        sampler.nlfd = -1;
+    }
+
+    sampler.info.netlink = (sampler.nlfd != -1);
+
+    time_t now = time(NULL);
+    sample_addrs();
+    sample_system(now);
+
+    return sampler.nlfd != -1 ? 0 : -1;
+}
+
+int sysinfo_fd(void)
+{
+    return sampler.nlfd;
+}
+
+void sysinfo_poll(time_t now)
+{
+    char buf[8192];
+
+    if (sampler.nlfd != -1) {
+        ssize_t n;
+
+        /* what changed does not matter, a change is rare and rereading all is cheap */
+        while ((n = recv(sampler.nlfd, buf, sizeof(buf), 0)) > 0 || (n == -1 && errno == EINTR)) {
+            sampler.addrs_stale = true;
+        }
+
+        /* ENOBUFS: events were dropped, so something changed */
+        if (n == -1 && errno == ENOBUFS) {
+            sampler.addrs_stale = true;
+        }
+    }
+
+    bool due = now - sampler.info.sampled >= SYSINFO_REFRESH;
+
+    if (sampler.addrs_stale || (due && sampler.nlfd == -1)) {
+        sample_addrs();
+    }
+
+    if (due) {
+        sample_system(now);
+    }
+}
+
+const struct SysInfo *sysinfo_get(void)
+{
+    return &sampler.info;
+}
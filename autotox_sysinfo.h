@@ -0,0 +1,58 @@
+#ifndef AUTOTOX_SYSINFO_H
+#define AUTOTOX_SYSINFO_H
+
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define SYSINFO_REFRESH   10        /* seconds between samples of load, memory and disk */
+#define SYSINFO_MAX_ADDRS 16
+
+struct SysAddr {
+    char     ifname[IF_NAMESIZE];
+    char     addr[INET6_ADDRSTRLEN];
+    unsigned prefix;
+};
+
+/* What the sampler last saw. Addresses are reread when netlink reports a link or
+ * address change, the rest every SYSINFO_REFRESH seconds; without netlink the
+ * addresses go by the timer too.
+ */
+struct SysInfo {
+    time_t   sampled;
+    uint64_t uptime_secs;
+    double   load[3];
+    unsigned running;
+    unsigned tasks;
+    uint64_t mem_total;
+    uint64_t mem_avail;
+    uint64_t disk_total;        /* of the served root */
+    uint64_t disk_free;         /* available to unprivileged users */
+    struct SysAddr addrs[SYSINFO_MAX_ADDRS];
+    size_t   naddrs;            /* up, not loopback, IPv6 link-local left out */
+    uint64_t samples;
+    uint64_t addr_samples;
+    bool     netlink;
+};
+
+/* Takes the first sample; disk figures are for the filesystem holding root.
+ *
+ * Returns 0 on success.
+ * Returns -1 if netlink is unavailable; the sampler then works on the timer alone.
+ */
+int sysinfo_init(const char *root);
+
+/* Returns the netlink socket to wait on along with other fds, -1 if there is none. */
+int sysinfo_fd(void);
+
+/* Drains netlink events and takes the samples that are due. Call it from the main
+ * loop; the sampler is not thread safe.
+ */
+void sysinfo_poll(time_t now);
+
+const struct SysInfo *sysinfo_get(void);
+
+#endif /* AUTOTOX_SYSINFO_H */
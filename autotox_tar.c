@@ -0,0 +1,573 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "autotox_tar.h"
+
+#define TAR_BLOCK   512
+#define TAR_TRAILER (2 * TAR_BLOCK)     /* two zero blocks end the archive */
+#define TAR_NAME    100                 /* longer names and link targets go in GNU long name records */
+#define NO_LINK     ((size_t) -1)
+
+#define TAR_ROUND(n) (((n) + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK)
+
+struct TarMember {
+    size_t   name;             /* offset in the stream's names, relative to the folder, "" for itself */
+    size_t   link;             /* offset of a symlink's target, NO_LINK if none */
+    char     type;             /* the header's typeflag: '0' file, '2' symlink, '5' folder */
+    mode_t   mode;
+    uint64_t size;
+    time_t   mtime;
+    uint64_t off;              /* where its headers start in the archive */
+    size_t   hdrlen;           /* its headers, long name records included */
+};
+
+/* The members of the folder as found by the walk, read back as an archive. */
+struct TarStream {
+    int      rootfd;
+    char    *base;             /* the folder's name, every member's name starts with it */
+    struct TarMember *members;
+    size_t   count;
+    size_t   cap;
+    char    *names;
+    size_t   names_len;
+    size_t   names_cap;
+    uint64_t size;
+
+    uint64_t pos;
+    size_t   cur;              /* the member pos falls in */
+    int      fd;               /* the file of member fdfor, -1 if none */
+    size_t   fdfor;
+    uint8_t *hdr;              /* the headers of member hdrfor */
+    size_t   hdrcap;
+    size_t   hdrfor;
+};
+
+/*******************************************************************************
+ *
+ * Walk
+ *
+ ******************************************************************************/
+
+/* Returns the offset of len bytes of s copied into ts's names, -1 if out of memory. */
+static long add_name(struct TarStream *ts, const char *s, size_t len)
+{
+    if (ts->names_cap - ts->names_len < len + 1) {
+        size_t cap = ts->names_cap ? ts->names_cap : 65536;
+
+        while (cap - ts->names_len < len + 1) {
+            cap *= 2;
+        }
+
+        char *names = realloc(ts->names, cap);
+
+        if (names == NULL) {
+            return -1;
+        }
+
+        ts->names = names;
+        ts->names_cap = cap;
+    }
+
+    long off = (long) ts->names_len;
+
+    memcpy(ts->names + off, s, len);
+    ts->names[off + len] = '\0';
+    ts->names_len += len + 1;
+
+    return off;
+}
+
+/* Appends the member rel, link being its target or NULL.
+ * Returns false if out of memory or there are too many, with errno set.
+ */
+static bool add_member(struct TarStream *ts, const char *rel, size_t len, const struct stat *st, const char *link)
+{
+    if (ts->count >= TAR_STREAM_MAX_ENTRIES) {
+        errno = E2BIG;
+        return false;
+    }
+
+    if (ts->count == ts->cap) {
+        size_t cap = ts->cap ? ts->cap * 2 : 1024;
+        struct TarMember *members = realloc(ts->members, cap * sizeof(struct TarMember));
+
+        if (members == NULL) {
+            errno = ENOMEM;
+            return false;
+        }
+
+        ts->members = members;
+        ts->cap = cap;
+    }
+
+    long name = add_name(ts, rel, len);
+    long target = (link != NULL) ? add_name(ts, link, strlen(link)) : 0;
+
+    if (name == -1 || target == -1) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    struct TarMember *m = &ts->members[ts->count++];
+
+    *m = (struct TarMember) {
+        .name = (size_t) name,
+        .link = (link != NULL) ? (size_t) target : NO_LINK,
+        .type = S_ISDIR(st->st_mode) ? '5' : S_ISLNK(st->st_mode) ? '2' : '0',
+        .mode = st->st_mode & 07777,
+        .size = S_ISREG(st->st_mode) ? (uint64_t) st->st_size : 0,
+        .mtime = st->st_mtime,
+    };
+
+    return true;
+}
+
+/* Adds every entry of folder member i, the folders among them are walked when the loop reaches them.
+ * Returns false if out of memory or there are too many entries; an unreadable folder is skipped.
+ */
+static bool walk_folder(struct TarStream *ts, size_t i, struct TarStreamResult *res)
+{
+    char rel[PATH_MAX];
+    char link[PATH_MAX];
+    size_t rellen = (size_t) snprintf(rel, sizeof(rel), "%s", ts->names + ts->members[i].name);
+    int fd = (rellen == 0) ? dup(ts->rootfd) : openat(ts->rootfd, rel, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = (fd != -1) ? fdopendir(fd) : NULL;
+    struct dirent *d;
+    bool ok = true;
+
+    if (dir == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+
+        return true;
+    }
+
+    while (ok && (d = readdir(dir)) != NULL) {
+        const char *name = d->d_name;
+        struct stat st;
+
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+
+        size_t len = (size_t) snprintf(rel + rellen, sizeof(rel) - rellen, "%s%s", (rellen > 0) ? "/" : "", name) + rellen;
+
+        if (len >= sizeof(rel) || fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            ++res->skipped;
+        } else if (S_ISREG(st.st_mode)) {
+            ok = add_member(ts, rel, len, &st, NULL);
+            ++res->files;
+            res->file_bytes += st.st_size;
+        } else if (S_ISDIR(st.st_mode)) {
+            ok = add_member(ts, rel, len, &st, NULL);
+            ++res->dirs;
+        } else if (S_ISLNK(st.st_mode)) {
+            ssize_t n = readlinkat(fd, name, link, sizeof(link) - 1);
+
+            if (n == -1) {
+                ++res->skipped;
+                continue;
+            }
+
+            link[n] = '\0';
+            ok = add_member(ts, rel, len, &st, link);
+            ++res->links;
+        } else {
+            ++res->skipped;
+        }
+    }
+
+    closedir(dir);
+
+    return ok;
+}
+
+static int cmp_member(const void *a, const void *b, void *names)
+{
+    return strcmp((const char *) names + ((const struct TarMember *) a)->name,
+                  (const char *) names + ((const struct TarMember *) b)->name);
+}
+
+/*******************************************************************************
+ *
+ * Headers
+ *
+ ******************************************************************************/
+
+/* Returns the length of member m's name in the archive: the folder's name, '/', its path, '/' if a folder. */
+static size_t full_name_len(const struct TarStream *ts, const struct TarMember *m)
+{
+    size_t len = strlen(ts->names + m->name);
+
+    return strlen(ts->base) + 1 + len + ((m->type == '5' && len > 0) ? 1 : 0);
+}
+
+static size_t headers_len(const struct TarStream *ts, const struct TarMember *m)
+{
+    size_t name = full_name_len(ts, m);
+    size_t link = (m->link != NO_LINK) ? strlen(ts->names + m->link) : 0;
+    size_t len = TAR_BLOCK;
+
+    if (name > TAR_NAME) {
+        len += TAR_BLOCK + TAR_ROUND(name + 1);
+    }
+
+    if (link > TAR_NAME) {
+        len += TAR_BLOCK + TAR_ROUND(link + 1);
+    }
+
+    return len;
+}
+
+/* Writes value into the numeric field of len bytes at f: octal, or base-256 if it does not fit. */
+static void put_number(uint8_t *f, size_t len, uint64_t value)
+{
+    if (len < 12 || value < (1ULL << (3 * (len - 1)))) {
+        for (size_t i = len - 1; i-- > 0; value >>= 3) {
+            f[i] = '0' + (value & 7);
+        }
+
+        f[len - 1] = '\0';
+        return;
+    }
+
+    for (size_t i = len; i-- > 1; value >>= 8) {
+        f[i] = value & 0xFF;
+    }
+
+    f[0] = 0x80;
+}
+
+/* Writes one header block of typeflag type for name, size bytes following it. */
+static void put_header(uint8_t *h, const char *name, char type, const struct TarMember *m, const char *link,
+                       uint64_t size)
+{
+    unsigned sum = 0;
+
+    memset(h, 0, TAR_BLOCK);
+    memcpy(h, name, strnlen(name, TAR_NAME));
+    put_number(h + 100, 8, m->mode);
+    put_number(h + 108, 8, 0);
+    put_number(h + 116, 8, 0);
+    put_number(h + 124, 12, size);
+    put_number(h + 136, 12, (m->mtime > 0) ? (uint64_t) m->mtime : 0);
+    h[156] = type;
+
+    if (link != NULL) {
+        memcpy(h + 157, link, strnlen(link, TAR_NAME));
+    }
+
+    /* GNU magic, which goes with its long name records */
+    memcpy(h + 257, "ustar  ", 8);
+    memcpy(h + 265, "root", 4);
+    memcpy(h + 297, "root", 4);
+    memset(h + 148, ' ', 8);
+
+    for (size_t i = 0; i < TAR_BLOCK; ++i) {
+        sum += h[i];
+    }
+
+    put_number(h + 148, 7, sum);
+}
+
+/* Writes a GNU long name record of typeflag type holding s, len bytes long, at h.
+ * Returns the bytes written.
+ */
+static size_t put_long_name(uint8_t *h, char type, const struct TarMember *m, const char *s, size_t len)
+{
+    put_header(h, "././@LongLink", type, m, NULL, len + 1);
+    memset(h + TAR_BLOCK, 0, TAR_ROUND(len + 1));
+    memcpy(h + TAR_BLOCK, s, len);
+
+    return TAR_BLOCK + TAR_ROUND(len + 1);
+}
+
+/* Builds the headers of member i into ts->hdr.
+ * Returns false if out of memory.
+ */
+static bool build_headers(struct TarStream *ts, size_t i)
+{
+    const struct TarMember *m = &ts->members[i];
+    char name[2 * PATH_MAX];
+    const char *rel = ts->names + m->name;
+    const char *link = (m->link != NO_LINK) ? ts->names + m->link : NULL;
+    size_t namelen = (size_t) snprintf(name, sizeof(name), "%s/%s%s", ts->base, rel,
+                                       (m->type == '5' && rel[0] != '\0') ? "/" : "");
+    size_t len = 0;
+
+    if (ts->hdrcap < m->hdrlen) {
+        uint8_t *hdr = realloc(ts->hdr, m->hdrlen);
+
+        if (hdr == NULL) {
+            return false;
+        }
+
+        ts->hdr = hdr;
+        ts->hdrcap = m->hdrlen;
+    }
+
+    if (link != NULL && strlen(link) > TAR_NAME) {
+        len += put_long_name(ts->hdr + len, 'K', m, link, strlen(link));
+    }
+
+    if (namelen > TAR_NAME) {
+        len += put_long_name(ts->hdr + len, 'L', m, name, namelen);
+    }
+
+    put_header(ts->hdr + len, name, m->type, m, link, m->size);
+    ts->hdrfor = i;
+
+    return true;
+}
+
+/*******************************************************************************
+ *
+ * Stream
+ *
+ ******************************************************************************/
+
+/* Copies n bytes of member m's file from d on into buf, zeros where it ended early, can not be read
+ * or is no longer a regular file. */
+static void read_file(struct TarStream *ts, const struct TarMember *m, uint64_t d, char *buf, size_t n)
+{
+    size_t done = 0;
+
+    if (ts->fdfor != ts->cur) {
+        if (ts->fd != -1) {
+            close(ts->fd);
+        }
+
+        struct stat st;
+
+        /* it may have been replaced since the walk: a fifo would block the open, nonblocking it does not */
+        ts->fd = openat(ts->rootfd, ts->names + m->name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+        ts->fdfor = ts->cur;
+
+        if (ts->fd != -1 && (fstat(ts->fd, &st) == -1 || !S_ISREG(st.st_mode))) {
+            close(ts->fd);
+            ts->fd = -1;
+        }
+
+        if (ts->fd != -1) {
+            posix_fadvise(ts->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+    }
+
+    while (done < n && ts->fd != -1) {
+        ssize_t r = pread(ts->fd, buf + done, n - done, (off_t) (d + done));
+
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (r <= 0) {
+            break;
+        }
+
+        done += r;
+    }
+
+    memset(buf + done, 0, n - done);
+}
+
+static ssize_t tar_read(void *cookie, char *buf, size_t size)
+{
+    struct TarStream *ts = cookie;
+    size_t done = 0;
+
+    while (done < size && ts->pos < ts->size) {
+        size_t n = size - done;
+
+        if (ts->pos >= ts->size - TAR_TRAILER) {
+            if (n > ts->size - ts->pos) {
+                n = ts->size - ts->pos;
+            }
+
+            memset(buf + done, 0, n);
+        } else {
+            while (ts->cur + 1 < ts->count && ts->members[ts->cur + 1].off <= ts->pos) {
+                ++ts->cur;
+            }
+
+            const struct TarMember *m = &ts->members[ts->cur];
+            uint64_t rel = ts->pos - m->off;
+
+            if (rel < m->hdrlen) {
+                if (ts->hdrfor != ts->cur && !build_headers(ts, ts->cur)) {
+                    errno = ENOMEM;
+                    return (done > 0) ? (ssize_t) done : -1;
+                }
+
+                if (n > m->hdrlen - rel) {
+                    n = m->hdrlen - rel;
+                }
+
+                memcpy(buf + done, ts->hdr + rel, n);
+            } else if (rel - m->hdrlen < m->size) {
+                uint64_t d = rel - m->hdrlen;
+
+                if (n > m->size - d) {
+                    n = m->size - d;
+                }
+
+                read_file(ts, m, d, buf + done, n);
+            } else {
+                uint64_t end = m->hdrlen + TAR_ROUND(m->size);
+
+                if (n > end - rel) {
+                    n = end - rel;
+                }
+
+                memset(buf + done, 0, n);
+            }
+        }
+
+        done += n;
+        ts->pos += n;
+    }
+
+    return done;
+}
+
+static int tar_seek(void *cookie, off64_t *offset, int whence)
+{
+    struct TarStream *ts = cookie;
+    off64_t base = (whence == SEEK_SET) ? 0 : (whence == SEEK_CUR) ? (off64_t) ts->pos : (off64_t) ts->size;
+
+    if (base + *offset < 0 || base + *offset > (off64_t) ts->size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ts->pos = base + *offset;
+    *offset = ts->pos;
+
+    /* the last member starting at or before pos */
+    size_t lo = 0, hi = ts->count;
+
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (ts->members[mid].off <= ts->pos) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    ts->cur = lo;
+
+    return 0;
+}
+
+static void tar_free(struct TarStream *ts)
+{
+    if (ts->fd != -1) {
+        close(ts->fd);
+    }
+
+    if (ts->rootfd != -1) {
+        close(ts->rootfd);
+    }
+
+    free(ts->base);
+    free(ts->members);
+    free(ts->names);
+    free(ts->hdr);
+    free(ts);
+}
+
+static int tar_close(void *cookie)
+{
+    tar_free(cookie);
+
+    return 0;
+}
+
+FILE *tar_stream_open(const char *path, struct TarStreamResult *res)
+{
+    struct TarStream *ts = calloc(1, sizeof(struct TarStream));
+    const char *slash = strrchr(path, '/');
+    struct stat st;
+    int err;
+
+    *res = (struct TarStreamResult) {0};
+
+    if (ts == NULL) {
+        return NULL;
+    }
+
+    ts->rootfd = -1;
+    ts->fd = -1;
+    ts->fdfor = (size_t) -1;
+    ts->hdrfor = (size_t) -1;
+    ts->base = strdup((slash != NULL && slash[1] != '\0') ? slash + 1 : "root");
+
+    if (ts->base == NULL) {
+        err = ENOMEM;
+        goto fail;
+    }
+
+    ts->rootfd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+    if (ts->rootfd == -1 || fstat(ts->rootfd, &st) == -1 || !add_member(ts, "", 0, &st, NULL)) {
+        err = errno;
+        goto fail;
+    }
+
+    /* the list grows as it is walked: each folder adds its entries after the ones found so far */
+    for (size_t i = 0; i < ts->count; ++i) {
+        if (ts->members[i].type == '5' && !walk_folder(ts, i, res)) {
+            err = errno;
+            goto fail;
+        }
+    }
+
+    /* sorted by name, a folder comes before everything in it */
+    qsort_r(ts->members, ts->count, sizeof(struct TarMember), cmp_member, ts->names);
+
+    for (size_t i = 0; i < ts->count; ++i) {
+        struct TarMember *m = &ts->members[i];
+
+        m->off = ts->size;
+        m->hdrlen = headers_len(ts, m);
+        ts->size += m->hdrlen + TAR_ROUND(m->size);
+    }
+
+    ts->size += TAR_TRAILER;
+
+    cookie_io_functions_t io = {
+        .read = tar_read,
+        .seek = tar_seek,
+        .close = tar_close,
+    };
+
+    FILE *fp = fopencookie(ts, "r", io);
+
+    if (fp == NULL) {
+        err = errno;
+        goto fail;
+    }
+
+    res->size = ts->size;
+
+    return fp;
+
+fail:
+    tar_free(ts);
+    errno = err;
+
+    return NULL;
+}
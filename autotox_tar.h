@@ -0,0 +1,32 @@
+#ifndef AUTOTOX_TAR_H
+#define AUTOTOX_TAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TAR_STREAM_MAX_ENTRIES 1000000
+
+struct TarStreamResult {
+    size_t   files;
+    size_t   dirs;
+    size_t   links;
+    size_t   skipped;          /* fifos, sockets, devices and entries that vanished during the walk */
+    uint64_t file_bytes;       /* size of the regular files archived */
+    uint64_t size;             /* size of the whole archive, what the stream reads */
+};
+
+/* Walks the folder path and returns a tar archive of it, every name starting with the
+ * folder's own name. Only the walk happens here: headers are built and files are read as the
+ * stream is read, so nothing is staged on disk or in memory and the exact size is known
+ * before the first byte is sent. A file that shrinks meanwhile is padded with zeros, one that
+ * grows is cut at the size it had during the walk, so the size never changes. Names too long
+ * for ustar use the GNU long name records, files of 8 GiB or more a base-256 size.
+ *
+ * Returns a stream reading the archive, which closes the files and frees the list once closed.
+ * Returns NULL on failure and leaves errno set: E2BIG if the folder holds more than
+ * TAR_STREAM_MAX_ENTRIES entries.
+ */
+FILE *tar_stream_open(const char *path, struct TarStreamResult *res);
+
+#endif /* AUTOTOX_TAR_H */
@@ -0,0 +1,1214 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "autotox_index.h"
+#include "autotox_text.h"
+#include "autotox_work.h"
+
+#define TEXT_DOC_DEAD   1
+#define TEXT_DOC_BINARY 2
+#define TEXT_READ_BLOCK (64 * 1024)
+#define TEXT_NONE       UINT32_MAX
+#define TEXT_MAGIC      "ATXTXT1\n"
+
+/* A word and its posting list: (doc, line) pairs in increasing order, each stored as the
+ * varint doc delta followed by the line, or by the line delta when the doc is the same.
+ */
+struct Term {
+    uint32_t hash;
+    uint32_t count;           /* postings */
+    uint32_t lastdoc;
+    uint32_t lastline;
+    uint32_t len;
+    uint32_t cap;
+    uint8_t *post;
+    uint8_t  wlen;
+    char     word[];
+};
+
+struct TermTable {
+    struct Term **slots;      /* open addressing, linear probing */
+    size_t mask;
+    size_t count;
+};
+
+struct TextDoc {
+    char    *path;            /* relative to the root */
+    uint64_t size;            /* size, mtime and inode as the file index had them */
+    int64_t  mtime;
+    uint64_t ino;
+    uint32_t npost;
+    uint8_t  flags;
+};
+
+struct PostIter {
+    const uint8_t *p;
+    const uint8_t *end;
+    uint32_t doc;
+    uint32_t line;
+};
+
+static struct {
+    /* searches read under it; the pass, the only writer, takes it only to change the index */
+    pthread_rwlock_t lock;
+    struct TermTable terms;
+    struct TextDoc *docs;
+    size_t   ndocs;
+    size_t   capdocs;
+    size_t   dead;
+    size_t   binary;
+    uint64_t postings;
+    uint64_t dead_postings;
+    size_t   bytes;
+    uint64_t text_bytes;
+    size_t   unindexed;
+    uint64_t disk_bytes;
+    uint64_t passes;
+    double   pass_secs;
+    bool     complete;
+
+    char    *root;
+    char    *path;
+    size_t   max_bytes;
+    uint64_t max_disk;
+    bool     started;
+
+    /* pass only */
+    bool     loaded;
+    bool     budget_full;
+
+    /* main thread, and the pass it submitted */
+    struct WorkJob pass;
+    bool     running;
+    bool     more;            /* the last pass ran out of budget */
+    bool     crawling;        /* the file index was still crawling when the pass started */
+    time_t   last_pass;
+    uint64_t seen_events;
+} text = {
+    .lock = PTHREAD_RWLOCK_INITIALIZER,
+    .seen_events = UINT64_MAX,
+};
+
+/*******************************************************************************
+ *
+ * Terms and Postings
+ *
+ ******************************************************************************/
+
+static uint32_t hash_word(const char *w, size_t n)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < n; ++i) {
+        h = (h ^ (uint8_t) w[i]) * 16777619u;
+    }
+
+    return h;
+}
+
+static bool is_word_byte(unsigned char c)
+{
+    /* bytes of UTF-8 sequences count as letters, so other scripts are indexed as they are */
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c >= 0x80;
+}
+
+static struct Term **table_slot(const struct TermTable *t, const char *w, size_t n, uint32_t h)
+{
+    for (size_t i = h & t->mask;; i = (i + 1) & t->mask) {
+        struct Term *e = t->slots[i];
+
+        if (e == NULL || (e->hash == h && e->wlen == n && memcmp(e->word, w, n) == 0)) {
+            return &t->slots[i];
+        }
+    }
+}
+
+static const struct Term *table_find(const struct TermTable *t, const char *w, size_t n)
+{
+    return t->slots ? *table_slot(t, w, n, hash_word(w, n)) : NULL;
+}
+
+/* Returns the term for w, added if missing, and adds the memory it took to *bytes.
+ * Returns NULL if out of memory.
+ */
+static struct Term *table_get(struct TermTable *t, const char *w, size_t n, uint32_t h, size_t *bytes)
+{
+    size_t nslots = t->slots ? t->mask + 1 : 0;
+
+    if ((t->count + 1) * 4 > nslots * 3) {
+        size_t grown = nslots ? nslots * 2 : 1024;
+        struct Term **slots = calloc(grown, sizeof(*slots));
+
+        if (slots == NULL) {
+            return NULL;
+        }
+
+        for (size_t i = 0; i < nslots; ++i) {
+            struct Term *e = t->slots[i];
+            size_t k = e ? e->hash & (grown - 1) : 0;
+
+            while (e && slots[k]) {
+                k = (k + 1) & (grown - 1);
+            }
+
+            if (e) {
+                slots[k] = e;
+            }
+        }
+
+        free(t->slots);
+        t->slots = slots;
+        t->mask = grown - 1;
+        *bytes += (grown - nslots) * sizeof(*slots);
+    }
+
+    struct Term **slot = table_slot(t, w, n, h);
+
+    if (*slot == NULL) {
+        struct Term *e = calloc(1, sizeof(*e) + n + 1);
+
+        if (e == NULL) {
+            return NULL;
+        }
+
+        e->hash = h;
+        e->wlen = n;
+        memcpy(e->word, w, n);
+        *slot = e;
+        ++t->count;
+        *bytes += sizeof(*e) + n + 1;
+    }
+
+    return *slot;
+}
+
+static void table_free(struct TermTable *t)
+{
+    for (size_t i = 0; t->slots && i <= t->mask; ++i) {
+        if (t->slots[i]) {
+            free(t->slots[i]->post);
+            free(t->slots[i]);
+        }
+    }
+
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
+
+static size_t put_varint(uint8_t *p, uint32_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = v | 0x80;
+        v >>= 7;
+    }
+
+    p[n++] = v;
+
+    return n;
+}
+
+static bool get_varint(const uint8_t **p, const uint8_t *end, uint32_t *v)
+{
+    uint32_t shift = 0;
+
+    *v = 0;
+
+    while (*p < end && shift < 35) {
+        uint8_t b = *(*p)++;
+        *v |= (uint32_t)(b & 0x7f) << shift;
+
+        if (!(b & 0x80)) {
+            return true;
+        }
+
+        shift += 7;
+    }
+
+    return false;
+}
+
+/* Appends (doc, line) to the postings of e, once per line. Returns false if out of memory. */
+static bool post_add(struct Term *e, uint32_t doc, uint32_t line, size_t *bytes)
+{
+    if (e->count > 0 && doc == e->lastdoc && line == e->lastline) {
+        return true;
+    }
+
+    if (e->len + 10 > e->cap) {
+        uint32_t cap = e->cap ? e->cap * 2 : 16;
+        uint8_t *p = realloc(e->post, cap);
+
+        if (p == NULL) {
+            return false;
+        }
+
+        *bytes += cap - e->cap;
+        e->post = p;
+        e->cap = cap;
+    }
+
+    uint32_t dd = doc - e->lastdoc;
+
+    e->len += put_varint(e->post + e->len, dd);
+    e->len += put_varint(e->post + e->len, dd ? line : line - e->lastline);
+    e->lastdoc = doc;
+    e->lastline = line;
+    ++e->count;
+
+    return true;
+}
+
+static void post_iter(struct PostIter *it, const struct Term *e)
+{
+    it->p = e->post;
+    it->end = e->post + e->len;
+    it->doc = 0;
+    it->line = 0;
+}
+
+static bool post_next(struct PostIter *it)
+{
+    uint32_t dd, v;
+
+    if (!get_varint(&it->p, it->end, &dd) || !get_varint(&it->p, it->end, &v)) {
+        return false;
+    }
+
+    it->doc += dd;
+    it->line = dd ? v : it->line + v;
+
+    return true;
+}
+
+/*******************************************************************************
+ *
+ * Documents
+ *
+ ******************************************************************************/
+
+/* Appends a document, to be called with the lock held for writing. Returns its id, TEXT_NONE if out of memory. */
+static uint32_t add_doc(const struct DirEntry *e, uint8_t flags)
+{
+    if (text.ndocs == text.capdocs) {
+        size_t cap = text.capdocs ? text.capdocs * 2 : 256;
+        struct TextDoc *docs = realloc(text.docs, cap * sizeof(*docs));
+
+        if (docs == NULL) {
+            return TEXT_NONE;
+        }
+
+        text.bytes += (cap - text.capdocs) * sizeof(*docs);
+        text.docs = docs;
+        text.capdocs = cap;
+    }
+
+    struct TextDoc *d = &text.docs[text.ndocs];
+
+    if ((d->path = strdup(e->name)) == NULL) {
+        return TEXT_NONE;
+    }
+
+    d->size = e->size;
+    d->mtime = e->mtime;
+    d->ino = e->ino;
+    d->npost = 0;
+    d->flags = flags;
+    text.bytes += strlen(e->name) + 1;
+    text.text_bytes += (flags & TEXT_DOC_BINARY) ? 0 : e->size;
+    text.binary += (flags & TEXT_DOC_BINARY) != 0;
+
+    return text.ndocs++;
+}
+
+/* Marks a document dead, to be called with the lock held for writing. Its postings stay until compacted. */
+static void kill_doc(uint32_t id)
+{
+    struct TextDoc *d = &text.docs[id];
+
+    if (d->flags & TEXT_DOC_DEAD) {
+        return;
+    }
+
+    d->flags |= TEXT_DOC_DEAD;
+    ++text.dead;
+    text.dead_postings += d->npost;
+    text.text_bytes -= (d->flags & TEXT_DOC_BINARY) ? 0 : d->size;
+    text.binary -= (d->flags & TEXT_DOC_BINARY) != 0;
+}
+
+/* Returns the memory merge_doc() would add to the index for local: lists grow by doubling,
+ * so a few words of a small file can cost as much as their lists already hold.
+ */
+static size_t merge_cost(const struct TermTable *local)
+{
+    size_t cost = 0, added = 0;
+
+    for (size_t i = 0; local->slots && i <= local->mask; ++i) {
+        const struct Term *l = local->slots[i];
+
+        if (l == NULL) {
+            continue;
+        }
+
+        const struct Term *g = table_find(&text.terms, l->word, l->wlen);
+        uint64_t len = (g ? g->len : 0) + l->len + 5;     /* the first posting carries a doc delta */
+        uint64_t cap = g ? g->cap : 0;
+
+        while (len + 10 > cap) {
+            cap = cap ? cap * 2 : 16;
+        }
+
+        cost += cap - (g ? g->cap : 0);
+
+        if (g == NULL) {
+            cost += sizeof(*g) + l->wlen + 1;
+            ++added;
+        }
+    }
+
+    size_t nslots = text.terms.slots ? text.terms.mask + 1 : 0;
+
+    while ((text.terms.count + added) * 4 > nslots * 3) {
+        cost += (nslots ? nslots : 1024) * sizeof(struct Term *);
+        nslots = nslots ? nslots * 2 : 1024;
+    }
+
+    return cost;
+}
+
+/* Moves the postings of the words in local, a file's own table, to document id. */
+static bool merge_doc(uint32_t id, const struct TermTable *local)
+{
+    for (size_t i = 0; local->slots && i <= local->mask; ++i) {
+        const struct Term *l = local->slots[i];
+        struct PostIter it;
+
+        if (l == NULL) {
+            continue;
+        }
+
+        struct Term *g = table_get(&text.terms, l->word, l->wlen, l->hash, &text.bytes);
+
+        if (g == NULL) {
+            return false;
+        }
+
+        post_iter(&it, l);
+
+        while (post_next(&it)) {
+            uint32_t before = g->count;
+
+            if (!post_add(g, id, it.line, &text.bytes)) {
+                return false;
+            }
+
+            text.docs[id].npost += g->count - before;
+            text.postings += g->count - before;
+        }
+    }
+
+    return true;
+}
+
+/* Reads a file and collects its words, with the lines they are on, into local.
+ * Returns 0, 1 if it looks binary, -1 if it can not be read or out of memory.
+ */
+static int scan_file(int rootfd, const char *name, struct TermTable *local, size_t *local_bytes, uint64_t *io)
+{
+    int fd = openat(rootfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    char *buf = malloc(TEXT_READ_BLOCK);
+    char word[TEXT_TERM_MAX];
+    size_t wlen = 0;
+    uint32_t line = 1;
+    uint64_t off = 0;
+    int ret = 0;
+
+    if (fd == -1 || buf == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+
+        free(buf);
+        return -1;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while (ret == 0 && off < TEXT_MAX_FILE) {
+        ssize_t n = read(fd, buf, TEXT_READ_BLOCK);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            ret = (n == 0) ? 0 : -1;
+            break;
+        }
+
+        if (off == 0 && memchr(buf, '\0', (n < TEXT_BINARY_PEEK) ? n : TEXT_BINARY_PEEK)) {
+            ret = 1;
+            break;
+        }
+
+        off += n;
+        *io += n;
+
+        /* a byte past the word's end, or the end of the file below, adds the word */
+        for (ssize_t i = 0; i < n; ++i) {
+            unsigned char c = buf[i];
+
+            if (is_word_byte(c)) {
+                if (wlen < TEXT_TERM_MAX) {
+                    word[wlen++] = (c >= 'A' && c <= 'Z') ? c + 32 : c;
+                }
+
+                continue;
+            }
+
+            if (wlen >= TEXT_TERM_MIN) {
+                struct Term *e = table_get(local, word, wlen, hash_word(word, wlen), local_bytes);
+
+                if (e == NULL || !post_add(e, 0, line, local_bytes)) {
+                    ret = -1;
+                    break;
+                }
+            }
+
+            wlen = 0;
+            line += (c == '\n');
+        }
+    }
+
+    if (ret == 0 && wlen >= TEXT_TERM_MIN) {
+        struct Term *e = table_get(local, word, wlen, hash_word(word, wlen), local_bytes);
+        ret = (e && post_add(e, 0, line, local_bytes)) ? 0 : -1;
+    }
+
+    close(fd);
+    free(buf);
+
+    return ret;
+}
+
+/* Drops the dead documents and their postings. The new index is built beside the old one,
+ * which only this pass changes, so searches wait only while the two are swapped.
+ */
+static void compact(void)
+{
+    struct TermTable terms = {0};
+    uint32_t *newid = malloc((text.ndocs + 1) * sizeof(*newid));
+    size_t live = text.ndocs - text.dead;
+    struct TextDoc *docs = malloc((live + 1) * sizeof(*docs));
+    size_t bytes = (live + 1) * sizeof(*docs);
+    uint32_t n = 0;
+
+    if (newid == NULL || docs == NULL) {
+        goto fail;
+    }
+
+    for (size_t i = 0; i < text.ndocs; ++i) {
+        newid[i] = (text.docs[i].flags & TEXT_DOC_DEAD) ? TEXT_NONE : n;
+
+        if (newid[i] != TEXT_NONE) {
+            docs[n++] = text.docs[i];
+            bytes += strlen(text.docs[i].path) + 1;
+        }
+    }
+
+    for (size_t i = 0; text.terms.slots && i <= text.terms.mask; ++i) {
+        const struct Term *old = text.terms.slots[i];
+        struct Term *e = NULL;
+        struct PostIter it;
+
+        if (old == NULL) {
+            continue;
+        }
+
+        post_iter(&it, old);
+
+        while (post_next(&it)) {
+            if (newid[it.doc] == TEXT_NONE) {
+                continue;
+            }
+
+            if (e == NULL && (e = table_get(&terms, old->word, old->wlen, old->hash, &bytes)) == NULL) {
+                goto fail;
+            }
+
+            if (!post_add(e, newid[it.doc], it.line, &bytes)) {
+                goto fail;
+            }
+        }
+    }
+
+    pthread_rwlock_wrlock(&text.lock);
+
+    for (size_t i = 0; i < text.ndocs; ++i) {
+        if (newid[i] == TEXT_NONE) {
+            free(text.docs[i].path);
+        }
+    }
+
+    struct TermTable old = text.terms;
+    struct TextDoc *olddocs = text.docs;
+
+    text.terms = terms;
+    text.docs = docs;
+    text.ndocs = text.capdocs = live;
+    text.postings -= text.dead_postings;
+    text.dead = 0;
+    text.dead_postings = 0;
+    text.bytes = bytes;
+
+    pthread_rwlock_unlock(&text.lock);
+
+    table_free(&old);
+    free(olddocs);
+    free(newid);
+
+    return;
+
+fail:
+    table_free(&terms);
+    free(docs);
+    free(newid);
+}
+
+/*******************************************************************************
+ *
+ * Saving
+ *
+ ******************************************************************************/
+
+static void save_index(void)
+{
+    char tmp[4096];
+    uint64_t size = strlen(TEXT_MAGIC) + 2 + strlen(text.root) + 8;
+
+    for (size_t i = 0; i < text.ndocs; ++i) {
+        size += 31 + strlen(text.docs[i].path);
+    }
+
+    for (size_t i = 0; text.terms.slots && i <= text.terms.mask; ++i) {
+        const struct Term *e = text.terms.slots[i];
+        size += e ? 17 + e->wlen + e->len : 0;
+    }
+
+    /* an older, smaller save would be loaded as if current: better none */
+    if (size > text.max_disk) {
+        unlink(text.path);
+        text.disk_bytes = 0;
+        return;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", text.path);
+
+    FILE *f = fopen(tmp, "wb");
+
+    if (f == NULL) {
+        return;
+    }
+
+    uint16_t rootlen = strlen(text.root);
+    uint32_t ndocs = text.ndocs, nterms = text.terms.count;
+
+    fwrite(TEXT_MAGIC, 1, strlen(TEXT_MAGIC), f);
+    fwrite(&rootlen, sizeof(rootlen), 1, f);
+    fwrite(text.root, 1, rootlen, f);
+    fwrite(&ndocs, sizeof(ndocs), 1, f);
+    fwrite(&nterms, sizeof(nterms), 1, f);
+
+    for (size_t i = 0; i < text.ndocs; ++i) {
+        const struct TextDoc *d = &text.docs[i];
+        uint16_t len = strlen(d->path);
+
+        fwrite(&d->size, sizeof(d->size), 1, f);
+        fwrite(&d->mtime, sizeof(d->mtime), 1, f);
+        fwrite(&d->ino, sizeof(d->ino), 1, f);
+        fwrite(&d->npost, sizeof(d->npost), 1, f);
+        fwrite(&d->flags, sizeof(d->flags), 1, f);
+        fwrite(&len, sizeof(len), 1, f);
+        fwrite(d->path, 1, len, f);
+    }
+
+    for (size_t i = 0; text.terms.slots && i <= text.terms.mask; ++i) {
+        const struct Term *e = text.terms.slots[i];
+
+        if (e == NULL) {
+            continue;
+        }
+
+        fwrite(&e->wlen, sizeof(e->wlen), 1, f);
+        fwrite(e->word, 1, e->wlen, f);
+        fwrite(&e->count, sizeof(e->count), 1, f);
+        fwrite(&e->lastdoc, sizeof(e->lastdoc), 1, f);
+        fwrite(&e->lastline, sizeof(e->lastline), 1, f);
+        fwrite(&e->len, sizeof(e->len), 1, f);
+        fwrite(e->post, 1, e->len, f);
+    }
+
+    bool ok = (fflush(f) == 0 && !ferror(f) && fsync(fileno(f)) == 0);
+
+    if (fclose(f) == 0 && ok && rename(tmp, text.path) == 0) {
+        text.disk_bytes = size;
+    } else {
+        unlink(tmp);
+    }
+}
+
+/* Loads a saved index into the empty one. Anything that does not check out discards it all. */
+static void load_index(void)
+{
+    FILE *f = fopen(text.path, "rb");
+    char magic[sizeof(TEXT_MAGIC) - 1];
+    char root[4096];
+    uint16_t rootlen;
+    uint32_t ndocs, nterms;
+    size_t bytes = 0;
+
+    if (f == NULL) {
+        return;
+    }
+
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, TEXT_MAGIC, sizeof(magic)) != 0
+            || fread(&rootlen, sizeof(rootlen), 1, f) != 1 || rootlen >= sizeof(root)
+            || fread(root, 1, rootlen, f) != rootlen || (root[rootlen] = '\0', strcmp(root, text.root) != 0)
+            || fread(&ndocs, sizeof(ndocs), 1, f) != 1 || fread(&nterms, sizeof(nterms), 1, f) != 1
+            || ndocs > TEXT_MAX_DOCS) {
+        fclose(f);
+        return;
+    }
+
+    struct TextDoc *docs = calloc(ndocs + 1, sizeof(*docs));
+    struct TermTable terms = {0};
+    size_t dead = 0, binary = 0;
+    uint64_t postings = 0, dead_postings = 0, text_bytes = 0;
+    bool ok = (docs != NULL);
+
+    bytes += (ndocs + 1) * sizeof(*docs);
+
+    for (uint32_t i = 0; ok && i < ndocs; ++i) {
+        struct TextDoc *d = &docs[i];
+        uint16_t len;
+
+        ok = fread(&d->size, sizeof(d->size), 1, f) == 1 && fread(&d->mtime, sizeof(d->mtime), 1, f) == 1
+             && fread(&d->ino, sizeof(d->ino), 1, f) == 1 && fread(&d->npost, sizeof(d->npost), 1, f) == 1
+             && fread(&d->flags, sizeof(d->flags), 1, f) == 1 && fread(&len, sizeof(len), 1, f) == 1
+             && (d->path = malloc(len + 1)) != NULL && fread(d->path, 1, len, f) == len;
+
+        if (ok) {
+            d->path[len] = '\0';
+            bytes += len + 1;
+            dead += (d->flags & TEXT_DOC_DEAD) != 0;
+            dead_postings += (d->flags & TEXT_DOC_DEAD) ? d->npost : 0;
+            binary += (d->flags & (TEXT_DOC_DEAD | TEXT_DOC_BINARY)) == TEXT_DOC_BINARY;
+            text_bytes += (d->flags & (TEXT_DOC_DEAD | TEXT_DOC_BINARY)) ? 0 : d->size;
+        }
+    }
+
+    for (uint32_t i = 0; ok && i < nterms; ++i) {
+        char word[TEXT_TERM_MAX];
+        uint8_t wlen;
+        uint32_t count, lastdoc, lastline, len;
+        struct Term *e;
+        struct PostIter it;
+        uint32_t n = 0;
+
+        ok = fread(&wlen, sizeof(wlen), 1, f) == 1 && wlen >= 1 && wlen <= TEXT_TERM_MAX
+             && fread(word, 1, wlen, f) == wlen && fread(&count, sizeof(count), 1, f) == 1
+             && fread(&lastdoc, sizeof(lastdoc), 1, f) == 1 && fread(&lastline, sizeof(lastline), 1, f) == 1
+             && fread(&len, sizeof(len), 1, f) == 1 && len <= (uint64_t) count * 10
+             && (e = table_get(&terms, word, wlen, hash_word(word, wlen), &bytes)) != NULL
+             && e->count == 0 && (e->post = malloc(len + 1)) != NULL && fread(e->post, 1, len, f) == len;
+
+        if (!ok) {
+            break;
+        }
+
+        e->len = e->cap = len;
+        bytes += len;
+        post_iter(&it, e);
+
+        while (post_next(&it) && it.doc < ndocs) {
+            ++n;
+        }
+
+        e->count = count;
+        e->lastdoc = lastdoc;
+        e->lastline = lastline;
+        postings += count;
+
+        /* every posting decoded, and the append state agrees with the last one */
+        ok = (it.p == it.end && n == count && count > 0 && it.doc == lastdoc && it.line == lastline);
+    }
+
+    ok = ok && fgetc(f) == EOF;
+    long disk = ftell(f);
+    fclose(f);
+
+    if (!ok) {
+        for (uint32_t i = 0; docs && i < ndocs; ++i) {
+            free(docs[i].path);
+        }
+
+        free(docs);
+        table_free(&terms);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&text.lock);
+    text.terms = terms;
+    text.docs = docs;
+    text.ndocs = ndocs;
+    text.capdocs = ndocs + 1;
+    text.dead = dead;
+    text.binary = binary;
+    text.postings = postings;
+    text.dead_postings = dead_postings;
+    text.text_bytes = text_bytes;
+    text.bytes = bytes;
+    text.disk_bytes = (disk > 0) ? disk : 0;
+    pthread_rwlock_unlock(&text.lock);
+}
+
+/*******************************************************************************
+ *
+ * Passes
+ *
+ ******************************************************************************/
+
+/* Maps the paths of the live documents to their ids, for one pass */
+struct PathMap {
+    uint32_t *slots;
+    size_t mask;
+};
+
+static bool path_map_build(struct PathMap *m)
+{
+    size_t n = 1024;
+
+    while (n < (text.ndocs - text.dead) * 2) {
+        n *= 2;
+    }
+
+    if ((m->slots = malloc(n * sizeof(*m->slots))) == NULL) {
+        return false;
+    }
+
+    memset(m->slots, 0xff, n * sizeof(*m->slots));
+    m->mask = n - 1;
+
+    for (uint32_t id = 0; id < text.ndocs; ++id) {
+        const char *p = text.docs[id].path;
+
+        if (text.docs[id].flags & TEXT_DOC_DEAD) {
+            continue;
+        }
+
+        size_t k = hash_word(p, strlen(p)) & m->mask;
+
+        while (m->slots[k] != TEXT_NONE) {
+            k = (k + 1) & m->mask;
+        }
+
+        m->slots[k] = id;
+    }
+
+    return true;
+}
+
+static uint32_t path_map_find(const struct PathMap *m, const char *p)
+{
+    for (size_t k = hash_word(p, strlen(p)) & m->mask; m->slots[k] != TEXT_NONE; k = (k + 1) & m->mask) {
+        if (strcmp(text.docs[m->slots[k]].path, p) == 0) {
+            return m->slots[k];
+        }
+    }
+
+    return TEXT_NONE;
+}
+
+/* Indexes the new and changed text files known to the file index and drops the documents of
+ * the files gone, reading at most TEXT_PASS_BUDGET bytes.
+ */
+static void pass_run(struct WorkJob *w)
+{
+    struct DirListing files = {0};
+    struct PathMap map = {0};
+    struct timespec t0, t1;
+    uint64_t io = 0;
+    size_t unindexed = 0;
+    bool changed = false, more = false;
+
+    (void) w;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if (!text.loaded && text.path[0] != '\0') {
+        load_index();
+    }
+
+    text.loaded = true;
+
+    long total = file_index_files(text.root, TEXT_MAX_DOCS, &files);
+    int rootfd = open(text.root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    size_t before = text.ndocs;
+    bool *seen = calloc(before + 1, sizeof(*seen));
+
+    if (total < 0 || rootfd == -1 || seen == NULL || !path_map_build(&map)) {
+        goto out;
+    }
+
+    /* space freed by compaction makes room for what did not fit */
+    if (text.budget_full && text.bytes < text.max_bytes / 10 * 9) {
+        text.budget_full = false;
+    }
+
+    for (size_t i = 0; i < files.count; ++i) {
+        const struct DirEntry *e = &files.entries[i];
+        uint32_t id = path_map_find(&map, e->name);
+
+        if (e->size > TEXT_MAX_FILE) {
+            continue;
+        }
+
+        if (id != TEXT_NONE && text.docs[id].size == e->size && text.docs[id].mtime == e->mtime
+                && text.docs[id].ino == e->ino) {
+            seen[id] = true;
+            continue;
+        }
+
+        /* out of budget: a changed file keeps its old words until the next pass */
+        if (io >= TEXT_PASS_BUDGET) {
+            more = true;
+
+            if (id != TEXT_NONE) {
+                seen[id] = true;
+            }
+
+            continue;
+        }
+
+        if (text.budget_full) {
+            ++unindexed;
+            continue;
+        }
+
+        struct TermTable local = {0};
+        size_t local_bytes = 0;
+        int ret = scan_file(rootfd, e->name, &local, &local_bytes, &io);
+
+        size_t docs_cost = strlen(e->name) + 1 + ((text.ndocs < text.capdocs) ? 0 : (text.capdocs ? text.capdocs : 256) * sizeof(struct TextDoc));
+
+        if (ret == 0 && text.bytes + docs_cost + merge_cost(&local) > text.max_bytes) {
+            text.budget_full = true;
+            ++unindexed;
+        } else if (ret >= 0) {
+            pthread_rwlock_wrlock(&text.lock);
+
+            if (id != TEXT_NONE) {
+                kill_doc(id);
+            }
+
+            uint32_t doc = add_doc(e, (ret == 1) ? TEXT_DOC_BINARY : 0);
+
+            if (doc == TEXT_NONE || !merge_doc(doc, &local)) {
+                text.budget_full = true;
+                ++unindexed;
+            }
+
+            pthread_rwlock_unlock(&text.lock);
+            changed = true;
+        }
+
+        table_free(&local);
+    }
+
+    /* an incomplete list would look like deletions */
+    if ((size_t) total <= TEXT_MAX_DOCS) {
+        pthread_rwlock_wrlock(&text.lock);
+
+        for (uint32_t id = 0; id < before; ++id) {
+            if (!seen[id] && !(text.docs[id].flags & TEXT_DOC_DEAD)) {
+                kill_doc(id);
+                changed = true;
+            }
+        }
+
+        pthread_rwlock_unlock(&text.lock);
+    }
+
+    if (text.dead_postings * 3 > text.postings || text.dead * 2 > text.ndocs) {
+        compact();
+    }
+
+    if (changed && text.path[0] != '\0') {
+        save_index();
+    }
+
+out:
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    pthread_rwlock_wrlock(&text.lock);
+    text.unindexed = unindexed;
+    text.complete = (total >= 0 && (size_t) total <= TEXT_MAX_DOCS && !more && unindexed == 0 && !text.crawling);
+    text.pass_secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    ++text.passes;
+    pthread_rwlock_unlock(&text.lock);
+
+    text.more = more;
+
+    if (rootfd != -1) {
+        close(rootfd);
+    }
+
+    free(map.slots);
+    free(seen);
+    dir_listing_free(&files);
+}
+
+static void pass_done(struct WorkJob *w)
+{
+    (void) w;
+    text.running = false;
+}
+
+int text_index_start(const char *root, const char *path, size_t max_bytes, uint64_t max_disk)
+{
+    if (max_bytes == 0 || text.started) {
+        return -1;
+    }
+
+    text.root = strdup(root);
+    text.path = strdup(path);
+
+    if (text.root == NULL || text.path == NULL) {
+        return -1;
+    }
+
+    text.max_bytes = max_bytes;
+    text.max_disk = max_disk;
+    text.pass.run = pass_run;
+    text.pass.done = pass_done;
+    text.started = true;
+
+    return 0;
+}
+
+void text_index_poll(time_t now)
+{
+    struct FileIndexStats st;
+
+    if (!text.started || text.running) {
+        return;
+    }
+
+    /* the file index counts its inotify events: none since the last pass, nothing to do */
+    file_index_get_stats(&st);
+
+    uint64_t events = st.events + st.rebuilds;
+    bool changed = (events != text.seen_events || st.pending_dirs > 0);
+
+    if (!text.more && (!changed || now - text.last_pass < TEXT_INDEX_INTERVAL)) {
+        return;
+    }
+
+    text.seen_events = events;
+    text.crawling = (st.pending_dirs > 0);
+    text.last_pass = now;
+    text.running = true;
+    work_submit(&text.pass);
+}
+
+/*******************************************************************************
+ *
+ * Searching
+ *
+ ******************************************************************************/
+
+int text_index_search(const char *query, struct DirListing *out, struct TextSearchResult *res)
+{
+    char words[TEXT_QUERY_TERMS][TEXT_TERM_MAX];
+    size_t lens[TEXT_QUERY_TERMS];
+    size_t nwords = 0;
+    const struct Term *terms[TEXT_QUERY_TERMS];
+    struct timespec t0, t1;
+    int ret = 0;
+
+    memset(res, 0, sizeof(*res));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    /* the words of the query, cut and folded the way the files' were */
+    for (const unsigned char *p = (const unsigned char *) query; *p && nwords < TEXT_QUERY_TERMS;) {
+        size_t n = 0;
+
+        while (*p && !is_word_byte(*p)) {
+            ++p;
+        }
+
+        for (; *p && is_word_byte(*p); ++p) {
+            if (n < TEXT_TERM_MAX) {
+                words[nwords][n++] = (*p >= 'A' && *p <= 'Z') ? *p + 32 : *p;
+            }
+        }
+
+        bool dup = false;
+
+        for (size_t k = 0; k < nwords; ++k) {
+            dup = dup || (lens[k] == n && memcmp(words[k], words[nwords], n) == 0);
+        }
+
+        if (n >= TEXT_TERM_MIN && !dup) {
+            lens[nwords++] = n;
+        }
+    }
+
+    if (!text.started || nwords == 0) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&text.lock);
+
+    for (size_t k = 0; k < nwords; ++k) {
+        if ((terms[k] = table_find(&text.terms, words[k], lens[k])) == NULL) {
+            goto out;
+        }
+    }
+
+    /* rarest first: the candidates only shrink from there */
+    for (size_t k = 1; k < nwords; ++k) {
+        for (size_t m = k; m > 0 && terms[m]->count < terms[m - 1]->count; --m) {
+            const struct Term *t = terms[m];
+            terms[m] = terms[m - 1];
+            terms[m - 1] = t;
+        }
+    }
+
+    uint32_t *docs = malloc((terms[0]->count + 1) * sizeof(*docs));
+    uint32_t *lines = malloc((terms[0]->count + 1) * sizeof(*lines));
+    size_t n = 0;
+    struct PostIter it;
+
+    if (docs == NULL || lines == NULL) {
+        free(docs);
+        free(lines);
+        ret = -1;
+        goto out;
+    }
+
+    post_iter(&it, terms[0]);
+
+    while (post_next(&it)) {
+        if (!(text.docs[it.doc].flags & TEXT_DOC_DEAD)) {
+            docs[n] = it.doc;
+            lines[n++] = it.line;
+        }
+    }
+
+    for (size_t k = 1; k < nwords && n > 0; ++k) {
+        size_t i = 0, kept = 0;
+        bool more;
+
+        post_iter(&it, terms[k]);
+        more = post_next(&it);
+
+        while (i < n && more) {
+            uint64_t a = (uint64_t) docs[i] << 32 | lines[i];
+            uint64_t b = (uint64_t) it.doc << 32 | it.line;
+
+            if (a < b) {
+                ++i;
+            } else if (b < a) {
+                more = post_next(&it);
+            } else {
+                docs[kept] = docs[i];
+                lines[kept++] = lines[i++];
+                more = post_next(&it);
+            }
+        }
+
+        n = kept;
+    }
+
+    res->lines = n;
+
+    for (size_t i = 0; i < n && ret == 0;) {
+        const struct TextDoc *d = &text.docs[docs[i]];
+        char note[TEXT_NOTE_LINES * 11 + 32];
+        size_t first = i, len;
+
+        while (i < n && docs[i] == docs[first]) {
+            ++i;
+        }
+
+        if (++res->files > TEXT_MAX_RESULTS) {
+            continue;
+        }
+
+        len = snprintf(note, sizeof(note), "line%s", (i - first > 1) ? "s" : "");
+
+        for (size_t k = first; k < i && k - first < TEXT_NOTE_LINES; ++k) {
+            len += snprintf(note + len, sizeof(note) - len, " %u", lines[k]);
+        }
+
+        if (i - first > TEXT_NOTE_LINES) {
+            len += snprintf(note + len, sizeof(note) - len, " and %zu more", i - first - TEXT_NOTE_LINES);
+        }
+
+        struct DirEntry *e = dir_listing_push_note(out, d->path, strlen(d->path), note, len);
+
+        if (e == NULL) {
+            ret = -1;
+            break;
+        }
+
+        e->type = DIR_ENTRY_FILE;
+        e->size = d->size;
+        e->mtime = d->mtime;
+        e->ino = d->ino;
+    }
+
+    free(docs);
+    free(lines);
+
+out:
+    pthread_rwlock_unlock(&text.lock);
+    dir_listing_seal(out);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    res->usecs = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+
+    return ret;
+}
+
+void text_index_get_stats(struct TextIndexStats *stats)
+{
+    pthread_rwlock_rdlock(&text.lock);
+    stats->docs = text.ndocs - text.dead;
+    stats->dead_docs = text.dead;
+    stats->binary_docs = text.binary;
+    stats->terms = text.terms.count;
+    stats->postings = text.postings - text.dead_postings;
+    stats->bytes = text.bytes;
+    stats->max_bytes = text.max_bytes;
+    stats->disk_bytes = text.disk_bytes;
+    stats->max_disk = text.max_disk;
+    stats->text_bytes = text.text_bytes;
+    stats->unindexed = text.unindexed;
+    stats->passes = text.passes;
+    stats->pass_secs = text.pass_secs;
+    stats->complete = text.complete;
+    pthread_rwlock_unlock(&text.lock);
+}
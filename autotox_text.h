@@ -0,0 +1,73 @@
+#ifndef AUTOTOX_TEXT_H
+#define AUTOTOX_TEXT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "autotox_dir.h"
+
+#define TEXT_INDEX_INTERVAL 30                  /* seconds between passes while files keep changing */
+#define TEXT_PASS_BUDGET    (64 * 1024 * 1024)  /* bytes one pass reads, the next one carries on */
+#define TEXT_MAX_FILE       (16 * 1024 * 1024)  /* bigger files are left to grep */
+#define TEXT_MAX_DOCS       (1 << 22)
+#define TEXT_BINARY_PEEK    8192
+#define TEXT_TERM_MIN       2                   /* shorter words are not indexed */
+#define TEXT_TERM_MAX       32                  /* longer ones are cut to this many bytes */
+#define TEXT_QUERY_TERMS    8
+#define TEXT_MAX_RESULTS    1000                /* files per search */
+#define TEXT_NOTE_LINES     8                   /* line numbers shown per file */
+
+struct TextIndexStats {
+    size_t   docs;             /* files indexed, binary ones included */
+    size_t   dead_docs;        /* changed or removed, their postings not compacted away yet */
+    size_t   binary_docs;
+    size_t   terms;
+    uint64_t postings;
+    size_t   bytes;            /* memory used */
+    size_t   max_bytes;
+    uint64_t disk_bytes;       /* size of the saved index, 0 if not saved */
+    uint64_t max_disk;
+    uint64_t text_bytes;       /* size of the text files indexed */
+    size_t   unindexed;        /* files left out by the memory budget in the last pass */
+    uint64_t passes;
+    double   pass_secs;        /* duration of the last pass */
+    bool     complete;         /* every file known to the file index is covered */
+};
+
+struct TextSearchResult {
+    size_t   files;            /* files with a matching line, may exceed the entries appended */
+    size_t   lines;
+    uint64_t usecs;
+};
+
+/* Starts a content index over the text files below root, an inverted index from words to
+ * the files and lines holding them. It is built and kept current by passes on the worker
+ * pool that follow the file index: a file is read again only when its size, mtime or inode
+ * changed. max_bytes caps its memory; files that do not fit are left out until space
+ * is freed. If path is not empty the index is saved there after passes that changed it,
+ * as long as it stays under max_disk bytes, and loaded back by the first pass.
+ *
+ * Returns 0 on success.
+ * Returns -1 if max_bytes is 0 or the index can not be set up; search then finds nothing.
+ */
+int text_index_start(const char *root, const char *path, size_t max_bytes, uint64_t max_disk);
+
+/* Queues a pass when the file index saw changes, at most every TEXT_INDEX_INTERVAL
+ * seconds, or right away while the last pass ran out of budget. Call it from the main loop.
+ */
+void text_index_poll(time_t now);
+
+/* Finds the lines holding every word of query, case insensitively for ASCII. The files
+ * with such lines are appended to out, named by their path relative to root, with the
+ * line numbers as note, at most TEXT_MAX_RESULTS of them.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the query has no word to look up, the index is off or out of memory.
+ */
+int text_index_search(const char *query, struct DirListing *out, struct TextSearchResult *res);
+
+void text_index_get_stats(struct TextIndexStats *stats);
+
+#endif /* AUTOTOX_TEXT_H */
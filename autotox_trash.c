@@ -0,0 +1,173 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "autotox_trash.h"
+#include "autotox_work.h"
+
+static struct {
+    int     fd;
+    dev_t   dev;
+    time_t  last_purge;
+    bool    purging;                /* main thread only */
+    struct WorkJob purge;
+
+    atomic_uint_fast64_t seq;       /* keeps trash names unique within a second */
+    atomic_uint_fast64_t moved;
+    atomic_uint_fast64_t unlinked;
+    atomic_uint_fast64_t purged;
+} trash = {
+    .fd = -1,
+};
+
+int trash_init(const char *path)
+{
+    struct stat st;
+
+    if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    trash.fd = fd;
+    trash.dev = st.st_dev;
+
+    return 0;
+}
+
+int trash_delete(int dirfd, const char *name)
+{
+    struct stat st;
+
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        return -1;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    if (trash.fd != -1 && st.st_dev == trash.dev) {
+        const char *base = strrchr(name, '/');
+        char tname[NAME_MAX + 1];
+
+        base = base ? base + 1 : name;
+
+        /* the time it was deleted goes first, it is what the purge goes by */
+        snprintf(tname, sizeof(tname), "%lld-%llu-%s", (long long) time(NULL),
+                 (unsigned long long) atomic_fetch_add_explicit(&trash.seq, 1, memory_order_relaxed), base);
+
+        if (renameat(dirfd, name, trash.fd, tname) == 0) {
+            atomic_fetch_add_explicit(&trash.moved, 1, memory_order_relaxed);
+            return 0;
+        }
+
+        /* a bind mount shares st_dev but still can not be renamed across */
+        if (errno != EXDEV) {
+            return -1;
+        }
+    }
+
+    if (unlinkat(dirfd, name, 0) == -1) {
+        return -1;
+    }
+
+    atomic_fetch_add_explicit(&trash.unlinked, 1, memory_order_relaxed);
+
+    return 0;
+}
+
+static void purge_run(struct WorkJob *job)
+{
+    (void) job;
+
+    int fd = dup(trash.fd);
+    DIR *d = (fd != -1) ? fdopendir(fd) : NULL;
+
+    if (d == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+
+        return;
+    }
+
+    time_t now = time(NULL);
+    struct dirent *de;
+
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+
+        char *end;
+        time_t deleted = (time_t) strtoll(de->d_name, &end, 10);
+
+        /* not one of ours: go by when it was put there */
+        if (*end != '-') {
+            struct stat st;
+
+            if (fstatat(trash.fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                continue;
+            }
+
+            deleted = st.st_ctime;
+        }
+
+        if (now - deleted >= TRASH_KEEP_SECS && unlinkat(trash.fd, de->d_name, 0) == 0) {
+            atomic_fetch_add_explicit(&trash.purged, 1, memory_order_relaxed);
+        }
+    }
+
+    closedir(d);
+}
+
+static void purge_done(struct WorkJob *job)
+{
+    (void) job;
+
+    trash.purging = false;
+}
+
+void trash_poll(time_t now)
+{
+    if (trash.fd == -1 || trash.purging || now - trash.last_purge < TRASH_PURGE_INTERVAL) {
+        return;
+    }
+
+    trash.last_purge = now;
+    trash.purging = true;
+    trash.purge.run = purge_run;
+    trash.purge.done = purge_done;
+    work_submit(&trash.purge);
+}
+
+void trash_get_stats(struct TrashStats *stats)
+{
+    stats->moved = atomic_load_explicit(&trash.moved, memory_order_relaxed);
+    stats->unlinked = atomic_load_explicit(&trash.unlinked, memory_order_relaxed);
+    stats->purged = atomic_load_explicit(&trash.purged, memory_order_relaxed);
+}
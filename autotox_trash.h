@@ -0,0 +1,40 @@
+#ifndef AUTOTOX_TRASH_H
+#define AUTOTOX_TRASH_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define TRASH_PURGE_INTERVAL 60     /* seconds between purge passes */
+#define TRASH_KEEP_SECS      600    /* how long a deleted file stays in the trash */
+
+struct TrashStats {
+    uint64_t moved;       /* files renamed into the trash */
+    uint64_t unlinked;    /* files removed right away, no trash or another filesystem */
+    uint64_t purged;
+};
+
+/* Uses path, created if missing, as the trash directory. Deleting is then a rename,
+ * which takes no time whatever the file size, and the space is given back later by
+ * a purge job on the worker pool. Without a trash, files are unlinked directly.
+ *
+ * Returns 0 on success.
+ * Returns -1 if path can not be used as a trash.
+ */
+int trash_init(const char *path);
+
+/* Deletes the file name (may hold '/') below dirfd: moved into the trash, or unlinked
+ * if there is none or it lives on another filesystem. Never removes a directory.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure and leaves errno set.
+ */
+int trash_delete(int dirfd, const char *name);
+
+/* Queues a purge of what has been in the trash longer than TRASH_KEEP_SECS, at most
+ * every TRASH_PURGE_INTERVAL seconds. Call it from the main loop.
+ */
+void trash_poll(time_t now);
+
+void trash_get_stats(struct TrashStats *stats);
+
+#endif /* AUTOTOX_TRASH_H */
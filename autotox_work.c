@@ -0,0 +1,226 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "autotox_work.h"
+
+#define WORK_NICE 10
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  work;
+    struct WorkJob *queue_head;    /* submitted jobs, under lock */
+    struct WorkJob *queue_tail;
+    size_t   queued;
+    size_t   running;
+    size_t   threads;
+
+    /* finished jobs, pushed by the workers without a lock and taken all at once
+     * by work_poll(): a single consumer swapping the head out cannot hit ABA
+     */
+    _Atomic(struct WorkJob *) done;
+    int      eventfd;
+
+    atomic_uint_fast64_t completed;
+    uint64_t lag_max_us;
+    uint64_t lag_avg_us;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .eventfd = -1,
+};
+
+static void push_done(struct WorkJob *job)
+{
+    struct WorkJob *head = atomic_load_explicit(&pool.done, memory_order_relaxed);
+
+    do {
+        job->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&pool.done, &head, job, memory_order_release,
+             memory_order_relaxed));
+
+    atomic_fetch_add_explicit(&pool.completed, 1, memory_order_relaxed);
+
+    if (pool.eventfd != -1) {
+        uint64_t one = 1;
+
+        /* only fails when the counter is saturated, and then the reader is due anyway */
+        if (write(pool.eventfd, &one, sizeof(one)) == -1) {
+            return;
+        }
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    (void) arg;
+
+    /* a worker chewing through a big dir must not take turns away from the tox loop,
+     * which matters on single core boxes; nice is per thread on Linux
+     */
+    id_t tid = (id_t) syscall(SYS_gettid);
+    errno = 0;
+    int nice = getpriority(PRIO_PROCESS, tid);
+
+    if (errno == 0) {
+        setpriority(PRIO_PROCESS, tid, nice + WORK_NICE);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+
+    for (;;) {
+        while (pool.queue_head == NULL) {
+            pthread_cond_wait(&pool.work, &pool.lock);
+        }
+
+        struct WorkJob *job = pool.queue_head;
+        pool.queue_head = job->next;
+
+        if (pool.queue_head == NULL) {
+            pool.queue_tail = NULL;
+        }
+
+        --pool.queued;
+        ++pool.running;
+        pthread_mutex_unlock(&pool.lock);
+
+        job->run(job);
+
+        pthread_mutex_lock(&pool.lock);
+        --pool.running;
+        pthread_mutex_unlock(&pool.lock);
+
+        push_done(job);
+
+        pthread_mutex_lock(&pool.lock);
+    }
+
+    return NULL;
+}
+
+int work_start(int nthreads)
+{
+    pthread_mutex_lock(&pool.lock);
+
+    if (pool.threads > 0) {
+        pthread_mutex_unlock(&pool.lock);
+        return 0;
+    }
+
+    pool.eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+
+    if (nthreads > WORK_MAX_THREADS) {
+        nthreads = WORK_MAX_THREADS;
+    }
+
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_t t;
+
+        if (pthread_create(&t, NULL, worker_thread, NULL) == 0) {
+            pthread_detach(t);
+            ++pool.threads;
+        }
+    }
+
+    int ret = pool.threads > 0 ? 0 : -1;
+    pthread_mutex_unlock(&pool.lock);
+
+    return ret;
+}
+
+void work_submit(struct WorkJob *job)
+{
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool.lock);
+
+    if (pool.threads == 0) {
+        pthread_mutex_unlock(&pool.lock);
+        job->run(job);
+        push_done(job);
+        return;
+    }
+
+    if (pool.queue_tail) {
+        pool.queue_tail->next = job;
+    } else {
+        pool.queue_head = job;
+    }
+
+    pool.queue_tail = job;
+    ++pool.queued;
+    pthread_cond_signal(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+int work_fd(void)
+{
+    return pool.eventfd;
+}
+
+void work_poll(void)
+{
+    if (pool.eventfd != -1) {
+        uint64_t count;
+
+        if (read(pool.eventfd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+            return;
+        }
+    }
+
+    struct WorkJob *list = atomic_exchange_explicit(&pool.done, NULL, memory_order_acquire);
+    struct WorkJob *fifo = NULL;
+
+    /* the stack holds them newest first */
+    while (list) {
+        struct WorkJob *next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
+    }
+
+    while (fifo) {
+        struct WorkJob *next = fifo->next;
+        fifo->done(fifo);
+        fifo = next;
+    }
+}
+
+void work_record_lag(uint64_t usecs)
+{
+    if (usecs > pool.lag_max_us) {
+        pool.lag_max_us = usecs;
+    }
+
+    pool.lag_avg_us = (pool.lag_avg_us * 63 + usecs) / 64;
+}
+
+void work_get_stats(struct WorkStats *stats)
+{
+    pthread_mutex_lock(&pool.lock);
+
+    *stats = (struct WorkStats) {
+        .threads = pool.threads,
+        .queued = pool.queued,
+        .running = pool.running,
+        .completed = atomic_load_explicit(&pool.completed, memory_order_relaxed),
+        .lag_max_us = pool.lag_max_us,
+        .lag_avg_us = pool.lag_avg_us,
+    };
+
+    pthread_mutex_unlock(&pool.lock);
+}
@@ -0,0 +1,51 @@
+#ifndef AUTOTOX_WORK_H
+#define AUTOTOX_WORK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WORK_MAX_THREADS 8
+
+/* A unit of blocking work. Embed it as the first member of the job's own struct:
+ * run() is called on a worker thread, then done() on the thread calling work_poll(),
+ * which is where results may touch Tox and other single threaded state.
+ */
+struct WorkJob {
+    void (*run)(struct WorkJob *job);
+    void (*done)(struct WorkJob *job);
+    struct WorkJob *next;
+};
+
+struct WorkStats {
+    size_t   threads;
+    size_t   queued;            /* submitted, not picked up by a worker yet */
+    size_t   running;
+    uint64_t completed;
+    uint64_t lag_max_us;        /* longest main loop iteration seen */
+    uint64_t lag_avg_us;        /* moving average of the iteration time */
+};
+
+/* Starts nthreads workers, capped at WORK_MAX_THREADS.
+ *
+ * Returns 0 on success.
+ * Returns -1 if no worker could be started; jobs then run inline in work_submit().
+ */
+int work_start(int nthreads);
+
+/* Hands job to the workers. Never blocks on the job itself. */
+void work_submit(struct WorkJob *job);
+
+/* Returns an fd that turns readable when finished jobs are waiting for work_poll(),
+ * to sleep on instead of a fixed pause. Returns -1 if there is none.
+ */
+int work_fd(void);
+
+/* Calls done() of every job finished since the last call, in completion order. */
+void work_poll(void);
+
+/* Records how long one main loop iteration spent working, for the lag figures. */
+void work_record_lag(uint64_t usecs);
+
+void work_get_stats(struct WorkStats *stats);
+
+#endif /* AUTOTOX_WORK_H */